@@ -42,14 +42,17 @@
 #include "disassemble.h"
 
 
-int NumberofArgs=0;
-int Args[10];
+// the hex values given with a command
+typedef struct {
+    int NumberofArgs;
+    int Args[10];
+} MONITORARGS;
 
 // edit RAM 
-int editMemory(void){
+int editMemory(struct machine *m, MONITORARGS *args){
     
     int bufferposition=0;
-    int StartAddress=Args[0];
+    int StartAddress=args->Args[0];
     int CurrentAddress;
     int argvalue;
 
@@ -57,11 +60,14 @@ int editMemory(void){
     
     while (true){
         CurrentAddress=StartAddress;
-        printf("%4.4X  %2.2X",CurrentAddress,RAM(CurrentAddress));
+        fprintf(m->out, "%4.4X  %2.2X",CurrentAddress,RAM(CurrentAddress));
         
-        fgets( inputdata, 100, stdin );
+        if (fgets( inputdata, 100, m->in ) == NULL){
+            // no more input - as if . was typed
+            return 0;
+        }
         
-        printf("input %s\n",inputdata);
+        fprintf(m->out, "input %s\n",inputdata);
         
         while (true){
             argvalue=0;
@@ -78,7 +84,10 @@ int editMemory(void){
                 return 0;
             }
             else if (inputdata[bufferposition] == ',') {
+                // a rom can be changed here, but not the one the machines share
+                map80RamUnshareRom(m, CurrentAddress);
                 RAM(CurrentAddress)=inputdata[bufferposition+1]&0xFF;
+                RAMPAGEWRITE(CurrentAddress, 1);
                 bufferposition++;
                 CurrentAddress++;
                 
@@ -111,7 +120,9 @@ int editMemory(void){
             //printf ("found %4.4X \n",argvalue);
             // store just the 16bit address
             // update value 
+            map80RamUnshareRom(m, CurrentAddress);
             RAM(CurrentAddress)=argvalue& 0xff;
+            RAMPAGEWRITE(CurrentAddress, 1);
             CurrentAddress++;
 
             if (inputdata[bufferposition] == 0x00){
@@ -123,13 +134,13 @@ int editMemory(void){
                 break;
             }
             if (inputdata[bufferposition] != 0x20){
-                printf("character %2.2X at position %d not space\n",inputdata[bufferposition],bufferposition);
-                printf("Error?");
+                fprintf(m->out, "character %2.2X at position %d not space\n",inputdata[bufferposition],bufferposition);
+                fprintf(m->out, "Error?");
                 
                 break;
             }
             
-            if (NumberofArgs > 10){
+            if (args->NumberofArgs > 10){
                 // arg array full
                 break;
             }
@@ -144,11 +155,11 @@ int editMemory(void){
 }
 
 
-int getarguments(char * inputdata){
+int getarguments(struct machine *m, MONITORARGS *args, char * inputdata){
 
     int bufferposition=0;
     int argvalue=0;
-    NumberofArgs=0;
+    args->NumberofArgs=0;
     while (true){
         // check for white space at start and beteen values
         while (iswhitespace(inputdata[bufferposition])){
@@ -183,7 +194,7 @@ int getarguments(char * inputdata){
         // add to array and inc counter
         //printf ("found %4.4X \n",argvalue);
         // store just the 16bit address
-        Args[NumberofArgs++]= argvalue & 0xFFFF;
+        args->Args[args->NumberofArgs++]= argvalue & 0xFFFF;
         if (inputdata[bufferposition] == 0x00){
             break;
         }
@@ -191,12 +202,12 @@ int getarguments(char * inputdata){
             break;
         }
         if (inputdata[bufferposition] != 0x20){
-            printf("character %2.2X at position %d not space\n",inputdata[bufferposition],bufferposition);
+            fprintf(m->out, "character %2.2X at position %d not space\n",inputdata[bufferposition],bufferposition);
             return 1;
             break;
         }
         
-        if (NumberofArgs > 10){
+        if (args->NumberofArgs > 10){
             // arg array full
             break;
         }
@@ -205,23 +216,23 @@ int getarguments(char * inputdata){
     return 0;
 }
 
-void displayBytes(void){
+void displayBytes(struct machine *m, MONITORARGS *args){
 
-    int StartAddress = Args[0];
+    int StartAddress = args->Args[0];
     int EndAddress = StartAddress;
     int NumberofBytes=8;
 
-    if (NumberofArgs>1){
-        EndAddress=Args[1];
+    if (args->NumberofArgs>1){
+        EndAddress=args->Args[1];
     }
 
     unsigned char asciiData[NumberofBytes+1];
     unsigned char asciichar;
 
     do{
-        printf("%4.4X ", StartAddress );
+        fprintf(m->out, "%4.4X ", StartAddress );
         for (int count1=0;count1<NumberofBytes;count1++){
-            printf("%2.2X ", RAM(StartAddress+count1) );
+            fprintf(m->out, "%2.2X ", RAM(StartAddress+count1) );
             asciichar = RAM(StartAddress+count1) & 0x7F;
             if ( ( asciichar >= 0x20 ) ){
                 asciiData[count1]=asciichar;
@@ -231,7 +242,7 @@ void displayBytes(void){
             }
         }
         asciiData[NumberofBytes]=0;
-        printf(" %s\n", asciiData);
+        fprintf(m->out, " %s\n", asciiData);
         
         StartAddress+=NumberofBytes;
     } while(StartAddress<EndAddress);
@@ -241,16 +252,16 @@ void displayBytes(void){
 }
 
 // disassemble lines of code
-void DoDisassemble(void){
+void DoDisassemble(struct machine *m, MONITORARGS *args){
     
-    int StartAddress=Args[0];
+    int StartAddress=args->Args[0];
     int EndAddress=StartAddress+1;
 //    char disstr[100];
 //    unsigned char disdata[5];
     int lencmd ;
 
-    if (NumberofArgs>1){
-        EndAddress = Args[1];
+    if (args->NumberofArgs>1){
+        EndAddress = args->Args[1];
     }
     do {
 //        disdata[0] = RAM(StartAddress);
@@ -259,7 +270,7 @@ void DoDisassemble(void){
 //        disdata[3] = RAM(StartAddress+3);
 //        disdata[4] = 0x00;
         //lencmd=disassembleline(StartAddress,disdata,disstr);
-        lencmd=disassembleprogram(StartAddress,stdout,0,0,0xFFFF,0,0,0,0,0);
+        lencmd=disassembleprogram(m, StartAddress,m->out,0,0,0xFFFF,0,0,0,0,0);
         //fprintf(stdout,"%s\n",disstr);
         StartAddress+=lencmd;
     } while (StartAddress<EndAddress);
@@ -270,9 +281,11 @@ void DoDisassemble(void){
 
 
 
-int MAP80nascomMonitor(char * FirstCommand){
+int MAP80nascomMonitor(struct machine *m, char * FirstCommand){
 
 // process user input
+    MONITORARGS arguments = { 0 };
+    MONITORARGS *args = &arguments;
     int doFirstCommand=0;
     char commandstr[101]="";
     if (strlen(FirstCommand)>0){
@@ -283,8 +296,11 @@ int MAP80nascomMonitor(char * FirstCommand){
     for(;;){
 
         if (doFirstCommand==0){
-            printf( "Bios:");
-            fgets( commandstr, 100, stdin );
+            fprintf(m->out, "Bios:");
+            if (fgets( commandstr, 100, m->in ) == NULL){
+                // no more input, e.g. a nasbatch job - as if x was typed
+                return 0;
+            }
         }
         else{
             doFirstCommand=0; // reset first command control
@@ -295,57 +311,59 @@ int MAP80nascomMonitor(char * FirstCommand){
         if (strlen(commandstr) > 0 ){
             if(commandstr[0] != ' ' ){
                 //printf("Calling get agr\n");
-                getarguments(&commandstr[1]);
+                getarguments(m, args, &commandstr[1]);
                 //printf("number of arguments %d args %4.4X %4.4X\n",NumberofArgs,Args[0],Args[1]);
                         
                 switch (toupper(commandstr[0])){
             
                     case 'T':   // tabulate command
-                        displayBytes();
+                        displayBytes(m, args);
                         break;
                     case 'O':   // output to port 
-                        if (NumberofArgs<2){
-                            printf("Needs port number and value\n");
+                        if (args->NumberofArgs<2){
+                            fprintf(m->out, "Needs port number and value\n");
                         }
                         else{
-                            out(Args[0],Args[1]);
+                            out(m, args->Args[0],args->Args[1]);
                         }
                         break;
                     case 'Q':   // query a port 
-                        if (NumberofArgs<1){
-                            printf("Needs port number \n");
+                        if (args->NumberofArgs<1){
+                            fprintf(m->out, "Needs port number \n");
                         }
                         else{
-                            int result=in(Args[0]);
-                            printf("%2.2X\n",result);
+                            int result=in(m, args->Args[0]);
+                            fprintf(m->out, "%2.2X\n",result);
                         }
                         break;
 
                     case 'M':   // memory update
-                        editMemory();
+                        editMemory(m, args);
 
                         break;
                         
                     case 'R':   // trace command mode
-                        if (traceon==1){
-                            printf("Turning disassemble trace off\n");
-                            traceon=0;
+                        if (m->traceon==1){
+                            fprintf(m->out, "Turning disassemble trace off\n");
+                            m->traceon=0;
+                            m->simevents &= ~SIMEVENT_TRACE;
                         }
                         else{
-                            printf("Turning disassemble trace on\n");
-                            traceon=1;
+                            fprintf(m->out, "Turning disassemble trace on\n");
+                            m->traceon=1;
+                            m->simevents |= SIMEVENT_TRACE;
                         }
                     case 'D':    // disassemble from address
-                        DoDisassemble();
+                        DoDisassemble(m, args);
                         break;
                     case 'E':   // execute command
                         
-                        if (NumberofArgs>0){
-                            pc=Args[0]&0xFFFF;
+                        if (args->NumberofArgs>0){
+                            m->pc=args->Args[0]&0xFFFF;
                         }
 
-                        fprintf(stdout, "Calling simz80 starting at %4.4X\n",pc);
-                        puts("The following keys are supported:\n"
+                        fprintf(m->out, "Calling simz80 starting at %4.4X\n",m->pc);
+                        fprintf(m->out, "The following keys are supported:\n"
                              "\n"
                              "* F1 - Triggers an NMI \n"
                              "* F2 - Turns on/off disassembler trace\n"
@@ -356,22 +374,39 @@ int MAP80nascomMonitor(char * FirstCommand){
                              "* F9 - resets the emulated Nascom\n"
                              "* F10 - toggles between \"raw\" and \"natural\" keyboard emulation\n"
                              "* END - leaves a nascom screen dump in `screendump`\n"
-                             "\n");
+                             "\n\n");
                             
-                        FASTWORK Retval=simz80(pc, t_sim_delay, sim_delay);
+                        // used to report the emulation speed when verbose
+                        uint64_t startinstructions = m->z80instructions;
+                        uint64_t starttstates = m->tstates;
+                        Uint64 starthost = SDL_GetPerformanceCounter();
+
+                        FASTWORK Retval=simz80(m, m->pc, m->t_sim_delay, sim_delay);
+
+                        if (m->verbose){
+                            double seconds = (double)(SDL_GetPerformanceCounter() - starthost) / SDL_GetPerformanceFrequency();
+                            if (seconds > 0){
+                                fprintf(m->out, "Z80 ran %llu instructions ( %llu T-states ) in %.2f seconds - %.2f MIPS %.2f MHz\n",
+                                    (unsigned long long)(m->z80instructions - startinstructions),
+                                    (unsigned long long)(m->tstates - starttstates),
+                                    seconds,
+                                    (m->z80instructions - startinstructions) / seconds / 1000000,
+                                    (m->tstates - starttstates) / seconds / 1000000);
+                            }
+                        }
 
                         // On return from simulator, refresh the screen one last
                         // time, in order to see any final output eg before a HALT
-                        sim_delay();
+                        sim_delay(m);
 
-                        if (usebiosmonitor==0){
+                        if (m->usebiosmonitor==0){
                             return 0;
                         }
 
-                        fprintf(stderr,"Emulator stopped at %4.4X \n",Retval&0xFFFF);
-                        fprintf(stdout,"Ensure console window is selected \n");
-                        fprintf(stdout,"Then enter the x commands to exit the Bios process\n");
-                        fprintf(stdout,"or ? for help\n");
+                        fprintf(m->err, "Emulator stopped at %4.4X \n",Retval&0xFFFF);
+                        fprintf(m->out, "Ensure console window is selected \n");
+                        fprintf(m->out, "Then enter the x commands to exit the Bios process\n");
+                        fprintf(m->out, "or ? for help\n");
                         
                         break;
                         
@@ -379,7 +414,7 @@ int MAP80nascomMonitor(char * FirstCommand){
                         return 0;
                         break;
                     case '?':
-                        printf("The bios program commands are\n"
+                        fprintf(m->out, "The bios program commands are\n"
                                "D xxxx YYYY disassemble code address xxxx to yyyy\n"
                                "E xxxx to start Z80sim from address xxxx \n"
                                "O xx yy output value yy on 'port' xx \n"
@@ -388,12 +423,12 @@ int MAP80nascomMonitor(char * FirstCommand){
                                "X to exit\n"
                                );
                     default:
-                        printf("unknown command %s\n",commandstr);
+                        fprintf(m->out, "unknown command %s\n",commandstr);
                         break;
                     
                 }
                 // a BIOS command may cause the display to change, so update it
-                sim_delay();
+                sim_delay(m);
             }
         }
     }
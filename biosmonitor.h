@@ -3,7 +3,9 @@
 
    */
 
-extern int MAP80nascomMonitor(char * FirstCommand);
+struct machine;
+
+extern int MAP80nascomMonitor(struct machine *m, char * FirstCommand);
 
 
 // end of file
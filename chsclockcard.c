@@ -7,23 +7,59 @@
  *
  */
 
+#define _XOPEN_SOURCE 700      // localtime_r, asctime_r
+
+#include <stdbool.h>
 #include "options.h"
+#include "simz80.h"
+#include "map80nascom.h"
 #include "chsclockcard.h"
+#include "interrupts.h"
+#include "snapshot.h"
+#include "log.h"
 #include <time.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-// set to 1 to display clock card processing
-int chsclockcarddebug = CHSCLOCKCARDDEBUG; 
-                                  
-static int hoursmode=CRTC_HOURS_MODE_24H;             // set to 24 hours mode
-static int daysmode=0;                                // set using CRTC_DAYS_MODE_LEAP_YEAR if a leap year     
+// the Z80 PIO control registers of one port
+typedef struct {
+    int mode;           // 0 output, 1 input, 2 bidirectional, 3 bit control
+    int iomask;         // mode 3 - 1 for the bits that are inputs
+    int intcontrol;     // PIO_INT_ bits of the interrupt control word
+    int intmask;        // mode 3 - 0 for the bits that can interrupt
+    int expect;         // PIO_EXPECT_ what the next control byte is
+    INTSOURCE interrupt;
+} CRTC_PIO;
+
+// interrupt control word bits
+#define PIO_INT_ENABLE      0x80
+#define PIO_INT_AND         0x40    // all the monitored bits must be active, not any
+#define PIO_INT_HIGH        0x20    // the monitored bits are active high
+#define PIO_INT_MASKFOLLOWS 0x10
+
+#define PIO_EXPECT_CONTROL  0
+#define PIO_EXPECT_IOMASK   1
+#define PIO_EXPECT_INTMASK  2
+
+typedef struct CLOCKCARD {
+    int hoursmode;                  // CRTC_HOURS_MODE_24H for 24 hours mode
+    int daysmode;                   // set using CRTC_DAYS_MODE_LEAP_YEAR if a leap year
 
-static int portAdata=0;  // set to the last value written to port A data port
-                                         // sets hold read write and address bits
-static int portBdata=0;  // set to the last value written to port B data port
+    int portAdata;                  // set to the last value written to port A data port
+                                    // sets hold read write and address bits
+    int portBdata;                  // set to the last value written to port B data port
+
+    CRTC_PIO pioA;
+    CRTC_PIO pioB;
+
+    // once a second while port B can interrupt - the 1024Hz reference is not emulated
+    EVENT referenceevent;
+    int referenceseconds;           // reference pulses so far, for the minute and hour pulses
+
+    struct tm lasttimestamp;        // will contain the current time when the hold is set or data read without setting hold
+} CLOCKCARD;
 
-static struct tm lasttimestamp;   // will contain the current time when the hold is set or data read without setting hold
 /*
  * The structure is 
  * struct tm {
@@ -40,33 +76,144 @@ static struct tm lasttimestamp;   // will contain the current time when the hold
  * 
  */
 
-static void crtc_time_update( void );
+// give the machine its clock card, in 24 hour mode with both PIO ports inputs
+void chsclockcardCreate( struct machine *m ){
+
+    CLOCKCARD *card = calloc( 1, sizeof( CLOCKCARD ) );
+    if ( card == NULL ){
+        fprintf( m->err, "Out of memory for the clock card\n" );
+        exit( 1 );
+    }
+    card->hoursmode = CRTC_HOURS_MODE_24H;
+    card->pioA = (CRTC_PIO){ .mode = 1, .intmask = 0xFF, .interrupt = { .name = "clock card PIO A" } };
+    card->pioB = (CRTC_PIO){ .mode = 1, .intmask = 0xFF, .interrupt = { .name = "clock card PIO B" } };
+    m->clock = card;
+}
+
+void chsclockcardFree( struct machine *m ){
+
+    free( m->clock );
+    m->clock = NULL;
+}
+
+static void crtc_time_update( struct machine *m );
+static void crtc_reference_tick( struct machine *m, EVENT *event );
 
 
-static void crtc_time_update( void ){
+static void crtc_time_update( struct machine *m ){
+    CLOCKCARD *card = m->clock;
     
     time_t now; // number of seconds since the Epoch (00:00:00 UTC, January 1, 1970)
     time(&now);
-    struct tm *t;
-    t=localtime(&now);
-    memcpy ( &lasttimestamp, t, sizeof( struct tm));
-    if (chsclockcarddebug){
-        printf("refreshing time stamp: %s", asctime(&lasttimestamp ));
+    char text[26];  // the _r versions as nasbatch can have several clock cards ticking at once
+    localtime_r(&now, &card->lasttimestamp);
+    LOG(m, LOG_CLOCK, LOG_DEBUG, "refreshing time stamp: %s", asctime_r(&card->lasttimestamp, text ));
+
+}
+
+
+
+// the PIO is on the daisy chain with port A above port B
+void chsclockcardInitialise( struct machine *m ){
+    CLOCKCARD *card = m->clock;
+
+    card->referenceevent.func = crtc_reference_tick;
+    interrupt_register( m, &card->pioA.interrupt );
+    interrupt_register( m, &card->pioB.interrupt );
+}
+
+// the MSM5832 reference pulses are on the port B inputs while register 15 is being read
+// so port B in bit control mode can interrupt on the second, minute or hour
+static void crtc_reference_tick( struct machine *m, EVENT *event ){
+    CLOCKCARD *card = m->clock;
+
+    card->referenceseconds++;
+    int pulses = CRTC_REFERENCE_SECOND;
+    if ( card->referenceseconds % 60 == 0 ){
+        pulses |= CRTC_REFERENCE_MINUTE;
+    }
+    if ( card->referenceseconds % 3600 == 0 ){
+        pulses |= CRTC_REFERENCE_HOUR;
     }
+    event_schedule( m, event, event->when + m->clockrate * 1000000ULL );
 
+    if ( ( card->portAdata & ( CRTC_CONTROL_ADDRESS_MASK | CRTC_CONTROL_READ ) ) != ( CRTC_REGISTER_REFERENCE | CRTC_CONTROL_READ ) ){
+        return;
+    }
+    // the pulses are active high
+    int monitored = ~card->pioB.intmask & card->pioB.iomask & 0x0F;
+    if ( !( card->pioB.intcontrol & PIO_INT_HIGH ) || monitored == 0 ){
+        return;
+    }
+    if ( ( card->pioB.intcontrol & PIO_INT_AND ) ? ( pulses & monitored ) == monitored : ( pulses & monitored ) != 0 ){
+        LOG(m, LOG_CLOCK, LOG_DEBUG, "chs_rtc reference pulses %2.2X interrupt vector %2.2X\n", pulses, card->pioB.interrupt.vector);
+        interrupt_request( m, &card->pioB.interrupt );
+    }
 }
 
+// the reference pulses are only counted while port B can use them
+static void crtc_reference_schedule( struct machine *m ){
+    CLOCKCARD *card = m->clock;
 
+    if ( card->pioB.interrupt.enabled && card->pioB.mode == 3 ){
+        if ( !card->referenceevent.scheduled ){
+            event_schedule( m, &card->referenceevent, m->tstates + m->clockrate * 1000000ULL );
+        }
+    }
+    else {
+        event_cancel( m, &card->referenceevent );
+    }
+}
+
+// a Z80 PIO control word - vector, mode or interrupt control, and the masks that follow them
+static void crtc_pio_control( struct machine *m, CRTC_PIO *pio, int port_data ){
+
+    if ( pio->expect == PIO_EXPECT_IOMASK ){
+        pio->iomask = port_data;
+        pio->expect = PIO_EXPECT_CONTROL;
+        return;
+    }
+    if ( pio->expect == PIO_EXPECT_INTMASK ){
+        pio->intmask = port_data;
+        pio->expect = PIO_EXPECT_CONTROL;
+    }
+    else if ( ( port_data & 0x01 ) == 0 ){
+        pio->interrupt.vector = port_data;
+        return;
+    }
+    else {
+        switch ( port_data & 0x0F ){
+            case 0x0F:      // mode
+                pio->mode = ( port_data >> 6 ) & 0x03;
+                if ( pio->mode == 3 ){
+                    pio->expect = PIO_EXPECT_IOMASK;
+                }
+                break;
+            case 0x07:      // interrupt control
+                pio->intcontrol = port_data & 0xF0;
+                if ( port_data & PIO_INT_MASKFOLLOWS ){
+                    // a new mask throws away an interrupt that is waiting
+                    pio->expect = PIO_EXPECT_INTMASK;
+                    pio->interrupt.requesting = 0;
+                }
+                break;
+            case 0x03:      // interrupt enable only
+                pio->intcontrol = ( pio->intcontrol & ~PIO_INT_ENABLE ) | ( port_data & PIO_INT_ENABLE );
+                break;
+        }
+    }
+    pio->interrupt.enabled = ( pio->intcontrol & PIO_INT_ENABLE ) != 0 && pio->expect == PIO_EXPECT_CONTROL;
+    interrupt_update(m);
+}
 
 // read from Port A - really not sure it should return anything as 
 // port A is set to output 
-int crtc_PIOportadata_read( int portaddress){
+int crtc_PIOportadata_read( struct machine *m, int portaddress){
+    CLOCKCARD *card = m->clock;
     
-    if (chsclockcarddebug){
-        printf("chs_rtc port %2.2X PIO A data read value %2.2X\n",portaddress,portAdata);
-    }
+    LOG(m, LOG_CLOCK, LOG_DEBUG, "chs_rtc port %2.2X PIO A data read value %2.2X\n",portaddress,card->portAdata);
 
-    return portAdata;
+    return card->portAdata;
 }
 
 
@@ -74,33 +221,32 @@ int crtc_PIOportadata_read( int portaddress){
 
 // write to PIOdataA which is the address lines Hold and read write lines to the clock chip
 // 
-void crtc_PIOportadata_write( int portaddress, int port_data){
+void crtc_PIOportadata_write( struct machine *m, int portaddress, int port_data){
+    CLOCKCARD *card = m->clock;
 
-    if (chsclockcarddebug){
-        printf("chs_rtc port %2.2X PIO A data write value %2.2X\n",portaddress,port_data);
-    }
+    LOG(m, LOG_CLOCK, LOG_DEBUG, "chs_rtc port %2.2X PIO A data write value %2.2X\n",portaddress,port_data);
     // xor so get changes to bit pattern
-    int delta = port_data ^ portAdata;
+    int delta = port_data ^ card->portAdata;
 
-    portAdata = port_data;
+    card->portAdata = port_data;
 
-    if ( delta & portAdata & CRTC_CONTROL_HOLD )
+    if ( delta & card->portAdata & CRTC_CONTROL_HOLD )
     {
-        crtc_time_update(  );          /* Update from system clock as late as possible if going into hold mode */
+        crtc_time_update( m );          /* Update from system clock as late as possible if going into hold mode */
     }
 
-    if ( delta & portAdata & CRTC_CONTROL_WRITE )  /* If rising edge of write strobe */
+    if ( delta & card->portAdata & CRTC_CONTROL_WRITE )  /* If rising edge of write strobe */
     {
         // set the special switches when the write pulse is done
         //  check what address has been set on the write 
         // only 2 addresses are relevant 
-        switch ( portAdata & CRTC_CONTROL_ADDRESS_MASK )
+        switch ( card->portAdata & CRTC_CONTROL_ADDRESS_MASK )
         {
             case CRTC_REGISTER_TENS_OF_HOURS: 
-                  hoursmode = portBdata;
+                  card->hoursmode = card->portBdata;
                   break;
             case CRTC_REGISTER_TENS_OF_DAYS:
-                  daysmode = portBdata;
+                  card->daysmode = card->portBdata;
                   break;
         }
 
@@ -111,92 +257,87 @@ void crtc_PIOportadata_write( int portaddress, int port_data){
 
 // read the details from the PIO port B 
 // technically in the real interface it returns the lower 4 bits 
-int crtc_PIOportbdata_read( int portaddress){
+int crtc_PIOportbdata_read( struct machine *m, int portaddress){
+    CLOCKCARD *card = m->clock;
    /*
    * If hold is not present then get latest time from operating system
    */
-  if ( ! (portAdata & CRTC_CONTROL_HOLD ) )
+  if ( ! (card->portAdata & CRTC_CONTROL_HOLD ) )
   {
-    crtc_time_update( );
+    crtc_time_update( m );
   }
 
   int port_data = 0xFF;
-  if (chsclockcarddebug){
-        printf("check portAdata %2.2X read status %2.2X\n",portAdata, portAdata & CRTC_CONTROL_READ);
-  }
-  if ( portAdata & CRTC_CONTROL_READ ) {
-      if (chsclockcarddebug){
-        printf("Read active\n");
-      }
-      switch ( portAdata & CRTC_CONTROL_ADDRESS_MASK )
+  LOG(m, LOG_CLOCK, LOG_DEBUG, "check portAdata %2.2X read status %2.2X\n",card->portAdata, card->portAdata & CRTC_CONTROL_READ);
+  if ( card->portAdata & CRTC_CONTROL_READ ) {
+      LOG(m, LOG_CLOCK, LOG_DEBUG, "Read active\n");
+      switch ( card->portAdata & CRTC_CONTROL_ADDRESS_MASK )
       {
         case  CRTC_REGISTER_UNITS_OF_SECONDS:
-          port_data = lasttimestamp.tm_sec%10;
+          port_data = card->lasttimestamp.tm_sec%10;
           break;
         case  CRTC_REGISTER_TENS_OF_SECONDS:
-          port_data = lasttimestamp.tm_sec/10;
+          port_data = card->lasttimestamp.tm_sec/10;
           break;
         case  CRTC_REGISTER_UNITS_OF_MINUTES:
-          port_data = lasttimestamp.tm_min%10;
+          port_data = card->lasttimestamp.tm_min%10;
           break;
         case  CRTC_REGISTER_TENS_OF_MINUTES:
-          port_data = lasttimestamp.tm_min/10;
+          port_data = card->lasttimestamp.tm_min/10;
           break;
         case  CRTC_REGISTER_UNITS_OF_HOURS:
-          if ( hoursmode & CRTC_HOURS_MODE_24H )
+          if ( card->hoursmode & CRTC_HOURS_MODE_24H )
           {
-            port_data = lasttimestamp.tm_hour%10;
+            port_data = card->lasttimestamp.tm_hour%10;
           }
           else
           {
-         int hour = lasttimestamp.tm_hour;
+         int hour = card->lasttimestamp.tm_hour;
              hour = hour % 12;
              if ( hour == 0 ) hour = 12;
              port_data = hour % 10;
           }
           break;
         case  CRTC_REGISTER_TENS_OF_HOURS:
-          if ( hoursmode & CRTC_HOURS_MODE_24H )
+          if ( card->hoursmode & CRTC_HOURS_MODE_24H )
           {
-            port_data = lasttimestamp.tm_hour/10;
+            port_data = card->lasttimestamp.tm_hour/10;
           }
           else
           {
-         int hour = lasttimestamp.tm_hour;
+         int hour = card->lasttimestamp.tm_hour;
              port_data = (hour>=12) ? CRTC_HOURS_MODE_PM : 0;
              hour = hour % 12;
              if ( hour == 0 ) hour = 12;
              port_data |= hour / 10;
           }
-          port_data |= ( hoursmode & CRTC_HOURS_MODE_24H );
+          port_data |= ( card->hoursmode & CRTC_HOURS_MODE_24H );
           break;
         case  CRTC_REGISTER_UNITS_OF_DAYS:
-          port_data = lasttimestamp.tm_mday%10;
+          port_data = card->lasttimestamp.tm_mday%10;
           break;
         case  CRTC_REGISTER_TENS_OF_DAYS:
-          port_data = lasttimestamp.tm_mday/10;
-          port_data |= ( daysmode | CRTC_DAYS_MODE_LEAP_YEAR );
+          port_data = card->lasttimestamp.tm_mday/10;
+          port_data |= ( card->daysmode | CRTC_DAYS_MODE_LEAP_YEAR );
           break;
         case  CRTC_REGISTER_DAY_OF_WEEK:
-          port_data = lasttimestamp.tm_wday;
+          port_data = card->lasttimestamp.tm_wday;
           break;
         case  CRTC_REGISTER_UNITS_OF_MONTHS:
-          port_data = (lasttimestamp.tm_mon+1)%10;
+          port_data = (card->lasttimestamp.tm_mon+1)%10;
           break;
         case  CRTC_REGISTER_TENS_OF_MONTHS:
-          port_data = (lasttimestamp.tm_mon+1)/10;
+          port_data = (card->lasttimestamp.tm_mon+1)/10;
           break;
         case  CRTC_REGISTER_UNITS_OF_YEAR:
-          port_data = lasttimestamp.tm_year%10;
+          port_data = card->lasttimestamp.tm_year%10;
           break;
         case  CRTC_REGISTER_TENS_OF_YEAR:
-          port_data = (lasttimestamp.tm_year/10)%10;
+          port_data = (card->lasttimestamp.tm_year/10)%10;
           break;
       }
   }
-  if (chsclockcarddebug){
-    printf("chs_rtc port %2.2X PIO B data read value %2.2X\n",portaddress,port_data);
-  }
+  LOG(m, LOG_CLOCK, LOG_DEBUG, "chs_rtc port %2.2X PIO B data read value %2.2X\n",portaddress,port_data);
 
   return port_data;
 }
@@ -204,51 +345,93 @@ int crtc_PIOportbdata_read( int portaddress){
 
 
 // write to PIO port B
-void crtc_PIOportbdata_write( int portaddress, int port_data){
+void crtc_PIOportbdata_write( struct machine *m, int portaddress, int port_data){
+    CLOCKCARD *card = m->clock;
 
-    if (chsclockcarddebug){
-        printf("chs_rtc port %2.2X PIO B data write  value %2.2X\n",portaddress,port_data);
-    }
-    portBdata=port_data; 
+    LOG(m, LOG_CLOCK, LOG_DEBUG, "chs_rtc port %2.2X PIO B data write  value %2.2X\n",portaddress,port_data);
+    card->portBdata=port_data; 
     
 }
 
-int crtc_PIOportacontrol_read( int portaddress ){
+int crtc_PIOportacontrol_read( struct machine *m, int portaddress ){
 
     int port_data=0;
-    if (chsclockcarddebug){
-        printf("chs_rtc port %2.2X PIO A control read value %2.2X\n",portaddress,port_data);
-    }
+    LOG(m, LOG_CLOCK, LOG_DEBUG, "chs_rtc port %2.2X PIO A control read value %2.2X\n",portaddress,port_data);
     return port_data;
     
 }
     
-void crtc_PIOportacontrol_write( int portaddress, int port_data){
+void crtc_PIOportacontrol_write( struct machine *m, int portaddress, int port_data){
+    CLOCKCARD *card = m->clock;
 
-    if (chsclockcarddebug){
-        printf("chs_rtc port %2.2X PIO A control write  value %2.2X\n",portaddress,port_data);
-    }
-    
+    LOG(m, LOG_CLOCK, LOG_DEBUG, "chs_rtc port %2.2X PIO A control write  value %2.2X\n",portaddress,port_data);
+    crtc_pio_control( m, &card->pioA, port_data );
 }
 
 
-int crtc_PIOportbcontrol_read( int portaddress ){
+int crtc_PIOportbcontrol_read( struct machine *m, int portaddress ){
  
     int port_data=0;
-    if (chsclockcarddebug){
-        printf("chs_rtc port %2.2X PIO B control read value %2.2X\n",portaddress,port_data);
-    }
+    LOG(m, LOG_CLOCK, LOG_DEBUG, "chs_rtc port %2.2X PIO B control read value %2.2X\n",portaddress,port_data);
     return port_data;
     
 }
     
-void crtc_PIOportbcontrol_write( int portaddress, int port_data){
+void crtc_PIOportbcontrol_write( struct machine *m, int portaddress, int port_data){
+    CLOCKCARD *card = m->clock;
 
-    if (chsclockcarddebug){
-        printf("chs_rtc port %2.2X PIO B control write  value %2.2X\n",portaddress,port_data);
-    }
-    
+    LOG(m, LOG_CLOCK, LOG_DEBUG, "chs_rtc port %2.2X PIO B control write  value %2.2X\n",portaddress,port_data);
+    crtc_pio_control( m, &card->pioB, port_data );
+    crtc_reference_schedule( m );
 }
 
+// save or restore the pio ports and modes - the time itself comes from the host clock
+void chsclockcardSnapshot(struct machine *m, SNAPSHOT *s){
+    CLOCKCARD *card = m->clock;
+
+    int state[4] = { card->hoursmode, card->daysmode, card->portAdata, card->portBdata };
+
+    snapshot_data(s, "chsclock", state, sizeof(state));
+    if (s->restoring && !s->error){
+        card->hoursmode = state[0];
+        card->daysmode = state[1];
+        card->portAdata = state[2];
+        card->portBdata = state[3];
+    }
+
+    // the PIO registers, interrupt state and when the next reference pulse is due
+    CRTC_PIO *pios[2] = { &card->pioA, &card->pioB };
+    int piostate[2][9];
+    uint64_t referencedue = card->referenceevent.scheduled ? card->referenceevent.when : 0;
+    for (int i = 0; i < 2; i++){
+        CRTC_PIO *pio = pios[i];
+        int values[9] = { pio->mode, pio->iomask, pio->intcontrol, pio->intmask, pio->expect,
+                          pio->interrupt.enabled, pio->interrupt.requesting, pio->interrupt.inservice, pio->interrupt.vector };
+        memcpy(piostate[i], values, sizeof(values));
+    }
+    snapshot_data(s, "chspio", piostate, sizeof(piostate));
+    snapshot_data(s, "chsref", &referencedue, sizeof(referencedue));
+    snapshot_data(s, "chsrefs", &card->referenceseconds, sizeof(card->referenceseconds));
+    if (s->restoring && !s->error){
+        for (int i = 0; i < 2; i++){
+            CRTC_PIO *pio = pios[i];
+            pio->mode = piostate[i][0];
+            pio->iomask = piostate[i][1];
+            pio->intcontrol = piostate[i][2];
+            pio->intmask = piostate[i][3];
+            pio->expect = piostate[i][4];
+            pio->interrupt.enabled = piostate[i][5];
+            pio->interrupt.requesting = piostate[i][6];
+            pio->interrupt.inservice = piostate[i][7];
+            pio->interrupt.vector = piostate[i][8];
+        }
+        if (referencedue != 0){
+            event_schedule(m, &card->referenceevent, referencedue);
+        }
+        else {
+            event_cancel(m, &card->referenceevent);
+        }
+    }
+}
 
 // end of FILE
\ No newline at end of file
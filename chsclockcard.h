@@ -18,6 +18,15 @@
 #define CRTC_REGISTER_TENS_OF_MONTHS        (10)
 #define CRTC_REGISTER_UNITS_OF_YEAR         (11)
 #define CRTC_REGISTER_TENS_OF_YEAR          (12)
+#define CRTC_REGISTER_REFERENCE             (15)               /* reads the reference pulses below */
+
+/*
+ * Reference pulses - on the data lines while register 15 is being read
+ */
+#define CRTC_REFERENCE_1024HZ               (0x01)
+#define CRTC_REFERENCE_SECOND               (0x02)
+#define CRTC_REFERENCE_MINUTE               (0x04)
+#define CRTC_REFERENCE_HOUR                 (0x08)
 
 /*
  * Mode control - bits within the tens of hours and tens of days register to give operating mode 
@@ -37,12 +46,21 @@
 #define CRTC_CONTROL_ADJUST                 (0x80)               /* Adjust signal to the rtc (Active High)*/
 
 
-extern int crtc_PIOportadata_read( int portaddress);
-extern void crtc_PIOportadata_write( int portaddress, int port_data);
-extern int crtc_PIOportbdata_read( int portaddress);
-extern void crtc_PIOportbdata_write( int portaddress, int port_data);
+struct machine;
+
+// give the machine its clock card, and take it away again
+extern void chsclockcardCreate( struct machine *m );
+extern void chsclockcardFree( struct machine *m );
+
+// put the PIO on the interrupt daisy chain
+extern void chsclockcardInitialise( struct machine *m );
+
+extern int crtc_PIOportadata_read( struct machine *m, int portaddress);
+extern void crtc_PIOportadata_write( struct machine *m, int portaddress, int port_data);
+extern int crtc_PIOportbdata_read( struct machine *m, int portaddress);
+extern void crtc_PIOportbdata_write( struct machine *m, int portaddress, int port_data);
 
-extern int crtc_PIOportacontrol_read( int portaddress );
-extern void crtc_PIOportacontrol_write( int portaddress, int port_data);
-extern int crtc_PIOportbcontrol_read( int portaddress );
-extern void crtc_PIOportbcontrol_write( int portaddress, int port_data);
+extern int crtc_PIOportacontrol_read( struct machine *m, int portaddress );
+extern void crtc_PIOportacontrol_write( struct machine *m, int portaddress, int port_data);
+extern int crtc_PIOportbcontrol_read( struct machine *m, int portaddress );
+extern void crtc_PIOportbcontrol_write( struct machine *m, int portaddress, int port_data);
@@ -5,17 +5,15 @@
 
 #include "simz80.h"
 #include "map80ram.h"
+#include "cpmswitch.h"
 
 
-int cpmswitchstate=0;          // set to 1 if cpm mode set
-                              // vfc boot rom in at 0 to start
-                             // Nascom ROM and VWRAM not enabled
-                            //
-
-void setcpmswitch(int state){ // set the mode for cpm switch 
+void setcpmswitch(struct machine *m, int state){ // set the mode for cpm switch 
     // 0 - NASSYS
     // 1 - cpm - map80vfc link 4 is set to bring in the rom at start
     
+    struct rampage *rampagetable = m->rampagetable;
+
     if (state==0){
          // fix DA - set locked memory pages
         // now fix for monitor and Nascom 2 working ram
@@ -24,22 +22,22 @@ void setcpmswitch(int state){ // set the mode for cpm switch
         // location for 0 to 1 linked to addresses in special area
         // this is for the monitor and video/working ram
         // assumes 2k pages so allow for monitor
-        ramlocktable[0] = 1;
+        rampagetable[0].flags |= RAMPAGE_LOCKED;
         // assumes 2k pages so allow for video and work ram
-        ramlocktable[1] = 1;
+        // and trap writes so the display knows which lines have changed
+        rampagetable[1].flags |= RAMPAGE_LOCKED | RAMPAGE_IOTRAP;
         // lock the nascom rom area/
         // using loadNASformat which uses the memory directly so not an issue
-        // simz80 uses putbyte to store stuff and ramromtable stops it.
+        // simz80 uses putbyte to store stuff and RAMPAGE_ROM stops it.
         // assumes 2k pages so allow for monitor
-        ramromtable[0] = 1;
+        rampagetable[0].flags |= RAMPAGE_ROM;
         // point those ram locations in rampagetable to Nascom MonVWram 4k area of ram for NASCOM etc.,
-        for (int c=0; c< 2 ; ++c) {
-            rampagetable[c]=NascomMonVWram+(c<<RAMPAGESHIFTBITS);
-            // printf(" rampagetable %d address %p \n",c,rampagetable[c]);
-        }
+        // the monitor from the rom the machines share - see map80RamShareRoms
+        rampagetable[0].host=m->ram->monitorrom;
+        rampagetable[1].host=m->ram->NascomMonVWram+(1<<RAMPAGESHIFTBITS);
     }
     // tell the rest if the code we are in cpm mode
-    cpmswitchstate=state;
+    m->cpmswitchstate=state;
     
 }
     
\ No newline at end of file
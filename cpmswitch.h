@@ -3,12 +3,12 @@
  
  */
  
-extern int cpmswitchstate;   // set to 1 if cpm mode set
+// cpmswitchstate in struct machine is set to 1 if cpm mode set
                          // vfc boot rom in at 0 to start
                         // Nascom ROM and VWRAM not enabled
                        //
                        
- extern void setcpmswitch(int state); // set the mode for cpm switch 
+ extern void setcpmswitch(struct machine *m, int state); // set the mode for cpm switch 
  // 0 - NASSYS
  // 1 - cpm - mapvfc link 4 is 
   
\ No newline at end of file
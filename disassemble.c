@@ -797,7 +797,8 @@ int disassembleline (unsigned int address, unsigned char * bindata, char * retur
 
 }
 
-int disassembleprogram(FASTREG PC,
+int disassembleprogram(struct machine *m,
+                        FASTREG PC,
                         FILE * outputfile,
                         int showregisters,
                         FASTREG startaddress,
@@ -808,9 +809,8 @@ int disassembleprogram(FASTREG PC,
                         FASTREG HL,
                         FASTREG SP){
 
-        static FASTREG previousPC=0;
         // added limit range to the trace option
-        //printf("Tracing only between address %4.4X and %4.4X (hex) \n",tracestartaddress,traceendaddress);
+        //printf("Tracing only between address %4.4X and %4.4X (hex) \n",m->tracestartaddress,m->traceendaddress);
         
         char disstr[100];
         unsigned char disdata[5];
@@ -837,8 +837,8 @@ int disassembleprogram(FASTREG PC,
             }
             fprintf(outputfile,"\n");
 
-            previousPC=PC;
-            if (cpmswitchstate==0){
+            m->previousPC=PC;
+            if (m->cpmswitchstate==0){
                   // nassys3 mode 
                   int numberofbytes=0;  // set to how many extra bytes to display
                 if ( ( RAM(PC)& 0xC7) == 0xC7) { // a RST opcode
@@ -1084,11 +1084,11 @@ int disassembleprogram(FASTREG PC,
 
         }
         else{
-            if ( (previousPC>=tracestartaddress) && (previousPC <= traceendaddress) )  {
+            if ( (m->previousPC>=m->tracestartaddress) && (m->previousPC <= m->traceendaddress) )  {
                 // display this address as previous one was in the range
               fprintf(outputfile,"::%4.4X: > > >\n",PC);
             }
-            previousPC=PC;
+            m->previousPC=PC;
         }
 
     return lencmd;
@@ -9,7 +9,8 @@ extern int disassembleline (unsigned int address, unsigned  char * bindata, char
 
 // process a line in the program 
 // replaced above to include limits and nassys code.
-extern int disassembleprogram(FASTREG PC,
+extern int disassembleprogram(struct machine *m,
+                        FASTREG PC,
                         FILE * outputfile,
                         int showregisters,
                         FASTREG startaddress,
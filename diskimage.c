@@ -0,0 +1,429 @@
+/*  disc image files for the floppy and SDcard controllers
+
+    The whole image is mapped with mmap MAP_SHARED so
+    - a sector read or write is done straight in the mapping
+    - writes go to the file through the page cache, msync pushes them to the disc
+    - a large SD card image mounts at once and only the sectors used are paged in
+
+    or, with an overlay, mapped MAP_PRIVATE so the image file is only read
+    - the kernel copies a page when it is first written, the rest stay shared
+    - the blocks written are kept in the overlay file and put back on top when it is opened again
+
+    or, for a compressed image, anonymous memory the size of the image that
+    zimage unpacks blocks into as they are used
+
+*/
+
+#define _XOPEN_SOURCE 700      // msync, fdatasync, strdup
+#define _DEFAULT_SOURCE        // MAP_NORESERVE, MAP_ANONYMOUS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "options.h"
+#include "diskimage.h"
+
+
+// open a .zimg and map memory for it to be unpacked into - returns 0 if okay
+static int diskimage_open_compressed(DISKIMAGE *image, const char *filename){
+
+    image->compressed = malloc(sizeof(ZIMAGE));
+    if (image->compressed == NULL || zimage_open(image->compressed, filename, DISKIMAGECACHEBLOCKS, image->out, image->err) != 0){
+        free(image->compressed);
+        image->compressed = NULL;
+        return -1;
+    }
+    // nothing is taken until a block is unpacked
+#ifdef MAP_NORESERVE
+    void * mapping = mmap(NULL, image->compressed->imageSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#else
+    void * mapping = mmap(NULL, image->compressed->imageSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#endif
+    if (mapping == MAP_FAILED){
+        fprintf(image->err, "%s: %s\n", filename, strerror(errno));
+        zimage_close(image->compressed);
+        free(image->compressed);
+        image->compressed = NULL;
+        return -1;
+    }
+    image->base = mapping;
+    image->size = image->compressed->imageSize;
+    return 0;
+}
+
+int diskimage_open(DISKIMAGE *image, const char *filename, FILE *out, FILE *err){
+
+    struct stat filestatus;
+    int prot = PROT_READ | PROT_WRITE;
+
+    memset(image, 0, sizeof(DISKIMAGE));
+    image->out = out;
+    image->err = err;
+
+    if (zimage_is_compressed(filename)){
+        // blocks written would have nowhere to go without an overlay
+        image->readOnly = 1;
+        return diskimage_open_compressed(image, filename);
+    }
+
+    int fd = open(filename, O_RDWR);
+    if (fd < 0){
+        // may still be able to read it
+        fd = open(filename, O_RDONLY);
+        if (fd < 0){
+            fprintf(image->err, "%s: %s\n", filename, strerror(errno));
+            return -1;
+        }
+        prot = PROT_READ;
+        image->readOnly = 1;
+    }
+
+    if (fstat(fd, &filestatus) != 0){
+        fprintf(image->err, "%s: %s\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (filestatus.st_size == 0){
+        fprintf(image->out, "Disc image '%s' is empty.\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    void * mapping = mmap(NULL, filestatus.st_size, prot, MAP_SHARED, fd, 0);
+    // the mapping keeps the file open
+    close(fd);
+    if (mapping == MAP_FAILED){
+        fprintf(image->err, "%s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    image->base = mapping;
+    image->size = filestatus.st_size;
+    return 0;
+}
+
+// start of an overlay file - the bitmap follows
+typedef struct {
+    char magic[8];              // OVERLAYMAGIC
+    uint32_t blockSize;
+    uint32_t reserved;
+    uint64_t imageSize;         // must match the image
+} OVERLAYHEADER;
+
+#define OVERLAYBITMAPBYTES(blocks) (((blocks) + 7) / 8)
+#define OVERLAYBIT(map, n) ((map)[(n) >> 3] & (1 << ((n) & 7)))
+#define OVERLAYSETBIT(map, n) ((map)[(n) >> 3] |= (1 << ((n) & 7)))
+#define OVERLAYCLEARBIT(map, n) ((map)[(n) >> 3] &= ~(1 << ((n) & 7)))
+
+// bytes in block n - the last block of the image can be short
+static size_t overlay_blocklength(DISKIMAGE *image, size_t n){
+    size_t offset = n * image->blockSize;
+    return (image->size - offset < image->blockSize) ? image->size - offset : image->blockSize;
+}
+
+int diskimage_open_overlay(DISKIMAGE *image, const char *filename, const char *overlayname,
+                           size_t blocksize, int overlayexit, FILE *out, FILE *err){
+
+    struct stat filestatus;
+    OVERLAYHEADER header;
+
+    memset(image, 0, sizeof(DISKIMAGE));
+    image->out = out;
+    image->err = err;
+
+    if (blocksize == 0){
+        fprintf(image->out, "Disc image '%s' has no block size for the overlay.\n", filename);
+        return -1;
+    }
+    if (zimage_is_compressed(filename)){
+        if (diskimage_open_compressed(image, filename) != 0){
+            return -1;
+        }
+    }
+    else {
+        // the image itself is never written to until a commit
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0){
+            fprintf(image->err, "%s: %s\n", filename, strerror(errno));
+            return -1;
+        }
+        if (fstat(fd, &filestatus) != 0){
+            fprintf(image->err, "%s: %s\n", filename, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (filestatus.st_size == 0){
+            fprintf(image->out, "Disc image '%s' is empty.\n", filename);
+            close(fd);
+            return -1;
+        }
+        // a large SD card image would not fit the swap if it all had to be reserved for copies
+#ifdef MAP_NORESERVE
+        void * mapping = mmap(NULL, filestatus.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+#else
+        void * mapping = mmap(NULL, filestatus.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+#endif
+        close(fd);
+        if (mapping == MAP_FAILED){
+            fprintf(image->err, "%s: %s\n", filename, strerror(errno));
+            return -1;
+        }
+        image->base = mapping;
+        image->size = filestatus.st_size;
+    }
+
+    image->blockSize = blocksize;
+    image->blocks = (image->size + blocksize - 1) / blocksize;
+    size_t bitmapbytes = OVERLAYBITMAPBYTES(image->blocks);
+    image->overlayData = ((sizeof(OVERLAYHEADER) + bitmapbytes + 4095) / 4096) * 4096;
+    image->overlayMap = calloc(bitmapbytes, 1);
+    image->overlayDirty = calloc(bitmapbytes, 1);
+    image->fileName = strdup(filename);
+    image->overlayName = strdup(overlayname);
+    image->overlayExit = OVERLAY_KEEP;   // until it has been opened
+    image->overlayFile = open(overlayname, O_RDWR | O_CREAT, 0644);
+    if (image->overlayFile < 0){
+        fprintf(image->err, "%s: %s\n", overlayname, strerror(errno));
+        diskimage_close(image);
+        return -1;
+    }
+
+    ssize_t headerbytes = pread(image->overlayFile, &header, sizeof(header), 0);
+    if (headerbytes == 0){
+        // a new overlay - an empty bitmap and no blocks
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, OVERLAYMAGIC, sizeof(header.magic));
+        header.blockSize = blocksize;
+        header.imageSize = image->size;
+        if (pwrite(image->overlayFile, &header, sizeof(header), 0) != sizeof(header) ||
+            ftruncate(image->overlayFile, image->overlayData) != 0){
+            fprintf(image->err, "%s: %s\n", overlayname, strerror(errno));
+            diskimage_close(image);
+            return -1;
+        }
+    }
+    else if (headerbytes != sizeof(header) || memcmp(header.magic, OVERLAYMAGIC, sizeof(header.magic)) != 0 ||
+             header.blockSize != blocksize || header.imageSize != image->size){
+        fprintf(image->out, "Overlay '%s' is not an overlay for '%s'.\n", overlayname, filename);
+        diskimage_close(image);
+        return -1;
+    }
+    else {
+        // put the blocks already written back on top of the image
+        if (pread(image->overlayFile, image->overlayMap, bitmapbytes, sizeof(header)) != (ssize_t)bitmapbytes){
+            fprintf(image->err, "%s: %s\n", overlayname, strerror(errno));
+            diskimage_close(image);
+            return -1;
+        }
+        for (size_t n = 0; n < image->blocks; n++){
+            if (OVERLAYBIT(image->overlayMap, n)){
+                size_t length = overlay_blocklength(image, n);
+                // the rest of a compressed block has to be there before the overlay goes on top of it
+                if (image->compressed != NULL){
+                    if (zimage_load(image->compressed, image->base, n * blocksize, length) != 0){
+                        diskimage_close(image);
+                        return -1;
+                    }
+                    zimage_pin(image->compressed, n * blocksize, length);
+                }
+                if (pread(image->overlayFile, image->base + n * blocksize, length,
+                          image->overlayData + n * blocksize) != (ssize_t)length){
+                    fprintf(image->err, "%s: %s\n", overlayname, strerror(errno));
+                    diskimage_close(image);
+                    return -1;
+                }
+            }
+        }
+    }
+    image->overlayExit = overlayexit;
+    return 0;
+}
+
+int diskimage_overlay_exit(const char *name){
+
+    if (strcmp(name, "keep") == 0){
+        return OVERLAY_KEEP;
+    }
+    if (strcmp(name, "discard") == 0){
+        return OVERLAY_DISCARD;
+    }
+    if (strcmp(name, "commit") == 0){
+        return OVERLAY_COMMIT;
+    }
+    return -1;
+}
+
+unsigned char * diskimage_sector(DISKIMAGE *image, off_t offset, size_t length){
+
+    if (image->base == NULL || offset < 0 || (size_t)offset > image->size || length > image->size - offset){
+        return NULL;
+    }
+    if (image->compressed != NULL && zimage_load(image->compressed, image->base, offset, length) != 0){
+        return NULL;
+    }
+    return image->base + offset;
+}
+
+void diskimage_prefetch(DISKIMAGE *image, off_t offset, size_t length){
+
+    // a compressed image is unpacked now by diskimage_sector
+    if (diskimage_sector(image, offset, length) != NULL && image->compressed == NULL){
+        // madvise has to start on a page boundary
+        size_t pagesize = sysconf(_SC_PAGESIZE);
+        size_t start = offset - offset % pagesize;
+        posix_madvise(image->base + start, offset + length - start, POSIX_MADV_WILLNEED);
+    }
+}
+
+void diskimage_written(DISKIMAGE *image, off_t offset, size_t length){
+
+    if (image->compressed != NULL){
+        // only copy of what was written until it is in the overlay
+        zimage_pin(image->compressed, offset, length);
+    }
+    if (image->overlayMap != NULL && length > 0){
+        for (size_t n = offset / image->blockSize; n <= (offset + length - 1) / image->blockSize; n++){
+            OVERLAYSETBIT(image->overlayDirty, n);
+        }
+    }
+    if (image->dirtyStart == image->dirtyEnd){
+        image->dirtyStart = offset;
+        image->dirtyEnd = offset + length;
+    }
+    else {
+        if ((size_t)offset < image->dirtyStart){
+            image->dirtyStart = offset;
+        }
+        if (offset + length > image->dirtyEnd){
+            image->dirtyEnd = offset + length;
+        }
+    }
+}
+
+// write the blocks written since the last flush to the overlay file
+static void overlay_flush(DISKIMAGE *image){
+
+    size_t first = image->dirtyStart / image->blockSize;
+    size_t last = (image->dirtyEnd - 1) / image->blockSize;
+
+    for (size_t n = first; n <= last; n++){
+        if (OVERLAYBIT(image->overlayDirty, n)){
+            OVERLAYCLEARBIT(image->overlayDirty, n);
+            // nothing to keep if it is going to be thrown away
+            if (image->overlayExit == OVERLAY_DISCARD){
+                continue;
+            }
+            size_t length = overlay_blocklength(image, n);
+            if (pwrite(image->overlayFile, image->base + n * image->blockSize, length,
+                       image->overlayData + n * image->blockSize) != (ssize_t)length){
+                fprintf(image->err, "%s: %s\n", image->overlayName, strerror(errno));
+                continue;
+            }
+            OVERLAYSETBIT(image->overlayMap, n);
+        }
+    }
+    if (image->overlayExit == OVERLAY_DISCARD){
+        return;
+    }
+    // the blocks have to be in the file before the bitmap says they are
+    fdatasync(image->overlayFile);
+    if (pwrite(image->overlayFile, image->overlayMap + first / 8, last / 8 - first / 8 + 1,
+               sizeof(OVERLAYHEADER) + first / 8) != (ssize_t)(last / 8 - first / 8 + 1)){
+        fprintf(image->err, "%s: %s\n", image->overlayName, strerror(errno));
+    }
+    fdatasync(image->overlayFile);
+}
+
+// write the blocks in the overlay into the image file
+static int overlay_commit(DISKIMAGE *image){
+
+    if (image->compressed != NULL){
+        fprintf(image->out, "Overlay '%s' kept - it can not be committed to the compressed image '%s'.\n",
+                image->overlayName, image->fileName);
+        return -1;
+    }
+    int fd = open(image->fileName, O_WRONLY);
+    if (fd < 0){
+        fprintf(image->err, "%s: %s\n", image->fileName, strerror(errno));
+        return -1;
+    }
+    int result = 0;
+    for (size_t n = 0; n < image->blocks; n++){
+        if (OVERLAYBIT(image->overlayMap, n)){
+            size_t length = overlay_blocklength(image, n);
+            if (pwrite(fd, image->base + n * image->blockSize, length, n * image->blockSize) != (ssize_t)length){
+                fprintf(image->err, "%s: %s\n", image->fileName, strerror(errno));
+                result = -1;
+                break;
+            }
+        }
+    }
+    if (fsync(fd) != 0){
+        fprintf(image->err, "%s: %s\n", image->fileName, strerror(errno));
+        result = -1;
+    }
+    close(fd);
+    return result;
+}
+
+void diskimage_flush(DISKIMAGE *image){
+
+    if (image->base != NULL && image->dirtyStart != image->dirtyEnd && image->overlayMap != NULL){
+        overlay_flush(image);
+        image->dirtyStart = image->dirtyEnd = 0;
+    }
+    else if (image->base != NULL && image->dirtyStart != image->dirtyEnd && image->compressed == NULL){
+        // msync has to start on a page boundary
+        size_t pagesize = sysconf(_SC_PAGESIZE);
+        size_t start = image->dirtyStart - image->dirtyStart % pagesize;
+        if (msync(image->base + start, image->dirtyEnd - start, MS_SYNC) != 0){
+            fprintf(image->err, "disc image flush: %s\n", strerror(errno));
+        }
+        image->dirtyStart = image->dirtyEnd = 0;
+    }
+}
+
+void diskimage_close(DISKIMAGE *image){
+
+    if (image->base != NULL){
+        diskimage_flush(image);
+    }
+    if (image->overlayMap != NULL){
+        if (image->overlayFile >= 0){
+            close(image->overlayFile);
+            if (image->overlayExit == OVERLAY_COMMIT && overlay_commit(image) == 0){
+                fprintf(image->out, "Overlay '%s' committed to '%s'.\n", image->overlayName, image->fileName);
+                unlink(image->overlayName);
+            }
+            else if (image->overlayExit == OVERLAY_DISCARD){
+                unlink(image->overlayName);
+            }
+        }
+        free(image->overlayMap);
+        free(image->overlayDirty);
+        free(image->fileName);
+        free(image->overlayName);
+        image->overlayMap = NULL;
+    }
+    if (image->base != NULL){
+        munmap(image->base, image->size);
+        image->base = NULL;
+        image->size = 0;
+    }
+    if (image->compressed != NULL){
+        zimage_close(image->compressed);
+        free(image->compressed);
+        image->compressed = NULL;
+    }
+}
+
+// end of file
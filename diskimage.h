@@ -0,0 +1,94 @@
+/*  disc image files for the floppy and SDcard controllers
+
+    The image file is mapped into memory when it is mounted, so a sector
+    is just a pointer into the mapping. The controllers read and write the
+    bytes in place, nothing is copied in or out of a sector buffer, and
+    only the parts of the image that are used take up memory.
+
+    With an overlay the image file is only read. It is mapped copy on write,
+    so the pages not written are shared with any other emulator using the
+    same image, and each block written goes to a sparse overlay file:
+
+        header      OVERLAYMAGIC, block size and image size
+        bitmap      a bit per block, set if the block is in the overlay
+        blocks      from the first 4K boundary after the bitmap, block n at n * block size
+                    from there, with holes for the blocks not written
+
+    When the image is closed the overlay is kept for next time, thrown away,
+    or committed, that is written into the image file and then removed.
+
+    A compressed image ( see zimage.h ) is mapped as memory of its own and
+    blocks are unpacked into it as they are asked for. It can only be written
+    to with an overlay, and the overlay can not be committed to it.
+
+*/
+
+#ifndef DISKIMAGE_DEFINED_H
+#define DISKIMAGE_DEFINED_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "zimage.h"
+
+// what happens to an overlay when the image is closed
+#define OVERLAY_KEEP 0
+#define OVERLAY_DISCARD 1
+#define OVERLAY_COMMIT 2
+
+#define OVERLAYMAGIC "MAP80COW"
+
+typedef struct {
+    unsigned char * base;       // start of the mapping - NULL if no image open
+    size_t size;                // size of the image file in bytes
+    int readOnly;               // 1 if the image could only be opened for reading
+    size_t dirtyStart;          // range written since the last flush
+    size_t dirtyEnd;            //    dirtyStart == dirtyEnd if none
+    // overlay - only used if overlayMap is not NULL
+    int overlayFile;            // the overlay file
+    char * fileName;            // image file, for commit
+    char * overlayName;         // overlay file, for discard and commit
+    size_t blockSize;           // bytes in a block of the overlay - the sector size
+    size_t blocks;              // blocks in the image
+    off_t overlayData;          // offset of block 0 in the overlay file
+    unsigned char * overlayMap;     // bit per block - set if the block is in the overlay
+    unsigned char * overlayDirty;   // bit per block - set if written since the last flush
+    int overlayExit;            // OVERLAY_KEEP, OVERLAY_DISCARD or OVERLAY_COMMIT
+    ZIMAGE * compressed;        // the .zimg file - NULL if the image is not compressed
+    FILE * out;                 // where problems are reported - the machine's out
+    FILE * err;                 //    and the errors from the system - the machine's err
+} DISKIMAGE;
+
+// map the image file - returns 0 if okay
+// if it can not be written to, or is compressed, it is mapped read only and readOnly is set
+// problems with it are reported to out and err, from now until it is closed
+extern int diskimage_open(DISKIMAGE *image, const char *filename, FILE *out, FILE *err);
+
+// map the image file copy on write with the blocks already in the overlay file on top
+// the overlay file is made if it is not there - returns 0 if okay
+extern int diskimage_open_overlay(DISKIMAGE *image, const char *filename, const char *overlayname,
+                                  size_t blocksize, int overlayexit, FILE *out, FILE *err);
+
+// parse keep, discard or commit - returns -1 if it is none of them
+extern int diskimage_overlay_exit(const char *name);
+
+// pointer to length bytes at offset in the image - NULL if outside the image
+// for a compressed image the pointer is good until the next call for the same image
+extern unsigned char * diskimage_sector(DISKIMAGE *image, off_t offset, size_t length);
+
+// ask for length bytes at offset to be read in from the image file ahead of use
+extern void diskimage_prefetch(DISKIMAGE *image, off_t offset, size_t length);
+
+// note length bytes at offset have been written to so the next flush writes them out
+extern void diskimage_written(DISKIMAGE *image, off_t offset, size_t length);
+
+// write the parts written to since the last flush out to the image file, or to the overlay file
+extern void diskimage_flush(DISKIMAGE *image);
+
+// flush and unmap the image - the overlay is kept, discarded or committed as set when it was opened
+extern void diskimage_close(DISKIMAGE *image);
+
+#endif
+
+// end of file
@@ -23,6 +23,10 @@ static uint32_t pixmap[NASCOM_DISPLAY_HEIGHT * NASCOM_DISPLAY_WIDTH];
 
 static BYTE *screenRam;
 
+// one bit for each line of screen ram that has been written to since the last refresh
+// start with them all set so the first refresh draws everything
+static uint32_t nascomdirtylines = (1u << NASCOM_DISPLAYLINES) - 1;
+
 static void RenderItem(int idx, int xp, int yp);
 
 int nascomdisplayxpos=NASCOM_DISPLAY_XPOS;
@@ -117,6 +121,21 @@ void nascom_GetWindowSize(int* w, int* h){
 }
 
 
+// length bytes from offset in the screen ram have been written to
+// called from the rampagetable write trap
+void nascom_display_written(unsigned int offset, int length)
+{
+    unsigned int last = offset + length - 1;
+
+    // the 2k page also holds the monitor work ram
+    if (offset >= NASCOM_DISPLAYLINES * 64)
+        return;
+    if (last >= NASCOM_DISPLAYLINES * 64)
+        last = NASCOM_DISPLAYLINES * 64 - 1;
+    for (unsigned int line = offset / 64; line <= last / 64; line++)
+        nascomdirtylines |= 1u << line;
+}
+
 /* Would be better to do the updating on demand and the push here */
 // fix DA - need to ensure we pick up the RAM entry not ram
 //     that is allow for the paging process.
@@ -159,9 +178,16 @@ void nascom_display_refresh(void)
     // for each line on the screen
     // normally screen is 80A to BFF
     // as special ram for screen it is now 00A 4FF
+    // only lines that have been written to need to be looked at
+    uint32_t dirtylines = nascomdirtylines;
+    nascomdirtylines = 0;
     for (WORD screenAddress = 0x00A ;
                screenAddress <  0x400; screenAddress += 64, screencacheAddress += 64) {
 
+        if ((dirtylines & (1u << (screenAddress / 64))) == 0){
+            continue;
+        }
+
         uint8_t *cacheByte = screencacheAddress;  // address into screen cache to use in the next loop
 
         // for each character in the line
@@ -36,6 +36,7 @@
 
 extern int nascom_create_screen(BYTE *ScreenMemory);
 extern void nascom_display_refresh(void);
+extern void nascom_display_written(unsigned int offset, int length);
 extern void nascom_display_change_size(int sizefactor);
 extern void nascom_display_position(int x, int y);
 extern void nascom_GetWindowSize(int* w, int* h);
@@ -0,0 +1,145 @@
+/*  imgzip - convert a floppy or SDcard image to a compressed .zimg and back
+
+    imgzip image.img image.zimg         compress
+    imgzip -d image.zimg image.img      uncompress
+
+    A .zimg can be used wherever an image file can, see zimage.h
+
+*/
+
+#define _XOPEN_SOURCE 700      // pread, pwrite
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "zimage.h"
+
+static int compress(const char *from, const char *to){
+
+    struct stat filestatus;
+    ZIMAGEHEADER header;
+
+    int in = open(from, O_RDONLY);
+    if (in < 0 || fstat(in, &filestatus) != 0){
+        perror(from);
+        return 1;
+    }
+    if (filestatus.st_size == 0){
+        fprintf(stderr, "%s is empty\n", from);
+        return 1;
+    }
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0){
+        perror(to);
+        return 1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ZIMAGEMAGIC, sizeof(header.magic));
+    header.blockSize = ZIMAGEBLOCKSIZE;
+    header.imageSize = filestatus.st_size;
+    header.blocks = (header.imageSize + header.blockSize - 1) / header.blockSize;
+
+    uint64_t *index = malloc((header.blocks + 1) * sizeof(uint64_t));
+    unsigned char *block = malloc(header.blockSize);
+    unsigned char *packed = malloc(header.blockSize);
+    if (index == NULL || block == NULL || packed == NULL){
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    // the blocks go after the index
+    uint64_t position = sizeof(header) + (header.blocks + 1) * sizeof(uint64_t);
+    for (uint64_t n = 0; n < header.blocks; n++){
+        size_t length = header.imageSize - n * header.blockSize;
+        if (length > header.blockSize){
+            length = header.blockSize;
+        }
+        if (pread(in, block, length, n * header.blockSize) != (ssize_t)length){
+            perror(from);
+            return 1;
+        }
+        // stored as it is if it does not get any smaller
+        size_t packedlength = lz4_compress(block, length, packed, length - 1);
+        unsigned char *data = packed;
+        if (packedlength == 0){
+            packedlength = length;
+            data = block;
+        }
+        if (pwrite(out, data, packedlength, position) != (ssize_t)packedlength){
+            perror(to);
+            return 1;
+        }
+        index[n] = position;
+        position += packedlength;
+    }
+    index[header.blocks] = position;
+
+    size_t indexbytes = (header.blocks + 1) * sizeof(uint64_t);
+    if (pwrite(out, &header, sizeof(header), 0) != sizeof(header) ||
+        pwrite(out, index, indexbytes, sizeof(header)) != (ssize_t)indexbytes ||
+        fsync(out) != 0){
+        perror(to);
+        return 1;
+    }
+    close(out);
+    close(in);
+    fprintf(stdout, "%s: %llu bytes, %s: %llu bytes in %llu blocks\n", from, (unsigned long long)header.imageSize,
+            to, (unsigned long long)position, (unsigned long long)header.blocks);
+    free(index);
+    free(block);
+    free(packed);
+    return 0;
+}
+
+static int uncompress(const char *from, const char *to){
+
+    ZIMAGE zimage;
+
+    // all of the blocks are unpacked so keep them all
+    if (zimage_open(&zimage, from, 0, stderr, stderr) != 0){
+        return 1;
+    }
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0){
+        perror(to);
+        return 1;
+    }
+    unsigned char *image = malloc(zimage.imageSize);
+    if (image == NULL){
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    if (zimage_load(&zimage, image, 0, zimage.imageSize) != 0){
+        return 1;
+    }
+    if (pwrite(out, image, zimage.imageSize, 0) != (ssize_t)zimage.imageSize || fsync(out) != 0){
+        perror(to);
+        return 1;
+    }
+    close(out);
+    fprintf(stdout, "%s: %zu bytes\n", to, zimage.imageSize);
+    free(image);
+    zimage_close(&zimage);
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+
+    if (argc == 3 && strcmp(argv[1], "-d") != 0){
+        return compress(argv[1], argv[2]);
+    }
+    if (argc == 4 && strcmp(argv[1], "-d") == 0){
+        return uncompress(argv[2], argv[3]);
+    }
+    fprintf(stderr, "usage: imgzip image zimage\n"
+                    "       imgzip -d zimage image\n");
+    return 2;
+}
+
+// end of file
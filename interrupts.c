@@ -0,0 +1,139 @@
+/*  Z80 maskable interrupts and the T-state event queue
+
+    see interrupts.h
+
+    There are only a few sources and events, so the daisy chain is an
+    array in priority order and the event queue is a list kept in
+    tstates order.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "options.h"
+#include "simz80.h"
+#include "interrupts.h"
+
+void interrupt_register(struct machine *m, INTSOURCE *source){
+
+    if (m->daisychainlength == INTERRUPTMAXSOURCES){
+        fprintf(m->err, "Too many interrupt sources - %s is not on the daisy chain\n", source->name);
+        return;
+    }
+    m->daisychain[m->daisychainlength++] = source;
+    interrupt_update(m);
+}
+
+// a source can interrupt if it is asking and nothing above it is in service
+void interrupt_update(struct machine *m){
+
+    m->interruptline = 0;
+    for (int i = 0; i < m->daisychainlength; i++){
+        INTSOURCE *source = m->daisychain[i];
+        if (source->inservice){
+            // IEO is low for everything further down the chain
+            break;
+        }
+        if (source->requesting && source->enabled){
+            m->interruptline = 1;
+            // simz80 decides if it can take it
+            m->simevents |= SIMEVENT_INT;
+            break;
+        }
+    }
+}
+
+void interrupt_request(struct machine *m, INTSOURCE *source){
+
+    source->requesting = 1;
+    interrupt_update(m);
+}
+
+void interrupt_cancel(struct machine *m, INTSOURCE *source){
+
+    source->requesting = 0;
+    interrupt_update(m);
+}
+
+int interrupt_acknowledge(struct machine *m){
+
+    for (int i = 0; i < m->daisychainlength; i++){
+        INTSOURCE *source = m->daisychain[i];
+        if (source->inservice){
+            break;
+        }
+        if (source->requesting && source->enabled){
+            source->requesting = 0;
+            source->inservice = 1;
+            interrupt_update(m);
+            return source->vector & 0xFF;
+        }
+    }
+    m->interruptline = 0;
+    return -1;
+}
+
+void interrupt_reti(struct machine *m){
+
+    // the device nearest the Z80 that is in service sees the RETI
+    for (int i = 0; i < m->daisychainlength; i++){
+        if (m->daisychain[i]->inservice){
+            m->daisychain[i]->inservice = 0;
+            interrupt_update(m);
+            return;
+        }
+    }
+}
+
+void interrupt_reset(struct machine *m){
+
+    for (int i = 0; i < m->daisychainlength; i++){
+        m->daisychain[i]->requesting = 0;
+        m->daisychain[i]->inservice = 0;
+    }
+    m->interruptline = 0;
+}
+
+void event_schedule(struct machine *m, EVENT *event, uint64_t when){
+
+    event_cancel(m, event);
+    event->when = when;
+    event->scheduled = 1;
+    EVENT **link = &m->eventqueue;
+    while (*link != NULL && (*link)->when <= when){
+        link = &(*link)->next;
+    }
+    event->next = *link;
+    *link = event;
+    m->eventnext = m->eventqueue->when;
+}
+
+void event_cancel(struct machine *m, EVENT *event){
+
+    if (!event->scheduled){
+        return;
+    }
+    for (EVENT **link = &m->eventqueue; *link != NULL; link = &(*link)->next){
+        if (*link == event){
+            *link = event->next;
+            break;
+        }
+    }
+    event->scheduled = 0;
+    m->eventnext = m->eventqueue != NULL ? m->eventqueue->when : UINT64_MAX;
+}
+
+void event_run(struct machine *m){
+
+    // an event may schedule itself again, so take each one off the queue first
+    while (m->eventqueue != NULL && m->eventqueue->when <= m->tstates){
+        EVENT *event = m->eventqueue;
+        m->eventqueue = event->next;
+        event->scheduled = 0;
+        m->eventnext = m->eventqueue != NULL ? m->eventqueue->when : UINT64_MAX;
+        event->func(m, event);
+    }
+}
+
+// end of file
@@ -0,0 +1,87 @@
+/*  Z80 maskable interrupts and the T-state event queue
+
+    Interrupt sources
+    Each device that can interrupt has an INTSOURCE and registers it at
+    start up, in daisy chain order - the first registered is nearest the
+    Z80 and has the highest priority.
+    A device calls interrupt_request to pull the INT line, and simz80
+    accepts the interrupt at the end of an instruction while interrupts
+    are enabled ( IFF1 set ), taking the vector from the highest priority
+    source that is asking:
+        IM 0    the vector is taken as an RST instruction
+        IM 1    RST 38 - the vector is not used
+        IM 2    call the address in the table at I * 256 + vector
+    The source that is accepted is in service until the Z80 does a RETI,
+    and until then only the sources above it in the chain can interrupt,
+    as with the IEI / IEO lines of the Z80 PIO, CTC and SIO.
+
+    Event queue
+    A device that needs to do something after a number of Z80 T-states,
+    e.g. a timer or the clock card reference pulses, schedules an EVENT
+    for that tstates count and simz80 calls its function once the count
+    has been reached. The events are checked between blocks of straight
+    line code, so they are late by at most a block.
+
+*/
+
+#ifndef INTERRUPTS_DEFINED_H
+#define INTERRUPTS_DEFINED_H
+
+#include <stdint.h>
+
+struct machine;
+
+// most sources on the daisy chain
+#define INTERRUPTMAXSOURCES 8
+
+typedef struct {
+    const char * name;          // for debug messages
+    int enabled;                // set by the device when it is allowed to interrupt
+    int requesting;             // set by interrupt_request, cleared when accepted
+    int inservice;              // set when accepted, cleared by RETI
+    int vector;                 // put on the data bus when accepted
+} INTSOURCE;
+
+typedef struct EVENT {
+    uint64_t when;              // tstates count to call func at
+    void (*func)(struct machine *m, struct EVENT *event);
+    void * context;             // for the device
+    int scheduled;              // 1 while in the queue
+    struct EVENT * next;
+} EVENT;
+
+// the daisy chain, the event queue and interruptline, which simz80 looks at when
+// interrupts are enabled, are in struct machine - see simz80.h
+
+// put a source on the end of the daisy chain
+extern void interrupt_register(struct machine *m, INTSOURCE *source);
+
+// ask for an interrupt, or stop asking
+extern void interrupt_request(struct machine *m, INTSOURCE *source);
+extern void interrupt_cancel(struct machine *m, INTSOURCE *source);
+
+// called by simz80 when it accepts an interrupt
+// returns the vector of the source now in service, -1 if nothing is asking
+extern int interrupt_acknowledge(struct machine *m);
+
+// called by simz80 for RETI - ends the highest priority source in service
+extern void interrupt_reti(struct machine *m);
+
+// Z80 reset - nothing asking or in service
+extern void interrupt_reset(struct machine *m);
+
+// work out interruptline again, e.g. after a device has changed enabled
+extern void interrupt_update(struct machine *m);
+
+// call event->func once tstates reaches when - moves the event if it is already scheduled
+extern void event_schedule(struct machine *m, EVENT *event, uint64_t when);
+
+// take an event out of the queue, if it is in it
+extern void event_cancel(struct machine *m, EVENT *event);
+
+// called by simz80 once tstates reaches eventnext - calls the events that are due
+extern void event_run(struct machine *m);
+
+#endif
+
+// end of file
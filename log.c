@@ -0,0 +1,267 @@
+/*  leveled logging for the devices
+
+    see log.h
+
+    The ring is a bounded queue with a sequence number in each slot, so
+    adding a message is a compare and swap on the head and no lock:
+    a slot is free to fill when its sequence is the head position, and
+    ready to write out when it is one more.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <SDL2/SDL.h>
+
+#include "options.h"
+#include "simz80.h"
+#include "log.h"
+
+typedef struct {
+    SDL_atomic_t sequence;
+    FILE *out;                          // the machine's out
+    char text[LOGTEXTSIZE];
+} LOGSLOT;
+
+static const char * categorynames[LOGCATEGORIES] = { "sd", "floppy", "clock", "rampage" };
+static const char * levelnames[] = { "off", "error", "warn", "info", "debug" };
+
+// the errors and warnings the devices have always shown, and the debug details if asked for in options.h
+static const int defaultlevel[LOGCATEGORIES] = {
+    LOG_WARN,
+    VFCFLOPPYDEBUG ? LOG_DEBUG : LOG_WARN,
+    CHSCLOCKCARDDEBUG ? LOG_DEBUG : LOG_WARN,
+    MAP80RAMDEBUG ? LOG_DEBUG : LOG_WARN,
+};
+
+static LOGSLOT ring[LOGRINGSIZE];
+static SDL_atomic_t ringhead;           // position of the next message added
+static unsigned int ringtail;           // position of the next message written - only the writer uses it
+static SDL_atomic_t written;            // ringtail for log_sync to see
+static SDL_atomic_t dropped;            // messages lost because the ring was full
+
+// the most machines' outs a dropped count is written to
+#define LOGDROPOUTS 32
+
+static SDL_Thread * logthread;
+static SDL_atomic_t stopping;
+static int started;                     // 1 while the thread is writing the messages
+
+// write the messages in the ring to their machines' out
+static void log_drain(void){
+
+    FILE *out = NULL;           // where the last message went, flushed when they change
+    FILE *outs[LOGDROPOUTS];    // the outs written to - the machines that filled the ring
+    int outcount = 0;
+
+    for (;;){
+        LOGSLOT *slot = &ring[ringtail & (LOGRINGSIZE - 1)];
+        if ((unsigned int)SDL_AtomicGet(&slot->sequence) != ringtail + 1){
+            break;
+        }
+        if (out != slot->out){
+            if (out != NULL){
+                fflush(out);
+            }
+            int seen = 0;
+            for (int i = 0; i < outcount; i++){
+                seen |= outs[i] == slot->out;
+            }
+            if (!seen && outcount < LOGDROPOUTS){
+                outs[outcount++] = slot->out;
+            }
+        }
+        out = slot->out;
+        fputs(slot->text, out);
+        SDL_AtomicSet(&slot->sequence, (int)(ringtail + LOGRINGSIZE));
+        ringtail++;
+    }
+    int lost = SDL_AtomicSet(&dropped, 0);
+    if (lost != 0){
+        // the messages lost were from the machines whose messages were in the ring
+        if (outcount == 0){
+            outs[outcount++] = stdout;
+        }
+        for (int i = 0; i < outcount; i++){
+            fprintf(outs[i], "\n%d log messages dropped - the log ring is full\n", lost);
+            if (outs[i] != out){
+                fflush(outs[i]);
+            }
+        }
+    }
+    if (out != NULL){
+        fflush(out);
+    }
+    SDL_AtomicSet(&written, (int)ringtail);
+}
+
+static int log_thread(void *data){
+
+    while (!SDL_AtomicGet(&stopping)){
+        log_drain();
+        SDL_Delay(LOGDRAINMS);
+    }
+    return 0;
+}
+
+void log_message(FILE *out, int category, int level, const char *format, ...){
+
+    va_list args;
+
+    va_start(args, format);
+    if (!started){
+        vfprintf(out, format, args);
+        va_end(args);
+        return;
+    }
+
+    // take the slot at the head - if another message got it first try the next
+    unsigned int position = (unsigned int)SDL_AtomicGet(&ringhead);
+    LOGSLOT *slot;
+    for (;;){
+        slot = &ring[position & (LOGRINGSIZE - 1)];
+        int difference = (int)((unsigned int)SDL_AtomicGet(&slot->sequence) - position);
+        if (difference == 0){
+            if (SDL_AtomicCAS(&ringhead, (int)position, (int)(position + 1))){
+                break;
+            }
+        }
+        else if (difference < 0){
+            // full - the writer has not got to this slot yet
+            SDL_AtomicAdd(&dropped, 1);
+            va_end(args);
+            return;
+        }
+        position = (unsigned int)SDL_AtomicGet(&ringhead);
+    }
+    int length = vsnprintf(slot->text, sizeof(slot->text), format, args);
+    va_end(args);
+    if (length >= (int)sizeof(slot->text)){
+        // too long - show where it was cut, keeping the end of the line
+        int newline = format[strlen(format) - 1] == '\n';
+        strcpy(&slot->text[sizeof(slot->text) - 4 - newline], newline ? "...\n" : "...");
+    }
+    slot->out = out;
+    SDL_AtomicSet(&slot->sequence, (int)(position + 1));
+}
+
+void log_defaults(struct machine *m){
+
+    for (int i = 0; i < LOGCATEGORIES; i++){
+        m->loglevel[i] = defaultlevel[i];
+    }
+}
+
+// name=level or name, name is a category or all
+static int log_setting(struct machine *m, const char *setting, size_t length){
+
+    size_t namelength = length;
+    int level = LOG_DEBUG;
+    const char *equals = memchr(setting, '=', length);
+
+    if (equals != NULL){
+        namelength = equals - setting;
+        size_t levellength = length - namelength - 1;
+        level = -1;
+        for (int i = 0; i < (int)(sizeof(levelnames) / sizeof(levelnames[0])); i++){
+            if (strlen(levelnames[i]) == levellength && strncmp(equals + 1, levelnames[i], levellength) == 0){
+                level = i;
+            }
+        }
+        if (level < 0){
+            fprintf(m->out, "Log level '%.*s' not recognised - use off, error, warn, info or debug.\n",
+                    (int)levellength, equals + 1);
+            return -1;
+        }
+    }
+    if (namelength == 3 && strncmp(setting, "all", 3) == 0){
+        for (int i = 0; i < LOGCATEGORIES; i++){
+            m->loglevel[i] = level;
+        }
+        return 0;
+    }
+    for (int i = 0; i < LOGCATEGORIES; i++){
+        if (strlen(categorynames[i]) == namelength && strncmp(setting, categorynames[i], namelength) == 0){
+            m->loglevel[i] = level;
+            return 0;
+        }
+    }
+    fprintf(m->out, "Log category '%.*s' not recognised - use sd, floppy, clock, rampage or all.\n",
+            (int)namelength, setting);
+    return -1;
+}
+
+int log_option(struct machine *m, const char *option){
+
+    int result = 0;
+
+    while (*option != 0){
+        size_t length = strcspn(option, ",");
+        if (length > 0 && log_setting(m, option, length) != 0){
+            result = -1;
+        }
+        option += length;
+        if (*option == ','){
+            option++;
+        }
+    }
+    return result;
+}
+
+int log_start(void){
+
+    if (started){
+        return 0;
+    }
+    for (unsigned int i = 0; i < LOGRINGSIZE; i++){
+        SDL_AtomicSet(&ring[i].sequence, (int)i);
+    }
+    SDL_AtomicSet(&ringhead, 0);
+    ringtail = 0;
+    SDL_AtomicSet(&written, 0);
+    SDL_AtomicSet(&stopping, 0);
+    // anything already on stdout goes first
+    fflush(stdout);
+    logthread = SDL_CreateThread(log_thread, "log", NULL);
+    if (logthread == NULL){
+        // carry on writing the messages straight away
+        return -1;
+    }
+    started = 1;
+    static int atexitset;
+    if (!atexitset){
+        atexit(log_stop);
+        atexitset = 1;
+    }
+    return 0;
+}
+
+void log_stop(void){
+
+    if (!started){
+        return;
+    }
+    SDL_AtomicSet(&stopping, 1);
+    SDL_WaitThread(logthread, NULL);
+    logthread = NULL;
+    started = 0;
+    // whatever came in after the thread last looked
+    log_drain();
+}
+
+void log_sync(void){
+
+    if (!started){
+        return;
+    }
+    // a message taken a slot for but not yet formatted is waited for too
+    unsigned int position = (unsigned int)SDL_AtomicGet(&ringhead);
+    while ((int)((unsigned int)SDL_AtomicGet(&written) - position) < 0){
+        SDL_Delay(1);
+    }
+}
+
+// end of file
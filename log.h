@@ -0,0 +1,76 @@
+/*  leveled logging for the devices
+
+    Each message has a category, the device it comes from, and a level.
+    A category only logs the messages at or above the level it is set to,
+    and the check is made before anything is formatted, so a message that
+    is not wanted costs one compare and branch in the emulator.
+    Each machine has its own levels, which start as set in options.h, and
+    can be changed at run time with the --log option, e.g.
+        --log sd=debug,floppy=info
+        --log all=off
+    A category given without a level logs everything ( debug ).
+
+    The messages that pass are formatted into a ring buffer and written to
+    the machine's out by a thread of their own every LOGDRAINMS milliseconds,
+    so a device logging a lot does not hold the Z80 up waiting for the terminal.
+    The machines nasbatch runs at once share the ring and the thread.
+    Adding a message never waits - if the ring is full the message is
+    dropped and counted, and the count is written with the next messages,
+    to the out of each machine that had messages in the full ring.
+    Until log_start, and after log_stop, messages are written straight away.
+
+    A message can be part of a line, e.g. a floppy command decoded a piece
+    at a time - the pieces are written in the order they were logged.
+
+*/
+
+#ifndef LOG_DEFINED_H
+#define LOG_DEFINED_H
+
+#include <stdio.h>
+
+// categories
+#define LOG_SD          0       // Nascom 4 SDcard
+#define LOG_FLOPPY      1       // MAP80 VFC floppy controller
+#define LOG_CLOCK       2       // CHS clock card
+#define LOG_RAMPAGE     3       // MAP80 256k ram paging
+#define LOGCATEGORIES   4
+
+// levels
+#define LOG_OFF         0
+#define LOG_ERROR       1
+#define LOG_WARN        2
+#define LOG_INFO        3
+#define LOG_DEBUG       4
+
+struct machine;
+
+// 1 if a message at level would be logged for category on machine m
+#define LOGGING(m, category, level) ((level) <= (m)->loglevel[category])
+
+// log a message, printf style - the arguments are only looked at if the message is wanted
+#define LOG(m, category, level, ...) \
+    do { if (LOGGING(m, category, level)) log_message((m)->out, category, level, __VA_ARGS__); } while (0)
+
+extern void log_message(FILE *out, int category, int level, const char *format, ...)
+    __attribute__ ((format (printf, 4, 5)));
+
+// set the levels of a new machine as in options.h
+extern void log_defaults(struct machine *m);
+
+// set levels from a --log option - returns 0 if okay, -1 if something was not recognised
+extern int log_option(struct machine *m, const char *option);
+
+// start the thread writing the messages - log_stop is called at exit if not before
+// returns -1 if the thread could not be started, the messages are then written straight away
+extern int log_start(void);
+
+// write the messages still in the ring and stop the thread
+extern void log_stop(void);
+
+// wait until the messages logged so far have been written, e.g. before closing their file
+extern void log_sync(void);
+
+#endif
+
+// end of file
@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <ctype.h>
 #include <stdbool.h>
@@ -17,6 +18,7 @@
 #include "map80VFCdisplay.h"
 #include "cpmswitch.h"
 #include "statusdisplay.h"
+#include "snapshot.h"
 
 
 
@@ -39,6 +41,10 @@ static uint32_t pixmap[MAP80VFCDISPLAY_DISPLAY_HEIGHT * MAP80VFCDISPLAY_DISPLAY_
 // a pointer to the memory where the screen characters are stored.
 static BYTE *screenRam=NULL;
 
+// one bit for each line of screen ram that has been written to since the last refresh
+// start with them all set so the first refresh draws everything
+static uint32_t vfcdirtylines = (1u << MAP80VFCDISPLAYLINES) - 1;
+
 // TODO need to look at how these values impact on the display 
 // and how many we are going to just ingore 
 // for now assuming it is 80 x 25 and font is 10 lines
@@ -51,7 +57,7 @@ static BYTE *screenRam=NULL;
 //   actual address is done by ((highaddress << 8) + lowaddress) & 0x0FFF
 //    and maybe use & 0x07FF to remap it to 0 to 7FF.
 //  
-static unsigned char map80_6845_registers[] = 
+static const unsigned char map80_6845_initialregisters[MAP80_6845_NUMBEROFREGISTERS] = 
 {  0x72,                                          // 00 Horizontal total chars - 1  Not used */
    MAP80VFCDISPLAYCHARACTERS,                          // 01 Horizontal displayed characters */
    0x5a,                                          // 02 Horizontal sync position -1 not used */
@@ -72,36 +78,68 @@ static unsigned char map80_6845_registers[] =
    0x00                                           // 11    and low 
 };
 
-// set by call to 0xEA - says which register is being looked at
-static int map80_6845_registerPointer =0;
-// decode the cursor type using the 
-//cursor control Cursor start register 
-//Bit 6 5 
-//    0 0 non-blink
-//    0 1 cursor non-display
-//    1 0 blink 1/16 rate
-//    1 1 blink 1/32 rate
-//bits 0 to 4 start row in character
-//    0 to 0x1F positions 
-// cursor control cursor end register 
-//  bits 0 to 4 give end row  
-//    0 to 0x1F positions 
-static int cursorBlinking = 1; 
-// use when the blick speed can be changed
-//static int cursorBlinkSpeed = 0; // slow blink
-static int cursorStartrow = 8;
-static int cursorEndrow = 9;
-
-static int vfcdisplayinversevideo=0; // 0 means use upper 128 character set else use inverse video
+typedef struct VFCDISPLAY {
+    // the 6845 registers - see map80_6845_initialregisters
+    unsigned char map80_6845_registers[MAP80_6845_NUMBEROFREGISTERS];
+
+    // set by call to 0xEA - says which register is being looked at
+    int map80_6845_registerPointer;
+    // decode the cursor type using the 
+    //cursor control Cursor start register 
+    //Bit 6 5 
+    //    0 0 non-blink
+    //    0 1 cursor non-display
+    //    1 0 blink 1/16 rate
+    //    1 1 blink 1/32 rate
+    //bits 0 to 4 start row in character
+    //    0 to 0x1F positions 
+    // cursor control cursor end register 
+    //  bits 0 to 4 give end row  
+    //    0 to 0x1F positions 
+    int cursorBlinking; 
+    // use when the blick speed can be changed
+    //int cursorBlinkSpeed; // slow blink
+    int cursorStartrow;
+    int cursorEndrow;
+
+    int vfcdisplayinversevideo; // 0 means use upper 128 character set else use inverse video
+
+    // the rampagetable entries the vfc rom and display ram are in
+    int vfcRomEntry; // -1 means not allocated
+    int vfcDisplayEntry; // -1 means not allocated
+} VFCDISPLAY;
 
 #define MAP80_6845_CURSORBLINKMASK 0x20
 #define MAP80_6845_CURSORSPEEDMASK 0x40
 #define MAP80_6845_CURSORSTARTMASK 0x1F
 #define MAP80_6845_CURSORENDMASK   0x1F
 
+// give the machine its display card, with the registers the VFC rom sets up
+void map80VFCDisplayCreate(struct machine *m){
+
+    VFCDISPLAY *vfc = calloc(1, sizeof(VFCDISPLAY));
+    if (vfc == NULL){
+        fprintf(m->err, "Out of memory for the VFC display\n");
+        exit(1);
+    }
+    memcpy(vfc->map80_6845_registers, map80_6845_initialregisters, sizeof(vfc->map80_6845_registers));
+    vfc->cursorBlinking = 1;
+    vfc->cursorStartrow = 8;
+    vfc->cursorEndrow = 9;
+    vfc->vfcRomEntry = -1;
+    vfc->vfcDisplayEntry = -1;
+    m->vfc = vfc;
+}
+
+void map80VFCDisplayFree(struct machine *m){
+
+    free(m->vfc);
+    m->vfc = NULL;
+}
+
 
 // VideoControlPort swaps the memory in and out of main ram
-static void processVideoControlPort(unsigned int value);
+static void processVideoControlPort(struct machine *m, unsigned int value);
 
 
 int map80vfc_create_screen(BYTE *screenMemory){
@@ -201,14 +239,33 @@ void map80vfc_GetWindowSize(int* w, int* h){
 
 
 
+// length bytes from offset in the screen ram have been written to
+// called from the rampagetable write trap
+void map80vfc_display_written(unsigned int offset, int length){
+
+    unsigned int last = offset + length - 1;
+
+    // the 2k of ram is a bit bigger than the screen
+    if (offset >= MAP80VFCDISPLAYLINES * MAP80VFCDISPLAYCHARACTERS){
+        return;
+    }
+    if (last >= MAP80VFCDISPLAYLINES * MAP80VFCDISPLAYCHARACTERS){
+        last = MAP80VFCDISPLAYLINES * MAP80VFCDISPLAYCHARACTERS - 1;
+    }
+    for (unsigned int line = offset / MAP80VFCDISPLAYCHARACTERS; line <= last / MAP80VFCDISPLAYCHARACTERS; line++){
+        vfcdirtylines |= 1u << line;
+    }
+}
+
 /* Would be better to do the updating on demand and the push here */
 // fix DA - need to ensure we pick up the RAM entry not ram
 //     that is allow for the paging process.
 // this is called when the simz80 code calls the sim_delay function
 
 
-void map80vfc_display_refresh(void)
+void map80vfc_display_refresh(struct machine *m)
 {
+    VFCDISPLAY *vfc = m->vfc;
     // hold a copy of the screen memory to compare and see what has changed
     static uint8_t screencache[2*1024] = { 0 };
     bool dirty = false;
@@ -230,7 +287,7 @@ void map80vfc_display_refresh(void)
     // which gives the address of the byte in the screen memory.
     // but since we really only have 2k of screen memory on the map80 vfc 
     //  & high address with 0x07 using only 3 bits from top address
-    WORD cursorAddress = ((map80_6845_registers[MAP80_6845_CURSOR_H] << 8) + map80_6845_registers[MAP80_6845_CURSOR_L]) & 0x7FF;
+    WORD cursorAddress = ((vfc->map80_6845_registers[MAP80_6845_CURSOR_H] << 8) + vfc->map80_6845_registers[MAP80_6845_CURSOR_L]) & 0x7FF;
     // printf("Cursor is at [%4.4X]\n",cursorAddress);
     //printf("High address [%2.2X], shifted [%2.2X]\n",map80_6845_registers[MAP80_6845_CURSOR_H],map80_6845_registers[MAP80_6845_CURSOR_H]<<8);
 
@@ -265,6 +322,13 @@ void map80vfc_display_refresh(void)
         cursorcountdown=0; // and need to start blinking again
     }
 
+    // only look at lines that have been written to
+    // and the lines with the old and new cursor on
+    uint32_t dirtylines = vfcdirtylines;
+    vfcdirtylines = 0;
+    dirtylines |= 1u << (cursorAddress / MAP80VFCDISPLAYCHARACTERS);
+    dirtylines |= 1u << (lastcursorAddress / MAP80VFCDISPLAYCHARACTERS);
+
     // cycle through the screen memory 
     // it is possible for the 6845 chip to not start the display at 0 but , , , , , TODO
     // MAP80_6845_START_ADDRESS_H and L
@@ -274,6 +338,10 @@ void map80vfc_display_refresh(void)
                ypos+=(MAP80VFCDISPLAY_FONT_H*MAP80VFCDISPLAY_DISPLAY_WIDTH*MAP80VFCDISPLAYSCALEY))  // actual pixel position pixel map
         {
 
+        if ((dirtylines & (1u << (screenAddress / MAP80VFCDISPLAYCHARACTERS))) == 0){
+            continue;
+        }
+
         uint8_t *cacheByte = screencacheAddress;  // address into screen cache to use in the lower loop
         xpos=0;           // start of new line
 
@@ -294,7 +362,7 @@ void map80vfc_display_refresh(void)
                 
                 //printf("cursorhere address %4.4X cursor show %d\n",cursorAddress,cursorshow);
                 // this is where the cursor should be
-                if (cursorBlinking==1){
+                if (vfc->cursorBlinking==1){
                     // check if we need to change cursor 
                     if (cursorcountdown-- < 1){
                         // time to change cursor
@@ -337,7 +405,7 @@ void map80vfc_display_refresh(void)
                 *cacheByte = screenByte;
                 // get the address of the first line of the font 
                         // if inverse video and top 128 characters - use lower 128 character
-                if (( vfcdisplayinversevideo!=0) &&  (screenByte>0x7F)) {
+                if (( vfc->vfcdisplayinversevideo!=0) &&  (screenByte>0x7F)) {
                     fontAddress = map80VFCcharRom1 + (MAP80VFCDISPLAY_BYTESPERCHARACTER * (screenByte-128));
                 }
                 else {
@@ -354,14 +422,14 @@ void map80vfc_display_refresh(void)
                 for (int y = 0; y < MAP80VFCDISPLAY_FONT_H; y++) {
                     // doing 1 row of the characters pixels
                     uint8_t fontLine = *fontAddress;
-                    if (vfcdisplayinversevideo!=0){
+                    if (vfc->vfcdisplayinversevideo!=0){
                         // if inverse video and top 128 characters - inverse it
                         if (screenByte>0x7F){
                             fontLine = ~fontLine;
                         }
                     }
                     // check if we are at cursor position and if we need to set it
-                    if (cursorshow==1 && ( y >= cursorStartrow && y <= cursorEndrow)){
+                    if (cursorshow==1 && ( y >= vfc->cursorStartrow && y <= vfc->cursorEndrow)){
                         // invert line for cursor
                         fontLine ^= 0xFF; 
                     }
@@ -413,7 +481,8 @@ void map80vfc_display_refresh(void)
 
 
 // handle all calls to the MAP80 VFC output ports
-void outPortVFCDisplay(unsigned int port, unsigned int value){
+void outPortVFCDisplay(struct machine *m, unsigned int port, unsigned int value){
+    VFCDISPLAY *vfc = m->vfc;
 
     switch (port) {
     case 0xE6:
@@ -427,26 +496,26 @@ void outPortVFCDisplay(unsigned int port, unsigned int value){
     case 0xEA:
         // write only 6845 chip register select
         if (vfcdisplaydebug){
-            printf("setting 6845 address [%2.2X]\n",value);
+            fprintf(m->out, "setting 6845 address [%2.2X]\n",value);
         }
-        map80_6845_registerPointer = value;
+        vfc->map80_6845_registerPointer = value;
         break;
     case 0xEB:
         // write to 6845 chip register set by EA
         if (vfcdisplaydebug){
-            printf("setting 6845 address [%2.2X] to [%2.2X]\n",map80_6845_registerPointer,value);
+            fprintf(m->out, "setting 6845 address [%2.2X] to [%2.2X]\n",vfc->map80_6845_registerPointer,value);
         }
-        if ( map80_6845_registerPointer < MAP80_6845_NUMBEROFREGISTERS){
-            map80_6845_registers[map80_6845_registerPointer]=value;
+        if ( vfc->map80_6845_registerPointer < MAP80_6845_NUMBEROFREGISTERS){
+            vfc->map80_6845_registers[vfc->map80_6845_registerPointer]=value;
         }
         else{
-            printf("invalid address [%2.2X]\n",MAP80_6845_NUMBEROFREGISTERS);
+            fprintf(m->out, "invalid address [%2.2X]\n",MAP80_6845_NUMBEROFREGISTERS);
         }
         break;
     case 0xEC:
     case 0xED:
         // EC and ED write only video control ports
-        processVideoControlPort(value);
+        processVideoControlPort(m, value);
         break;
     case 0xEE:
         // select video 1
@@ -456,14 +525,15 @@ void outPortVFCDisplay(unsigned int port, unsigned int value){
         break;
 
     default:
-        fprintf(stderr,"MAP80 VFC Display unhandled write to port [%2X] value [%2X] \n",port,value);
+        fprintf(m->err, "MAP80 VFC Display unhandled write to port [%2X] value [%2X] \n",port,value);
         break;
     }
 
 }
 
 
-int inPortVFCDisplay(unsigned int port){
+int inPortVFCDisplay(struct machine *m, unsigned int port){
+    VFCDISPLAY *vfc = m->vfc;
 
     switch (port) {
     case 0xE6:
@@ -479,22 +549,22 @@ int inPortVFCDisplay(unsigned int port){
     case 0xEA:
         // write only 6845 chip register select
         if (vfcdisplaydebug){
-            printf("Reading setting 6845 address [%2.2X]\n",map80_6845_registerPointer);
+            fprintf(m->out, "Reading setting 6845 address [%2.2X]\n",vfc->map80_6845_registerPointer);
         }
-        return map80_6845_registerPointer;
+        return vfc->map80_6845_registerPointer;
         break;
     case 0xEB:
         // read 6845 chip register set by EA
         // write to 6845 chip register set by EA
-        if ( map80_6845_registerPointer < MAP80_6845_NUMBEROFREGISTERS){
+        if ( vfc->map80_6845_registerPointer < MAP80_6845_NUMBEROFREGISTERS){
             if (vfcdisplaydebug){
-                printf("Reading 6845 address [%2.2X] value [%2.2X]\n",map80_6845_registerPointer,map80_6845_registers[map80_6845_registerPointer]);
+                fprintf(m->out, "Reading 6845 address [%2.2X] value [%2.2X]\n",vfc->map80_6845_registerPointer,vfc->map80_6845_registers[vfc->map80_6845_registerPointer]);
             }
-            return map80_6845_registers[map80_6845_registerPointer];
+            return vfc->map80_6845_registers[vfc->map80_6845_registerPointer];
 
         }
         else{
-            printf("Reading 6845 address [%2.2X] failed - invalid address\n",MAP80_6845_NUMBEROFREGISTERS);
+            fprintf(m->out, "Reading 6845 address [%2.2X] failed - invalid address\n",MAP80_6845_NUMBEROFREGISTERS);
         }
         break;
     case 0xEC:
@@ -512,7 +582,7 @@ int inPortVFCDisplay(unsigned int port){
         break;
     default:
 
-        fprintf(stderr,"MAP80 VFC Display unhandled read on port [%2X] \n",port);
+        fprintf(m->err, "MAP80 VFC Display unhandled read on port [%2X] \n",port);
     }
 
     return 0xFF;
@@ -522,16 +592,15 @@ int inPortVFCDisplay(unsigned int port){
 
 
 // process the control ports
-void processVideoControlPort(unsigned int value){
+void processVideoControlPort(struct machine *m, unsigned int value){
+    VFCDISPLAY *vfc = m->vfc;
 
     // check if inverse video or top 128 character set
     
-    vfcdisplayinversevideo = value & MAP80VFC_INVERSE_VIDEO;
+    vfc->vfcdisplayinversevideo = value & MAP80VFC_INVERSE_VIDEO;
 
     // allowing ram and rom to be enabled at various addresses
 
-    static int vfcRomEntry=-1; // -1 means not allocated
-    static int vfcDisplayEntry=-1; // -1 means not allocated
     //static int vfc4kEntry=0; // default value should be reset by first call
 
     int newvfcRomEntry=-1;
@@ -551,7 +620,7 @@ void processVideoControlPort(unsigned int value){
 
     // check if cpm switch set
     // equivalent of setting the Link 4 on the VFC board
-    if (cpmswitchstate==1){
+    if (m->cpmswitchstate==1){
         // toggle the ROM enable bit
         enablerom ^= MAP80VFC_ROMENABLE;
         // printf("enable rom toggle %02X \n",enablerom);
@@ -570,78 +639,101 @@ void processVideoControlPort(unsigned int value){
     }
 
     // rom entry
-    if (newvfcRomEntry!=vfcRomEntry){
+    if (newvfcRomEntry!=vfc->vfcRomEntry){
         // need to change rom stuff
-        if (vfcRomEntry > -1){
+        if (vfc->vfcRomEntry > -1){
             // remove current entry
             // assumes 2k pages so allow for vfc rom
-            ramlocktable[vfcRomEntry] = 0;
-            // set so the entry is ram again
-            ramromtable[vfcRomEntry] = 0;
+            // and set so the entry is ram again
+            m->rampagetable[vfc->vfcRomEntry].flags &= ~(RAMPAGE_LOCKED | RAMPAGE_ROM | RAMPAGE_NORAM);
             // reset the 2k pointer back to default value - i.e. ram
-            rampagetable[vfcRomEntry]=ramdefaultpagetable[vfcRomEntry];
+            m->rampagetable[vfc->vfcRomEntry].host=m->ram->ramdefaultpagetable[vfc->vfcRomEntry];
+            blockcachepagechanged(m, vfc->vfcRomEntry);
 
             //printf("VFC Rom removed from memory entry %02X address reset to %p for 4k boundary %4.4X\n",vfcRomEntry,rampagetable[vfcRomEntry],vfcRomEntry*RAMPAGESIZE*1024);
         }
 
-        vfcRomEntry=newvfcRomEntry;
+        vfc->vfcRomEntry=newvfcRomEntry;
 
-        if (vfcRomEntry > -1){
+        if (vfc->vfcRomEntry > -1){
             // to protect the Nascom monitor only do this if ramlock not already set ( nascom ram disable line )
-            if (ramlocktable[vfcRomEntry] == 0){
+            if ((m->rampagetable[vfc->vfcRomEntry].flags & RAMPAGE_LOCKED) == 0){
                 // prom enable
                 // assumes 2k pages so allow for VFC rom
                 // lock the rampage entry so map80ram wont change it ( nascom ram disable line )
-                ramlocktable[vfcRomEntry] = 1;
-                // set so the entry is rom and cannot be updated
-                ramromtable[vfcRomEntry] = 1;
+                // and set so the entry is rom and cannot be updated
+                m->rampagetable[vfc->vfcRomEntry].flags |= RAMPAGE_LOCKED | RAMPAGE_ROM;
                 // set the 2k pointer to the VFC Rom
-                rampagetable[vfcRomEntry]=&vfcrom[0];
+                m->rampagetable[vfc->vfcRomEntry].host=m->ram->vfcbootrom;
+                blockcachepagechanged(m, vfc->vfcRomEntry);
                 // printf("set vfcRomentry rampagetable %02X  address %p \n",vfcRomentry,rampagetable[vfcRomentry]);
                 //printf("VFC ROM added to memory entry %02X to address to %p for 4k boundary %4.4X\n",vfcRomEntry,rampagetable[vfcRomEntry],vfcRomEntry*RAMPAGESIZE*1024);
             }
             else {
-                fprintf(stderr,"set vfcRomentry not possible as ramlocktable[%02X] already set to %d for 4k boundary %4.4X\n",vfcRomEntry,ramlocktable[vfcRomEntry],vfcRomEntry*RAMPAGESIZE*1024);
-                vfcRomEntry=-1;
+                fprintf(m->err, "set vfcRomentry not possible as rampagetable[%02X] already locked flags %02X for 4k boundary %4.4X\n",vfc->vfcRomEntry,m->rampagetable[vfc->vfcRomEntry].flags,vfc->vfcRomEntry*RAMPAGESIZE*1024);
+                vfc->vfcRomEntry=-1;
             }
         }
     }
 
-    if (newvfcDisplayEntry!=vfcDisplayEntry){
+    if (newvfcDisplayEntry!=vfc->vfcDisplayEntry){
 
-        if (vfcDisplayEntry > -1){
+        if (vfc->vfcDisplayEntry > -1){
             // remove current entry
             // reset the 2k pointer back to default value - i.e. ram
-            ramlocktable[vfcDisplayEntry] = 0;
+            m->rampagetable[vfc->vfcDisplayEntry].flags &= ~(RAMPAGE_LOCKED | RAMPAGE_IOTRAP);
 
-            rampagetable[vfcDisplayEntry]=ramdefaultpagetable[vfcDisplayEntry];
+            m->rampagetable[vfc->vfcDisplayEntry].host=m->ram->ramdefaultpagetable[vfc->vfcDisplayEntry];
+            blockcachepagechanged(m, vfc->vfcDisplayEntry);
 
             //printf("VFC Display removed from memory entry %02X address reset to %p for 4k boundary %4.4X\n",vfcDisplayEntry,rampagetable[vfcDisplayEntry],vfcDisplayEntry*RAMPAGESIZE*1024);
 
         }
 
-        vfcDisplayEntry=newvfcDisplayEntry;
+        vfc->vfcDisplayEntry=newvfcDisplayEntry;
 
-        if (vfcDisplayEntry > -1){
+        if (vfc->vfcDisplayEntry > -1){
 
-            if (ramlocktable[vfcDisplayEntry] == 0){
+            if ((m->rampagetable[vfc->vfcDisplayEntry].flags & RAMPAGE_LOCKED) == 0){
                 // assumes 2k pages s
                 // lock the rampage entry so map80ram wont change it ( nascom ram disable line )
-                ramlocktable[vfcDisplayEntry] = 1;
+                // and trap writes so the display knows which lines have changed
+                m->rampagetable[vfc->vfcDisplayEntry].flags |= RAMPAGE_LOCKED | RAMPAGE_IOTRAP;
                 // set the 2k pointer to the VFC Rom
-                rampagetable[vfcDisplayEntry]=&vfcdisplayram[0];
+                m->rampagetable[vfc->vfcDisplayEntry].host=&m->ram->vfcdisplayram[0];
+                blockcachepagechanged(m, vfc->vfcDisplayEntry);
                 //printf("VFC Display added to memory entry %02X to address to %p for 4k boundary %4.4X\n",vfcDisplayEntry,rampagetable[vfcDisplayEntry],vfcDisplayEntry*RAMPAGESIZE*1024);
             }
             else {
-                fprintf(stderr,"set vfcDisplayEntry not possible as ramlocktable[%02X] already set to %d for 4k boundary %4.4X\n",vfcDisplayEntry,ramlocktable[vfcDisplayEntry],vfcDisplayEntry*RAMPAGESIZE*1024);
-                vfcDisplayEntry=-1;
+                fprintf(m->err, "set vfcDisplayEntry not possible as rampagetable[%02X] already locked flags %02X for 4k boundary %4.4X\n",vfc->vfcDisplayEntry,m->rampagetable[vfc->vfcDisplayEntry].flags,vfc->vfcDisplayEntry*RAMPAGESIZE*1024);
+                vfc->vfcDisplayEntry=-1;
             }
         }
     }
 
 }
 
-
+// save or restore the 6845 and the control port state
+// the memory mapping itself is restored by map80RamSnapshot
+void map80VFCDisplaySnapshot(struct machine *m, SNAPSHOT *s){
+    VFCDISPLAY *vfc = m->vfc;
+
+    int state[8] = { vfc->map80_6845_registerPointer, vfc->cursorBlinking, vfc->cursorStartrow, vfc->cursorEndrow,
+                     vfc->vfcdisplayinversevideo, vfc->vfcRomEntry, vfc->vfcDisplayEntry, 0 };
+
+    snapshot_data(s, "6845", vfc->map80_6845_registers, sizeof(vfc->map80_6845_registers));
+    snapshot_data(s, "vfcdisp", state, sizeof(state));
+    if (s->restoring && !s->error){
+        vfc->map80_6845_registerPointer = state[0];
+        vfc->cursorBlinking = state[1];
+        vfc->cursorStartrow = state[2];
+        vfc->cursorEndrow = state[3];
+        vfc->vfcdisplayinversevideo = state[4];
+        vfc->vfcRomEntry = state[5];
+        vfc->vfcDisplayEntry = state[6];
+        // draw the whole screen again
+        vfcdirtylines = (1u << MAP80VFCDISPLAYLINES) - 1;
+    }
+}
 
 // end of file
-
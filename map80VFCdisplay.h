@@ -122,8 +122,15 @@ extern int map80vfcdisplayxpos;
 extern int map80vfcdisplayypos;
 
 
+struct machine;
+
+// give the machine its display card, and take it away again
+extern void map80VFCDisplayCreate(struct machine *m);
+extern void map80VFCDisplayFree(struct machine *m);
+
 extern int map80vfc_create_screen(BYTE *screenMemory);    // creates the screen
-extern void map80vfc_display_refresh(void);        // refresh the screen from memory
+extern void map80vfc_display_refresh(struct machine *m);        // refresh the screen from memory
+extern void map80vfc_display_written(unsigned int offset, int length);  // mark screen lines changed
 extern void map80vfc_display_change_size(int sizefactor);
 extern void map80vfc_display_position(int x, int y);
 // get the current size of the nascom window on the screen
@@ -133,5 +140,5 @@ extern void map80vfc_GetWindowSize(int* w, int* h);
 
 
 // handle the ports for the vfc video card
-extern int inPortVFCDisplay(unsigned int port);
-extern void outPortVFCDisplay(unsigned int port, unsigned int value);
+extern int inPortVFCDisplay(struct machine *m, unsigned int port);
+extern void outPortVFCDisplay(struct machine *m, unsigned int port, unsigned int value);
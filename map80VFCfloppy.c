@@ -6,9 +6,9 @@
      * and the handeling of the busy/ready/data status bits might need some work.
      * 
      * Note: some functions are not implimented
-     * Multi sector reads and writes are not handled - you will get an error
-     * Read track and write track just reset the busy indicator.
-     * This means that the cpm format and interrogate programs will not work.
+     * Multi sector reads and writes carry on to the end of the track or a Force Interrupt.
+     * Write track picks the sectors out of the IBM format track sent and writes the track to the image in one go.
+     * Read track makes up a double density IBM format track from the sectors in the image.
      * 
      * 
      * Read address returns the same "sort of valid" sector header each time.
@@ -20,8 +20,10 @@
 
 #include <stdlib.h>            // std libraries
 #include <string.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "options.h"           //defines the options to use map80RamIntialise
 #include "simz80.h"            // define all the z80 simulator
@@ -29,120 +31,183 @@
 #include "utilities.h"          // some useful bits of code
 #include "map80nascom.h"
 #include "statusdisplay.h"
+#include "snapshot.h"
+#include "log.h"
+
+// write track states - see floppyFormatState
+#define FORMAT_GAP 0                                     // in a gap, looking for an address mark
+#define FORMAT_ID 1                                      // taking the 4 bytes of an id field
+#define FORMAT_DATA 2                                    // taking the bytes of a data field
+
+typedef struct VFCFLOPPY {
+    // status details used to set status register and status port return values
+    // ports 0xE0 and 0xE4
+    // Status port    INTRQ, Not READY and DRQ
+    int floppyInteruptRequest;                           // set to 1 to provide interrupt to computer ???
+    // floppyNotReady  done by setting floppyDelayReady 
+    //int floppyNotReady;                                // cleared when floppy is ready
+    int floppyDelayReady;                                // set to 2 to set the ready flag for x-1 calls
+
+    int floppyDataRequest;                               // set to 1 if data ready to read or data ready to be written to
+    int floppyDelayForByteRequest;                       // set to delay the setting of the request data flag
+                                                         // once < 1 it won't do any requests
+                                                         // so floppyDelayByteRequestBy should be 1 or more
+
+    int floppyDataLost;                                  // set to 1 if data lost during read or write
+    int floppyBusy;                                      // busy doing command when 1
+    int SetBusyForTime;                                  // if set > 1 then triggers busy status for x calls to get status
+
+    int floppyHeadLoaded;                                // set to 1 when the heads are "locked and loaded"
+    int floppyCRCError;                                  // set to 1 if there is a crc error
+    int floppySeekError;                                 // set to 1 when seek error occured
+
+    int floppyRecordNotFound;                            // set to 1 if record not found
+    int floppyWriteFailWriteProtected;                   // set to 1 if write failed because disc write protected
+
+    // There are 2 separate values for track positions:
+    // - what the 1797 chip thinks the track number is: floppyTrackRegister
+    // - where the real head is on that floppy: floppyDrives[].track
+    // These may or may not match, especially after switching drives
+    //
+    // registers inside the 1797 floppy control chip
+    // (the status register is dynamically built on each call, from the individual status bits above)
+    unsigned int floppyTrackRegister;
+    unsigned int floppySectorRegister;
+    unsigned int floppyDataRegister;
+    // floppyTrackRegister, floppySectorRegister, floppySide and floppyActiveDrive are globals representing 1797 state and used
+    // by the readASector/writeASector routines.
+    unsigned int floppySide;                             // set to side by type II and III commands
+    int floppyActiveDrive;                               // assume drive 0 is selected by default ?
+
+    // TODO remove position of the head on tracks
+    //unsigned int floppyPhysicalTrackPosition;
+
+    // floppyDrives hold the details of the images attached to them
+    // including the geometry    sprintf(strBuffer,"Tape position: %c input:%06ld  output:%06ld ", " *"[tape_led] , tape_in_pos, tape_out_pos ); 
+
+    // and current track position for that drive
+    FLOPPYDRIVEINFO floppyDrives[NUMBEROFDRIVES];        // drives 0 to 4
+
+    int floppyMaxTrackNumber;                            // tracks 0 to 79 - the hardware device only has 80 tracks????
+
+    unsigned int floppyStepDirection;                    // set to seek direction of last call
+                                                         // default to step in is away from track 0
+
+    unsigned char floppyBuffer[FLOPPYMAXSECTORSIZE];     // buffer for read address and write track
+    unsigned char *floppyData;                           // data being read or written - points into the
+                                                         // mapped image for read and write sector
+    long int floppyDataOffset;                           // offset of the sector being written in the image
+    int floppyMultiSector;                               // set to 1 for a multi sector read or write
+    unsigned int floppyBufferPosition;                   // position in buffer for read or write
+    unsigned int floppyBufferUsed;                       // how many bytes are in buffer
+
+    // write track - the sectors found in the bytes sent are built up here
+    // then the whole track is written to the image in one go
+    unsigned char floppyTrackBuffer[FLOPPYMAXTRACKSIZE];
+    long int floppyFormatOffset;                         // where the track is in the image
+    long int floppyFormatLength;                         //   and how long it is
+    int floppyFormatState;
+    unsigned char floppyFormatId[4];                     // track, side, sector and length code of the last id field
+    int floppyFormatHaveId;                              // set when an id field is waiting for its data field
+    int floppyFormatCount;                               // bytes taken of the id field or the data field
+    unsigned char *floppyFormatSector;                   // where the data field goes - NULL if it is not kept
+    int floppyFormatSectors;                             // data fields received
+
+    // the last commands recieved
+    int floppyPreviousCommand;
+    int floppyCurrentCommand;
+
+    // 
+    int readaddresssector;
+
+    // countdowns and the last value returned by the status and drive port reads
+    int IndexpulseCountdown;
+    int Numbercalls;
+    int lastreturn;
+} VFCFLOPPY;
+
+// give the machine its controller, with no discs mounted
+void floppyCreate(struct machine *m){
+
+    VFCFLOPPY *fd = calloc(1, sizeof(VFCFLOPPY));
+    if (fd == NULL){
+        fprintf(m->err, "Out of memory for the floppy controller\n");
+        exit(1);
+    }
+    fd->floppyDelayForByteRequest = floppyDelayByteRequestBy;
+    fd->SetBusyForTime = floppyDelayResetBusy;
+    fd->floppyMaxTrackNumber = 79;
+    fd->floppyStepDirection = 1;
+    fd->floppyData = fd->floppyBuffer;
+    fd->floppyFormatState = FORMAT_GAP;
+    fd->readaddresssector = -1;
+    fd->IndexpulseCountdown = 20;
+    fd->lastreturn = 0xFF;
+    m->floppy = fd;
+}
 
-// global variables - initial values set in options.
-int vfcfloppydebug=VFCFLOPPYDEBUG;
-int vfcfloppydisplaysectors=VFCFLOPPYDISPLAYSECTORS;
-
-// status details used to set status register and status port return values
-// ports 0xE0 and 0xE4
-// Status port    INTRQ, Not READY and DRQ
-static int floppyInteruptRequest = 0; // set to 1 to provide interrupt to computer ???
-// floppyNotReady  done by setting floppyDelayReady 
-//static int floppyNotReady = 1; // cleared when floppy is ready
-static int floppyDelayReady=0;  // set to 2 to set the ready flag for x-1 calls
-
-static int floppyDataRequest = 0; // set to 1 if data ready to read or data ready to be written to
-static int floppyDelayForByteRequest = floppyDelayByteRequestBy; // set to delay the setting of the request data flag
-                                   // once < 1 it won't do any requests
-                                   // so floppyDelayByteRequestBy should be 1 or more
-
-static int floppyDataLost = 0 ; // set to 1 if data lost during read or write
-static int floppyBusy = 0;  // busy doing command when 1
-static int SetBusyForTime=floppyDelayResetBusy;   // if set > 1 then triggers busy status for x calls to get status
-
-static int floppyHeadLoaded = 0; // set to 1 when the heads are "locked and loaded"
-static int floppyCRCError=0;     // set to 1 if there is a crc error
-static int floppySeekError = 0;  // set to 1 when seek error occured
-
-static int floppyRecordNotFound = 0; // set to 1 if record not found
-static int floppyWriteFailWriteProtected = 0; // set to 1 if write failed because disc write protected
-
-
-
-// There are 2 separate values for track positions:
-// - what the 1797 chip thinks the track number is: floppyTrackRegister
-// - where the real head is on that floppy: floppyDrives[].track
-// These may or may not match, especially after switching drives
-//
-// registers inside the 1797 floppy control chip
-// (the status register is dynamically built on each call, from the individual status bits above)
-static unsigned int floppyTrackRegister;
-static unsigned int floppySectorRegister;
-static unsigned int floppyDataRegister;
-// floppyTrackRegister, floppySectorRegister, floppySide and floppyActiveDrive are globals representing 1797 state and used
-// by the readASector/writeASector routines.
-static unsigned int floppySide = 0;         // set to side by type II and III commands
-static int floppyActiveDrive = 0;           // assume drive 0 is selected by default ?
-
-// TODO remove position of the head on tracks
-//unsigned int floppyPhysicalTrackPosition;
-
-// floppyDrives hold the details of the images attached to them
-// including the geometry    sprintf(strBuffer,"Tape position: %c input:%06ld  output:%06ld ", " *"[tape_led] , tape_in_pos, tape_out_pos ); 
-
-// and current track position for that drive
-static FLOPPYDRIVEINFO floppyDrives[NUMBEROFDRIVES];   // drives 0 to 4
-
-static int floppyMaxTrackNumber=79; // tracks 0 to 79 - the hardware device only has 80 tracks????
-
-static unsigned int floppyStepDirection=1;  // set to seek direction of last call
-                                     // default to step in is away from track 0
-
-static unsigned char floppyBuffer[FLOPPYMAXSECTORSIZE];  // buffer to hold latest sector
-static unsigned int floppyBufferPosition=0;              // position in buffer for read or write
-static unsigned int floppyBufferUsed=0;                  // how many bytes are in buffer
-
-// the last commands recieved
-static int floppyPreviousCommand=0;
-static int floppyCurrentCommand=0;
+void floppyFree(struct machine *m){
 
-// 
-static int readaddresssector=-1;
+    free(m->floppy);
+    m->floppy = NULL;
+}
 
 
 // functions - internal
 // port write
-static int floppySetCommand(unsigned int value); // call to set command register
-static int floppySetTrack(unsigned int value); // call to set track register
-static int floppySetSector(unsigned int value); // call to set sector register
-static int floppySetData(unsigned int value);   // set the data port
-static int floppySetDrive(unsigned int value); // call to set active drive
+static int floppySetCommand(struct machine *m, unsigned int value); // call to set command register
+static int floppySetTrack(struct machine *m, unsigned int value); // call to set track register
+static int floppySetSector(struct machine *m, unsigned int value); // call to set sector register
+static int floppySetData(struct machine *m, unsigned int value);   // set the data port
+static int floppySetDrive(struct machine *m, unsigned int value); // call to set active drive
 // port read
-static int floppyReadStatus(); // call to read the status register
-static int floppyReadTrack(); // call to read Track register
-static int floppyReadSector(); // call to read Sector register
-static int floppyReadData(); // read data register
-static int floppyReadDrivePort(); // call to read Drive port ( DRQ, INTRQ and READY )
+static int floppyReadStatus(struct machine *m); // call to read the status register
+static int floppyReadTrack(struct machine *m); // call to read Track register
+static int floppyReadSector(struct machine *m); // call to read Sector register
+static int floppyReadData(struct machine *m); // read data register
+static int floppyReadDrivePort(struct machine *m); // call to read Drive port ( DRQ, INTRQ and READY )
 // general
 //void checkIfDiskLoaded();
 //void setTypeIStatusRegister();
-static void clearStatusIndcators();
-static void readASector(unsigned int command);
-static void writeASector(void);
-static void readAddress(unsigned int command);
-static void showFloppySector();
-static void displayBuffer(unsigned char buffer[], int length );
-static long int floppyFindOffset(int DriveNumber,int Track, int discSide, int Sector);
-static int getSideFromCommand(unsigned int command);
-static void displayDetails(char * message);
-static void displayCommand(unsigned int command);
-static void printdiscimageproperties(int drive);
-static void dostep(int value);
-static void formattrack(void);
-static void displayfloppystatus(void);
-static int getFloppyReadyFlag(void);
-static int getsectorsizeLSBvalue(int sectorLengthFlag, unsigned int sectorsize);
+static void clearStatusIndcators(struct machine *m);
+static void readASector(struct machine *m, unsigned int command);
+static int floppySectorsToTransfer(struct machine *m);
+static FLOPPYTRACKCACHE * floppyFindTrack(struct machine *m, int track, int side);
+static unsigned char * floppySectorData(struct machine *m, int size, long int *offset);
+static void floppyNextSector(struct machine *m);
+static void writeASector(struct machine *m);
+static void readAddress(struct machine *m, unsigned int command);
+static void showFloppySector(struct machine *m);
+static void displayBuffer(struct machine *m, unsigned char buffer[], int length );
+static long int floppyFindOffset(struct machine *m, int DriveNumber,int Track, int discSide, int Sector);
+static int getSideFromCommand(struct machine *m, unsigned int command);
+static void displayDetails(struct machine *m, char * message);
+static void displayCommand(struct machine *m, unsigned int command);
+static void printdiscimageproperties(struct machine *m, int drive);
+static void dostep(struct machine *m, int value);
+static void formattrack(struct machine *m);
+static int formattrackbyte(struct machine *m, unsigned char value);
+static void readTrack(struct machine *m);
+static unsigned int floppyCRC(unsigned int crc, unsigned char *data, int length);
+static void floppyWritten(struct machine *m, long int offset, long int length);
+static void displayfloppystatus(struct machine *m);
+static int getFloppyReadyFlag(struct machine *m);
+static int getsectorsizeLSBvalue(struct machine *m, int sectorLengthFlag, unsigned int sectorsize);
 
 
 // display floppy status - when motor on / off
-static void displayfloppystatus(void){
+static void displayfloppystatus(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
 
     char strBuffer[]="  ";
     char drivestatus=0;
     
+    // the status screen is the windows' - there is none headless
+    if (m->headless){
+        return;
+    }
     for (int driveno=0;driveno<4;driveno++){
-        if (floppyActiveDrive==driveno){
+        if (fd->floppyActiveDrive==driveno){
             drivestatus=0xB9;
         }
         else {
@@ -154,14 +219,20 @@ static void displayfloppystatus(void){
     }
    
 }
-static void displayfloppyposition(){
+static void displayfloppyposition(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
 
     char strBuffer[250];
     
     
-    if ((floppyActiveDrive>-1) && (floppyActiveDrive<4)){
-        sprintf(strBuffer,"Track %2d Head %d Sector %2d      ",floppyDrives[floppyActiveDrive].track,floppySide,floppyReadSector()); 
-        status_display_show_chars_full(strBuffer,5,(floppyActiveDrive*2)+2,STATUS_DISPLAYSCALEX,STATUS_DISPLAYSCALEY,STATUS_YELLOW,STATUS_BLACK);
+    if (m->headless){
+        return;
+    }
+    if ((fd->floppyActiveDrive>-1) && (fd->floppyActiveDrive<4)){
+        FLOPPYDRIVEINFO *drive = &fd->floppyDrives[fd->floppyActiveDrive];
+        sprintf(strBuffer,"Track %2d Head %d Sector %2d  Cache %3lu%%  ",drive->track,fd->floppySide,floppyReadSector(m),
+                (drive->trackCacheClock ? drive->trackCacheHits * 100 / drive->trackCacheClock : 0)); 
+        status_display_show_chars_full(strBuffer,5,(fd->floppyActiveDrive*2)+2,STATUS_DISPLAYSCALEX,STATUS_DISPLAYSCALEY,STATUS_YELLOW,STATUS_BLACK);
         //printf("Floppy %d %s\n",floppyActiveDrive,strBuffer);
     }
    
@@ -170,22 +241,26 @@ static void displayfloppyposition(){
 
 
 // display floppy details on the status screen
-void displayfloppydetails(){
+void displayfloppydetails(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
     
     char strBuffer[250];
     char drivestatus=0;
     char filename[100];
     int linenumber=1;
+    if (m->headless){
+        return;
+    }
     status_display_show_chars_full("Drives",0,0,STATUS_DISPLAYSCALEX,STATUS_DISPLAYSCALEY,STATUS_WHITE,STATUS_BLACK);
     for (int driveno=0;driveno<4;driveno++){
-        if (floppyDrives[driveno].fileNamePointer == NULL ){
+        if (fd->floppyDrives[driveno].fileNamePointer == NULL ){
             drivestatus=0xB8;
             filename[0]=0;
         }
         else {
             drivestatus=0xB8;
             int maxfilenamesize=20;
-            copystringtobuffer(filename,floppyDrives[driveno].fileNamePointer,maxfilenamesize);
+            copystringtobuffer(filename,fd->floppyDrives[driveno].fileNamePointer,maxfilenamesize);
 /*            if ((strlen(floppyDrives[driveno].fileNamePointer) > maxfilenamesize)){
                 strncpy(filename,floppyDrives[driveno].fileNamePointer,maxfilenamesize);
                 filename[maxfilenamesize]='.';
@@ -216,17 +291,77 @@ void displayfloppydetails(){
 }
 
 // null the filenames of all drives 
-void resetalldrives(){
+void resetalldrives(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
     // clear all floppy drives 
     for (int driveno=0;driveno<4;driveno++){
-        floppyDrives[driveno].fileNamePointer=NULL;
+        fd->floppyDrives[driveno].fileNamePointer=NULL;
+        fd->floppyDrives[driveno].overlayNamePointer=NULL;
+        fd->floppyDrives[driveno].image.base=NULL;
+        fd->floppyDrives[driveno].unflushedSince=0;
+    }
+}
+
+// flush the sectors written to one drive out to the host disk
+static void floppyFlushDrive(struct machine *m, int driveno){
+    VFCFLOPPY *fd = m->floppy;
+    if (fd->floppyDrives[driveno].unflushedSince != 0){
+        diskimage_flush(&fd->floppyDrives[driveno].image);
+        fd->floppyDrives[driveno].unflushedSince=0;
+    }
+}
+
+// flush written sectors to the host disk
+// force flushes every drive, otherwise only timer drives whose writes are FLOPPYFLUSHSECONDS old
+// called from sim_delay so a timer flush happens even when the disc goes quiet
+void floppyFlushDrives(struct machine *m, int force){
+    VFCFLOPPY *fd = m->floppy;
+    time_t now = 0;
+    for (int driveno=0;driveno<NUMBEROFDRIVES;driveno++){
+        if (fd->floppyDrives[driveno].unflushedSince == 0){
+            continue;
+        }
+        if (!force){
+            if (fd->floppyDrives[driveno].flushPolicy != FLOPPYFLUSH_TIMER){
+                continue;
+            }
+            if (now == 0){
+                now = time(NULL);
+            }
+            if (now - fd->floppyDrives[driveno].unflushedSince < FLOPPYFLUSHSECONDS){
+                continue;
+            }
+        }
+        floppyFlushDrive(m, driveno);
+    }
+}
+
+// flush and close the image file of one drive
+static void floppyCloseDrive(struct machine *m, int driveno){
+    VFCFLOPPY *fd = m->floppy;
+    diskimage_close(&fd->floppyDrives[driveno].image);
+    fd->floppyDrives[driveno].unflushedSince=0;
+    // the track cache points into the image
+    memset(fd->floppyDrives[driveno].trackCache, 0, sizeof(fd->floppyDrives[driveno].trackCache));
+}
+
+// flush and close all the image files - called when the emulator stops
+void floppyCloseDrives(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
+    for (int driveno=0;driveno<NUMBEROFDRIVES;driveno++){
+        if (m->verbose && fd->floppyDrives[driveno].trackCacheClock > 0){
+            fprintf(m->out, "Floppy drive %d track cache %lu hits %lu misses\n",
+                driveno, fd->floppyDrives[driveno].trackCacheHits, fd->floppyDrives[driveno].trackCacheMisses);
+        }
+        floppyCloseDrive(m, driveno);
     }
 }
 
 
 
 // mount a floppy drive
-int floppyMountDisk(unsigned int drive, char *configfilename){
+int floppyMountDisk(struct machine *m, unsigned int drive, char *configfilename){
+    VFCFLOPPY *fd = m->floppy;
 
 // read the parameters for a floppy disk
 // each disk has it's own config file that also tells up the file name
@@ -258,7 +393,7 @@ int floppyMountDisk(unsigned int drive, char *configfilename){
     int notimplemented=0;   // set to 1 if the option has not been implemented
 
     if (drive > 3){
-        fprintf(stdout, "Mount Floppy drive - Drive number %d too big for '%s', ignoring it. \n",drive, configfilename);
+        fprintf(m->out, "Mount Floppy drive - Drive number %d too big for '%s', ignoring it. \n",drive, configfilename);
         return -1;
     }
 
@@ -284,36 +419,43 @@ int floppyMountDisk(unsigned int drive, char *configfilename){
 
     // set the default values
 
+    // write out and close the image that was in the drive
+    floppyCloseDrive(m, setdrive);
+
     // free the space used for the original file name
-    if ( floppyDrives[setdrive].fileNamePointer != NULL ){
-        if (vfcfloppydebug){
-            printf("Mount Floppy drive - releasing memory\n");
-        }
-        free(floppyDrives[setdrive].fileNamePointer );
+    if ( fd->floppyDrives[setdrive].fileNamePointer != NULL ){
+        LOG(m, LOG_FLOPPY, LOG_DEBUG, "Mount Floppy drive - releasing memory\n");
+        free(fd->floppyDrives[setdrive].fileNamePointer );
         // say no image loaded
-        floppyDrives[setdrive].fileNamePointer = NULL;
+        fd->floppyDrives[setdrive].fileNamePointer = NULL;
+    }
+    if ( fd->floppyDrives[setdrive].overlayNamePointer != NULL ){
+        free(fd->floppyDrives[setdrive].overlayNamePointer );
+        fd->floppyDrives[setdrive].overlayNamePointer = NULL;
     }
 
     // these are the polydos basic settings
-    floppyDrives[setdrive].fileNamePointer = NULL;
-    floppyDrives[setdrive].numberOfHeads=1;    // number of heads / sides
-    floppyDrives[setdrive].numberOfTracks=35;    // number of tracks
-    floppyDrives[setdrive].numberOfSectors=18;  // number of Sectors
-    floppyDrives[setdrive].firstSectorNumber=0;
-    floppyDrives[setdrive].interleaved=1;       // say track interleaved
-    floppyDrives[setdrive].sidesswapped=0;       // not sided swapped
-    floppyDrives[setdrive].reverseside0=0;      // side 0 not reversed
-    floppyDrives[setdrive].reverseside1=0;      // side 1 not reversed
-    floppyDrives[setdrive].writeProtect=0;      // write protect status off
-    floppyDrives[setdrive].sizeOfSector = 256;   // size of each sector
-    floppyDrives[setdrive].track=0;             // current track
+    fd->floppyDrives[setdrive].fileNamePointer = NULL;
+    fd->floppyDrives[setdrive].numberOfHeads=1;    // number of heads / sides
+    fd->floppyDrives[setdrive].numberOfTracks=35;    // number of tracks
+    fd->floppyDrives[setdrive].numberOfSectors=18;  // number of Sectors
+    fd->floppyDrives[setdrive].firstSectorNumber=0;
+    fd->floppyDrives[setdrive].interleaved=1;       // say track interleaved
+    fd->floppyDrives[setdrive].sidesswapped=0;       // not sided swapped
+    fd->floppyDrives[setdrive].reverseside0=0;      // side 0 not reversed
+    fd->floppyDrives[setdrive].reverseside1=0;      // side 1 not reversed
+    fd->floppyDrives[setdrive].writeProtect=0;      // write protect status off
+    fd->floppyDrives[setdrive].sizeOfSector = 256;   // size of each sector
+    fd->floppyDrives[setdrive].track=0;             // current track
+    fd->floppyDrives[setdrive].flushPolicy=FLOPPYFLUSHDEFAULT; // when writes reach the image file
+    fd->floppyDrives[setdrive].overlayExit=OVERLAY_KEEP;      // overlay kept for next time
 
 
     // open the config file
     filep = fopen(configfilename, "r");
     if ( filep == NULL) {
-        fprintf(stdout, "Mount Floppy drive - config file '%s' failed to open.\n", configfilename);
-        perror(configfilename);
+        fprintf(m->out, "Mount Floppy drive - config file '%s' failed to open.\n", configfilename);
+        fprintf(m->err, "%s: %s\n", configfilename, strerror(errno));
         return 1;
     }
 
@@ -325,12 +467,12 @@ int floppyMountDisk(unsigned int drive, char *configfilename){
         //fprintf(stdout, "Mount Floppy drive - config file '%s', line %d is '%s'. \n", configfilename,filelinenumber,buffer);
         filelinenumber++;
         if (strlen(buffer) >249 ){
-            fprintf(stdout, "Mount Floppy drive - floppy config file '%s', line %d is too long - ignoring. \n", configfilename,filelinenumber);
+            fprintf(m->out, "Mount Floppy drive - floppy config file '%s', line %d is too long - ignoring. \n", configfilename,filelinenumber);
             // skip to end of line in the file
             ch = buffer[249];
             while (ch != -1 && ch != '\n'){
                 ch = fgetc(filep);
-                printf("Mount Floppy drive - extras %02X \n",ch);
+                fprintf(m->out, "Mount Floppy drive - extras %02X \n",ch);
             }
             // end of file exit
             if (ch == -1){
@@ -371,7 +513,7 @@ int floppyMountDisk(unsigned int drive, char *configfilename){
             bufferposition++;
         }
         else{
-            fprintf(stdout, "Mount Floppy drive - config file '%s', line %d no = found - ignoring. \n", configfilename,filelinenumber);
+            fprintf(m->out, "Mount Floppy drive - config file '%s', line %d no = found - ignoring. \n", configfilename,filelinenumber);
             continue;
         }
         // again skip any white spaces
@@ -403,32 +545,32 @@ int floppyMountDisk(unsigned int drive, char *configfilename){
         else if(strcmp(keyword,"cyls")==0){
             // number of cylinders ( or tracks to you and me )
             paramValue=strtoll(paramdata,NULL,10);
-            floppyDrives[setdrive].numberOfTracks=paramValue;
+            fd->floppyDrives[setdrive].numberOfTracks=paramValue;
         }
         else if(strcmp(keyword,"heads")==0){
             // number of heads either 1 or 2
             paramValue=strtoll(paramdata,NULL,10);
 
-            floppyDrives[setdrive].numberOfHeads=paramValue;
+            fd->floppyDrives[setdrive].numberOfHeads=paramValue;
         }
         else if(strcmp(keyword,"secs")==0){
             // number of sectors per cylinder/track per side
             paramValue=strtoll(paramdata,NULL,10);
 
-            floppyDrives[setdrive].numberOfSectors=paramValue;
+            fd->floppyDrives[setdrive].numberOfSectors=paramValue;
 
         }
         else if(strcmp(keyword,"bps")==0){
             // number of bytes in a sector
             paramValue=strtoll(paramdata,NULL,10);
 
-            floppyDrives[setdrive].sizeOfSector=paramValue;
+            fd->floppyDrives[setdrive].sizeOfSector=paramValue;
 
         }
         else if(strcmp(keyword,"id")==0){
             // the number of the first sector on the track
             paramValue=strtoll(paramdata,NULL,10);
-            floppyDrives[setdrive].firstSectorNumber=paramValue;
+            fd->floppyDrives[setdrive].firstSectorNumber=paramValue;
 
         }
         else if(strcmp(keyword,"h")==0){
@@ -482,8 +624,23 @@ int floppyMountDisk(unsigned int drive, char *configfilename){
         }
         else if(strcmp(keyword,"write-protect")==0){
             // set disc write protected
-            floppyDrives[setdrive].writeProtect = ((paramdata[0] == 'Y') || (paramdata[0] == 'y'));
-            printf("Floppy write protect %d\n",floppyDrives[setdrive].writeProtect);
+            fd->floppyDrives[setdrive].writeProtect = ((paramdata[0] == 'Y') || (paramdata[0] == 'y'));
+            fprintf(m->out, "Floppy write protect %d\n",fd->floppyDrives[setdrive].writeProtect);
+        }
+        else if(strcmp(keyword,"flush")==0){
+            // when sectors written are flushed out to the image file
+            if (strcmp(paramdata,"sector")==0){
+                fd->floppyDrives[setdrive].flushPolicy=FLOPPYFLUSH_SECTOR;
+            }
+            else if (strcmp(paramdata,"timer")==0){
+                fd->floppyDrives[setdrive].flushPolicy=FLOPPYFLUSH_TIMER;
+            }
+            else if (strcmp(paramdata,"exit")==0){
+                fd->floppyDrives[setdrive].flushPolicy=FLOPPYFLUSH_EXIT;
+            }
+            else {
+                fprintf(m->out, "Mount Floppy drive - config file '%s', line %d - unrecognised flush '%s'\n", configfilename,filelinenumber,paramdata);
+            }
         }
         else if(strcmp(keyword,"file-layout")==0){
             // not using this keyword
@@ -496,23 +653,23 @@ int floppyMountDisk(unsigned int drive, char *configfilename){
                 }
                 // now see if we recognise the parameter value
                 if (strcmp(parampointer1, "reverse-side0")==0) {
-                    floppyDrives[setdrive].reverseside0=1;
+                    fd->floppyDrives[setdrive].reverseside0=1;
                 }
                 else if (strcmp(parampointer1, "reverse-side1")==0) {
-                    floppyDrives[setdrive].reverseside1=1;
+                    fd->floppyDrives[setdrive].reverseside1=1;
                 }
                 else if (!strcmp(parampointer1, "interleaved")) {
-                    floppyDrives[setdrive].interleaved=1;
+                    fd->floppyDrives[setdrive].interleaved=1;
                 }
                 else if (!strcmp(parampointer1, "sequential")) {
                     // set to say not interleaved == sequential
-                    floppyDrives[setdrive].interleaved=0;
+                    fd->floppyDrives[setdrive].interleaved=0;
                 }
                 else if (!strcmp(parampointer1, "sides-swapped")) {
-                    floppyDrives[setdrive].sidesswapped=1;
+                    fd->floppyDrives[setdrive].sidesswapped=1;
                 }
                 else {
-                    fprintf(stdout, "Mount Floppy drive - config file '%s', line %d - unrecognised file-layout '%s'\n", configfilename,filelinenumber,parampointer1);
+                    fprintf(m->out, "Mount Floppy drive - config file '%s', line %d - unrecognised file-layout '%s'\n", configfilename,filelinenumber,parampointer1);
                 }
             }
 
@@ -522,40 +679,70 @@ int floppyMountDisk(unsigned int drive, char *configfilename){
             len = strlen( paramdata );
             heap_string = malloc( len + 1 );
             strcpy( heap_string, paramdata );
-            floppyDrives[setdrive].fileNamePointer = heap_string;
+            fd->floppyDrives[setdrive].fileNamePointer = heap_string;
             //printf("found image name %s\n",paramdata);
 
         }
+        else if(strcmp(keyword,"overlay")==0){
+            // writes go to this file and the image file is only read
+            len = strlen( paramdata );
+            heap_string = malloc( len + 1 );
+            strcpy( heap_string, paramdata );
+            fd->floppyDrives[setdrive].overlayNamePointer = heap_string;
+        }
+        else if(strcmp(keyword,"overlay-exit")==0){
+            // what happens to the overlay when the emulator stops
+            int overlayexit = diskimage_overlay_exit(paramdata);
+            if (overlayexit < 0){
+                fprintf(m->out, "Mount Floppy drive - config file '%s', line %d - unrecognised overlay-exit '%s'\n", configfilename,filelinenumber,paramdata);
+            }
+            else {
+                fd->floppyDrives[setdrive].overlayExit=overlayexit;
+            }
+        }
         else {
-            fprintf(stdout,"Mount Floppy drive - config line %d keyword='%s' unknown - ignored \n",filelinenumber, keyword);
+            fprintf(m->out, "Mount Floppy drive - config line %d keyword='%s' unknown - ignored \n",filelinenumber, keyword);
         }
 
         if (notimplemented==1){
-            if (verbose){
-                printf("Mount Floppy drive - config line %d keyword='%s' not yet implemented\n",filelinenumber, keyword);
+            if (m->verbose){
+                fprintf(m->out, "Mount Floppy drive - config line %d keyword='%s' not yet implemented\n",filelinenumber, keyword);
             }
         }
     }
 
     fclose(filep); // close the config file
 
-    if (floppyDrives[setdrive].fileNamePointer != NULL){
+    if (fd->floppyDrives[setdrive].fileNamePointer != NULL && fd->floppyDrives[setdrive].overlayNamePointer != NULL){
 
-        filep = fopen(floppyDrives[setdrive].fileNamePointer, "r+b");
-        if ( filep == NULL) {
-            fprintf(stdout, "Mount Floppy drive - cannot find image file '%s'. \n", floppyDrives[setdrive].fileNamePointer);
-            perror(floppyDrives[setdrive].fileNamePointer);
+        // map the image with the overlay on top - sectors written go to the overlay
+        if (diskimage_open_overlay(&fd->floppyDrives[setdrive].image, fd->floppyDrives[setdrive].fileNamePointer,
+                                   fd->floppyDrives[setdrive].overlayNamePointer,
+                                   fd->floppyDrives[setdrive].sizeOfSector, fd->floppyDrives[setdrive].overlayExit,
+                                   m->out, m->err) != 0) {
+            fprintf(m->out, "Mount Floppy drive - cannot use image file '%s' with overlay '%s'. \n",
+                    fd->floppyDrives[setdrive].fileNamePointer, fd->floppyDrives[setdrive].overlayNamePointer);
         }
-        if ( filep != NULL) {
-            fclose(filep);
+        fd->floppyDrives[setdrive].unflushedSince = 0;
+    }
+    else if (fd->floppyDrives[setdrive].fileNamePointer != NULL){
+
+        // map the image while it is mounted - sectors are then read and written in place
+        if (diskimage_open(&fd->floppyDrives[setdrive].image, fd->floppyDrives[setdrive].fileNamePointer, m->out, m->err) != 0) {
+            fprintf(m->out, "Mount Floppy drive - cannot find image file '%s'. \n", fd->floppyDrives[setdrive].fileNamePointer);
+        }
+        else if (fd->floppyDrives[setdrive].image.readOnly) {
+            fprintf(m->out, "Mount Floppy drive - image file '%s' is read only - write protecting it. \n", fd->floppyDrives[setdrive].fileNamePointer);
+            fd->floppyDrives[setdrive].writeProtect=1;
         }
+        fd->floppyDrives[setdrive].unflushedSince = 0;
     }
 
-    printf("Mount Floppy drive %d, config file '%s', image file '%s' \n",
-                setdrive,configfilename,(floppyDrives[setdrive].fileNamePointer==NULL? "null":floppyDrives[setdrive].fileNamePointer ));
-    if (verbose){
+    fprintf(m->out, "Mount Floppy drive %d, config file '%s', image file '%s' \n",
+                setdrive,configfilename,(fd->floppyDrives[setdrive].fileNamePointer==NULL? "null":fd->floppyDrives[setdrive].fileNamePointer ));
+    if (m->verbose){
 
-        printdiscimageproperties(setdrive);
+        printdiscimageproperties(m, setdrive);
         
     }
 
@@ -565,29 +752,29 @@ int floppyMountDisk(unsigned int drive, char *configfilename){
 
 
 // handle all calls to the MAP80 VFC output ports
-void outPortFloppy(unsigned int port, unsigned int value){
+void outPortFloppy(struct machine *m, unsigned int port, unsigned int value){
 
-    printf("port out %2.2X %2.2X\n",port,value);
+    LOG(m, LOG_FLOPPY, LOG_DEBUG, "port out %2.2X %2.2X\n",port,value);
 
     switch (port) {
     case 0xE0:
         // P 0xE0 command write
-        floppySetCommand(value);
+        floppySetCommand(m, value);
         break;
 
     case 0xE1:
         // P 0xE1 track register
-        floppySetTrack(value);
+        floppySetTrack(m, value);
         break;
 
     case 0xE2:
         // P 0xE2 Sector register
-        floppySetSector(value);
+        floppySetSector(m, value);
         break;
 
     case 0xE3:
         // P 0xE3 Data Register
-        floppySetData(value);
+        floppySetData(m, value);
         break;
 
     case 0xE4:
@@ -595,24 +782,32 @@ void outPortFloppy(unsigned int port, unsigned int value){
         // drop into 0xE5
     case 0xE5:
         // P 0xE5 Drive Port - as 0xE4
-        floppySetDrive(value);
+        floppySetDrive(m, value);
         break;
     default:
-        fprintf(stdout,"MAP80 VFC unhandled write to port %2.2X value %2.2X \n",port,value);
+        LOG(m, LOG_FLOPPY, LOG_WARN, "MAP80 VFC unhandled write to port %2.2X value %2.2X \n",port,value);
     }
 
 }
 
-void printdiscimageproperties(int driveNumber){
-
-    printf("Image details for drive  %2.2X \n",driveNumber);
-    printf("   Image file [%s]\n",floppyDrives[driveNumber].fileNamePointer);
-    printf("   Number of Heads   [%d]\n",floppyDrives[driveNumber].numberOfHeads);
-    printf("   Number of tracks  [%d]\n",floppyDrives[driveNumber].numberOfTracks);
-    printf("   Number of Sectors [%d]\n",floppyDrives[driveNumber].numberOfSectors);
-    printf("   First Sector      [%d]\n",floppyDrives[driveNumber].firstSectorNumber);
-    printf("   Interleaved       [%d]\n",floppyDrives[driveNumber].interleaved);
-    printf("   Size of Sector    [%d]\n",floppyDrives[driveNumber].sizeOfSector);
+void printdiscimageproperties(struct machine *m, int driveNumber){
+    VFCFLOPPY *fd = m->floppy;
+
+    fprintf(m->out, "Image details for drive  %2.2X \n",driveNumber);
+    fprintf(m->out, "   Image file [%s]\n",fd->floppyDrives[driveNumber].fileNamePointer);
+    fprintf(m->out, "   Number of Heads   [%d]\n",fd->floppyDrives[driveNumber].numberOfHeads);
+    fprintf(m->out, "   Number of tracks  [%d]\n",fd->floppyDrives[driveNumber].numberOfTracks);
+    fprintf(m->out, "   Number of Sectors [%d]\n",fd->floppyDrives[driveNumber].numberOfSectors);
+    fprintf(m->out, "   First Sector      [%d]\n",fd->floppyDrives[driveNumber].firstSectorNumber);
+    fprintf(m->out, "   Interleaved       [%d]\n",fd->floppyDrives[driveNumber].interleaved);
+    fprintf(m->out, "   Size of Sector    [%d]\n",fd->floppyDrives[driveNumber].sizeOfSector);
+    fprintf(m->out, "   Flush policy      [%s]\n",(fd->floppyDrives[driveNumber].flushPolicy==FLOPPYFLUSH_SECTOR ? "sector" :
+                                          fd->floppyDrives[driveNumber].flushPolicy==FLOPPYFLUSH_TIMER ? "timer" : "exit"));
+    if (fd->floppyDrives[driveNumber].overlayNamePointer != NULL){
+        fprintf(m->out, "   Overlay file      [%s] %s on exit\n",fd->floppyDrives[driveNumber].overlayNamePointer,
+                                          (fd->floppyDrives[driveNumber].overlayExit==OVERLAY_COMMIT ? "commit" :
+                                           fd->floppyDrives[driveNumber].overlayExit==OVERLAY_DISCARD ? "discard" : "keep"));
+    }
 
 
 /*
@@ -622,36 +817,36 @@ void printdiscimageproperties(int driveNumber){
     floppyDrives[driveNumber].writeProtect=0;      // write protect status off
     floppyDrives[driveNumber].track=0;             // current track
 */
-    printf("\n");
+    fprintf(m->out, "\n");
 
 }
 
 
 
 // handle any read ports for the MAP80VFC Floppy controller
-int inPortFloppy(unsigned int port){
+int inPortFloppy(struct machine *m, unsigned int port){
 
 int retval=0xFF;
 
     switch (port) {
     case 0xE0:
         // P 0xE0 command write
-        retval=floppyReadStatus();
+        retval=floppyReadStatus(m);
         break;
 
     case 0xE1:
         // P 0xE1 track register
-        retval=floppyReadTrack();
+        retval=floppyReadTrack(m);
         break;
 
     case 0xE2:
         // P 0xE2 Sector register
-        retval=floppyReadSector();
+        retval=floppyReadSector(m);
         break;
 
     case 0xE3:
         // P 0xE3 Data Register
-        retval=floppyReadData();
+        retval=floppyReadData(m);
         break;
 
     case 0xE4:
@@ -659,13 +854,13 @@ int retval=0xFF;
         // drop into 0xE5
     case 0xE5:
         // P 0xE5 Drive Port - as 0xE4
-        retval=floppyReadDrivePort();
+        retval=floppyReadDrivePort(m);
         break;
     default:
-        fprintf(stdout,"MAP80 VFC unhandled read on port [%2X] \n",port);
+        LOG(m, LOG_FLOPPY, LOG_WARN, "MAP80 VFC unhandled read on port [%2X] \n",port);
     }
 
-    printf("port in [%2X] returned [%2X]\n",port,retval);
+    LOG(m, LOG_FLOPPY, LOG_DEBUG, "port in [%2X] returned [%2X]\n",port,retval);
 
     return retval;
 
@@ -674,13 +869,14 @@ int retval=0xFF;
 
 // ********** internal functions from here on **********8
 
-static void displayDetails(char * message){
+static void displayDetails(struct machine *m, char * message){
+    VFCFLOPPY *fd = m->floppy;
 
     char CurState[]="Off";
 
-    if (floppyActiveDrive> -1) {
+    if (fd->floppyActiveDrive> -1) {
         // floppy dirve number set
-        if (floppyDrives[floppyActiveDrive].fileNamePointer ==NULL) {
+        if (fd->floppyDrives[fd->floppyActiveDrive].fileNamePointer ==NULL) {
             // but not loaded
             strcpy(CurState,"Nul");
         }
@@ -692,7 +888,7 @@ static void displayDetails(char * message){
     }
     // display the current disk details after each call
 
-    fprintf(stdout,"%s "
+    log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "%s "
                   "TrackReg   %2.2X  "
                   "SectorReg   %2.2X  "
                   "Side   %2.2X  "
@@ -700,11 +896,11 @@ static void displayDetails(char * message){
                   "drive  %2.2X  "
                   "pointer %s  \n",
                           message,
-                          floppyTrackRegister,
-                          floppySectorRegister,
-                          floppySide,
-                          floppyDataRegister,
-                          floppyActiveDrive,
+                          fd->floppyTrackRegister,
+                          fd->floppySectorRegister,
+                          fd->floppySide,
+                          fd->floppyDataRegister,
+                          fd->floppyActiveDrive,
                           CurState);
 
 }
@@ -712,84 +908,84 @@ static void displayDetails(char * message){
 //
 // display what the command to the disk controller was
 //
-static void displayCommand(unsigned int command){
+static void displayCommand(struct machine *m, unsigned int command){
     // set side - only neeed for TYPE II and III commands
-    int diskside =  getSideFromCommand(command);
+    int diskside =  getSideFromCommand(m, command);
 
-    fprintf(stdout,"Command %2.2X ", command);
+    log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "Command %2.2X ", command);
     switch ( command & 0xF0 )
     {
         case floppyCmdRestore:
-            fprintf(stdout, "Restore");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "Restore");
             break;
 
         case floppyCmdSeek:
-            fprintf(stdout, "Seek");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "Seek");
             break;
 
         case floppyCmdStep:
-            fprintf(stdout, "Step");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "Step");
             break;
         case floppyCmdStepTrackUpdate:
-            fprintf(stdout, "StepTU");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "StepTU");
             break;
         case floppyCmdStepin:
-            fprintf(stdout, "StepIn");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "StepIn");
             break;
         case floppyCmdStepinTrackUpdate:
-            fprintf(stdout, "StepInTU");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "StepInTU");
             break;
         case floppyCmdStepout:
-            fprintf(stdout, "StepOut");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "StepOut");
             break;
         case floppyCmdStepOutTrackUpdate:
-            fprintf(stdout, "StepOutTU");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "StepOutTU");
             break;
         // type 2 commands
         case floppyCmdReadSector:
-            fprintf(stdout, "ReadSector");
-            fprintf(stdout, " side %d",diskside);
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "ReadSector");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, " side %d",diskside);
             break;
         case floppyCmdReadSectorMulti:
-            fprintf(stdout, "ReadSectorMulti");
-            fprintf(stdout, " side %d",diskside);
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "ReadSectorMulti");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, " side %d",diskside);
             break;
         case floppyCmdWriteSector:
-            fprintf(stdout, "WriteSector");
-            fprintf(stdout, " side %d",diskside);
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "WriteSector");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, " side %d",diskside);
             break;
         case floppyCmdWriteSectorMulti:
-            fprintf(stdout, "WriteSectorMulti");
-            fprintf(stdout, " side %d",diskside);
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "WriteSectorMulti");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, " side %d",diskside);
             break;
        // type 3 commands
         case floppyCmdReadAddress:
-            fprintf(stdout, "ReadAddress");
-            fprintf(stdout, " side %d",diskside);
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "ReadAddress");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, " side %d",diskside);
             break;
         case floppyCmdReadTrack:
-            fprintf(stdout, "ReadTrack");
-            fprintf(stdout, " side %d",diskside);
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "ReadTrack");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, " side %d",diskside);
             break;
         case floppyCmdWriteTrack:
-            fprintf(stdout, "WriteTrack");
-            fprintf(stdout, " side %d",diskside);
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "WriteTrack");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, " side %d",diskside);
             break;
         // type 4 command
         case floppyCmdForceInterupt:
-            fprintf(stdout, "ForceInterupt");
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "ForceInterupt");
             break;
         default:
             // should not happen but . . . .
-            fprintf(stdout, " unknown command  %2.2X ",command );
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, " unknown command  %2.2X ",command );
     }
-    fprintf(stdout,"\n");
+    log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "\n");
 
 }
 
 // the side being used is part of the TYPE II command
 // use and on the bit to find out which side
-static int getSideFromCommand(unsigned int command){
+static int getSideFromCommand(struct machine *m, unsigned int command){
         // set side
         if (command & floppyCmdSelectSide ){
             return 1;
@@ -799,12 +995,13 @@ static int getSideFromCommand(unsigned int command){
 }
 
 // output to the command port E0
-static int floppySetCommand(unsigned int value){ // call to set command register
+static int floppySetCommand(struct machine *m, unsigned int value){ // call to set command register
+    VFCFLOPPY *fd = m->floppy;
 
     // a long bit of code . . . . .
 
-    if (vfcfloppydebug){
-        displayCommand(value);
+    if (LOGGING(m, LOG_FLOPPY, LOG_DEBUG)){
+        displayCommand(m, value);
     }
 
     // first check id type 4 command
@@ -815,45 +1012,62 @@ static int floppySetCommand(unsigned int value){ // call to set command register
             // else leave alone  ??
             // busy only set for a time ??
             // if (SetBusyForTime < 1 ){
-            if (floppyBusy == 0){
+            if (fd->floppyBusy == 0){
                 // reset status register
-                clearStatusIndcators();
+                clearStatusIndcators(m);
+            }
+            // stop any read or write that is still going
+            if (fd->floppyBufferPosition < fd->floppyBufferUsed){
+                if ((fd->floppyPreviousCommand & 0xE0) == floppyCmdWriteSector && fd->floppyBufferPosition > 0){
+                    // keep what has been written so far
+                    fd->floppyBufferUsed = fd->floppyBufferPosition;
+                    writeASector(m);
+                }
+                if ((fd->floppyPreviousCommand & 0xF0) == floppyCmdWriteTrack){
+                    // keep the sectors formatted so far
+                    formattrack(m);
+                }
+                fd->floppyBufferUsed = fd->floppyBufferPosition;
+                fd->floppyDataRequest = 0;
+                fd->floppyDelayForByteRequest = 0;
+                fd->floppyInteruptRequest = 1;
+                fd->floppyBusy = 0;
             }
             
             // say command complete - set interrupt bit
-            floppyDelayReady = 2;   // delay ready and not busy for 1 calls
-            SetBusyForTime = 2;
+            fd->floppyDelayReady = 2;   // delay ready and not busy for 1 calls
+            fd->SetBusyForTime = 2;
 
     }
-    else if (!floppyBusy) {
+    else if (!fd->floppyBusy) {
         // not busy so we can process the other comamnds
         // only the first 4 byte give the command
         // process the command request
         // the rest of the bits control extra functions like which side for read
 
-        floppyCurrentCommand = value;
+        fd->floppyCurrentCommand = value;
         // command received and being done
         // say busy
-        floppyBusy = 1;
+        fd->floppyBusy = 1;
         // clear the other flags
-        clearStatusIndcators();
+        clearStatusIndcators(m);
 
         // is it a type I command is 00 to 7F
         if ((value & 0x80) == 0 ){
 
-            floppyBusy = 1;
+            fd->floppyBusy = 1;
 
             switch ( value & 0xF0 ){
                 case floppyCmdRestore:
                     // restore command - reset drive to track 0 both in the drive and the track register
                     // should do this when controller is reset
                     // set the status register to show we are at track 0
-                    floppyStepDirection = 1; // next seek goes up in track numbers
-                    floppyTrackRegister = 0;
-                    floppySectorRegister = 0;
+                    fd->floppyStepDirection = 1; // next seek goes up in track numbers
+                    fd->floppyTrackRegister = 0;
+                    fd->floppySectorRegister = 0;
                     // reset the physical track position for active drive
-                    if ((floppyActiveDrive>-1) && (floppyActiveDrive<4) ) {
-                        floppyDrives[floppyActiveDrive].track=floppyTrackRegister;
+                    if ((fd->floppyActiveDrive>-1) && (fd->floppyActiveDrive<4) ) {
+                        fd->floppyDrives[fd->floppyActiveDrive].track=fd->floppyTrackRegister;
                     }
 
                     break;
@@ -865,39 +1079,37 @@ static int floppySetCommand(unsigned int value){ // call to set command register
                     // assuming it is within range.
                     // TODO - check if disc active???
 
-                    if ((floppyActiveDrive>-1) && (floppyActiveDrive<4) ) {
+                    if ((fd->floppyActiveDrive>-1) && (fd->floppyActiveDrive<4) ) {
                         // decide how we would get to the new track
                         // and set direction
-                        if (floppyTrackRegister>floppyDataRegister){
+                        if (fd->floppyTrackRegister>fd->floppyDataRegister){
                             // we need to step out towards track 0
-                            floppyStepDirection=-1;
+                            fd->floppyStepDirection=-1;
                         }
-                        if (floppyTrackRegister<floppyDataRegister){
+                        if (fd->floppyTrackRegister<fd->floppyDataRegister){
                             // we need to step in away from track 0
-                            floppyStepDirection=1;
+                            fd->floppyStepDirection=1;
                         }
 
                         // track is withing range
                         // set seek direction
-                        floppyStepDirection = 1; // assume step out
-                        if ( floppyDataRegister < floppyTrackRegister ){
+                        fd->floppyStepDirection = 1; // assume step out
+                        if ( fd->floppyDataRegister < fd->floppyTrackRegister ){
                             // nope we are stepping in to get tothe track
-                            floppyStepDirection = -1;
+                            fd->floppyStepDirection = -1;
                         }
                         // so set track number for the
                         // TrackRegister and current floppy drive
                         // TODO not sure if we should set Physical track position
-                        floppyTrackRegister = floppyDataRegister;
-                        floppyDrives[floppyActiveDrive].track = floppyTrackRegister;
-                        if (vfcfloppydebug){
-                            printf("Track Register set to %2.2X\n",floppyTrackRegister);
-                        }
+                        fd->floppyTrackRegister = fd->floppyDataRegister;
+                        fd->floppyDrives[fd->floppyActiveDrive].track = fd->floppyTrackRegister;
+                        LOG(m, LOG_FLOPPY, LOG_DEBUG, "Track Register set to %2.2X\n",fd->floppyTrackRegister);
                     }
                     else {
                         // say seek error
-                        floppySeekError = 1;
+                        fd->floppySeekError = 1;
                     }
-                    floppyInteruptRequest = 1; // command completed
+                    fd->floppyInteruptRequest = 1; // command completed
 
                     break;
 
@@ -921,8 +1133,8 @@ static int floppySetCommand(unsigned int value){ // call to set command register
                         }
                     }
                      */
-                    dostep(value);  // do the step
-                    SetBusyForTime=floppyDelayResetBusy;     // set busy flag for x-1 calls to status - then set floppyInteruptRequest
+                    dostep(m, value);  // do the step
+                    fd->SetBusyForTime=floppyDelayResetBusy;     // set busy flag for x-1 calls to status - then set floppyInteruptRequest
                     break;
                 case floppyCmdStepin:
                     // step in 1 track - that is away from track 0
@@ -931,8 +1143,8 @@ static int floppySetCommand(unsigned int value){ // call to set command register
                     // step in 1 track
                     // and update track register
                     // reset status register
-                    floppyStepDirection = 1;
-                    dostep(value);  // do the step
+                    fd->floppyStepDirection = 1;
+                    dostep(m, value);  // do the step
 /*
                     if ((floppyActiveDrive>-1) && (floppyActiveDrive<4) ) {
                         if ( (floppyDrives[floppyActiveDrive].track < floppyMaxTrackNumber) && (floppyStepDirection > 0)){
@@ -945,7 +1157,7 @@ static int floppySetCommand(unsigned int value){ // call to set command register
                         }
                     }
                      */
-                    SetBusyForTime=floppyDelayResetBusy;     // set busy flag for x-1 calls to status then set floppyInteruptRequest
+                    fd->SetBusyForTime=floppyDelayResetBusy;     // set busy flag for x-1 calls to status then set floppyInteruptRequest
                     break;
                 case floppyCmdStepout:
                     // step out 1 track  - that is towards track 0
@@ -953,8 +1165,8 @@ static int floppySetCommand(unsigned int value){ // call to set command register
                 case floppyCmdStepOutTrackUpdate:
                     // step out 1 track
                     // and update track register
-                    floppyStepDirection = -1;
-                    dostep(value);  // do the step
+                    fd->floppyStepDirection = -1;
+                    dostep(m, value);  // do the step
 /*
                     if ((floppyActiveDrive>-1) && (floppyActiveDrive<4) ) {
                         printf("Step out called - track is %2.2X direction %d\n",floppyDrives[floppyActiveDrive].track,floppyStepDirection);
@@ -972,109 +1184,113 @@ static int floppySetCommand(unsigned int value){ // call to set command register
                     }
 */
                     // say that the head is loaded
-                    SetBusyForTime=floppyDelayResetBusy;     // set busy flag for x-1 calls to status then set floppyInteruptRequest
+                    fd->SetBusyForTime=floppyDelayResetBusy;     // set busy flag for x-1 calls to status then set floppyInteruptRequest
 
                     break;
                 default:
                     // should not happen but . . . .
-                    fprintf(stdout, "floppy controller received unknown Type I command  %2.2X , ignoring it. \n", value);
+                    LOG(m, LOG_FLOPPY, LOG_WARN, "floppy controller received unknown Type I command  %2.2X , ignoring it. \n", value);
 
             } // end of switch
 
-            if ((floppyActiveDrive>-1) && (floppyActiveDrive<4) ){
+            if ((fd->floppyActiveDrive>-1) && (fd->floppyActiveDrive<4) ){
                 // if bit 3 set the mount the heads
                 if ( (value & floppyCmdLoadHead ) == floppyCmdLoadHead ){
                     // set floppy head to loaded
-                    floppyHeadLoaded = 1 ;
+                    fd->floppyHeadLoaded = 1 ;
                     //fprintf(stdout, "floppy head loaded  %2.2X ,  %2.2X  \n", value,(value & floppyCmdLoadHead));
                 }
                 else {
                     // set floppy head to unloaded
-                    floppyHeadLoaded = 0 ;
+                    fd->floppyHeadLoaded = 0 ;
                 }
             }
             // say command complete - set interrupt bit
-            floppyBusy = 0;   // no longer busy
+            fd->floppyBusy = 0;   // no longer busy
 
         } // end of if
         else{
             // type II III  commands
             // set side
             if (value & floppyCmdSelectSide ){
-                floppySide=1;
+                fd->floppySide=1;
             }
             else {
-                floppySide=0;
+                fd->floppySide=0;
             }
+            // set again by the multi sector commands
+            fd->floppyMultiSector = 0;
             // type 2 commands
             switch ( value & 0xF0 ){
                 case floppyCmdReadSector:
-                    // read a sector from the disk
-                    readASector(value);
-                    floppyBusy = 0;   // no longer busy
-                    break;
                 case floppyCmdReadSectorMulti:
-                    // not doing this at present
-                    floppyInteruptRequest = 1; // set interrupt
-                    floppyRecordNotFound = 1; // say not found as error
+                    // read a sector, or the rest of the track, from the disk
+                    readASector(m, value);
+                    fd->floppyBusy = 0;   // no longer busy
                     break;
                 case floppyCmdWriteSector:
+                case floppyCmdWriteSectorMulti:
                     //fprintf(stdout,"Write sector command\n");
                     // write a sector sets flags ready to recieve the data
                     // the actual sector write does not actually happen until
                     //  all the data has been recieved.
                     // check if drive active
-                    if (floppyDrives[floppyActiveDrive].fileNamePointer == NULL ){
+                    if (fd->floppyDrives[fd->floppyActiveDrive].fileNamePointer == NULL ){
                         // no disk mounted in drive TODO what error
-                        floppyInteruptRequest = 1; // set interrupt
-                        floppyRecordNotFound = 1;
-                        floppyBusy = 0;   // no longer busy
+                        fd->floppyInteruptRequest = 1; // set interrupt
+                        fd->floppyRecordNotFound = 1;
+                        fd->floppyBusy = 0;   // no longer busy
                         // fprintf(stdout,"write sector no disk mounted\n");
                         }
-                    else if (floppyDrives[floppyActiveDrive].writeProtect != 0 ){
+                    else if (fd->floppyDrives[fd->floppyActiveDrive].writeProtect != 0 ){
                         // write protected disk mounted in drive TODO what error
-                        floppyInteruptRequest = 1; // set interrupt
-                        floppyWriteFailWriteProtected = 1;
-                        floppyBusy = 0;   // no longer busy
+                        fd->floppyInteruptRequest = 1; // set interrupt
+                        fd->floppyWriteFailWriteProtected = 1;
+                        fd->floppyBusy = 0;   // no longer busy
                         //fprintf(stdout,"write sector write protect\n");
                     }
                     // check if tracks match
-                    else if ( floppyTrackRegister != floppyDrives[floppyActiveDrive].track){
+                    else if ( fd->floppyTrackRegister != fd->floppyDrives[fd->floppyActiveDrive].track){
                         // say not able to write track
-                        floppyInteruptRequest = 1; // set interrupt
-                        floppyRecordNotFound = 1;
-                        floppyBusy = 0;   // no longer busy
-                        fprintf(stdout,"write sector mismatch track number register %d drive %d\n",floppyTrackRegister,floppyDrives[floppyActiveDrive].track);
+                        fd->floppyInteruptRequest = 1; // set interrupt
+                        fd->floppyRecordNotFound = 1;
+                        fd->floppyBusy = 0;   // no longer busy
+                        LOG(m, LOG_FLOPPY, LOG_ERROR, "write sector mismatch track number register %d drive %d\n",fd->floppyTrackRegister,fd->floppyDrives[fd->floppyActiveDrive].track);
                     }
                     else{
 
-                        int writeSize= floppyDrives[floppyActiveDrive].sizeOfSector;
-                        // read all into buffer TODO what if sector size is too big ??
-                        if (writeSize > 1024) {
-                            writeSize=1024;
+                        // multi sector carries on to the end of the track
+                        fd->floppyMultiSector = ((value & 0xF0) == floppyCmdWriteSectorMulti);
+                        int writeSize= fd->floppyDrives[fd->floppyActiveDrive].sizeOfSector * floppySectorsToTransfer(m);
+                        // the data goes straight into the sector in the mapped image
+                        unsigned char * sectordata = floppySectorData(m, writeSize, &fd->floppyDataOffset);
+                        if (sectordata == NULL){
+                            fd->floppyInteruptRequest = 1; // set interrupt
+                            fd->floppyRecordNotFound = 1;
+                            fd->floppyBusy = 0;   // no longer busy
+                            LOG(m, LOG_FLOPPY, LOG_ERROR, "Write Invalid file pos\n");
+                        }
+                        else {
+                            fd->floppyData = sectordata;
+                            fd->floppyBufferUsed = writeSize; // where to stop
+                            // load the first element
+                            fd->floppyBufferPosition=0; // where to start storing
+                            fd->floppyDataRequest=1; //say data avaiable
+                            fd->floppyInteruptRequest=0;   // clear if all worked okay
+                            //fprintf(stdout,"write sector set\n");
                         }
-                        floppyBufferUsed = writeSize; // where to stop
-                        // load the first element
-                        floppyBufferPosition=0; // where to start storing
-                        floppyDataRequest=1; //say data avaiable
-                        floppyInteruptRequest=0;   // clear if all worked okay
-                        //fprintf(stdout,"write sector set\n");
                     }
                     break;
-                case floppyCmdWriteSectorMulti:
-                    // not doing this at present
-                    floppyInteruptRequest = 1; // set interrupt
-                    floppyRecordNotFound = 1; // say not found as error
-                    break;
                 // type 3 commands
                 case floppyCmdReadAddress:
                     // read address - create a dummy id record
-                    readAddress(value);
-                    floppyBusy = 0;   // no longer busy
+                    readAddress(m, value);
+                    fd->floppyBusy = 0;   // no longer busy
                     break;
                 case floppyCmdReadTrack:
-                    // just reset busy
-                    floppyBusy = 0;   // no longer busy
+                    // make up the raw track from the image
+                    readTrack(m);
+                    fd->floppyBusy = 0;   // no longer busy
                     break;
                 case floppyCmdWriteTrack:
                     // dummy code to write track 
@@ -1083,18 +1299,18 @@ static int floppySetCommand(unsigned int value){ // call to set command register
                     // the actual sector write does not actually happen until
                     //  all the data has been recieved.
                     // check if drive active
-                    if (floppyDrives[floppyActiveDrive].fileNamePointer == NULL ){
+                    if (fd->floppyDrives[fd->floppyActiveDrive].fileNamePointer == NULL ){
                         // no disk mounted in drive TODO what error
-                        floppyInteruptRequest = 1; // set interrupt
-                        floppyRecordNotFound = 1;
-                        floppyBusy = 0;   // no longer busy
+                        fd->floppyInteruptRequest = 1; // set interrupt
+                        fd->floppyRecordNotFound = 1;
+                        fd->floppyBusy = 0;   // no longer busy
                         // fprintf(stdout,"write sector no disk mounted\n");
                         }
-                    else if (floppyDrives[floppyActiveDrive].writeProtect != 0 ){
+                    else if (fd->floppyDrives[fd->floppyActiveDrive].writeProtect != 0 ){
                         // no disk mounted in drive TODO what error
-                        floppyInteruptRequest = 1; // set interrupt
-                        floppyWriteFailWriteProtected = 1;
-                        floppyBusy = 0;   // no longer busy
+                        fd->floppyInteruptRequest = 1; // set interrupt
+                        fd->floppyWriteFailWriteProtected = 1;
+                        fd->floppyBusy = 0;   // no longer busy
                         //fprintf(stdout,"write sector write protect\n");
                         }
                     // check if tracks match - not needed for wrtie track
@@ -1106,19 +1322,29 @@ static int floppySetCommand(unsigned int value){ // call to set command register
                     //    fprintf(stdout,"write track mismatch track number register %d drive %d\n",floppyTrackRegister,floppyDrives[floppyActiveDrive].track);
                     //    }
                     else{
-                        // dummy setup
-                        int writeSize= floppyDrives[floppyActiveDrive].sizeOfSector;
-                        // read all into buffer TODO what if sector size is too big ??
-                        if (writeSize > FLOPPYMAXSECTORSIZE) {
-                            writeSize=FLOPPYMAXSECTORSIZE;
+                        // the track under the head, whatever the track register says
+                        FLOPPYTRACKCACHE *entry = floppyFindTrack(m, fd->floppyDrives[fd->floppyActiveDrive].track, fd->floppySide);
+                        if (entry == NULL || entry->length > FLOPPYMAXTRACKSIZE){
+                            fd->floppyInteruptRequest = 1; // set interrupt
+                            fd->floppyRecordNotFound = 1;
+                            fd->floppyBusy = 0;   // no longer busy
+                            LOG(m, LOG_FLOPPY, LOG_ERROR, "write track %d side %d not in the image\n",fd->floppyDrives[fd->floppyActiveDrive].track,fd->floppySide);
+                        }
+                        else {
+                            // sectors not in the bytes sent keep what they had
+                            memcpy(fd->floppyTrackBuffer, entry->data, entry->length);
+                            fd->floppyFormatOffset = entry->offset;
+                            fd->floppyFormatLength = entry->length;
+                            fd->floppyFormatState = FORMAT_GAP;
+                            fd->floppyFormatHaveId = 0;
+                            fd->floppyFormatSectors = 0;
+                            // take bytes until all the sectors have been sent, or about a track and a bit
+                            fd->floppyData = fd->floppyBuffer;
+                            fd->floppyBufferUsed = FLOPPYMAXSECTORSIZE; // where to stop
+                            fd->floppyBufferPosition=0; // bytes taken
+                            fd->floppyDataRequest=1; //say data avaiable
+                            fd->floppyInteruptRequest=0;   // clear if all worked okay
                         }
-                        writeSize=FLOPPYMAXSECTORSIZE; // fix to get most of data
-                        floppyBufferUsed = writeSize; // where to stop
-                        // load the first element
-                        floppyBufferPosition=0; // where to start storing
-                        floppyDataRequest=1; //say data avaiable
-                        floppyInteruptRequest=0;   // clear if all worked okay
-                        //fprintf(stdout,"write sector set\n");
                     }
                     break;
                     // originallly just reset busy
@@ -1127,7 +1353,7 @@ static int floppySetCommand(unsigned int value){ // call to set command register
 
                 default:
                     // should not happen but . . . .
-                    fprintf(stdout, "floppy controller received unknown command  %2.2X , ignoring it. \n", value);
+                    LOG(m, LOG_FLOPPY, LOG_WARN, "floppy controller received unknown command  %2.2X , ignoring it. \n", value);
 
             }  // end of switch
         } // end of  else
@@ -1136,211 +1362,260 @@ static int floppySetCommand(unsigned int value){ // call to set command register
     } // end of else if busy
 
     else {
-        fprintf(stdout, "floppy controller received command  %2.2X  while busy, ignoring it. \n", value);
+        LOG(m, LOG_FLOPPY, LOG_WARN, "floppy controller received command  %2.2X  while busy, ignoring it. \n", value);
 
     }
     // display current floppy status 
-    displayfloppyposition();
+    displayfloppyposition(m);
     // store last commands
-    floppyPreviousCommand = value;
+    fd->floppyPreviousCommand = value;
     return 0;
 }
 
 
 // output to the set track port E1
-static int floppySetTrack(unsigned int value){
+static int floppySetTrack(struct machine *m, unsigned int value){
+    VFCFLOPPY *fd = m->floppy;
 // call to set track register
-    floppyTrackRegister=value &0xFF; // ensure it is only 1 byte
-    if (vfcfloppydebug){
-        fprintf(stdout,"Floppy set track  %2.2X \n", value);
-    }
+    fd->floppyTrackRegister=value &0xFF; // ensure it is only 1 byte
+    LOG(m, LOG_FLOPPY, LOG_DEBUG, "Floppy set track  %2.2X \n", value);
     return 0;
 }
 
 // output to the set sector port E2
-static int floppySetSector(unsigned int value){
+static int floppySetSector(struct machine *m, unsigned int value){
+    VFCFLOPPY *fd = m->floppy;
 // call to set sector register
-    floppySectorRegister=value &0xFF; // ensure it is only 1 byte
-    if (vfcfloppydebug){
-        fprintf(stdout,"Floppy set sector  %2.2X  \n", value);
-    }
+    fd->floppySectorRegister=value &0xFF; // ensure it is only 1 byte
+    LOG(m, LOG_FLOPPY, LOG_DEBUG, "Floppy set sector  %2.2X  \n", value);
     return 0;
 }
 
 // output to the setdata port E3 
-static int floppySetData(unsigned int value){
+static int floppySetData(struct machine *m, unsigned int value){
+    VFCFLOPPY *fd = m->floppy;
 
     // call to write to the data register
-    floppyDataRegister=value &0xFF; // ensure it is only 1 byte
+    fd->floppyDataRegister=value &0xFF; // ensure it is only 1 byte
 
     //fprintf(stdout,"set data received  %2.2X  \n",floppyDataRegister);
 
     // check we are processing a write command
-    if ((floppyPreviousCommand & 0xF0) == floppyCmdWriteSector){
+    if ((fd->floppyPreviousCommand & 0xE0) == floppyCmdWriteSector){   // single or multi sector
         // and we are requesting data
-        if (floppyDataRequest == 1){
+        if (fd->floppyDataRequest == 1){
             // store data into buffer
             // extra check to stop buffer overflow
-            floppyDataRequest=0;
-            if ( floppyBufferPosition < floppyBufferUsed ){
-                floppyBuffer[floppyBufferPosition++] = floppyDataRegister;
+            fd->floppyDataRequest=0;
+            if ( fd->floppyBufferPosition < fd->floppyBufferUsed ){
+                fd->floppyData[fd->floppyBufferPosition++] = fd->floppyDataRegister;
+                floppyNextSector(m);
             }
             // check if we have reach end of buffer
             // floppyBufferUsed is pointing at the next free location
             // so we need the floppyBufferPosition to be 1 more
-            if ( floppyBufferPosition < floppyBufferUsed ){
+            if ( fd->floppyBufferPosition < fd->floppyBufferUsed ){
                 // data still to receive
                 // floppyDataRequest=1;
-                floppyDelayForByteRequest = floppyDelayByteRequestBy; // set to delay the setting of the request data flag
+                fd->floppyDelayForByteRequest = floppyDelayByteRequestBy; // set to delay the setting of the request data flag
             }
             else {
                 // say no more data after this
-                floppyDataRequest=0;
+                fd->floppyDataRequest=0;
                 // need to actually write the sector
-                if (vfcfloppydisplaysectors){
-                    fprintf(stdout,"Write sector\n");
-                    showFloppySector();
+                if (m->vfcfloppydisplaysectors){
+                    log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "Write sector\n");
+                    showFloppySector(m);
                 }
                 // Sector specified by floppyTrackRegister, floppySide, floppySectorRegister
-                if ((floppyActiveDrive>-1) && (floppyActiveDrive<4)){
-                    if ( floppyTrackRegister != floppyDrives[floppyActiveDrive].track){
+                if ((fd->floppyActiveDrive>-1) && (fd->floppyActiveDrive<4)){
+                    if ( fd->floppyTrackRegister != fd->floppyDrives[fd->floppyActiveDrive].track){
                         // say not able to write track
-                        floppyRecordNotFound = 1;
-                        fprintf(stdout,"Floppy track register %d not matching drive %d actual track %d /n",
-                                        floppyTrackRegister, floppyActiveDrive, floppyDrives[floppyActiveDrive].track);
+                        fd->floppyRecordNotFound = 1;
+                        LOG(m, LOG_FLOPPY, LOG_ERROR, "Floppy track register %d not matching drive %d actual track %d /n",
+                                        fd->floppyTrackRegister, fd->floppyActiveDrive, fd->floppyDrives[fd->floppyActiveDrive].track);
                     }
                     else {
                         // all good
-                        writeASector();
+                        writeASector(m);
                     }
                 }
                 else { // invalid floppy number
-                    floppyRecordNotFound = 1;
-                    if (verbose){
-                        fprintf(stdout,"write sector:- Invalid drive no %d\n",floppyActiveDrive);
+                    fd->floppyRecordNotFound = 1;
+                    if (m->verbose){
+                        fprintf(m->out, "write sector:- Invalid drive no %d\n",fd->floppyActiveDrive);
                     }
                 }
                 // signify end
-                floppyInteruptRequest=1;
-                floppyBusy=0;
+                fd->floppyInteruptRequest=1;
+                fd->floppyBusy=0;
             }
         }
         else {
-            if (vfcfloppydebug){
-                printf("Setdata received unexpected %2.2X after write sector\n",value);
-            }
+            LOG(m, LOG_FLOPPY, LOG_DEBUG, "Setdata received unexpected %2.2X after write sector\n",value);
         }
     }
-    else if ((floppyPreviousCommand & 0xF0) ==  floppyCmdWriteTrack){
+    else if ((fd->floppyPreviousCommand & 0xF0) ==  floppyCmdWriteTrack){
         // some code to handle the write track command
         // and we are requesting data
-        if (floppyDataRequest == 1){
+        if (fd->floppyDataRequest == 1){
 
             // decided that we will just take first byte
             // then write a track
             // and set interupt and unset busy 
             if (0){
                 // say no more data after this
-                floppyDataRequest=0;
+                fd->floppyDataRequest=0;
                 // formattrack();
                 // signify end
-                floppyInteruptRequest=1;
-                floppyBusy=0;
+                fd->floppyInteruptRequest=1;
+                fd->floppyBusy=0;
             }
             else{
 
-                // store data into buffer
-                // extra check to stop buffer overflow
-                floppyDataRequest=0;
-                if ( floppyBufferPosition < floppyBufferUsed ){
-                    floppyBuffer[floppyBufferPosition++] = floppyDataRegister;
+                // pick the sectors out of the bytes sent
+                fd->floppyDataRequest=0;
+                if ( fd->floppyBufferPosition < fd->floppyBufferUsed ){
+                    fd->floppyBufferPosition++;
+                    if (formattrackbyte(m, fd->floppyDataRegister)){
+                        // last sector received, the rest would just be gap
+                        fd->floppyBufferPosition = fd->floppyBufferUsed;
+                    }
                 }
                 // check if we have reach end of buffer
                 // floppyBufferUsed is pointing at the next free location
                 // so we need the floppyBufferPosition to be 1 more
-                if ( floppyBufferPosition < floppyBufferUsed ){
+                if ( fd->floppyBufferPosition < fd->floppyBufferUsed ){
                     // data still to receive
                     // floppyDataRequest=1;
-                    floppyDelayForByteRequest = floppyDelayByteRequestBy; // set to delay the setting of the request data flag
+                    fd->floppyDelayForByteRequest = floppyDelayByteRequestBy; // set to delay the setting of the request data flag
                 }
                 else {
                     // say no more data after this
-                    floppyDataRequest=0;
-                    // need to actually write the sector
-                    if (vfcfloppydisplaysectors){
-                        fprintf(stdout,"Write track buffer\n");
-                        showFloppySector();
-                     }
-                    formattrack();
+                    fd->floppyDataRequest=0;
+                    // need to actually write the track
+                    if (m->vfcfloppydisplaysectors){
+                        log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "Write track %d side %d, %d sectors\n",fd->floppyDrives[fd->floppyActiveDrive].track,fd->floppySide,fd->floppyFormatSectors);
+                    }
+                    formattrack(m);
                     // signify end
-                    floppyInteruptRequest=1;
-                    floppyBusy=0;
+                    fd->floppyInteruptRequest=1;
+                    fd->floppyBusy=0;
                 }
             
             }
         }
         else {
-            if (vfcfloppydebug){
-                printf("Setdata received unexpected %2.2X after write track\n",value);
-            }
+            LOG(m, LOG_FLOPPY, LOG_DEBUG, "Setdata received unexpected %2.2X after write track\n",value);
         }
         // ignore if data not requested
     }
     else{
         // store for seek command
-        if (vfcfloppydebug){
-            fprintf(stdout,"set data received %2.2X  \n",floppyDataRegister);
-        }
+        LOG(m, LOG_FLOPPY, LOG_DEBUG, "set data received %2.2X  \n",fd->floppyDataRegister);
     }
 
 
     return 0;
 }
 
-// format the current track on the current drive
-static void formattrack(void){
+// write the track built up by write track into the image of the current drive in one go
+static void formattrack(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
 
-    if ((floppyActiveDrive>-1) && (floppyActiveDrive<4)) {
-        int writeSize= floppyDrives[floppyActiveDrive].sizeOfSector;
-        if (writeSize > FLOPPYMAXSECTORSIZE) {
-            writeSize=FLOPPYMAXSECTORSIZE;
+    if ((fd->floppyActiveDrive>-1) && (fd->floppyActiveDrive<4)) {
+        unsigned char *trackdata = diskimage_sector(&fd->floppyDrives[fd->floppyActiveDrive].image, fd->floppyFormatOffset, fd->floppyFormatLength);
+        if (trackdata != NULL && fd->floppyFormatSectors > 0){
+            memcpy(trackdata, fd->floppyTrackBuffer, fd->floppyFormatLength);
+            floppyWritten(m, fd->floppyFormatOffset, fd->floppyFormatLength);
         }
-        memset(&floppyBuffer, 0xE5,writeSize );  /* Fill with the E5  */
-        
-        //floppyDrives[floppyActiveDrive].track;
-
+    }
+}
 
+// take the next byte sent for write track
+// the id fields and data fields of the IBM format track are picked out, the gaps
+// and the sync (F5, F6) and CRC (F7) bytes are only needed by a real drive
+// a data field runs from its address mark to the F7 that writes its CRC and
+// goes to the sector named in the id field before it
+// returns 1 once all the sectors of the track have been received
+static int formattrackbyte(struct machine *m, unsigned char value){
+    VFCFLOPPY *fd = m->floppy;
+    FLOPPYDRIVEINFO *drive = &fd->floppyDrives[fd->floppyActiveDrive];
+
+    switch (fd->floppyFormatState){
+        case FORMAT_ID:
+            fd->floppyFormatId[fd->floppyFormatCount++] = value;
+            if (fd->floppyFormatCount == 4){
+                fd->floppyFormatHaveId = 1;
+                fd->floppyFormatState = FORMAT_GAP;
+            }
+            break;
+        case FORMAT_DATA:
+            if (value == 0xF7){
+                if (fd->floppyFormatCount != (int)drive->sizeOfSector && LOGGING(m, LOG_FLOPPY, LOG_DEBUG)){
+                    log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "Write track sector %d has %d bytes, not %d\n",fd->floppyFormatId[2],fd->floppyFormatCount,drive->sizeOfSector);
+                }
+                fd->floppyFormatSectors++;
+                fd->floppyFormatState = FORMAT_GAP;
+                return fd->floppyFormatSectors >= (int)drive->numberOfSectors;
+            }
+            if (fd->floppyFormatSector != NULL && fd->floppyFormatCount < (int)drive->sizeOfSector){
+                fd->floppyFormatSector[fd->floppyFormatCount] = value;
+            }
+            fd->floppyFormatCount++;
+            break;
+        default:
+            if (value == 0xFE){
+                // id address mark
+                fd->floppyFormatCount = 0;
+                fd->floppyFormatState = FORMAT_ID;
+            }
+            else if (value >= 0xF8 && value <= 0xFB && fd->floppyFormatHaveId){
+                // data address mark
+                long int sectorstart = (long int)drive->sizeOfSector * fd->floppyFormatId[2];
+                fd->floppyFormatHaveId = 0;
+                fd->floppyFormatCount = 0;
+                fd->floppyFormatSector = NULL;
+                if (sectorstart + drive->sizeOfSector <= fd->floppyFormatLength){
+                    fd->floppyFormatSector = fd->floppyTrackBuffer + sectorstart;
+                }
+                else if (LOGGING(m, LOG_FLOPPY, LOG_DEBUG)){
+                    log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "Write track sector %d is not in the image, ignored\n",fd->floppyFormatId[2]);
+                }
+                fd->floppyFormatState = FORMAT_DATA;
+            }
+            break;
     }
+    return 0;
 }
 
 // Wrtie to drive port E4 and E5
-static int floppySetDrive(unsigned int value){
+static int floppySetDrive(struct machine *m, unsigned int value){
+    VFCFLOPPY *fd = m->floppy;
 // call to set active drive
 //  map80 vfc works by setting bits
     switch (value&0x0F){
         case 0x01:
-            floppyActiveDrive = 0;
+            fd->floppyActiveDrive = 0;
             break;
         case 0x02:
-            floppyActiveDrive = 1;
+            fd->floppyActiveDrive = 1;
             break;
         case 0x04:
-            floppyActiveDrive = 2;
+            fd->floppyActiveDrive = 2;
             break;
         case 0x08:
-            floppyActiveDrive = 3;
+            fd->floppyActiveDrive = 3;
             break;
         default:
-            fprintf(stdout,"Floppy set drive invalid value  %2.2X  \n",value);
+            LOG(m, LOG_FLOPPY, LOG_WARN, "Floppy set drive invalid value  %2.2X  \n",value);
     }
     // show on the status screen
-    displayfloppystatus();
+    displayfloppystatus(m);
     // TODO look at FM and MFM values ?
-    floppyDelayReady = 2; // set ready after 1 read of E4
+    fd->floppyDelayReady = 2; // set ready after 1 read of E4
 
-    if (vfcfloppydebug){
-        fprintf(stdout,"Floppy drive set to  %2.2X  \n",floppyActiveDrive);
-    }
+    LOG(m, LOG_FLOPPY, LOG_DEBUG, "Floppy drive set to  %2.2X  \n",fd->floppyActiveDrive);
 
     // displayDetails("SetDrive");
 
@@ -1348,76 +1623,76 @@ static int floppySetDrive(unsigned int value){
 }
 
 // read status port E0
-static int floppyReadStatus(){
+static int floppyReadStatus(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
 // call to read the status register
 // Status register is generated dynamically based on indicators set.
 
     int retval = 0 ;
 
-    static int IndexpulseCountdown=20;
 
 
     // update register value with the standard stuff
 
-    if ( (floppyPreviousCommand &0x80) ){
+    if ( (fd->floppyPreviousCommand &0x80) ){
 
         if (0) {
-            printf("previous command TypeII, III, IV - %2X\n",floppyPreviousCommand);
-            fprintf(stdout,"status II write %d not found %d CRC %d lost %d \n",
-                floppyWriteFailWriteProtected,
-                floppyRecordNotFound,
-                floppyCRCError,
-                floppyDataLost);
+            fprintf(m->out, "previous command TypeII, III, IV - %2X\n",fd->floppyPreviousCommand);
+            fprintf(m->out, "status II write %d not found %d CRC %d lost %d \n",
+                fd->floppyWriteFailWriteProtected,
+                fd->floppyRecordNotFound,
+                fd->floppyCRCError,
+                fd->floppyDataLost);
         }
         // Type II or II or IV command
-        if (floppyWriteFailWriteProtected){
+        if (fd->floppyWriteFailWriteProtected){
             retval |= FLOPPYSTATUSWRITEPROTECT;
         }
         // TODO deleted data mark
         // record not found
-        if (floppyRecordNotFound){
+        if (fd->floppyRecordNotFound){
             retval |= FLOPPYSTATUSRECORDNOTFOUND;
         }
         // CRC error
-        if (floppyCRCError){
+        if (fd->floppyCRCError){
             retval |= FLOPPYSTATUSCRCERROR;
         }
         // data lost
-        if (floppyDataLost){
+        if (fd->floppyDataLost){
             retval |= FLOPPYSTATUSLOSTDATA;
         }
     }
     else {
         // Type I command
         //printf("previous command TypeI - %2X\n",floppyPreviousCommand);
-        if ((floppyActiveDrive>-1) && (floppyActiveDrive<4) ) {
+        if ((fd->floppyActiveDrive>-1) && (fd->floppyActiveDrive<4) ) {
             // set if track 0
             // set Head Loaded bit 5
-            if (floppyHeadLoaded){
+            if (fd->floppyHeadLoaded){
                 retval |= FLOPPYSTATUSHEADLOADED;
             }
             else{
                 retval &= ~FLOPPYSTATUSHEADLOADED;
             }
 
-            if (floppyDrives[floppyActiveDrive].track==0){
+            if (fd->floppyDrives[fd->floppyActiveDrive].track==0){
                 retval |= FLOPPYSTATUSTRACKZERO;
                 // printf("at track 0 \n");
             }
 
             // is it write protected
-            if (floppyDrives[floppyActiveDrive].writeProtect){
+            if (fd->floppyDrives[fd->floppyActiveDrive].writeProtect){
                 retval |= FLOPPYSTATUSWRITEPROTECT;
             }
 
             // simple code to pulse the index bit every so often
-            IndexpulseCountdown--;
-            if (IndexpulseCountdown<5){
+            fd->IndexpulseCountdown--;
+            if (fd->IndexpulseCountdown<5){
                 //printf("status %2X\n",retval);
                 retval |= FLOPPYSTATUSINDEXFOUND;
                 //printf("status %2X\n",retval);
-                if (IndexpulseCountdown<0){
-                    IndexpulseCountdown=20;
+                if (fd->IndexpulseCountdown<0){
+                    fd->IndexpulseCountdown=20;
                 }
 
             }
@@ -1426,7 +1701,7 @@ static int floppyReadStatus(){
     }
 
     // is floppy drive ready to run - bit 7
-    if (getFloppyReadyFlag()==1){
+    if (getFloppyReadyFlag(m)==1){
         // set bit to say not ready
         retval |= FLOPPYSTATUSNOTREADY;
     }
@@ -1434,84 +1709,83 @@ static int floppyReadStatus(){
         retval &= ~FLOPPYSTATUSNOTREADY;
     }
     
-    if (SetBusyForTime>0){    // set busy flag for x-1 calls to status - then set floppyInteruptRequest
-        SetBusyForTime--;
-        if (SetBusyForTime==0){     // if busy delay has got to 0 set floppyInteruptRequest
-            floppyInteruptRequest=1;
+    if (fd->SetBusyForTime>0){    // set busy flag for x-1 calls to status - then set floppyInteruptRequest
+        fd->SetBusyForTime--;
+        if (fd->SetBusyForTime==0){     // if busy delay has got to 0 set floppyInteruptRequest
+            fd->floppyInteruptRequest=1;
         }
     }
 
     // is floppy busy - bit 0
     // set if floppyBusy specifically set or being delayed
-    if (floppyBusy || (SetBusyForTime>0)){
+    if (fd->floppyBusy || (fd->SetBusyForTime>0)){
         retval |= FLOPPYSTATUSBUSY;
     }
     else {
         retval &= ~FLOPPYSTATUSBUSY;
     }
 
-    if (vfcfloppydebug){
-        fprintf(stdout,"Read Status returned  %2.2X  \n",retval);
-        //displayDetails("    ");
-    }
+    LOG(m, LOG_FLOPPY, LOG_DEBUG, "Read Status returned  %2.2X  \n",retval);
+    //displayDetails("    ");
 
     return retval;
 }
 
 // read track port E1
-static int floppyReadTrack(){
+static int floppyReadTrack(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
 // call to read Track register
-    if (vfcfloppydebug){
-        if (vfcfloppydisplaysectors){
-            displayDetails("Read Track");
+    if (LOGGING(m, LOG_FLOPPY, LOG_DEBUG)){
+        if (m->vfcfloppydisplaysectors){
+            displayDetails(m, "Read Track");
         }
     // fprintf(stdout,"Read Track Register returned   %2.2X  \n",(floppyTrackRegister&0xFF));
     }
-    return floppyTrackRegister&0xFF; // ensure it is only 1 byte
+    return fd->floppyTrackRegister&0xFF; // ensure it is only 1 byte
 }
 
 // read sector port E2
-static int floppyReadSector(){
+static int floppyReadSector(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
 // call to read Sector register
     //displayDetails("Read Sector");
     //fprintf(stdout,"Read Sector Register returned   %2.2X  \n",(floppySectorRegister&0xFF));
-    return floppySectorRegister &0xFF; // ensure it is only 1 byte
+    return fd->floppySectorRegister &0xFF; // ensure it is only 1 byte
 }
 
 // read data port E3
-static int floppyReadData(){
+static int floppyReadData(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
     // call to read the data register
-    // only handles basic sending of current buffer
-    // does not support reading the next sector in multi sector read.
+    // sends the current buffer - for a multi sector read that is the rest of the track
 
     unsigned int retval=0;
 
     //displayDetails("Read Data");
-    if (floppyDataRequest==1){ // we are sending data
-        floppyDataRequest=0; // set off for now - played with introducing a delay
-        retval = floppyDataRegister; // return current register value 
+    if (fd->floppyDataRequest==1){ // we are sending data
+        fd->floppyDataRequest=0; // set off for now - played with introducing a delay
+        retval = fd->floppyDataRegister; // return current register value 
 
         // check if we have reach end of buffer
         // floppyBufferPosition will be the position is for the next byte
         // floppyBufferUsed is pointing at the next free loaction
         // We want to stop when floppyBufferPosition is >= floppyBufferUsed
-        if ( floppyBufferPosition < floppyBufferUsed ){
+        floppyNextSector(m);
+        if ( fd->floppyBufferPosition < fd->floppyBufferUsed ){
             // set up next byte to return
-            floppyDataRegister = floppyBuffer[floppyBufferPosition++];
+            fd->floppyDataRegister = fd->floppyData[fd->floppyBufferPosition++];
             // data still to send
-            floppyDelayForByteRequest = floppyDelayByteRequestBy; // set to delay the setting of the request data flag
+            fd->floppyDelayForByteRequest = floppyDelayByteRequestBy; // set to delay the setting of the request data flag
             // floppyDataRequest=1;
         }
         else {
             // say no more data after this
-            floppyDataRequest=0;
+            fd->floppyDataRequest=0;
             // signify end
-            floppyInteruptRequest=1;
+            fd->floppyInteruptRequest=1;
         }
     }
-    if (vfcfloppydebug){
-        fprintf(stdout,"Read data datarequest %d returned  %2.2X  \n",floppyDataRequest,(retval &0xFF) );
-    }
+    LOG(m, LOG_FLOPPY, LOG_DEBUG, "Read data datarequest %d returned  %2.2X  \n",fd->floppyDataRequest,(retval &0xFF) );
 
     return retval &0xFF; // ensure it is only 1 byte
 
@@ -1519,13 +1793,12 @@ static int floppyReadData(){
 
 
 // read data from the drive port E4 & E5
-static int floppyReadDrivePort(){
+static int floppyReadDrivePort(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
 // call to read Drive port ( DRQ, INTRQ and READY ) using 0xE4 or 0xE5
 // need to combine to return
 
 // TODO - fix so if called a lot without other commands happening - bit ??
-    static int Numbercalls=0;
-    static int lastreturn=0xFF;
     // bit 0 is floppyInteruptRequest, bit 1 is floppyNotReady and bit 7 is floppyDataRequest
     // displayDetails("Read Port");
     
@@ -1533,7 +1806,7 @@ static int floppyReadDrivePort(){
 
     int invertedfloppyNotReady = 0;
     //if (floppyNotReady==0){
-    if (getFloppyReadyFlag()==0){
+    if (getFloppyReadyFlag(m)==0){
         invertedfloppyNotReady=1;
     }
 
@@ -1542,43 +1815,43 @@ static int floppyReadDrivePort(){
     // will be set to 1 or more by the read or write buffer routines
     // Also for Polydos needed to set inverted not ready flag
     // so while data not available it get back 0 
-    if (floppyDelayForByteRequest > 0 ){
-        floppyDelayForByteRequest -=1;
-        if (floppyDelayForByteRequest < 1 ){
-            floppyDataRequest=1;
+    if (fd->floppyDelayForByteRequest > 0 ){
+        fd->floppyDelayForByteRequest -=1;
+        if (fd->floppyDelayForByteRequest < 1 ){
+            fd->floppyDataRequest=1;
             invertedfloppyNotReady=1; // also say ready
         }
         else {
-            floppyDataRequest=0;
+            fd->floppyDataRequest=0;
             invertedfloppyNotReady=0; // also say not ready overriding normalvalue
         }
     }
 
-    int returnval = floppyInteruptRequest + (invertedfloppyNotReady << 1) + (floppyDataRequest << 7 );
+    int returnval = fd->floppyInteruptRequest + (invertedfloppyNotReady << 1) + (fd->floppyDataRequest << 7 );
 
         
-    if (vfcfloppydebug){
-        if ( lastreturn != returnval){
-            if (Numbercalls>1){
-                fprintf(stdout,"DrivePort returned value %2.2X  %d times\n", lastreturn, Numbercalls );
+    if (LOGGING(m, LOG_FLOPPY, LOG_DEBUG)){
+        if ( fd->lastreturn != returnval){
+            if (fd->Numbercalls>1){
+                log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "DrivePort returned value %2.2X  %d times\n", fd->lastreturn, fd->Numbercalls );
             }
-            fprintf(stdout,"DrivePort returned value %2.2X delay %d DataRequest %2.2X NotReady %2.2X InteruptReq  %2.2X\n",
-                    returnval, floppyDelayForByteRequest, floppyDataRequest,invertedfloppyNotReady,floppyInteruptRequest);
+            log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "DrivePort returned value %2.2X delay %d DataRequest %2.2X NotReady %2.2X InteruptReq  %2.2X\n",
+                    returnval, fd->floppyDelayForByteRequest, fd->floppyDataRequest,invertedfloppyNotReady,fd->floppyInteruptRequest);
         }
     }
-    if (returnval == lastreturn){
-        if( (Numbercalls == 1000) ){
-            printf("lots of calls to read port E4 - setting drive not ready\n");
+    if (returnval == fd->lastreturn){
+        if( (fd->Numbercalls == 1000) ){
+            LOG(m, LOG_FLOPPY, LOG_WARN, "lots of calls to read port E4 - setting drive not ready\n");
             returnval |= 0x02;
         }
         else{
-            Numbercalls++;
+            fd->Numbercalls++;
         }
         
     }
     else{
-        lastreturn = returnval;
-        Numbercalls=1;
+        fd->lastreturn = returnval;
+        fd->Numbercalls=1;
     }
     return returnval;
 
@@ -1588,13 +1861,14 @@ static int floppyReadDrivePort(){
 // internal routines
 
 // returns 0 if floppy is ready
-static int getFloppyReadyFlag(void){
+static int getFloppyReadyFlag(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
      // delay saying byte ready or needed by a few checks
     // once floppyDelayReady is less than 1 it has no impact
     // will be set to 1 or more by the read or write buffer routines
-    if (floppyDelayReady > 0 ){
-        floppyDelayReady -=1;
-        if (floppyDelayReady < 1 ){
+    if (fd->floppyDelayReady > 0 ){
+        fd->floppyDelayReady -=1;
+        if (fd->floppyDelayReady < 1 ){
             return 0;
         }
         else {
@@ -1608,34 +1882,36 @@ static int getFloppyReadyFlag(void){
 }
 
 // clear all indicators used to set status
-static void clearStatusIndcators(){
+static void clearStatusIndcators(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
 
-    floppyInteruptRequest = 0; // set to 1 when intrq should be set
-    floppyDataRequest = 0;   // set to 1 when data register available to read or empty to write
-    floppyHeadLoaded = 0; // set to 1 when the heads are "locked and loaded"
-    floppyCRCError=0;     // set to 1 if there is a crc error
-    floppySeekError = 0;  // set to 1 when seek error occured
-    floppyRecordNotFound = 0; // set to 1 if record not found
+    fd->floppyInteruptRequest = 0; // set to 1 when intrq should be set
+    fd->floppyDataRequest = 0;   // set to 1 when data register available to read or empty to write
+    fd->floppyHeadLoaded = 0; // set to 1 when the heads are "locked and loaded"
+    fd->floppyCRCError=0;     // set to 1 if there is a crc error
+    fd->floppySeekError = 0;  // set to 1 when seek error occured
+    fd->floppyRecordNotFound = 0; // set to 1 if record not found
 
 }
 
 // do a step in or out based on floppyStepDirection
 // value is the command used and used to see if we update the track register
-static void dostep(int value){
+static void dostep(struct machine *m, int value){
+    VFCFLOPPY *fd = m->floppy;
 
-    if ((floppyActiveDrive>-1) && (floppyActiveDrive<4) ) {
+    if ((fd->floppyActiveDrive>-1) && (fd->floppyActiveDrive<4) ) {
         // cannot step out any futher as at track 0
-        floppyDrives[floppyActiveDrive].track += floppyStepDirection;
-        if (floppyDrives[floppyActiveDrive].track < 0){
-           floppyDrives[floppyActiveDrive].track = 0;
+        fd->floppyDrives[fd->floppyActiveDrive].track += fd->floppyStepDirection;
+        if (fd->floppyDrives[fd->floppyActiveDrive].track < 0){
+           fd->floppyDrives[fd->floppyActiveDrive].track = 0;
         }
-        if (floppyDrives[floppyActiveDrive].track > floppyMaxTrackNumber){
-           floppyDrives[floppyActiveDrive].track = floppyMaxTrackNumber;
+        if (fd->floppyDrives[fd->floppyActiveDrive].track > fd->floppyMaxTrackNumber){
+           fd->floppyDrives[fd->floppyActiveDrive].track = fd->floppyMaxTrackNumber;
         }
         // update track position
         if  ( value & 0x10 ){
            // update track register
-           floppyTrackRegister=floppyDrives[floppyActiveDrive].track;
+           fd->floppyTrackRegister=fd->floppyDrives[fd->floppyActiveDrive].track;
         }
     }
 }
@@ -1644,274 +1920,466 @@ static void dostep(int value){
 // read sector address
 // create a dummy id record in the buffer
 // and set up the data read process
-static void readAddress(unsigned int command){
+static void readAddress(struct machine *m, unsigned int command){
+    VFCFLOPPY *fd = m->floppy;
 
     // fprintf(stdout, "Read Address \n");
-    floppyInteruptRequest=1;   // set will show if error
+    fd->floppyInteruptRequest=1;   // set will show if error
 
-    if ((floppyActiveDrive>-1) && (floppyActiveDrive<4) ) {
+    if ((fd->floppyActiveDrive>-1) && (fd->floppyActiveDrive<4) ) {
 
         // we need to send different sector numbers in case it is scanning all sectors
         // between index markers
-        if (readaddresssector==-1){
+        if (fd->readaddresssector==-1){
             // this is first request 
         }
-        readaddresssector+=1;
-        if (readaddresssector>floppyDrives[floppyActiveDrive].numberOfSectors){
-            readaddresssector=0;
+        fd->readaddresssector+=1;
+        if (fd->readaddresssector>fd->floppyDrives[fd->floppyActiveDrive].numberOfSectors){
+            fd->readaddresssector=0;
             // set index marker
         }
 
         
-        floppyBufferUsed=0;
-        floppyBuffer[floppyBufferUsed++]= floppyDrives[floppyActiveDrive].track; // track
-        floppyBuffer[floppyBufferUsed++]= floppySide;  // side
-        floppyBuffer[floppyBufferUsed++]= floppySectorRegister;
+        fd->floppyData = fd->floppyBuffer;
+        fd->floppyBufferUsed=0;
+        fd->floppyBuffer[fd->floppyBufferUsed++]= fd->floppyDrives[fd->floppyActiveDrive].track; // track
+        fd->floppyBuffer[fd->floppyBufferUsed++]= fd->floppySide;  // side
+        fd->floppyBuffer[fd->floppyBufferUsed++]= fd->floppySectorRegister;
 
 
         // set encoded value for length
-        floppyBuffer[floppyBufferUsed++]= getsectorsizeLSBvalue (0, floppyDrives[floppyActiveDrive].sizeOfSector);
+        fd->floppyBuffer[fd->floppyBufferUsed++]= getsectorsizeLSBvalue (m, 0, fd->floppyDrives[fd->floppyActiveDrive].sizeOfSector);
         // standard value for now !!! TODO
         //floppyBuffer[floppyBufferUsed++]=0x01;
-        floppyBuffer[floppyBufferUsed++]= 0x55; // CRC 1 - dummy
-        floppyBuffer[floppyBufferUsed++]= 0xAA; // CRC 2
+        fd->floppyBuffer[fd->floppyBufferUsed++]= 0x55; // CRC 1 - dummy
+        fd->floppyBuffer[fd->floppyBufferUsed++]= 0xAA; // CRC 2
         // the manual says to do this ?
-        floppySectorRegister = floppyDrives[floppyActiveDrive].track;
+        fd->floppySectorRegister = fd->floppyDrives[fd->floppyActiveDrive].track;
         // setup first byte to return
         // The rest of the process is handled by the readdata register routine
-        floppyBufferPosition=0;
-        floppyDataRegister = floppyBuffer[floppyBufferPosition++];
+        fd->floppyBufferPosition=0;
+        fd->floppyDataRegister = fd->floppyBuffer[fd->floppyBufferPosition++];
         //floppyDataRequest=1;
         // floppyInteruptRequest=0;   // reset to show worked
-        floppyDelayForByteRequest = floppyDelayByteRequestBy; // set to delay the setting of the request data flag
-        floppyInteruptRequest=0;   // clear if all worked okay
+        fd->floppyDelayForByteRequest = floppyDelayByteRequestBy; // set to delay the setting of the request data flag
+        fd->floppyInteruptRequest=0;   // clear if all worked okay
 
-        if (vfcfloppydebug){
-            printf("Read address buffer position %d Buffer used %d\n",floppyBufferPosition,floppyBufferUsed);
-        }
+        LOG(m, LOG_FLOPPY, LOG_DEBUG, "Read address buffer position %d Buffer used %d\n",fd->floppyBufferPosition,fd->floppyBufferUsed);
     }
     else{
-        printf("Read address : invalid drive number %d\n",floppyActiveDrive);
+        LOG(m, LOG_FLOPPY, LOG_ERROR, "Read address : invalid drive number %d\n",fd->floppyActiveDrive);
+    }
+}
+
+// find where a track is in the image of the active drive
+// looks in the drive's track cache first, then works it out and replaces the least recently used entry
+// NULL if there is no such track
+static FLOPPYTRACKCACHE * floppyFindTrack(struct machine *m, int track, int side){
+    VFCFLOPPY *fd = m->floppy;
+    FLOPPYDRIVEINFO *drive = &fd->floppyDrives[fd->floppyActiveDrive];
+    FLOPPYTRACKCACHE *entry;
+    FLOPPYTRACKCACHE *oldest = &drive->trackCache[0];
+
+    drive->trackCacheClock++;
+    for (entry = drive->trackCache; entry < drive->trackCache + FLOPPYTRACKCACHESIZE; entry++){
+        if (entry->data != NULL && entry->track == track && entry->side == side){
+            drive->trackCacheHits++;
+            entry->lastUsed = drive->trackCacheClock;
+            if (drive->image.compressed != NULL){
+                // the blocks of a compressed image may have been let go since
+                diskimage_sector(&drive->image, entry->offset, entry->length);
+            }
+            return entry;
+        }
+        if (entry->lastUsed < oldest->lastUsed){
+            oldest = entry;
+        }
+    }
+    drive->trackCacheMisses++;
+
+    long int offset = floppyFindOffset(m, fd->floppyActiveDrive, track, side, 0);
+    if (offset < 0 || drive->image.base == NULL || offset >= (long int)drive->image.size){
+        return NULL;
+    }
+    // sectors are found by their number from the start of the track
+    long int length = (long int)drive->sizeOfSector * (drive->firstSectorNumber + drive->numberOfSectors);
+    if (length > (long int)drive->image.size - offset){
+        // last track is short
+        length = drive->image.size - offset;
+    }
+    entry = oldest;
+    entry->data = drive->image.base + offset;
+    entry->offset = offset;
+    entry->length = length;
+    entry->track = track;
+    entry->side = side;
+    entry->lastUsed = drive->trackCacheClock;
+    // get the whole track read in from the image file now
+    diskimage_prefetch(&drive->image, offset, length);
+    return entry;
+}
+
+// find size bytes from the sector register on the current track and side of the active drive
+// returns a pointer into the mapped image and sets *offset to where it is in the image
+// NULL if they are not all in the image - *offset is -1 if there is no such track
+static unsigned char * floppySectorData(struct machine *m, int size, long int *offset){
+    VFCFLOPPY *fd = m->floppy;
+    FLOPPYDRIVEINFO *drive = &fd->floppyDrives[fd->floppyActiveDrive];
+    FLOPPYTRACKCACHE *entry = floppyFindTrack(m, fd->floppyTrackRegister, fd->floppySide);
+    if (entry == NULL){
+        *offset = -1;
+        return NULL;
+    }
+    long int sectorstart = (long int)drive->sizeOfSector * fd->floppySectorRegister;
+    *offset = entry->offset + sectorstart;
+    if (size <= 0 || sectorstart + size > entry->length){
+        return NULL;
+    }
+    return entry->data + sectorstart;
+}
+
+// the number of sectors a read or write sector command transfers
+// 1, or for a multi sector command up to the end of the track - 0 if the sector is past the end of the track
+static int floppySectorsToTransfer(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
+    int lastsector = fd->floppyDrives[fd->floppyActiveDrive].firstSectorNumber + fd->floppyDrives[fd->floppyActiveDrive].numberOfSectors - 1;
+    if (!fd->floppyMultiSector){
+        return 1;
+    }
+    if ((int)fd->floppySectorRegister > lastsector){
+        return 0;
+    }
+    return lastsector - fd->floppySectorRegister + 1;
+}
+
+// called after each byte of a multi sector read or write
+// steps the sector register on at the end of each sector, as the WD2797 does
+// going past the last sector on the track ends the command with record not found
+static void floppyNextSector(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
+    if (fd->floppyMultiSector && (fd->floppyBufferPosition % fd->floppyDrives[fd->floppyActiveDrive].sizeOfSector) == 0){
+        fd->floppySectorRegister++;
+        if (fd->floppyBufferPosition >= fd->floppyBufferUsed){
+            fd->floppyRecordNotFound = 1;
+        }
     }
 }
 
 // Read a sector from floppyActiveDrive at floppyTrackRegister, floppySectorRegister, floppySide.
-// Loads the correct sector into the buffer area and sets up the data read process
-static void readASector(unsigned int command){
+// Points the data register at the sector in the mapped image and sets up the data read process
+static void readASector(struct machine *m, unsigned int command){
+    VFCFLOPPY *fd = m->floppy;
     // TODO should really check that the tracks match but . . .
     // reset status register
-    FILE * filepointer=NULL;
-    floppyInteruptRequest=1;   // set will show if error
+    fd->floppyInteruptRequest=1;   // set will show if error
     // we need to find the track and sector off set in the disk
-    // position the file at the start of the sector
-    if (floppyDrives[floppyActiveDrive].fileNamePointer != NULL ){
-        if ( floppyTrackRegister != floppyDrives[floppyActiveDrive].track){
+    if (fd->floppyDrives[fd->floppyActiveDrive].fileNamePointer != NULL ){
+        if ( fd->floppyTrackRegister != fd->floppyDrives[fd->floppyActiveDrive].track){
             // say not able to read track
-            floppyRecordNotFound = 1;
+            fd->floppyRecordNotFound = 1;
+        }
+        else if (fd->floppyDrives[fd->floppyActiveDrive].image.base == NULL) {
+            LOG(m, LOG_FLOPPY, LOG_ERROR, "floppy image '%s' is not open, ignoring it. \n", fd->floppyDrives[fd->floppyActiveDrive].fileNamePointer);
+            // set to drive not ready
+            // floppyNotReady=1;
+            fd->floppyDelayReady=2; // say not ready for 1 call
         }
         else {
-            int result=0;
-            long int position = floppyFindOffset(floppyActiveDrive,
-                    floppyTrackRegister,
-                    floppySide,
-                    floppySectorRegister);
+            long int position;
+            // multi sector reads the rest of the track in one go
+            fd->floppyMultiSector = ((command & 0xF0) == floppyCmdReadSectorMulti);
+            int readSize= fd->floppyDrives[fd->floppyActiveDrive].sizeOfSector * floppySectorsToTransfer(m);
+            unsigned char * sectordata = floppySectorData(m, readSize, &position);
 
             if (position < 0 ){
                 // invalid something
-                floppyRecordNotFound=1;
-                fprintf(stdout,"Invalid file pos\n");
+                fd->floppyRecordNotFound=1;
+                LOG(m, LOG_FLOPPY, LOG_ERROR, "Invalid file pos\n");
             }
             else {
-                // filep = fopen(filename, "r+b");
-
-                filepointer = fopen(floppyDrives[floppyActiveDrive].fileNamePointer,"rb");
-                if ( filepointer == NULL) {
-                    fprintf(stdout, "floppy failed to load '%s', ignoring it. \n", floppyDrives[floppyActiveDrive].fileNamePointer);
-                    perror(floppyDrives[floppyActiveDrive].fileNamePointer);
-                    // set to drive not ready
-                    // floppyNotReady=1;
-                    floppyDelayReady=2; // say not ready for 1 call
-                    
-                } else {
-                    result=fseek(filepointer, position, SEEK_SET );
-                    if (result !=0 ) {
-                        // say not able to read sector
-                        floppyRecordNotFound=1;
-                        fprintf(stdout,"Read seek error setting Record Not Found\n");
-                        perror(floppyDrives[floppyActiveDrive].fileNamePointer);
-                    }
-                    else {
-                        int readSize= floppyDrives[floppyActiveDrive].sizeOfSector;
-                        // read all into buffer
-                        if (readSize > FLOPPYMAXSECTORSIZE) {
-                            readSize=FLOPPYMAXSECTORSIZE;
-                        }
-                        int numberRead = fread(floppyBuffer,1,readSize,filepointer);
-                        if ( numberRead == readSize){
-                            floppyBufferUsed= readSize; // where to stop
-                            // load the first element
-                            floppyBufferPosition=0; // where to start reading
-                            // set the first byte to return
-                            floppyDataRegister = floppyBuffer[floppyBufferPosition++];
-                            //floppyDataRequest=1; //say data avaiable
-                            floppyDelayForByteRequest = floppyDelayByteRequestBy; // set to delay the setting of the request data flag
-                            floppyInteruptRequest=0;   // clear if all worked okay
-                            if (vfcfloppydisplaysectors){
-                                fprintf(stdout,"Read sector %d, floppyBufferPosition %d, floppyBufferUsed %d\n",numberRead, floppyBufferPosition , floppyBufferUsed);
-                                showFloppySector();
-                            }
-                        }
-                        else {
-                            // may be something else but . . . .
-                            floppyCRCError=1;
-                            floppyRecordNotFound=1;
-                            fprintf(stdout,"Record CRC error Read [%d] readsize [%d] \n",numberRead,readSize);
-                            perror(floppyDrives[floppyActiveDrive].fileNamePointer);
-                        }
+                if ( sectordata != NULL){
+                    fd->floppyData = sectordata;
+                    fd->floppyBufferUsed= readSize; // where to stop
+                    // load the first element
+                    fd->floppyBufferPosition=0; // where to start reading
+                    // set the first byte to return
+                    fd->floppyDataRegister = fd->floppyData[fd->floppyBufferPosition++];
+                    //floppyDataRequest=1; //say data avaiable
+                    fd->floppyDelayForByteRequest = floppyDelayByteRequestBy; // set to delay the setting of the request data flag
+                    fd->floppyInteruptRequest=0;   // clear if all worked okay
+                    if (m->vfcfloppydisplaysectors){
+                        log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "Read sector %d, floppyBufferPosition %d, floppyBufferUsed %d\n",readSize, fd->floppyBufferPosition , fd->floppyBufferUsed);
+                        showFloppySector(m);
                     }
                 }
+                else {
+                    // sector is past the end of the image
+                    fd->floppyCRCError=1;
+                    fd->floppyRecordNotFound=1;
+                    LOG(m, LOG_FLOPPY, LOG_ERROR, "Record CRC error position [%ld] readsize [%d] past end of image\n",position,readSize);
+                }
             }
         }
     }
     else { // no disk mounted in drive TODO what error
-        floppyRecordNotFound = 1;
-        if (verbose) {
+        fd->floppyRecordNotFound = 1;
+        if (m->verbose) {
             // fprintf(stdout,"no disk mounted\n");
         }
 
     }
-    // ensure file is closed
-    if ( filepointer != NULL) {
-        fclose (filepointer);
+
+}
+
+// fast disk
+// called just after the Z80 has read the data register in a read loop simz80 recognises
+// the read is finished as if the Z80 had read the rest of the bytes one at a time
+// and the Z80 side copies them straight into memory
+int floppyFastRead(struct machine *m, unsigned char **data){
+    VFCFLOPPY *fd = m->floppy;
+
+    // only while a read sector, read address or read track still has bytes to come
+    unsigned int command = fd->floppyPreviousCommand & 0xF0;
+    if (!(command == floppyCmdReadSector || command == floppyCmdReadSectorMulti ||
+          command == floppyCmdReadAddress || command == floppyCmdReadTrack) ||
+          fd->floppyInteruptRequest || fd->floppyDelayForByteRequest < 1 ||
+          fd->floppyBufferPosition < 1 || fd->floppyBufferPosition > fd->floppyBufferUsed){
+        return 0;
+    }
+    // the byte in the data register and the rest of the buffer
+    int count = fd->floppyBufferUsed - fd->floppyBufferPosition + 1;
+    *data = &fd->floppyData[fd->floppyBufferPosition - 1];
+    // step through as floppyReadData does
+    while (1){
+        floppyNextSector(m);
+        if (fd->floppyBufferPosition < fd->floppyBufferUsed){
+            fd->floppyBufferPosition++;
+        }
+        else {
+            break;
+        }
     }
+    fd->floppyDataRegister = fd->floppyData[fd->floppyBufferUsed - 1];
+    fd->floppyDataRequest = 0;
+    fd->floppyDelayForByteRequest = 0;
+    // signify end
+    fd->floppyInteruptRequest = 1;
+    return count;
+}
 
+// fast disk
+// called just after the Z80 has written the data register in a write loop simz80 recognises
+// takes all but the last of the bytes still to come, so the write finishes through floppySetData
+// the Z80 side copies them to where the returned pointer says
+unsigned char * floppyFastWrite(struct machine *m, int *count){
+    VFCFLOPPY *fd = m->floppy;
+
+    if ((fd->floppyPreviousCommand & 0xE0) != floppyCmdWriteSector ||
+          fd->floppyInteruptRequest || fd->floppyDelayForByteRequest < 1 ||
+          fd->floppyBufferPosition + 1 >= fd->floppyBufferUsed){
+        return NULL;
+    }
+    unsigned char *data = &fd->floppyData[fd->floppyBufferPosition];
+    *count = fd->floppyBufferUsed - fd->floppyBufferPosition - 1;
+    while (fd->floppyBufferPosition + 1 < fd->floppyBufferUsed){
+        fd->floppyBufferPosition++;
+        floppyNextSector(m);
+    }
+    return data;
 }
 
 // Write a sector to floppyActiveDrive at floppyTrackRegister, floppySectorRegister, floppySide.
-// Saves the correct sector from the buffer area
-static void writeASector(void){
+// The data has already gone into the sector in the mapped image,
+// so this just gets it flushed according to the flush policy of the drive
+static void writeASector(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
 
-    FILE * filepointer=NULL;
     // reset status register
-    floppyInteruptRequest=1;   // set will show if error
-
-    if ((floppyActiveDrive>-1) && (floppyActiveDrive<4)){
-        if (floppyDrives[floppyActiveDrive].fileNamePointer != NULL ){
-            int result=0;
-            // we need to find the track and sector off set in the disk
-            // position the file at the start of the sector
-            long int position = floppyFindOffset(floppyActiveDrive,
-                    floppyTrackRegister,
-                    floppySide,
-                    floppySectorRegister);
+    fd->floppyInteruptRequest=1;   // set will show if error
 
-            if (position < 0 ){
-                // invalid something
-                floppyRecordNotFound=1;
-                fprintf(stdout,"Write Invalid file pos\n");
-            }
-            else {
-
-                filepointer = fopen(floppyDrives[floppyActiveDrive].fileNamePointer,"r+b");
-                if ( filepointer == NULL) {
-                    fprintf(stdout, "write floppy failed to load '%s', ignoring it. \n", floppyDrives[floppyActiveDrive].fileNamePointer);
-                    perror(floppyDrives[floppyActiveDrive].fileNamePointer);
-                    // set to drive not ready
-                    // floppyNotReady=1;
-                    floppyDelayReady=2; // say not ready for 1 call
-                } else {
-                    result=fseek(filepointer, position, SEEK_SET );
-                    if (result !=0 ) {
-                        // say not able to read sector
-                        floppyRecordNotFound=1;
-                        fprintf(stdout,"Seek error settting record not Found\n");
-                        perror(floppyDrives[floppyActiveDrive].fileNamePointer);
-                    }
-                    else {
-                        int writeSize= floppyDrives[floppyActiveDrive].sizeOfSector;
-                        // write all into buffer
-                        if (writeSize > FLOPPYMAXSECTORSIZE) {
-                            writeSize=FLOPPYMAXSECTORSIZE;
-                        }
-                        int numberWritten = fwrite(floppyBuffer,1,writeSize,filepointer);
-                        if ( numberWritten != writeSize){
-                            // may be something else but . . . .
-                            floppyCRCError=1;
-                            floppyRecordNotFound=1;
-                            fprintf(stdout,"write error - Record CRC error Witten [%d] writesize [%d] \n",numberWritten,writeSize);
-                            perror(floppyDrives[floppyActiveDrive].fileNamePointer);
-                        }
-                    }
-                }
-            }
+    if ((fd->floppyActiveDrive>-1) && (fd->floppyActiveDrive<4)){
+        if (fd->floppyDrives[fd->floppyActiveDrive].fileNamePointer != NULL ){
+            floppyWritten(m, fd->floppyDataOffset, fd->floppyBufferUsed);
         }
         else { // no disk mounted in drive TODO what error
-            floppyRecordNotFound = 1;
-            if (verbose){
-                fprintf(stdout,"no disk mounted in drive %d\n",floppyActiveDrive);
+            fd->floppyRecordNotFound = 1;
+            if (m->verbose){
+                fprintf(m->out, "no disk mounted in drive %d\n",fd->floppyActiveDrive);
             }
 
         }
     }
     else { // invalid floppy number
-        floppyRecordNotFound = 1;
-        if (verbose){
-            fprintf(stdout,"Invalid drive no %d\n",floppyActiveDrive);
+        fd->floppyRecordNotFound = 1;
+        if (m->verbose){
+            fprintf(m->out, "Invalid drive no %d\n",fd->floppyActiveDrive);
         }
     }
-    // ensure file is closed
-    if ( filepointer != NULL) {
-        fclose (filepointer);
+
+}
+
+
+// length bytes at offset in the image of the active drive have been written
+// flush them now or leave it to floppyFlushDrives, according to the flush policy of the drive
+static void floppyWritten(struct machine *m, long int offset, long int length){
+    VFCFLOPPY *fd = m->floppy;
+
+    diskimage_written(&fd->floppyDrives[fd->floppyActiveDrive].image, offset, length);
+    if (fd->floppyDrives[fd->floppyActiveDrive].unflushedSince == 0){
+        fd->floppyDrives[fd->floppyActiveDrive].unflushedSince = time(NULL);
+    }
+    if (fd->floppyDrives[fd->floppyActiveDrive].flushPolicy == FLOPPYFLUSH_SECTOR){
+        floppyFlushDrive(m, fd->floppyActiveDrive);
     }
+}
 
+// CRC-CCITT used for the id and data fields, x^16+x^12+x^5+1 starting from FFFF
+static unsigned int floppyCRC(unsigned int crc, unsigned char *data, int length){
+
+    while (length-- > 0){
+        crc ^= *data++ << 8;
+        for (int bit=0; bit<8; bit++){
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc & 0xFFFF;
 }
 
+// add count bytes of value to the raw track in floppyBuffer
+static void trackbytes(struct machine *m, unsigned char value, int count){
+    VFCFLOPPY *fd = m->floppy;
 
+    while (count-- > 0 && fd->floppyBufferUsed < FLOPPYMAXSECTORSIZE){
+        fd->floppyBuffer[fd->floppyBufferUsed++] = value;
+    }
+}
+
+// read track
+// make up the raw double density IBM format track under the head from the sectors in the image
+// and set up the data read process
+static void readTrack(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
+    FLOPPYDRIVEINFO *drive = &fd->floppyDrives[fd->floppyActiveDrive];
+
+    fd->floppyInteruptRequest=1;   // set will show if error
+
+    FLOPPYTRACKCACHE *entry = NULL;
+    if ((fd->floppyActiveDrive>-1) && (fd->floppyActiveDrive<4) && drive->fileNamePointer != NULL){
+        entry = floppyFindTrack(m, drive->track, fd->floppySide);
+    }
+    if (entry == NULL){
+        fd->floppyRecordNotFound = 1;
+        return;
+    }
+
+    int size = drive->sizeOfSector;
+    int sectors = drive->numberOfSectors;
+    // spread what is left of the track over the gaps between the sectors
+    int gap3 = (FLOPPYRAWTRACKSIZE - 146 - sectors * (62 + size)) / (sectors > 0 ? sectors : 1);
+    if (gap3 < 1){
+        gap3 = 1;
+    }
+
+    fd->floppyBufferUsed=0;
+    // index
+    trackbytes(m, 0x4E, 80);
+    trackbytes(m, 0x00, 12);
+    trackbytes(m, 0xC2, 3);
+    trackbytes(m, 0xFC, 1);
+    trackbytes(m, 0x4E, 50);
+    for (int sector = drive->firstSectorNumber; sector < (int)(drive->firstSectorNumber + sectors); sector++){
+        long int sectorstart = (long int)size * sector;
+        if (sectorstart + size > entry->length || fd->floppyBufferUsed + 62 + size + gap3 > FLOPPYMAXSECTORSIZE){
+            break;
+        }
+        unsigned int crc;
+        // id field
+        trackbytes(m, 0x00, 12);
+        trackbytes(m, 0xA1, 3);
+        unsigned char *field = &fd->floppyBuffer[fd->floppyBufferUsed];
+        trackbytes(m, 0xFE, 1);
+        trackbytes(m, drive->track, 1);
+        trackbytes(m, fd->floppySide, 1);
+        trackbytes(m, sector, 1);
+        trackbytes(m, getsectorsizeLSBvalue(m, 0, size), 1);
+        crc = floppyCRC(floppyCRC(0xFFFF, field - 3, 3), field, 5);
+        trackbytes(m, crc >> 8, 1);
+        trackbytes(m, crc & 0xFF, 1);
+        trackbytes(m, 0x4E, 22);
+        // data field
+        trackbytes(m, 0x00, 12);
+        trackbytes(m, 0xA1, 3);
+        field = &fd->floppyBuffer[fd->floppyBufferUsed];
+        trackbytes(m, 0xFB, 1);
+        memcpy(&fd->floppyBuffer[fd->floppyBufferUsed], entry->data + sectorstart, size);
+        fd->floppyBufferUsed += size;
+        crc = floppyCRC(floppyCRC(0xFFFF, field - 3, 3), field, size + 1);
+        trackbytes(m, crc >> 8, 1);
+        trackbytes(m, crc & 0xFF, 1);
+        trackbytes(m, 0x4E, gap3);
+    }
+    // up to the next index
+    trackbytes(m, 0x4E, FLOPPYRAWTRACKSIZE - (int)fd->floppyBufferUsed);
+
+    LOG(m, LOG_FLOPPY, LOG_DEBUG, "Read track %d side %d, %d bytes\n",drive->track,fd->floppySide,fd->floppyBufferUsed);
+    // the rest of the process is handled by the readdata register routine
+    fd->floppyData = fd->floppyBuffer;
+    fd->floppyBufferPosition=0;
+    fd->floppyDataRegister = fd->floppyData[fd->floppyBufferPosition++];
+    fd->floppyDelayForByteRequest = floppyDelayByteRequestBy; // set to delay the setting of the request data flag
+    fd->floppyInteruptRequest=0;   // clear if all worked okay
+}
 
-static void showFloppySector(){
 
-    printf( "floppy drive %d Position:- Track %02X Head %02X Sector %02X\n",
-             floppyActiveDrive,
-	         floppyTrackRegister,
-	         floppySide,
-	         floppySectorRegister );
-    if ((floppyActiveDrive>-1) && (floppyActiveDrive<4)) {
-        printf( "floppy drive %d Actual:- Track %02X\n",
-                 floppyActiveDrive,
-                 floppyDrives[floppyActiveDrive].track);
+static void showFloppySector(struct machine *m){
+    VFCFLOPPY *fd = m->floppy;
+
+    log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "floppy drive %d Position:- Track %02X Head %02X Sector %02X\n",
+             fd->floppyActiveDrive,
+	         fd->floppyTrackRegister,
+	         fd->floppySide,
+	         fd->floppySectorRegister );
+    if ((fd->floppyActiveDrive>-1) && (fd->floppyActiveDrive<4)) {
+        log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "floppy drive %d Actual:- Track %02X\n",
+                 fd->floppyActiveDrive,
+                 fd->floppyDrives[fd->floppyActiveDrive].track);
     }
-    displayBuffer( floppyBuffer, floppyBufferUsed );
+    displayBuffer( m, fd->floppyData, fd->floppyBufferUsed );
 }
 
-static void displayBuffer(unsigned char buffer[], int length ){
+// each line is built up then logged in one go
+static void displayBuffer(struct machine *m, unsigned char buffer[], int length ){
     int addr = 0; // could use this to show offset into disk image..
+    char line[160];
     for (int i = 0; i<length/32; i++) {
-        fprintf(stdout,"%08x: ", addr+i*32);
+        int used = sprintf(line,"%08x: ", addr+i*32);
         for (int j = 0; j<32; j++) {
             if (j%8 == 0) {
-                fprintf(stdout," ");
+                line[used++] = ' ';
             }
-            fprintf(stdout,"%02x ",buffer[i*32+j]);
+            used += sprintf(&line[used],"%02x ",buffer[i*32+j]);
         }
-        fprintf(stdout," ");
+        line[used++] = ' ';
         for (int j = 0; j<32; j++) {
             if (j%8 == 0) {
-                fprintf(stdout," ");
+                line[used++] = ' ';
             }
             if ((buffer[i*32+j] < 0x7f) && (buffer[i*32+j] > 0x1f)) {
-                fprintf(stdout,"%c", buffer[i*32+j]);
+                line[used++] = buffer[i*32+j];
             }
             else {
-                fprintf(stdout,".");
+                line[used++] = '.';
             }
         }
-        fprintf(stdout,"\n");
+        line[used] = 0;
+        log_message(m->out, LOG_FLOPPY, LOG_DEBUG, "%s\n", line);
     }
 }
 
 // we need to calculate offset into image file
 // using data store floppyDrives[]
-static long int floppyFindOffset(int DriveNumber,int Track, int discSide, int Sector){
+static long int floppyFindOffset(struct machine *m, int DriveNumber,int Track, int discSide, int Sector){
+    VFCFLOPPY *fd = m->floppy;
 
     long int position = -1;
 
@@ -1923,43 +2391,43 @@ static long int floppyFindOffset(int DriveNumber,int Track, int discSide, int Se
 
     if ((DriveNumber < 0) && (DriveNumber >= NUMBEROFDRIVES)){
         // invalid drive specified
-        printf("invalid drive no %d\n",DriveNumber);
+        LOG(m, LOG_FLOPPY, LOG_ERROR, "invalid drive no %d\n",DriveNumber);
     }
     else {
         
         // calculate the size of each track per side
-        sizeOfTracks=floppyDrives[DriveNumber].sizeOfSector * floppyDrives[DriveNumber].numberOfSectors;
-        if (floppyDrives[DriveNumber].sidesswapped == 1){
+        sizeOfTracks=fd->floppyDrives[DriveNumber].sizeOfSector * fd->floppyDrives[DriveNumber].numberOfSectors;
+        if (fd->floppyDrives[DriveNumber].sidesswapped == 1){
             // sides are swapped 0 becomes 1 and 1 becomes 0
             realdiscside = ( discSide + 1 ) & 0x01;
-            printf("Real disc side %d",realdiscside);
+            LOG(m, LOG_FLOPPY, LOG_DEBUG, "Real disc side %d",realdiscside);
         }
         // handle reverse sides
         if (realdiscside==0){
-            if (floppyDrives[DriveNumber].reverseside0==1){
+            if (fd->floppyDrives[DriveNumber].reverseside0==1){
                 // switch tracks
-                realtrackno= floppyDrives[DriveNumber].numberOfTracks - Track;
-                printf("RS0: Real track from %d to  %d",Track,realdiscside);
+                realtrackno= fd->floppyDrives[DriveNumber].numberOfTracks - Track;
+                LOG(m, LOG_FLOPPY, LOG_DEBUG, "RS0: Real track from %d to  %d",Track,realdiscside);
             }
         }
         if (realdiscside==1){
-            if (floppyDrives[DriveNumber].reverseside1==1){
+            if (fd->floppyDrives[DriveNumber].reverseside1==1){
                 // switch tracks
-                realtrackno= floppyDrives[DriveNumber].numberOfTracks - Track;
-                printf("RS1: Real track from %d to  %d",Track,realdiscside);
+                realtrackno= fd->floppyDrives[DriveNumber].numberOfTracks - Track;
+                LOG(m, LOG_FLOPPY, LOG_DEBUG, "RS1: Real track from %d to  %d",Track,realdiscside);
             }
         }
 
         // check in interleaved
-        if (floppyDrives[DriveNumber].interleaved == 1){
+        if (fd->floppyDrives[DriveNumber].interleaved == 1){
 
             // calculate where the current track side 0 starts in the file
             // track interleaved means skip 2 tracks for each "track"
-            startTrack=sizeOfTracks * (realtrackno * floppyDrives[DriveNumber].numberOfHeads);
+            startTrack=sizeOfTracks * (realtrackno * fd->floppyDrives[DriveNumber].numberOfHeads);
             // calculate if we need to skip side 0 
             startTrack += (sizeOfTracks * discSide);
             // calculate where the sector starts in that track
-            startSector = floppyDrives[DriveNumber].sizeOfSector * floppySectorRegister;
+            startSector = fd->floppyDrives[DriveNumber].sizeOfSector * Sector;
             // sort out the file position for that sector
             position = startTrack + startSector;
         }
@@ -1969,26 +2437,24 @@ static long int floppyFindOffset(int DriveNumber,int Track, int discSide, int Se
             // track Sequential means just * 1 for each "track"
             startTrack=sizeOfTracks * realtrackno;
             // calculate if we need to skip side 0
-            startTrack += (sizeOfTracks * floppyDrives[DriveNumber].numberOfTracks * discSide);
+            startTrack += (sizeOfTracks * fd->floppyDrives[DriveNumber].numberOfTracks * discSide);
             // calculate where the sector starts in that track
-            startSector = floppyDrives[DriveNumber].sizeOfSector * floppySectorRegister;
+            startSector = fd->floppyDrives[DriveNumber].sizeOfSector * Sector;
             // sort out the file position for that sector
             position = startTrack + startSector;
         }
         // check if gone for head 1 when only 1 head - after head swop ??????
-        if (realdiscside > floppyDrives[DriveNumber].numberOfHeads ){
-            printf("invalid head number %d drive no %d\n",realdiscside,DriveNumber);
+        if (realdiscside > fd->floppyDrives[DriveNumber].numberOfHeads ){
+            LOG(m, LOG_FLOPPY, LOG_ERROR, "invalid head number %d drive no %d\n",realdiscside,DriveNumber);
             position=-1;
         }
-        if (vfcfloppydebug){
-            //fprintf(stdout,"Record position %ld + %ld = %ld\n",startTrack, startSector,(startTrack + startSector) );
-            fprintf(stdout,"Record position for Track %d Head %d Sector %d is %ld\n",Track, discSide,Sector, position );
-        }
+        //fprintf(stdout,"Record position %ld + %ld = %ld\n",startTrack, startSector,(startTrack + startSector) );
+        LOG(m, LOG_FLOPPY, LOG_DEBUG, "Record position for Track %d Head %d Sector %d is %ld\n",Track, discSide,Sector, position );
     }
     return position;
 }
 
-int getsectorsizeLSBvalue(int sectorLengthFlag, unsigned int sectorsize){
+int getsectorsizeLSBvalue(struct machine *m, int sectorLengthFlag, unsigned int sectorsize){
 
     // the length seems to be related to the bit in the command
     // only on reads and write sectors - incorrect here !!!!!
@@ -2037,14 +2503,66 @@ int getsectorsizeLSBvalue(int sectorLengthFlag, unsigned int sectorsize){
                 
         }
     }
-    if (vfcfloppydebug){
-        printf("ReadAddress Length flag %2.2X, resulted in sector length field %2.2X \n",sectorLengthFlag ,lengthLSBvalue);
-    }
+    LOG(m, LOG_FLOPPY, LOG_DEBUG, "ReadAddress Length flag %2.2X, resulted in sector length field %2.2X \n",sectorLengthFlag ,lengthLSBvalue);
     return lengthLSBvalue;
 }
 
 
 
+// save or restore the controller registers and where the heads are
+// a command part way through is ended as if by a force interrupt
+void floppySnapshot(struct machine *m, SNAPSHOT *s){
+    VFCFLOPPY *fd = m->floppy;
+
+    int state[21 + NUMBEROFDRIVES] = {
+        fd->floppyInteruptRequest, fd->floppyDelayReady, fd->floppyDataRequest, fd->floppyDelayForByteRequest,
+        fd->floppyDataLost, fd->floppyBusy, fd->SetBusyForTime, fd->floppyHeadLoaded, fd->floppyCRCError,
+        fd->floppySeekError, fd->floppyRecordNotFound, fd->floppyWriteFailWriteProtected,
+        fd->floppyTrackRegister, fd->floppySectorRegister, fd->floppyDataRegister, fd->floppySide,
+        fd->floppyActiveDrive, fd->floppyStepDirection, fd->floppyPreviousCommand, fd->floppyCurrentCommand,
+        fd->readaddresssector };
+
+    for (int drive = 0; drive < NUMBEROFDRIVES; drive++){
+        state[21 + drive] = fd->floppyDrives[drive].track;
+    }
+    snapshot_data(s, "floppy", state, sizeof(state));
+    if (s->restoring && !s->error){
+        fd->floppyInteruptRequest = state[0];
+        fd->floppyDelayReady = state[1];
+        fd->floppyDataRequest = state[2];
+        fd->floppyDelayForByteRequest = state[3];
+        fd->floppyDataLost = state[4];
+        fd->floppyBusy = state[5];
+        fd->SetBusyForTime = state[6];
+        fd->floppyHeadLoaded = state[7];
+        fd->floppyCRCError = state[8];
+        fd->floppySeekError = state[9];
+        fd->floppyRecordNotFound = state[10];
+        fd->floppyWriteFailWriteProtected = state[11];
+        fd->floppyTrackRegister = state[12];
+        fd->floppySectorRegister = state[13];
+        fd->floppyDataRegister = state[14];
+        fd->floppySide = state[15];
+        fd->floppyActiveDrive = state[16];
+        fd->floppyStepDirection = state[17];
+        fd->floppyPreviousCommand = state[18];
+        fd->floppyCurrentCommand = state[19];
+        fd->readaddresssector = state[20];
+        for (int drive = 0; drive < NUMBEROFDRIVES; drive++){
+            fd->floppyDrives[drive].track = state[21 + drive];
+        }
+        if (fd->floppyBusy || fd->floppyDataRequest){
+            fd->floppyBusy = 0;
+            fd->floppyDataRequest = 0;
+            fd->floppyInteruptRequest = 1;
+        }
+        fd->floppyMultiSector = 0;
+        fd->floppyData = fd->floppyBuffer;
+        fd->floppyBufferPosition = 0;
+        fd->floppyBufferUsed = 0;
+    }
+}
+
 // end of code
 
 
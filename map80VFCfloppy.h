@@ -72,11 +72,22 @@
 #ifndef FLOPPY_DEFINED_H
 #define FLOPPY_DEFINED_H
 
+#include <time.h>
+
+#include "diskimage.h"
+
 // number of drives we will have
 #define NUMBEROFDRIVES 4
+// number of tracks remembered in each drive's track cache
+#define FLOPPYTRACKCACHESIZE 16
 // maximum sector size
 //#define FLOPPYMAXSECTORSIZE 1024
 #define FLOPPYMAXSECTORSIZE 1024*8
+// largest track write track can format - all the sectors of one side of one track
+#define FLOPPYMAXTRACKSIZE (1024*32)
+// bytes on one raw track, 250K bits per second double density at 300 rpm
+// used to lay out the track read track returns
+#define FLOPPYRAWTRACKSIZE 6250
 
 // commands to the WD2797 controller
 // the first 4 bits give the command
@@ -161,6 +172,22 @@
 // CPM boot process needs it to be set to 2 or above else it won't boot.
 #define floppyDelayResetBusy (2)
 
+// when sectors written to an image file are flushed out to the host disk
+// set per drive with the flush keyword in the drive config file
+#define FLOPPYFLUSH_SECTOR (0)      // after every sector written
+#define FLOPPYFLUSH_TIMER  (1)      // FLOPPYFLUSHSECONDS after the first unflushed write
+#define FLOPPYFLUSH_EXIT   (2)      // only when the disk is changed or the emulator stops
+
+
+// where a track is in the mapped image - one entry of a drive's track cache
+typedef struct {
+    unsigned char * data;           // start of the track in the mapped image - NULL if entry not used
+    long int offset;                // offset of the start of the track in the image
+    long int length;                // bytes of the track in the image
+    int track;                      // physical track
+    int side;                       // and side
+    unsigned long lastUsed;         // for least recently used replacement
+} FLOPPYTRACKCACHE;
 
 // define a structure to hold the details,of each of the drives
 typedef struct {
@@ -180,20 +207,39 @@ typedef struct {
                                      // sectors are not needed as logical not head movement
     char * fileNamePointer;			// pointer to the name of the file supporting the disc
     // TODO - when floppy changed - release name space
+    DISKIMAGE image;                 // image file - mapped while the disc is mounted
+    char * overlayNamePointer;       // overlay file taking the writes - NULL to write to the image file
+    int overlayExit;                 // OVERLAY_KEEP, OVERLAY_DISCARD or OVERLAY_COMMIT when the disc is closed
+    unsigned int flushPolicy;        // FLOPPYFLUSH_SECTOR, FLOPPYFLUSH_TIMER or FLOPPYFLUSH_EXIT
+    time_t unflushedSince;           // time of the first write not yet flushed - 0 if none
+    FLOPPYTRACKCACHE trackCache[FLOPPYTRACKCACHESIZE];  // tracks found in the image most recently
+    unsigned long trackCacheClock;   // counts track lookups for lastUsed
+    unsigned long trackCacheHits;    // track lookups found in the cache
+    unsigned long trackCacheMisses;  // and those that had to work out where the track is
 } FLOPPYDRIVEINFO;
 
 
-// defined the externall visible functions - note extern not strictly necessary for functions.
-extern void displayfloppydetails();
-extern void resetalldrives();
-extern int floppyMountDisk(unsigned int drive,char * filename); // call to mount a floppy disk image
+struct machine;
 
-// global variables to allow for debug etc.,
-extern int vfcfloppydebug;
-extern int vfcfloppydisplaysectors;
+// give the machine its floppy controller, and take it away again
+extern void floppyCreate(struct machine *m);
+extern void floppyFree(struct machine *m);
 
-void outPortFloppy(unsigned int port, unsigned int value);
-int inPortFloppy(unsigned int port);
+// defined the externall visible functions - note extern not strictly necessary for functions.
+extern void displayfloppydetails(struct machine *m);
+extern void resetalldrives(struct machine *m);
+extern int floppyMountDisk(struct machine *m, unsigned int drive,char * filename); // call to mount a floppy disk image
+extern void floppyFlushDrives(struct machine *m, int force);    // flush written sectors - all of them if force else by flush policy
+extern void floppyCloseDrives(struct machine *m);             // flush and close all the image files
+
+// fast disk - called by simz80 from a recognised sector read or write loop
+// the bytes of a read still to come - returns how many and points *data at them, 0 if none
+extern int floppyFastRead(struct machine *m, unsigned char **data);
+// where the bytes of a write go, all but the last still to come - *count of them, NULL if none
+extern unsigned char * floppyFastWrite(struct machine *m, int *count);
+
+void outPortFloppy(struct machine *m, unsigned int port, unsigned int value);
+int inPortFloppy(struct machine *m, unsigned int port);
 
 
 #endif
@@ -60,6 +60,9 @@
 #include <SDL2/SDL.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 
 #include "options.h"  //defines the options to usemap80RamIntialise
 #include "simz80.h"
@@ -68,6 +71,7 @@
 #include "display.h"
 #include "map80VFCfloppy.h"
 #include "nascom4SD.h"
+#include "log.h"
 #include "map80VFCdisplay.h"
 #include "sdlevents.h"
 #include "nasutils.h"   // define load program for .nas files
@@ -75,55 +79,22 @@
 #include "cpmswitch.h"
 #include "statusdisplay.h"
 #include "chsclockcard.h"
+#include "interrupts.h"
+#include "ports.h"
 #include "serial.h"
 #include "utilities.h"
+#include "snapshot.h"
 
 /*
  *  global variables
  *
+ *  what a run sets and changes is in struct machine - see simz80.h
+ *  there is only the one set of windows, so what they show is here
  */
 
-int vfcboot=0;   // set to 1 if cpm mode set
-                 // vfc boot rom in at 0 to start
-                 // Nascom ROM and VWRAM not enabled
 int shownascomscreen=0; // set to 1 to show nascom screen
 int showVFCscreen=0; // set to 1 to display VFC Screen
 
-bool go_fast = false;
-int t_sim_delay = SLOW_DELAY;
-
-/* NMI controls */
-int singleStep;		// set to 4 to execute some instructions before triggering NMI
-int NMI_flag;		// set to 1 to trigger NMI
-
-/* Z80 registers */
-
-WORD af[2];                     /* accumulator and flags (2 banks) */
-int af_sel;                     /* bank select for af */
-
-struct ddregs regs[2];          /* bc,de,hl */
-int regs_sel;                   /* bank select for ddregs */
-
-WORD ir;                        /* other Z80 registers */
-WORD ix;
-WORD iy;
-WORD sp;
-WORD pc;
-WORD IFF;
-
-
-//BYTE ram[RAMSIZE*1024];
-
-
-int verbose=0;          // set to true to display messages
-int traceon=0;          // set to 1 to turn trace z80 on
-                        // set by f2
-int tracestartaddress=0;    // trace will only show results when the PC is within this range
-int traceendaddress=0xFFFF; //  end address of the trace range
-
-
-int usebiosmonitor=0;   // set to 1 to make use of the bios moitor
-
 int scaledisplays=2;    // default scale display 
 /*
  *
@@ -136,27 +107,88 @@ int scaledisplays=2;    // default scale display
  * define internal functions
  */
 
-static void save_nascom(int start, int end, const char *name);
+static void save_nascom(struct machine *m, int start, int end, const char *name);
+static void print_screens(struct machine *m);
+static void pace_to_clockrate(struct machine *m);
+static void idle_wait(struct machine *m);
+static void portsInitialise(struct machine *m);
+static void videoramwritetrap(struct machine *m, unsigned int a, int length);
 // static void reportdisplaymodes(void);
-static int setdisassemblerrange(char * valuerange);
+static int setdisassemblerrange(struct machine *m, char * valuerange);
 
-int sim_delay(void)
+// a machine with the settings in options.h, no ports connected, and the cards as at power on
+struct machine *machine_new(void){
+
+    struct machine *m = calloc(1, sizeof(struct machine));
+    if (m == NULL){
+        fprintf(stderr, "Out of memory for the machine\n");
+        exit(1);
+    }
+    m->out = stdout;
+    m->err = stderr;
+    m->in = stdin;
+    m->memorydumpfile = "nasmemorydump.nas";
+    m->t_sim_delay = SLOW_DELAY;
+    m->clockrate = DEFAULT_CLOCKRATE;
+    m->traceendaddress = 0xFFFF;
+    m->eventnext = UINT64_MAX;
+    m->floppyfastdisk = FLOPPYFASTDISK;
+    m->vfcfloppydisplaysectors = VFCFLOPPYDISPLAYSECTORS;
+    m->sdfastsd = SDFASTSD;
+    log_defaults(m);
+    port_clear(m);
+
+    map80RamCreate(m);
+    map80VFCDisplayCreate(m);
+    floppyCreate(m);
+    SDCreate(m);
+    chsclockcardCreate(m);
+    keyboardCreate(m);
+    serialCreate(m);
+    return m;
+}
+
+void machine_free(struct machine *m){
+
+    serialFree(m);
+    keyboardFree(m);
+    chsclockcardFree(m);
+    SDFree(m);
+    floppyFree(m);
+    map80VFCDisplayFree(m);
+    map80RamFree(m);
+    free(m);
+}
+
+int sim_delay(struct machine *m)
 {
     sim_action_t localaction = CONT;
 
     // update the status display
-    status_display_refresh();
+    if (!m->headless){
+        status_display_refresh(m);
+    }
     if (shownascomscreen!=0){
         // update the nascom display
         nascom_display_refresh();
     }
     if (showVFCscreen!=0){
         // update the vfc display
-        map80vfc_display_refresh();
+        map80vfc_display_refresh(m);
     }
     
-    if (!go_fast){
-        SDL_Delay(50);
+    if (!m->go_fast){
+        pace_to_clockrate(m);
+    }
+    else{
+        // start pacing again from now when we slow down
+        m->pacingstarted = 0;
+    }
+
+    // the Z80 is halted or polling for input that has not come
+    if (m->z80idle){
+        m->z80idle = 0;
+        idle_wait(m);
     }
     
     //need some way to say stop from terminal ??
@@ -172,7 +204,25 @@ int sim_delay(void)
     // called to just check for control keys
     // TODO maybe need to have 2 keytables
     // 1 to set and to copy to another one on keyboard reset
-    ui_serve_input();
+    // headless has no SDL events - keys are typed in on the port 0 keyboard reset
+    if (!m->headless){
+        ui_serve_input(m);
+    }
+
+    // write out floppy sectors held back by the timer flush policy
+    floppyFlushDrives(m, 0);
+
+    // pick up serial input file changes and write out held back serial output
+    checkserialfiles(m);
+
+    // stop once the time limit is up
+    if (m->timelimit > 0 && time(NULL) - m->runstarttime >= m->timelimit){
+        if (m->verbose){
+            fprintf(m->out, "Time limit of %d seconds reached\n",m->timelimit);
+        }
+        m->timelimitreached = 1;
+        m->action = DONE;
+    }
 
     // action will be set by the keyboard routines to
     // DONE to close
@@ -180,15 +230,105 @@ int sim_delay(void)
     // fix DA - when action processed by z80sim program action is never reset
     // so it keeps resetting ?
     // return current value and reset global variable
-    localaction = action;
-    action=CONT;
+    localaction = m->action;
+    m->action=CONT;
     return localaction;
 
 }
 
+// hold the emulation back so the T-states run match the clock rate
+// compares against the host's monotonic performance counter
+
+static void pace_to_clockrate(struct machine *m){
+
+    Uint64 hostnow = SDL_GetPerformanceCounter();
+    Uint64 hostfrequency = SDL_GetPerformanceFrequency();
+
+    if (!m->pacingstarted){
+        m->pacingstarthost = hostnow;
+        m->pacingstarttstates = m->tstates;
+        m->pacingstarted = 1;
+        return;
+    }
+
+    // host counts the T-states since the start should have taken
+    double due = (double)(m->tstates - m->pacingstarttstates) * hostfrequency / (m->clockrate * 1000000.0);
+    double elapsed = (double)(hostnow - m->pacingstarthost);
+
+    if (due > elapsed){
+        // running ahead so wait
+        SDL_Delay((Uint32)((due - elapsed) * 1000 / hostfrequency));
+    }
+    else if ((elapsed - due) * 1000 / hostfrequency > CLOCKRATE_MAXLAG){
+        // too far behind ( host busy or in the bios monitor ) so start again from here
+        m->pacingstarthost = hostnow;
+        m->pacingstarttstates = m->tstates;
+    }
+}
+
+// let the host sleep while the Z80 is idle, until there may be something for it
+// the headless keyboard has to be scanned to type the keys, so no sleep until they are done
+
+static void idle_wait(struct machine *m){
+
+    if (m->headless){
+        if (keyboardinputwaiting(m)){
+            return;
+        }
+        SDL_Delay(IDLESLEEPMS);
+    }
+    else {
+        // back as soon as a key is pressed
+        SDL_WaitEventTimeout(NULL, IDLESLEEPMS);
+    }
+    // the Z80 was not running while the host slept, so do not catch up
+    m->pacingstarted = 0;
+}
+
+// writes to the screen ram pages come here so the displays
+// only have to redraw the lines that have changed
+
+static void videoramwritetrap(struct machine *m, unsigned int a, int length){
+
+    BYTE *host = m->rampagetable[RAMPAGEINDEX(a)].host;
+
+    if (host == &m->ram->NascomMonVWram[0x800]){
+        nascom_display_written(a & RAMPAGEMASK, length);
+    }
+    else if (host == &m->ram->vfcdisplayram[0]){
+        map80vfc_display_written(a & RAMPAGEMASK, length);
+    }
+}
+
+// with no windows print what is on the screens when the emulator stops
+
+static void print_screens(struct machine *m){
+
+    if (m->cpmswitchstate==0){
+        // nascom screen - the last line in memory is the top line on the screen
+        for (int line=0; line<NASCOM_DISPLAYLINES; line++){
+            BYTE *linestart = &m->ram->NascomMonVWram[0x800 + (((line + NASCOM_DISPLAYLINES - 1) % NASCOM_DISPLAYLINES) * 64) + 0x0A];
+            for (int c=0; c<NASCOM_DISPLAYCHARACTERS; c++){
+                fputc(isprint(linestart[c]) ? linestart[c] : ' ', m->out);
+            }
+            fputc('\n', m->out);
+        }
+    }
+    else {
+        // vfc screen
+        for (int line=0; line<MAP80VFCDISPLAYLINES; line++){
+            BYTE *linestart = &m->ram->vfcdisplayram[line * MAP80VFCDISPLAYCHARACTERS];
+            for (int c=0; c<MAP80VFCDISPLAYCHARACTERS; c++){
+                fputc(isprint(linestart[c]) ? linestart[c] : ' ', m->out);
+            }
+            fputc('\n', m->out);
+        }
+    }
+}
+
 // decode the range supplied from:to 
 
-static int setdisassemblerrange(char * valuerange){
+static int setdisassemblerrange(struct machine *m, char * valuerange){
 
     // printf("l option %s\n",valuerange);
     int retval = 0;
@@ -201,31 +341,31 @@ static int setdisassemblerrange(char * valuerange){
         // calculate start value 
         // need to pass address of pointer (&) as we are left at the next character
         
-        tracestartaddress = hextoint(&currentposition);
+        m->tracestartaddress = hextoint(&currentposition);
     }
     if ( *currentposition==':' ){
         // we have an end value 
         currentposition++;
         if ( *currentposition!=0 ){
             // need to pass address of pointer (&) as we are left at the next character
-            traceendaddress = hextoint(&currentposition);
+            m->traceendaddress = hextoint(&currentposition);
         }
     }
     if ( *currentposition!=0 ){
-        printf("unexpect values in option %s\n",currentposition);
+        fprintf(m->out, "unexpect values in option %s\n",currentposition);
         retval=1;
     }
 
-    printf("Tracing only between address %4.4X and %4.4X (hex) \n",tracestartaddress,traceendaddress);
+    fprintf(m->out, "Tracing only between address %4.4X and %4.4X (hex) \n",m->tracestartaddress,m->traceendaddress);
 
     return retval;
 }
 
 
 
-static void usage(char * progname)
+static void usage(struct machine *m, char * progname)
 {
-    fprintf(stderr,
+    fprintf(m->err,
  "This is MAP80 Nascom.  Usage: %s {flags} files\n"
  "        {flags}\n"
  "           -i <file>        take serial port input from file (if tape led is on)\n"
@@ -233,19 +373,37 @@ static void usage(char * progname)
  "           -m <file>        use <file> as monitor (default is nassys3.nal)\n"
  "           -b               boot in cpm mode\n"
  "           -f <configfile>  load floppy drive - repeat for up to 4 drives\n"
+ "           -c <image>[,<overlay>[,keep|discard|commit]]\n"
+ "                            mount an SDcard image, with writes going to an overlay file\n"
  "           -s factor        change the window sizes - default factor is 2\n"
+ "           -r MHz           Z80 clock rate, e.g. 2, 4 or 6 - 0 runs flat out - default is 4\n"
  "           -t               output a trace of the Z80 opcodes executed ( also F2 )\n"
  "           -l  start:end    limits the trace process to with an address range\n"
  "           -v               be verbose\n"
  "           -x               use bios monitor when starting and stopped\n"
+ "           --headless       run without any windows, flat out unless -r is given\n"
+ "           -k <file>        type the keyboard input from file ( - for stdin )\n"
+ "           -e seconds       stop the emulator after this many seconds, exit status 3\n"
+ "           --fastdisk       copy each floppy sector in one go in the boot rom and bios loops\n"
+ "           --fastsd         move each SDcard block in one go, with multi block reads and writes\n"
+ "           --log category[=level],...\n"
+ "                            device messages to show - sd, floppy, clock, rampage or all\n"
+ "                            at off, error, warn, info or debug - default debug\n"
+ "           --snapshot file  save the whole machine to file when the emulator stops\n"
+ "           --restore file   carry on from a snapshot instead of starting afresh\n"
  "       files                a list of nas files to load\n"
  
             ,progname);
-    exit (1);
 }
 
+// make sure everything written to the disc images and serial output is on the host disk
+static void closedevices(struct machine *m){
+    floppyCloseDrives(m);
+    SDUnmountDisk(m);
+    closeserialfiles(m);
+}
 
-int main(int argc, char **argv){
+int nascom_setup(struct machine *m, int argc, char **argv){
 
     int c;
 
@@ -260,7 +418,22 @@ int main(int argc, char **argv){
     char *sdcard = NULL;
     int SDCardPresent = 0;
 
-    char firstcommand[]="E0";  // used as the first command if not using biosmonitor 
+    char *restorefile = NULL;   // start from this snapshot
+
+    strcpy(m->firstcommand, "E0");  // used as the first command if not using biosmonitor 
+
+    int clockrateset=0;  // set to 1 if -r used
+
+    // options with no single letter version
+    static struct option longoptions[] = {
+        {"headless", no_argument, NULL, 'H'},
+        {"fastdisk", no_argument, NULL, 'D'},
+        {"fastsd", no_argument, NULL, 'F'},
+        {"log", required_argument, NULL, 'L'},
+        {"snapshot", required_argument, NULL, 'S'},
+        {"restore", required_argument, NULL, 'R'},
+        {NULL, 0, NULL, 0}
+    };
 
 // fix DA moved roms to the roms folder
     monitor = "roms/nassys3.nas";
@@ -272,37 +445,77 @@ int main(int argc, char **argv){
     //printf("display modes\n");
     //reportdisplaymodes();
     // it returns ? if invalid option having reported invalid option
-    while ((c = getopt(argc, argv, "c:f:i:m:o:s:vbtxl:")) != EOF)
+    while ((c = getopt_long(argc, argv, "c:e:f:i:k:m:o:r:s:vbtxl:", longoptions, NULL)) != EOF)
         switch (c) {
+        case 'H':
+            m->headless=1;
+            break;
+        case 'D':
+            m->floppyfastdisk=1;
+            break;
+        case 'F':
+            m->sdfastsd=1;
+            break;
+        case 'L':
+            if (log_option(m, optarg) != 0){
+                usage(m, progname);
+                return 1;
+            }
+            break;
+        case 'S':
+            m->snapshotfile=optarg;
+            break;
+        case 'R':
+            restorefile=optarg;
+            break;
+        case 'k':
+            // keyboard input file
+            if (setkeyboardinputfile(m, optarg)){
+                return 1;
+            }
+            break;
+        case 'e':{
+            // time limit
+            int limitvalue=0;
+            sscanf(optarg, "%d", &limitvalue);
+            if (limitvalue > 0){
+                m->timelimit=limitvalue;
+            }
+            else{
+                fprintf(m->out, "Time limit of %d seconds is not valid\n",limitvalue);
+            }
+            break;
+            }
         case 'l':
-            if (setdisassemblerrange(optarg)==1){
+            if (setdisassemblerrange(m, optarg)==1){
                 // problem with the limit range values
-                printf("Invalid -l options \n");
-                exit (1);
+                fprintf(m->out, "Invalid -l options \n");
+                return 1;
             }
             break;    
         case 'i':
-            setserialinputfile(optarg);
+            setserialinputfile(m, optarg);
             break;
         case 'o':
             // serial output file - appends to it 
-            setserialoutfilename(optarg);
+            setserialoutfilename(m, optarg);
             break;
         case 'b':
-            vfcboot=1;
+            m->vfcboot=1;
             break;
         case 't':
-            traceon=1;
+            m->traceon=1;
+            m->simevents |= SIMEVENT_TRACE;
             break;
         case 'm':
             monitor = optarg;
             break;
         case 'v':
-            verbose = 1;
+            m->verbose = 1;
             break;
         case 'f':
             if (numberofFloppies>4){
-                printf("only 4 floppies can be mounted\n");
+                fprintf(m->out, "only 4 floppies can be mounted\n");
             }
             else{
                 numberofFloppies++;
@@ -311,7 +524,7 @@ int main(int argc, char **argv){
             break;
         case 'c':
             if (SDCardPresent){
-                printf("only 1 SDcard can be mounted\n");
+                fprintf(m->out, "only 1 SDcard can be mounted\n");
             }
             else{
                 SDCardPresent = 1;
@@ -319,11 +532,29 @@ int main(int argc, char **argv){
             }
             break;
         case '?':
-            usage(progname);
-            break;
+            usage(m, progname);
+            return 1;
         case 'x':
-            usebiosmonitor=1;
+            m->usebiosmonitor=1;
             break;
+        case 'r':{
+            // clock rate to pace the Z80 at
+            int ratevalue=-1;
+            sscanf(optarg, "%d", &ratevalue);
+            clockrateset=1;
+            if (ratevalue == 0){
+                // unthrottled - same as F5, which can still switch back to the default rate
+                m->go_fast = true;
+                m->t_sim_delay = FAST_DELAY;
+            }
+            else if (ratevalue > 0 && ratevalue <= 50 ){
+                m->clockrate=ratevalue;
+            }
+            else{
+                fprintf(m->out, "Clock rate of %d MHz is not valid\n",ratevalue);
+            }
+            break;
+            }
         case 's':{
             // scale the screen by using the SDL_SetWindowSize
             int scalevalue=0;
@@ -332,7 +563,7 @@ int main(int argc, char **argv){
                 scaledisplays=scalevalue;
             }
             else{
-                printf("Scale value of %d is not valid\n",scalevalue);
+                fprintf(m->out, "Scale value of %d is not valid\n",scalevalue);
             }
             break;
             }
@@ -340,11 +571,11 @@ int main(int argc, char **argv){
 
     // fix DA - added F1 triggers NMI
 
-    puts("MAP80 Nascom, a Nascom 2 emulator version " VERSION "\n"
+    fputs("MAP80 Nascom, a Nascom 2 emulator version " VERSION "\n"
          "with MAP80 256 ram, MAP80 VFC display and floppy card\n"
-         "and CHS clock card.\n");
-    if (verbose){
-         puts("Copyright (c) David Allday 2021\n"
+         "and CHS clock card.\n\n", m->out);
+    if (m->verbose){
+         fputs("Copyright (c) David Allday 2021\n"
          "Uses code base from Virtual Vascom \n"
          "Copyright (C) 2000,2009,2017,2018  Tommy Thorn.\n"
          "http://github.com/tommythorn/virtual-nascom.git\n"
@@ -358,34 +589,72 @@ int main(int argc, char **argv){
          "\n"
          "All serial output is appended to serial output file ('-o' option)\n"
          "which may be fed back in on a subsequent launch via the '-i' option.\n"
-         "\n");
+         "\n\n", m->out);
     }
 
-    if (verbose){
+    if (m->verbose){
         char cwd[FILENAME_MAX]; //create string buffer to hold path
         getcwd( cwd, FILENAME_MAX );
-        printf("Current directory is '%s'\n",cwd);
+        fprintf(m->out, "Current directory is '%s'\n",cwd);
     }
     
-    if (sdl_initialise()){
+    if (m->headless){
+        // nobody to watch it so run flat out unless asked for a clock rate
+        if (!clockrateset){
+            m->go_fast = true;
+            m->t_sim_delay = FAST_DELAY;
+        }
+    }
+    else if (sdl_initialise()){
         // setup SDL
-        fprintf(stderr,"failure to initialise SDL \n");
-        exit(4);
+        fprintf(m->err, "failure to initialise SDL \n");
+        return 4;
     }   // setup SDL
 
     // sets the rampagetable entries to the first 64k of the ram space
-    map80RamInitialise();
+    map80RamInitialise(m);
+
+    //load_nascom(monitor);
+    // load nas monitor into the first 2k of NascomMonVWram ram and ensure it is only 2048 bytes
+    if (loadNASformatspecial(m, monitor, &m->ram->NascomMonVWram[0], 2048 ) != 0 ){
+        if (m->vfcboot==0){ // if in cpm mode ignore error
+            fprintf(m->err, "Failure in loading %s \n",monitor);
+            return 1;
+        }
+    }
+
+    // load VFC Boot rom into the first 2k of vfcrom rom and ensure it is only 2048 bytes
+    if (loadNASformatspecial(m, vfcromname, &m->ram->vfcrom[0], 2048 ) != 0 ){
+        if (m->vfcboot==1){ // if not in cpm mode ignore error
+            fprintf(m->err, "Failure in loading %s \n",vfcromname);
+            return 1;
+        }
+    }
+    // and run from the copies the machines share
+    map80RamShareRoms(m);
+
+    // tell the displays when their screen ram is written to
+    if (!m->headless){
+        m->rampagewritetrap = videoramwritetrap;
+    }
+    // the cards go in their ports
+    portsInitialise(m);
+    // the devices that can interrupt go on the daisy chain
+    chsclockcardInitialise(m);
 
     // if nascom mode set the nascom2 rom and ram
     //
-    setcpmswitch(vfcboot);
+    setcpmswitch(m, m->vfcboot);
 
     //   printf("NascomMonVWram address %p \n",&NascomMonVWram);
     //   printf("NascomMonVWram screen address %p \n",&NascomMonVWram[0x800]);
     
     // set the positions of the various screens
     // 
-    if (vfcboot==0){
+    if (m->headless){
+        // no windows at all
+    }
+    else if (m->vfcboot==0){
         // use the standard Nascom display
         nascomdisplayxpos=NASCOM_DISPLAY_XPOS;
         nascomdisplayypos=NASCOM_DISPLAY_YPOS;
@@ -404,16 +673,18 @@ int main(int argc, char **argv){
     }
 
     // setup the status screen
-    if (status_create_screen( (&statusdisplayram[0]) )){
-        return 1;
+    if (!m->headless){
+        if (status_create_screen( (&statusdisplayram[0]) )){
+            return 1;
+        }
+        // scale it to match others 
+        status_display_change_size(scaledisplays);
     }
-    // scale it to match others 
-    status_display_change_size(scaledisplays);
 
     if (shownascomscreen!=0){
         // create nascom screen in it's own ram
         // screen is in the nascom ram space
-        if (nascom_create_screen( (&NascomMonVWram[0x800]) )){
+        if (nascom_create_screen( (&m->ram->NascomMonVWram[0x800]) )){
             return 1;
         }
         nascom_display_change_size(scaledisplays);
@@ -428,7 +699,7 @@ int main(int argc, char **argv){
 
     if (showVFCscreen!=0){
         // create vfc screen in it's own ram
-        if (map80vfc_create_screen( (&vfcdisplayram[0]) )){
+        if (map80vfc_create_screen( (&m->ram->vfcdisplayram[0]) )){
          return 1;
         }
         map80vfc_display_change_size(scaledisplays);
@@ -442,23 +713,6 @@ int main(int argc, char **argv){
     }
 
 
-    //load_nascom(monitor);
-    // load nas monitor into the first 2k of NascomMonVWram ram and ensure it is only 2048 bytes
-    if (loadNASformatspecial(monitor, &NascomMonVWram[0], 2048 ) != 0 ){
-        if (vfcboot==0){ // if in cpm mode ignore error
-            fprintf(stderr,"Failure in loading %s \n",monitor);
-            exit (1);
-        }
-    }
-
-    // load VFC Boot rom into the first 2k of vfcrom rom and ensure it is only 2048 bytes
-    if (loadNASformatspecial(vfcromname, &vfcrom[0], 2048 ) != 0 ){
-        if (vfcboot==1){ // if not in cpm mode ignore error
-            fprintf(stderr,"Failure in loading %s \n",vfcromname);
-            exit (1);
-        }
-    }
-
 /*
     // fix DA moved roms to the roms folder
     // load the basic rom
@@ -480,25 +734,25 @@ int main(int argc, char **argv){
         // load it into the first 64k of the standard memory 
         // This works as the ramdefaultpagetable[0] points at the start of virtual memory
         // and virtual memory is contiguous.
-        int retval=loadNASformat(argv[optind]);
+        int retval=loadNASformat(m, argv[optind]);
         if (retval){
-                printf("Problem loading %s\n",argv[optind]);
+                fprintf(m->out, "Problem loading %s\n",argv[optind]);
         }
     }
 
     // ensure all drives are reset
-    resetalldrives();
+    resetalldrives(m);
     
     // now mount the drives requested
     for (int floppynumber=0;floppynumber<=numberofFloppies;floppynumber++){
-        floppyMountDisk(floppynumber,floppy[floppynumber]);
+        floppyMountDisk(m, floppynumber,floppy[floppynumber]);
     }
     
     
-    displayfloppydetails();
+    displayfloppydetails(m);
 
     if (SDCardPresent) {
-        SDMountDisk(sdcard);
+        SDMountDisk(m, sdcard);
     }
 
         // call to set the vfc rom\display entries
@@ -508,26 +762,80 @@ int main(int argc, char **argv){
         // if not set:
         //      00 will disable rom and 02 enables rom
         // 01 enables display
-        outPortVFCDisplay(0xEC,0x00);
+        outPortVFCDisplay(m, 0xEC,0x00);
 //    }
 
 
     // fix DA - no longer needed as getword changed
     // ram[0x10000] = ram[0]; // Make GetWord[0xFFFF) work correctly
 
+    // everything is set up as it was when the snapshot was saved, so now put the machine back
+    if (restorefile != NULL){
+        if (snapshot_restore(m, restorefile) != 0){
+            closedevices(m);
+            return 1;
+        }
+        // carry on from the PC in the snapshot
+        m->firstcommand[1]=0;
+    }
+
     // clear the first command if we want to use the bios monitor.
-    if (usebiosmonitor!=0){
-        firstcommand[0]=0;
+    if (m->usebiosmonitor!=0){
+        m->firstcommand[0]=0;
     }
+    return 0;
+}
+
+void nascom_run(struct machine *m){
 
-    MAP80nascomMonitor(firstcommand);
+    m->runstarttime = time(NULL);
+    MAP80nascomMonitor(m, m->firstcommand);
+
+    if (m->snapshotfile != NULL){
+        snapshot_save(m, m->snapshotfile);
+    }
+    closedevices(m);
+}
 
-    if (cpmswitchstate==0){
+int nascom_report(struct machine *m){
+
+    if (m->headless){
+        print_screens(m);
+    }
+
+    if (m->verbose){
+        port_counts(m, m->out);
+    }
+
+    if (m->cpmswitchstate==0){
         // save the nascom space to file
-        save_nascom(0x800, 0x10000, "nasmemorydump.nas");
+        save_nascom(m, 0x800, 0x10000, m->memorydumpfile);
+    }
+    // a run that had to be stopped is not the same as one that finished
+    return m->timelimitreached ? 3 : 0;
+}
+
+// nasbatch has a main of its own, and runs the machines with the three parts above
+#ifndef NASBATCH
+int main(int argc, char **argv){
+
+    struct machine *m = machine_new();
+
+    int status = nascom_setup(m, argc, argv);
+    if (status == 0){
+        // the device messages are written by a thread of their own from here on
+        if (log_start() != 0){
+            fprintf(m->err, "Log thread could not be started: %s\n", SDL_GetError());
+        }
+        nascom_run(m);
+        // the last device messages before anything else is shown
+        log_stop();
+        status = nascom_report(m);
     }
-    exit(0);
+    machine_free(m);
+    exit(status);
 }
+#endif
 
 
 /* see .h file for details of the port usage
@@ -540,265 +848,199 @@ int main(int argc, char **argv){
  *  Port E0-EF Map80 VFC card
  *  Port 0xFE Map 80 256k card controls memory mapping
  *
- * TODO - the real Nascom repeats the ports 00 to 0F at 10 to 1F etc., till 70 to 7F
- * 
+ * The real Nascom repeats the ports 00 to 0F at 10 to 1F etc., till 70 to 7F
+ * see portsInitialise and NASCOMPORTMIRRORS in options.h
+ *
 */
 
 
-void out(unsigned int port, unsigned char value)
-{
-    static int SingleStepState;  // set to 1 after single step activated so we dont do it again.
-    static int sscount;  // used to display ss details so know new message output
-
+// port 0 - keyboard, tape led and single step
+static void nascomport0_write(struct machine *m, void *context, unsigned int port, unsigned char value){
 
-    // change to (1) to display message
-    if (0) fprintf(stdout, "Out to port %02x value %02x\n", port, value);
 
-    if ( (port & 0xF0) == 0 ) {
-        switch (port & 0x0F) {
-        case 0:
+    // keyboard out routine
+    outPort0Keyboard(m, value);
 
-            // keyboard out routine
-            outPort0Keyboard(value);
+    if (m->verbose){
+        if (m->serial->tape_led != !!(value & P0_OUT_TAPE_DRIVE_LED))
+            fprintf(m->err, "Tape LED = %d\n", !!(value & P0_OUT_TAPE_DRIVE_LED));
+    }
 
-            if (verbose){
-                if (tape_led != !!(value & P0_OUT_TAPE_DRIVE_LED))
-                    fprintf(stderr, "Tape LED = %d\n", !!(value & P0_OUT_TAPE_DRIVE_LED));
-            }
+    m->serial->tape_led = (!!(value & P0_OUT_TAPE_DRIVE_LED)) | m->serial->tape_led_force;
+
+    // check if P0_OUT_SINGLE_STEP bit value has been set ( bit 3 value 8 )
+    if ( (value & P0_OUT_SINGLE_STEP) == P0_OUT_SINGLE_STEP ) { // single step bit is set ( 8 )
+        // only process if just gone from zero to 1
+        if ( m->singlestepstate == 0 ) {
+            m->sscount +=1;
+            // fprintf(stdout,"Single Step triggered %d \n",sscount);
+            // set single step
+            m->singlestepstate = 1;
+            m->singleStep = 4; // trigger single step after ? instructions
+            m->simevents |= SIMEVENT_SINGLESTEP;
+        }
+    } else {   // single step switch reset
+        if ( m->singlestepstate == 1 ) {
+            m->sscount +=1;
+            // fprintf(stdout,"Single Step reset %d \n",sscount);
+            m->singlestepstate = 0;
+        }
+    }
+}
 
-            tape_led = (!!(value & P0_OUT_TAPE_DRIVE_LED)) | tape_led_force;
-
-        // check if P0_OUT_SINGLE_STEP bit value has been set ( bit 3 value 8 )
-            if ( (value & P0_OUT_SINGLE_STEP) == P0_OUT_SINGLE_STEP ) { // single step bit is set ( 8 )
-                    // only process if just gone from zero to 1
-                if ( SingleStepState == 0 ) {
-                        sscount +=1;
-                    // fprintf(stdout,"Single Step triggered %d \n",sscount);
-                        // set single step
-                        SingleStepState = 1;
-                        singleStep = 4; // trigger single step after ? instructions
-                    }
-            } else {   // single step switch reset
-                if ( SingleStepState == 1 ) {
-                    sscount +=1;
-                    // fprintf(stdout,"Single Step reset %d \n",sscount);
-                    SingleStepState = 0;
-                   }
-            }
+static int nascomport0_read(struct machine *m, void *context, unsigned int port){
+    return inPort0Keyboard(m);
+}
 
-            break;
+// ports 1 and 2 - the UART data and status
+static void nascomuart_write(struct machine *m, void *context, unsigned int port, unsigned char value){
+    writeserialout(m, value);
+}
 
-        case 1:
-            writeserialout(value);
-            break;
-        default:
-            if (verbose){
-                fprintf(stdout, "Unknown output to port %02x value %02x\n", port, value);
-            }
-        }
+static int nascomuart_read(struct machine *m, void *context, unsigned int port){
+    if ((port & 0x0F) == 1){
+        return readserialin(m);
     }
-    else {
-        switch (port & 0xFF) {
-        case 0x10:
-        case 0x11:
-        case 0x12:
-        case 0x13:
-        case 0x14:
-            outPortSD( port,value);
-            break;
+    /* Status port on the UART */
+    return getuartstatus(m);
+}
 
-        // clock card PIO ports - for Chris's version
-        case 0x88:
-            crtc_PIOportadata_write( port,value);
-            break;
-        case 0x8B:
-            crtc_PIOportbdata_write( port,value);
-            break;
-        case 0x8C:
-            crtc_PIOportacontrol_write( port,value);
-            break;
-        case 0x8D:
-            crtc_PIOportbcontrol_write( port,value);
-            break;
+// the cards - they keep their own in and out routines
+static int sd_read(struct machine *m, void *context, unsigned int port){
+    return inPortSD(m, port);
+}
 
+static void sd_write(struct machine *m, void *context, unsigned int port, unsigned char value){
+    outPortSD(m, port, value);
+}
 
-        // clock card PIO ports 
-        case 0xD0:
-            crtc_PIOportadata_write( port,value);
-            break;
-        case 0xD1:
-            crtc_PIOportbdata_write( port,value);
-            break;
-        case 0xD2:
-            crtc_PIOportacontrol_write( port,value);
-            break;
-        case 0xD3:
-            crtc_PIOportbcontrol_write( port,value);
-            break;
+static int chsporta_read(struct machine *m, void *context, unsigned int port){
+    return crtc_PIOportadata_read(m, port);
+}
 
-            // floppy handling
-        case 0xE0:
-        case 0xE1:
-        case 0xE2:
-        case 0xE3:
-        case 0xE4:
-        case 0xE5:
-            outPortFloppy(port,value);
-            break;
-            // VFC screen handling
-        case 0xE6:
-        case 0xE7:
-        case 0xE8:
-        case 0xE9:
-        case 0xEA:
-        case 0xEB:
-        case 0xEC:
-        case 0xED:
-        case 0xEE:
-        case 0xEF:
-            outPortVFCDisplay(port,value);
-            break;
+static int chsportb_read(struct machine *m, void *context, unsigned int port){
+    return crtc_PIOportbdata_read(m, port);
+}
 
-            // MAP80 256k Card
-        case 0xFE:
-            // handle page mapping
-           map80Ram(value); 
-           //printf("port out 0xFE disabled - value %2.2X\n",value);
-            break;
+static int chscontrola_read(struct machine *m, void *context, unsigned int port){
+    return crtc_PIOportacontrol_read(m, port);
+}
 
-        default:
-            if (verbose){
-                fprintf(stdout, "Unknown output to port %02x value %02x\n", port, value);
-            }
-        }
-    }
+static int chscontrolb_read(struct machine *m, void *context, unsigned int port){
+    return crtc_PIOportbcontrol_read(m, port);
 }
 
+static void chsporta_write(struct machine *m, void *context, unsigned int port, unsigned char value){
+    crtc_PIOportadata_write(m, port, value);
+}
 
+static void chsportb_write(struct machine *m, void *context, unsigned int port, unsigned char value){
+    crtc_PIOportbdata_write(m, port, value);
+}
 
-int in(unsigned int port)
-{
+static void chscontrola_write(struct machine *m, void *context, unsigned int port, unsigned char value){
+    crtc_PIOportacontrol_write(m, port, value);
+}
 
-    int retval=0xFF;
-    
-    if ( (port & 0xF0) == 0 ) {
-        switch (port & 0x0F) {
-        case 0:
-            retval=inPort0Keyboard();
-            break;
-            
-        case 1:
-            retval=readserialin();
-            break;
+static void chscontrolb_write(struct machine *m, void *context, unsigned int port, unsigned char value){
+    crtc_PIOportbcontrol_write(m, port, value);
+}
 
-        case 2:{
-            // check if any data to get from serial file 
-            /* Status port on the UART */
-            // 
-            retval=getuartstatus();
-                //int uart_status= UART_TBR_EMPTY | (checkifanyserialinputdata() & tape_led ? UART_DATA_READY : 0);
-                // printf("Uart status check %2.2X, serial ready %2.2X, tape led %2.2X, \n",uart_status,serial_input_available,tape_led);
-                //return uart_status;
-            }
-            break;
-        default:
-            retval= 0xFF;
-            if (verbose){
-                fprintf(stdout, "unknown input request from port %2.2X returning %2.2X\n", port,retval);
-            }
-            break;
-        }
-    }
-    else {
-        switch (port & 0xFF) {
-
-        case 0x10:
-        case 0x11:
-        case 0x12:
-        case 0x13:
-        case 0x14:
-            retval=inPortSD(port);
-            break;
+static int floppy_read(struct machine *m, void *context, unsigned int port){
+    return inPortFloppy(m, port);
+}
 
-            // clock card PIO ports - for Chris's version
-        case 0x88:
-            retval=crtc_PIOportadata_read(port);
-            break;
-        case 0x89:
-            retval=crtc_PIOportbdata_read(port);
-            break;
-        case 0x8A:
-            retval=crtc_PIOportacontrol_read(port );
-            break;
-        case 0x8B:
-            retval=crtc_PIOportbcontrol_read( port );
-            break;
+static void floppy_write(struct machine *m, void *context, unsigned int port, unsigned char value){
+    outPortFloppy(m, port, value);
+}
 
+static int vfc_read(struct machine *m, void *context, unsigned int port){
+    return inPortVFCDisplay(m, port);
+}
 
-        // clock card PIO ports 
-        case 0xD0:
-            retval=crtc_PIOportadata_read(port);
-            break;
-        case 0xD1:
-            retval=crtc_PIOportbdata_read(port);
-            break;
-        case 0xD2:
-            retval=crtc_PIOportacontrol_read(port );
-            break;
-        case 0xD3:
-            retval=crtc_PIOportbcontrol_read( port );
-            break;
+static void vfc_write(struct machine *m, void *context, unsigned int port, unsigned char value){
+    outPortVFCDisplay(m, port, value);
+}
 
+static void map80ram_write(struct machine *m, void *context, unsigned int port, unsigned char value){
+    // handle page mapping
+    map80Ram(m, value);
+}
 
-            // handle the floppy input ports
-        case 0xE0:
-        case 0xE1:
-        case 0xE2:
-        case 0xE3:
-        case 0xE4:
-        case 0xE5:
-            retval=inPortFloppy(port);
-            break;
-            // VFC screen handling
-        case 0xE6:
-        case 0xE7:
-        case 0xE8:
-        case 0xE9:
-        case 0xEA:
-        case 0xEB:
-        case 0xEC:
-        case 0xED:
-        case 0xEE:
-        case 0xEF:
-            retval=inPortVFCDisplay(port);
-            break;
+// plug the cards into the port table
+static void portsInitialise(struct machine *m){
 
-        default:
-            retval= 0xFF;
-            if (verbose){
-                fprintf(stdout, "unknown input request from port %2.2X returning %2.2X\n", port,retval);
-            }
-            break;
-        }
+    // the Nascom 2 board - it only decodes the low 4 address lines of ports 00 to 7F
+    port_register(m, 0x00, 1, nascomport0_read, nascomport0_write, NULL, "keyboard");
+    port_register(m, 0x01, 1, nascomuart_read, nascomuart_write, NULL, "uart");
+    port_register(m, 0x02, 1, nascomuart_read, NULL, NULL, "uart");
+    if (NASCOMPORTMIRRORS){
+        port_mirror(m, 0x00, 0x10, 0x10, 0x7F);
     }
 
-    if (0) fprintf(stdout, "In from Port %2.2X value %2.2X\n", port,retval);
+    // the cards take their ports over from the mirrors
+    port_register(m, 0x10, 5, sd_read, sd_write, NULL, "SDcard");
+    if (m->sdfastsd){
+        // the multi block register - not on the real controller
+        port_register(m, SDBLOCKS, 1, NULL, sd_write, NULL, "SDcard");
+    }
 
-    //if ( (port & 0xf0) == 0xe0) fprintf(stdout, "in [%02x] \n", port);
-    return retval;
+    // clock card PIO ports - for Chris's version
+    port_register(m, 0x88, 1, chsporta_read, chsporta_write, NULL, "clock card");
+    port_register(m, 0x89, 1, chsportb_read, NULL, NULL, "clock card");
+    port_register(m, 0x8A, 1, chscontrola_read, NULL, NULL, "clock card");
+    port_register(m, 0x8B, 1, chscontrolb_read, chsportb_write, NULL, "clock card");
+    port_register(m, 0x8C, 1, NULL, chscontrola_write, NULL, "clock card");
+    port_register(m, 0x8D, 1, NULL, chscontrolb_write, NULL, "clock card");
+
+    // clock card PIO ports
+    port_register(m, 0xD0, 1, chsporta_read, chsporta_write, NULL, "clock card");
+    port_register(m, 0xD1, 1, chsportb_read, chsportb_write, NULL, "clock card");
+    port_register(m, 0xD2, 1, chscontrola_read, chscontrola_write, NULL, "clock card");
+    port_register(m, 0xD3, 1, chscontrolb_read, chscontrolb_write, NULL, "clock card");
+
+    // MAP80 VFC floppy controller and screen
+    port_register(m, 0xE0, 6, floppy_read, floppy_write, NULL, "VFC floppy");
+    port_register(m, 0xE6, 10, vfc_read, vfc_write, NULL, "VFC display");
+
+    // MAP80 256k Card
+    port_register(m, 0xFE, 1, NULL, map80ram_write, NULL, "MAP80 ram");
+}
+
+// simz80 calls these for the in and out opcodes
+void out(struct machine *m, unsigned int port, unsigned char value)
+{
+    PORTHANDLER *handler = &m->porttable[port & 0xFF];
+
+    // change to (1) to display message
+    if (0) fprintf(m->out, "Out to port %02x value %02x\n", port, value);
 
+    m->portwrites[port & 0xFF]++;
+    handler->write(m, handler->writecontext, port, value);
+}
+
+int in(struct machine *m, unsigned int port)
+{
+    PORTHANDLER *handler = &m->porttable[port & 0xFF];
+
+    m->portreads[port & 0xFF]++;
+    int retval = handler->read(m, handler->readcontext, port);
+
+    if (0) fprintf(m->out, "In from Port %2.2X value %2.2X\n", port,retval);
+
+    return retval;
 }
 
 
 
 
-static void save_nascom(int start, int end, const char *name)
+static void save_nascom(struct machine *m, int start, int end, const char *name)
 {
-    printf("Dumping memory from %4.4X to %4.4X to file %s\n",start,end,name);
+    fprintf(m->out, "Dumping memory from %4.4X to %4.4X to file %s\n",start,end,name);
     FILE *f = fopen(name, "w+");
 
     if (!f) {
-        perror(name);
+        fprintf(m->err, "%s: %s\n", name, strerror(errno));
         return;
     }
     // save as a nascom style file with csum
@@ -13,26 +13,31 @@
 #define SLOW_DELAY  25000
 #define FAST_DELAY 900000
 
+// Nascom 2 runs at 4MHz
+#define DEFAULT_CLOCKRATE 4
+// fallen behind by more than this ( in ms ) then give up catching up
+#define CLOCKRATE_MAXLAG 100
+
+struct machine;
+
 // define external procedures
 extern int main(int argc, char **argv);
 extern int setup(int, char **);
-extern int sim_delay(void);
-
-// these reutines are called by simz80 when in or out opcodes are called
-extern void out(unsigned int port, unsigned char value);
-extern int in(unsigned int port);
+extern int sim_delay(struct machine *m);
 
-extern int verbose;      // set to true to display messages
+// main in three parts, so nasbatch can run machines in threads of their own
+// set the machine up from the command line - returns 0, or the exit status if it cannot run
+extern int nascom_setup(struct machine *m, int argc, char **argv);
+// run the machine until it stops, then save it and close its files
+extern void nascom_run(struct machine *m);
+// show how the machine was left - returns the exit status
+extern int nascom_report(struct machine *m);
 
-extern bool go_fast;
-extern int t_sim_delay;
-
-extern int usebiosmonitor;
-
-extern int traceon;     // set to 1 to trace z80
+// these reutines are called by simz80 when in or out opcodes are called
+extern void out(struct machine *m, unsigned int port, unsigned char value);
+extern int in(struct machine *m, unsigned int port);
 
-extern int tracestartaddress;    // trace will only show results when the PC is within this range
-extern int traceendaddress;      //  end address of the trace range ( 0 to 0xFFFF )
+// the settings for a run, e.g. verbose, go_fast and clockrate, are in struct machine - see simz80.h
 
 
 /*
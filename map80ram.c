@@ -19,10 +19,11 @@
 #include "map80ram.h"
 #include "map80nascom.h"
 #include "statusdisplay.h"
+#include "snapshot.h"
+#include "log.h"
+#include "nasutils.h"
 
-int rampagedebug=0;
-
-void displayRamTable();
+static void displayRamTable(struct machine *m);
 
 
 /* handle the page mapping required for the MAP80 256k ram card
@@ -43,9 +44,9 @@ void displayRamTable();
    The process handles the movement by changing the pointers in rampagetable.
    All memory is in the ram array
 
-   Need to check ramlocktable for same element in rampagetable
-   if set to 1 then the rampagetable pointer cannot be updated
-   i.e. for monitor romramromtable
+   Need to check RAMPAGE_LOCKED for same element in rampagetable
+   if set then the rampagetable pointer cannot be updated
+   i.e. for monitor rom
 
 */
 
@@ -53,115 +54,161 @@ void displayRamTable();
 // each entry in ramapagetable points to the start of a page in ram
 // will be 2k if PAGESIZE is 2
 // For Nascom areas the rampagetable entry will be pointing at special memory area
-// Then the ramlocktable will be set to 1 stop the memory management system changing to this pointer
-// For ROMS the ramromtable will be set to 1 to stop writes to that memory area.
-BYTE *rampagetable[RAMPAGETABLESIZE];
-// we need a second table of pointers for the ram if the RAMDISABLE from Nascom was not active
-// It will point to the address in ram to use if MAP80 256k card was the active memory.
-BYTE *ramdefaultpagetable[RAMPAGETABLESIZE];
-// this is the total ram space to be used for memory management
-BYTE virutalram[VIRTUALRAMSIZE*1024];
-
-// fix DA
-// ramromtable is set to 0 if you can write to it
-// otherwise a write attempt is just ignored
-// i.e. that area is a ROM
-// set to 1 for permanent ROM - i.e. monitor
-// set to 2 for temporary when page mapping attempted past end of virtual memory
-int ramromtable[RAMPAGETABLESIZE];
-
-// ram lock table is set to 0 if you can change it's pointer in rampagetable
-// otherwise the rampagetable will not be changed
-// acts like the N2 ram disable line.
+// Then RAMPAGE_LOCKED will be set to stop the memory management system changing to this pointer
+// For ROMS RAMPAGE_ROM will be set to stop writes to that memory area.
+// RAMPAGE_NORAM is set when page mapping is attempted past end of virtual memory
+// RAMPAGE_LOCKED acts like the N2 ram disable line.
 // this should be linked to a seperate 2k block and not the normal ram area.
 // as the virtual ram can be switch from lower to upper 32k blocks and visa vera
-// this would mean that the "rom" could appear in an area that should be ram 
-int ramlocktable[RAMPAGETABLESIZE];
-
-// next 2 areas only referenced in virutal-nascom code
-// defines some space for NASCOM Monitor ROM, video ram and working Ram
-BYTE NascomMonVWram[4*1024];
-
-// this area of ram is set to show that ram does not exist
+// this would mean that the "rom" could appear in an area that should be ram
+// rampagetable is in struct machine and the memory it points at in the MAP80RAM card,
+// apart from roms loaded from the command line.
+// The second table, ramdefaultpagetable, has the address in ram to use if the
+// MAP80 256k card was the active memory, i.e. if the RAMDISABLE from Nascom was not active.
+// dummyram is set to show that ram does not exist
 // rampagetable can be pointed at it and it will return dummy value
-// but we will set the ramromtable so that it cannot be written to
-BYTE dummyram[RAMPAGESIZE*1024];
+// but we will set RAMPAGE_NORAM so that it cannot be written to
 
 // the status screen 
 BYTE statusdisplayram[STATUS_DISPLAYRAMSIZE];
-// space for the VFC rom and screen memory
-BYTE vfcrom[2*1024];
-// allowed 2k for display ram 
-// the display chip can address more ?? TODO - think about it 
-BYTE vfcdisplayram[2*1024];
 
+void map80RamCreate(struct machine *m){
+
+    m->ram = calloc(1, sizeof(MAP80RAM));
+    if (m->ram == NULL){
+        fprintf(m->err, "Out of memory for the MAP80 ram card\n");
+        exit(1);
+    }
+}
+
+void map80RamFree(struct machine *m){
+
+    for (int c = 0; c < RAMPAGETABLESIZE; c++){
+        free(m->ram->romcopies[c]);
+    }
+    free(m->ram);
+    m->ram = NULL;
+}
 
  // intialise the map80 memory card.
-void map80RamInitialise(){
+void map80RamInitialise(struct machine *m){
 
+    MAP80RAM *ram = m->ram;
+    struct rampage *rampagetable = m->rampagetable;
 
 
     // intialise rampagetable to point at the first 64k of ram
     for (int c=0; c< (RAMPAGETABLESIZE) ; ++c) {
         // first the default table if no ramdisable is active
-        ramdefaultpagetable[c]=virutalram+(c<<RAMPAGESHIFTBITS);
+        ram->ramdefaultpagetable[c]=ram->virutalram+(c<<RAMPAGESHIFTBITS);
         // then the memory pointers
-        rampagetable[c] = ramdefaultpagetable[c];
+        rampagetable[c].host = ram->ramdefaultpagetable[c];
+        rampagetable[c].flags = 0;
  	    //	 debug to show values generated
-        if (rampagedebug){
-            fprintf(stdout, "rampagetableindex [%02x], ram [%p], ram address [%p] \n",
-                           c, virutalram, rampagetable[c] );
-        }
+        LOG(m, LOG_RAMPAGE, LOG_DEBUG, "rampagetableindex [%02x], ram [%p], ram address [%p] \n",
+                       c, ram->virutalram, rampagetable[c].host );
 
     }
 
     // sets the memory used to tell us we are not in real memory
     // used if we try and set map80 256k card to values where no card exists
-    memset(dummyram, 0x76, RAMPAGESIZE*1024 );  /* Fill dummy ram with the halt instruction */
+    memset(ram->dummyram, 0x76, RAMPAGESIZE*1024 );  /* Fill dummy ram with the halt instruction */
     // set ram areas to HALT
     //	 debug to show values generated
-    if (rampagedebug){
-        printf("size of NascomMonVWram ram %ld \n", sizeof NascomMonVWram);
-    }
-    memset(&NascomMonVWram, 0x76,sizeof NascomMonVWram );  /* Fill with the halt instruction */
+    LOG(m, LOG_RAMPAGE, LOG_DEBUG, "size of NascomMonVWram ram %ld \n", sizeof ram->NascomMonVWram);
+    memset(&ram->NascomMonVWram, 0x76,sizeof ram->NascomMonVWram );  /* Fill with the halt instruction */
     // when nasbug T4 or nas-sys monitors start up, they restore the breakpoint byte at the
     // breakpoint address. The effect is to write 76H to address 7676H. Usually this is not
     // a problem. However, for the case where a command-line argument is used to load a .nas
     // file, and that file loads 7676H, the monitor start up will corrupt the data at that
     // address. To avoid this nastiness, set brkadr to 0 (which is read-only and so will
     // not be affected by the write of 76H.
-    NascomMonVWram[0x0c15]=0; // nasbug T4
-    NascomMonVWram[0x0c16]=0;
-    NascomMonVWram[0x0c23]=0; // nas-sys
-    NascomMonVWram[0x0c24]=0;
+    ram->NascomMonVWram[0x0c15]=0; // nasbug T4
+    ram->NascomMonVWram[0x0c16]=0;
+    ram->NascomMonVWram[0x0c23]=0; // nas-sys
+    ram->NascomMonVWram[0x0c24]=0;
 
-    if (rampagedebug){
-        printf("size of virtual ram %ld \n", sizeof virutalram);
-    }
-    memset(&virutalram, 0x76,sizeof virutalram );  /* Fill with the halt instruction */
+    LOG(m, LOG_RAMPAGE, LOG_DEBUG, "size of virtual ram %ld \n", sizeof ram->virutalram);
+    memset(&ram->virutalram, 0x76,sizeof ram->virutalram );  /* Fill with the halt instruction */
 
     // The vfc extra areas
-    if (rampagedebug){
-        printf("size of vfc rom %ld \n", sizeof vfcrom);
-    }
-    memset(&vfcrom, 0x76,sizeof vfcrom );  /* Fill with the halt instruction */
-    if (rampagedebug){
-        printf("size of vfc display %ld \n", sizeof vfcdisplayram);
-    }
-    memset(&vfcdisplayram, 0x76,sizeof vfcdisplayram );  /* Fill with the halt instruction */
+    LOG(m, LOG_RAMPAGE, LOG_DEBUG, "size of vfc rom %ld \n", sizeof ram->vfcrom);
+    memset(&ram->vfcrom, 0x76,sizeof ram->vfcrom );  /* Fill with the halt instruction */
+    LOG(m, LOG_RAMPAGE, LOG_DEBUG, "size of vfc display %ld \n", sizeof ram->vfcdisplayram);
+    memset(&ram->vfcdisplayram, 0x76,sizeof ram->vfcdisplayram );  /* Fill with the halt instruction */
+
+    // the roms are in the card until they are loaded and shared
+    ram->monitorrom = ram->NascomMonVWram;
+    ram->vfcbootrom = ram->vfcrom;
 
     // show where the pointers are pointing at
-    if (rampagedebug){
-        displayRamTable();
+    if (LOGGING(m, LOG_RAMPAGE, LOG_DEBUG)){
+        displayRamTable(m);
     }
 
     return ;
 }
 
 
+// once the monitor and VFC roms are loaded, use the copies shared by all the
+// machines in the process, so nasbatch jobs run from the same rom pages
+// call before the roms are mapped in by setcpmswitch and the VFC display
+void map80RamShareRoms(struct machine *m){
+
+    MAP80RAM *ram = m->ram;
+    BYTE *rom;
+
+    if ((rom = sharedrom(ram->NascomMonVWram, 2*1024)) != NULL){
+        ram->monitorrom = rom;
+    }
+    if ((rom = sharedrom(ram->vfcrom, sizeof ram->vfcrom)) != NULL){
+        ram->vfcbootrom = rom;
+    }
+}
+
+// a rom page a file is about to be loaded over gets memory of the machine's own,
+// so the copy the machines share is left as it was
+void map80RamUnshareRom(struct machine *m, unsigned int a){
+
+    MAP80RAM *ram = m->ram;
+    int index = RAMPAGEINDEX(a);
+    struct rampage *page = &m->rampagetable[index];
+    BYTE *own;
+
+    if ((page->flags & RAMPAGE_ROM) == 0){
+        return;
+    }
+    if (page->host == ram->monitorrom && ram->monitorrom != ram->NascomMonVWram){
+        // the card still has the monitor it was loaded into
+        own = ram->monitorrom = ram->NascomMonVWram;
+    }
+    else if (page->host == ram->vfcbootrom && ram->vfcbootrom != ram->vfcrom){
+        own = ram->vfcbootrom = ram->vfcrom;
+    }
+    else if (page->host == ram->NascomMonVWram || page->host == ram->vfcrom || page->host == ram->romcopies[index]){
+        // already its own
+        return;
+    }
+    else {
+        if (ram->romcopies[index] == NULL){
+            ram->romcopies[index] = malloc(RAMPAGESIZE*1024);
+            if (ram->romcopies[index] == NULL){
+                fprintf(m->err, "Out of memory for a copy of the rom page at %4.4X\n", a);
+                exit(1);
+            }
+        }
+        own = ram->romcopies[index];
+        memcpy(own, page->host, RAMPAGESIZE*1024);
+    }
+    page->host = own;
+    blockcachepagechanged(m, index);
+}
+
 // handle the changes to the map80 ram card memory mapping
-void map80Ram(unsigned char value){
+void map80Ram(struct machine *m, unsigned char value){
 
+    MAP80RAM *ram = m->ram;
+    struct rampage *rampagetable = m->rampagetable;
 
 
     // find the first entry in ram array
@@ -169,7 +216,7 @@ void map80Ram(unsigned char value){
     int page64knumber = ((value & 0x3E) >> 1 );
     // find the first 64k page in the ram array
     // multiple by (64 * 1024)  = 65536 which is shift 16 left
-    BYTE *ramaddress = virutalram + ( page64knumber << 16 );
+    BYTE *ramaddress = ram->virutalram + ( page64knumber << 16 );
 
     // rampagetable entry
     // starts at 0 - there is only 32 (64 / 2) entries
@@ -178,13 +225,11 @@ void map80Ram(unsigned char value){
     // number of pages to update if in 64k mode ( 64/2 ) = 32
     int numberToUpdate = 32;
 
-    if (rampagedebug){
-        // debug to show values generated
-        //fprintf(stdout, "Port Data [%2.2x], 64k page [%2.2x], rampagetableindex [%2.2x], ram address [%p], ram offset [%4.4X] \n",
-        //                       value, page64knumber, rampagetableindex, virutalram, (int32_t) (ramaddress-virutalram));
-        fprintf(stdout, "Port Data [%02X], 64k page [%02X], rampagetableindex [%02X], numbertoupdate [%02X], virtual ram address [%p], ramoffset [%4.4X] \n",
-                           value, page64knumber, rampagetableindex, numberToUpdate,  virutalram, (int32_t)(ramaddress-virutalram) );
-    }
+    // debug to show values generated
+    //fprintf(stdout, "Port Data [%2.2x], 64k page [%2.2x], rampagetableindex [%2.2x], ram address [%p], ram offset [%4.4X] \n",
+    //                       value, page64knumber, rampagetableindex, ram->virutalram, (int32_t) (ramaddress-ram->virutalram));
+    LOG(m, LOG_RAMPAGE, LOG_DEBUG, "Port Data [%02X], 64k page [%02X], rampagetableindex [%02X], numbertoupdate [%02X], virtual ram address [%p], ramoffset [%4.4X] \n",
+                       value, page64knumber, rampagetableindex, numberToUpdate,  ram->virutalram, (int32_t)(ramaddress-ram->virutalram) );
 
     // check if 32 or 64k mode
     if ( (value & 0x80) == 0x80 ) {
@@ -206,17 +251,15 @@ void map80Ram(unsigned char value){
         }
     }
 
-    if (rampagedebug){
-        // debug to show values generated
-        fprintf(stdout, "Port Data [%02X], 64k page [%02X], rampagetableindex [%02X], numbertoupdate [%02X], virtual ram address [%p], ramoffset [%4.4X] \n",
-                           value, page64knumber, rampagetableindex, numberToUpdate,  virutalram, (int32_t)(ramaddress-virutalram) );
-    }
+    // debug to show values generated
+    LOG(m, LOG_RAMPAGE, LOG_DEBUG, "Port Data [%02X], 64k page [%02X], rampagetableindex [%02X], numbertoupdate [%02X], virtual ram address [%p], ramoffset [%4.4X] \n",
+                       value, page64knumber, rampagetableindex, numberToUpdate,  ram->virutalram, (int32_t)(ramaddress-ram->virutalram) );
     // if the requested page is greater than the virtual ram
     //  256k card will generate page64knumber from 0 to 3
     if ( page64knumber >= VIRTUALRAMSIZE / 64 ) {
 	// page requested is past end of memory
         // set it to dummy memory
-            ramaddress = dummyram;
+            ramaddress = ram->dummyram;
 	}
     // now actually update the pagetableentries
     int indextostopbefore = rampagetableindex + numberToUpdate;
@@ -224,61 +267,152 @@ void map80Ram(unsigned char value){
     for (int tableindex = rampagetableindex ; tableindex < indextostopbefore ; tableindex ++ ) {
 
         // first the default table if no ramdisable is active
-        ramdefaultpagetable[tableindex]=ramaddress;
+        ram->ramdefaultpagetable[tableindex]=ramaddress;
 
  	    //	 debug to show values generated
-        if (rampagedebug){
-            fprintf(stdout, "Ramdefault Index [%02X], set to  [%p] \n",
-                   tableindex, ramaddress );
-        }
+        LOG(m, LOG_RAMPAGE, LOG_DEBUG, "Ramdefault Index [%02X], set to  [%p] \n",
+               tableindex, ramaddress );
 
-        if ( ramlocktable[tableindex] == 0 ) {
+        if ( (rampagetable[tableindex].flags & RAMPAGE_LOCKED) == 0 ) {
             // the ram is not locked so update the pointer
-            rampagetable [tableindex] = ramaddress;
-     	    //	 debug to show values generated
-            if (rampagedebug){
-                fprintf(stdout, "Rampage Index [%02X], set to  [%p] \n",
-                       tableindex, ramaddress );
+            if (rampagetable [tableindex].host != ramaddress){
+                // any code cached from the page is no longer there
+                blockcachepagechanged(m, tableindex);
             }
+            rampagetable [tableindex].host = ramaddress;
+     	    //	 debug to show values generated
+            LOG(m, LOG_RAMPAGE, LOG_DEBUG, "Rampage Index [%02X], set to  [%p] \n",
+                   tableindex, ramaddress );
             // set lock mode
-            if (ramaddress == dummyram){
+            if (ramaddress == ram->dummyram){
                 // set to prevent r/w
-                // if it is rom it would also have ramlocktable set
-                // use 2 for debug purposes
-                ramromtable[tableindex] = 2;
+                // if it is rom it would also have RAMPAGE_LOCKED set
+                rampagetable[tableindex].flags |= RAMPAGE_NORAM;
             } else {
                 // allow the area r/w in case it was set last time
-                ramromtable[tableindex] = 0;
+                rampagetable[tableindex].flags &= ~(RAMPAGE_ROM | RAMPAGE_NORAM);
             }
         }
         // now move on ram address - if needed
-        if (ramaddress != dummyram){
+        if (ramaddress != ram->dummyram){
             // increment the ram address by 2k for the next table entry
             ramaddress += 2048;
         }
 
     }
     //	 debug to show values generated
-    if (rampagedebug){
-        displayRamTable();
-        fprintf(stdout, "\n");
+    if (LOGGING(m, LOG_RAMPAGE, LOG_DEBUG)){
+        displayRamTable(m);
+        log_message(m->out, LOG_RAMPAGE, LOG_DEBUG, "\n");
     }
 
     return;
 }
 
-void displayRamTable(){
+static void displayRamTable(struct machine *m){
 
+    MAP80RAM *ram = m->ram;
 
     for (int c=0; c< (RAMPAGETABLESIZE) ; ++c) {
-        unsigned int offset1 = rampagetable[c]-virutalram;
-        unsigned int offset2 = ramdefaultpagetable[c]-virutalram;
-        fprintf(stdout, "rampagetableindex [%02x], ram [%p], ram address [%4.4X] default [%4.4X] \n",
-                           c, virutalram, offset1, offset2 );
+        unsigned int offset1 = m->rampagetable[c].host-ram->virutalram;
+        unsigned int offset2 = ram->ramdefaultpagetable[c]-ram->virutalram;
+        log_message(m->out, LOG_RAMPAGE, LOG_DEBUG, "rampagetableindex [%02x], ram [%p], ram address [%4.4X] default [%4.4X] \n",
+                           c, ram->virutalram, offset1, offset2 );
     }
 
 
 
 }
 
+// a write has been made to a page which has more than RAMPAGE_DIRTY set
+// mark it dirty, throw away code cached from the bytes written and tell the trap
+void rampagewritten(struct machine *m, unsigned int a, int length){
+
+    int index = RAMPAGEINDEX(a);
+    struct rampage *page = &m->rampagetable[index];
+
+    page->flags |= RAMPAGE_DIRTY;
+    if (page->flags & RAMPAGE_CODE){
+        blockcachewritten(m, a, length);
+    }
+    if ((page->flags & RAMPAGE_IOTRAP) && m->rampagewritetrap != NULL){
+        m->rampagewritetrap(m, a, length);
+    }
+}
+
+// a pointer in the page tables as the area of memory it is in and the offset into it
+// so it can be saved in a snapshot - area 0 is memory the snapshot does not know,
+// such as a rom loaded from the command line, and is left as it is on restore
+typedef struct {
+    uint32_t area;
+    uint32_t offset;
+    uint32_t flags;
+} RAMPAGESNAPSHOT;
+
+typedef struct {
+    BYTE *start;
+    size_t size;
+} RAMPAGEAREA;
+
+// the areas of the machine's ram card, in snapshot area order
+#define RAMPAGEAREAS 6
+static void rampageareas(MAP80RAM *ram, RAMPAGEAREA areas[RAMPAGEAREAS]){
+    areas[0] = (RAMPAGEAREA){ NULL, 0 };
+    areas[1] = (RAMPAGEAREA){ ram->virutalram, sizeof(ram->virutalram) };
+    areas[2] = (RAMPAGEAREA){ ram->NascomMonVWram, sizeof(ram->NascomMonVWram) };
+    areas[3] = (RAMPAGEAREA){ ram->dummyram, sizeof(ram->dummyram) };
+    areas[4] = (RAMPAGEAREA){ ram->vfcrom, sizeof(ram->vfcrom) };
+    areas[5] = (RAMPAGEAREA){ ram->vfcdisplayram, sizeof(ram->vfcdisplayram) };
+}
+
+static RAMPAGESNAPSHOT rampagetosnapshot(const RAMPAGEAREA *areas, BYTE *host, unsigned int flags){
+    RAMPAGESNAPSHOT entry = { 0, 0, flags };
+    for (unsigned int area = 1; area < RAMPAGEAREAS; area++){
+        if (host >= areas[area].start && host < areas[area].start + areas[area].size){
+            entry.area = area;
+            entry.offset = host - areas[area].start;
+        }
+    }
+    return entry;
+}
+
+static BYTE * rampagefromsnapshot(const RAMPAGEAREA *areas, RAMPAGESNAPSHOT entry, BYTE *host){
+    if (entry.area == 0 || entry.area >= RAMPAGEAREAS || entry.offset >= areas[entry.area].size){
+        return host;
+    }
+    return areas[entry.area].start + entry.offset;
+}
+
+// save or restore the ram and the memory mapping
+void map80RamSnapshot(struct machine *m, SNAPSHOT *s){
+
+    MAP80RAM *ram = m->ram;
+    struct rampage *rampagetable = m->rampagetable;
+    RAMPAGEAREA areas[RAMPAGEAREAS];
+    RAMPAGESNAPSHOT pages[RAMPAGETABLESIZE];
+    RAMPAGESNAPSHOT defaultpages[RAMPAGETABLESIZE];
+
+    rampageareas(ram, areas);
+    snapshot_data(s, "ram", ram->virutalram, sizeof(ram->virutalram));
+    snapshot_data(s, "nasram", ram->NascomMonVWram, sizeof(ram->NascomMonVWram));
+    snapshot_data(s, "vfcram", ram->vfcdisplayram, sizeof(ram->vfcdisplayram));
+
+    if (!s->restoring){
+        for (int c = 0; c < RAMPAGETABLESIZE; c++){
+            pages[c] = rampagetosnapshot(areas, rampagetable[c].host, rampagetable[c].flags & ~RAMPAGE_CODE);
+            defaultpages[c] = rampagetosnapshot(areas, ram->ramdefaultpagetable[c], 0);
+        }
+    }
+    snapshot_data(s, "rampages", pages, sizeof(pages));
+    snapshot_data(s, "ramdeflt", defaultpages, sizeof(defaultpages));
+    if (s->restoring && !s->error){
+        for (int c = 0; c < RAMPAGETABLESIZE; c++){
+            rampagetable[c].host = rampagefromsnapshot(areas, pages[c], rampagetable[c].host);
+            rampagetable[c].flags = pages[c].flags;
+            ram->ramdefaultpagetable[c] = rampagefromsnapshot(areas, defaultpages[c], ram->ramdefaultpagetable[c]);
+            blockcachepagechanged(m, c);
+        }
+    }
+}
 
+// end of file
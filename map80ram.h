@@ -2,26 +2,43 @@
  * definitions for MAP80RAM
  */
 
+#ifndef MAP80RAM_DEFINED_H
+#define MAP80RAM_DEFINED_H
 
-void map80RamInitialise();
-void map80Ram(unsigned char value);
-
-// external variables
 // rams areas for map80 card
-extern  int ramromtable[];
-
-extern int ramlocktable[];
-
-extern BYTE *ramdefaultpagetable[RAMPAGETABLESIZE];
-
-extern BYTE NascomMonVWram[];
-extern BYTE dummyram[];
-
-extern BYTE vfcrom[];
-extern BYTE vfcdisplayram[];
+// the page table the Z80 goes through, with the flags, is rampagetable in struct machine - see simz80.h
+typedef struct MAP80RAM {
+    // the pages to use if the RAMDISABLE from Nascom was not active
+    BYTE *ramdefaultpagetable[RAMPAGETABLESIZE];
+    // the total ram space to be used for memory management
+    BYTE virutalram[VIRTUALRAMSIZE*1024];
+    // the NASCOM Monitor ROM, video ram and working Ram
+    BYTE NascomMonVWram[4*1024];
+    // pages mapped past the end of virtual ram - reads as HALT
+    BYTE dummyram[RAMPAGESIZE*1024];
+    // space for the VFC rom and screen memory
+    BYTE vfcrom[2*1024];
+    BYTE vfcdisplayram[2*1024];
+    // the pages the Z80 sees the monitor and VFC roms in - the first 2k of NascomMonVWram
+    // and vfcrom, until map80RamShareRoms points them at the copies the machines share
+    BYTE *monitorrom;
+    BYTE *vfcbootrom;
+    // other rom pages a file has been loaded over - see map80RamUnshareRom
+    BYTE *romcopies[RAMPAGETABLESIZE];
+} MAP80RAM;
+
+// give the machine its ram card, and free it again
+void map80RamCreate(struct machine *m);
+void map80RamFree(struct machine *m);
+
+void map80RamInitialise(struct machine *m);
+void map80RamShareRoms(struct machine *m);
+void map80RamUnshareRom(struct machine *m, unsigned int a);
+void map80Ram(struct machine *m, unsigned char value);
+
+// the status screen - there is one, for the machine in the windows
 extern BYTE statusdisplayram[];
 
-extern int rampagedebug;    // set to 1 to display rampage details
+#endif
 
 // end of file
-
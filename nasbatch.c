@@ -0,0 +1,310 @@
+/*  nasbatch - run a batch of headless emulator jobs, several at a time
+
+    nasbatch [-j jobs] [-o logdir] jobfile
+
+    Each line of the job file is the arguments for one run of the emulator,
+    blank lines and lines starting with # are skipped, and %n is replaced
+    with the number of the job, e.g.
+
+        # CP/M regression suite
+        -e 60 -b -f disks/cpm3.config -k tests/dir.keys
+        -e 60 -c sd.img,/tmp/job%n.cow,discard -k tests/sd.keys
+
+    Every job is a machine of its own run headless, as if --headless was
+    given, by one of -j worker threads ( default the number of host cores )
+    in this process, with its output in logdir/job<n>.log and, in nascom
+    mode, its memory dump in logdir/job<n>.nas.
+    Each machine has its own registers, ram pages and devices, and they share
+    one copy of each rom - a machine only gets its own copy of a rom page if
+    a file is loaded over it.
+    The disc and SD images are opened by each job, so are shared by the host
+    page cache - give each job an overlay ( see README.md ) so the base
+    images are only read.
+    A job fails if the emulator would have exited with a status other than 0,
+    which includes 3 when its -e time limit was reached before the Z80 HALTed.
+    The exit status is the number of jobs that failed, up to 255.
+
+*/
+
+#define _XOPEN_SOURCE 700      // getline
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <SDL2/SDL.h>
+
+#include "simz80.h"
+#include "map80nascom.h"
+#include "log.h"
+
+// most arguments on a job line
+#define NASBATCHMAXARGS 64
+
+static char *logdir = ".";
+
+static FILE *jobfile;
+static SDL_mutex *jobfilelock;      // the workers take the next job in turn
+static int jobsstarted;
+static int joblinenumber;
+static int jobsfailed;
+
+static SDL_mutex *setuplock;        // getopt keeps its place in globals, so one setup at a time
+static SDL_mutex *reportlock;       // one job's line on stdout at a time
+
+// the job line with %n replaced by number - malloced
+static char * expandjob(const char *line, int number){
+
+    char numbertext[16];
+    size_t length = strlen(line) + 1;
+
+    snprintf(numbertext, sizeof(numbertext), "%d", number);
+    for (const char *p = line; (p = strstr(p, "%n")) != NULL; p += 2){
+        length += strlen(numbertext);
+    }
+    char *job = malloc(length);
+    if (job == NULL){
+        return NULL;
+    }
+    char *out = job;
+    while (*line){
+        if (line[0] == '%' && line[1] == 'n'){
+            strcpy(out, numbertext);
+            out += strlen(numbertext);
+            line += 2;
+        }
+        else {
+            *out++ = *line++;
+        }
+    }
+    *out = 0;
+    return job;
+}
+
+// split a job line into arguments at spaces, "quoted" arguments can hold spaces
+// returns the number of arguments - line is changed in place
+static int splitjob(char *line, char *argv[], int maxargs){
+
+    int argc = 0;
+    char *p = line;
+
+    while (*p){
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'){
+            p++;
+        }
+        if (*p == 0 || argc == maxargs){
+            break;
+        }
+        if (*p == '"'){
+            argv[argc++] = ++p;
+            while (*p && *p != '"'){
+                p++;
+            }
+        }
+        else {
+            argv[argc++] = p;
+            while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r'){
+                p++;
+            }
+        }
+        if (*p){
+            *p++ = 0;
+        }
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+// the next job line, with its job and line numbers - malloced, NULL when there are no more
+static char * nextjob(int *number, int *linenumber){
+
+    char *line = NULL;
+    size_t linesize = 0;
+
+    SDL_LockMutex(jobfilelock);
+    while (getline(&line, &linesize, jobfile) >= 0){
+        joblinenumber++;
+        char *p = line + strspn(line, " \t\r\n");
+        if (*p != 0 && *p != '#'){
+            *number = ++jobsstarted;
+            *linenumber = joblinenumber;
+            SDL_UnlockMutex(jobfilelock);
+            memmove(line, p, strlen(p) + 1);
+            return line;
+        }
+    }
+    SDL_UnlockMutex(jobfilelock);
+    free(line);
+    return NULL;
+}
+
+// run one job on a machine of its own - returns the emulator's exit status
+static int runjob(char *line, int number){
+
+    char *argv[NASBATCHMAXARGS + 2];
+    char logname[1024];
+    char dumpname[1024];
+
+    snprintf(logname, sizeof(logname), "%s/job%d.log", logdir, number);
+    snprintf(dumpname, sizeof(dumpname), "%s/job%d.nas", logdir, number);
+    FILE *log = fopen(logname, "w");
+    if (log == NULL){
+        perror(logname);
+        return 127;
+    }
+    // nothing to type unless the job gives a -k file
+    FILE *nothing = fopen("/dev/null", "r");
+    char *job = expandjob(line, number);
+    if (nothing == NULL || job == NULL){
+        fprintf(log, "Could not start the job\n");
+        if (nothing != NULL){
+            fclose(nothing);
+        }
+        free(job);
+        fclose(log);
+        return 127;
+    }
+    argv[0] = "map80nascom";
+    int argc = 1 + splitjob(job, argv + 1, NASBATCHMAXARGS);
+
+    struct machine *m = machine_new();
+    m->out = log;
+    m->err = log;
+    m->in = nothing;
+    m->headless = 1;
+    m->memorydumpfile = dumpname;
+
+    SDL_LockMutex(setuplock);
+    optind = 0;         // start getopt again for this job's arguments
+    int status = nascom_setup(m, argc, argv);
+    SDL_UnlockMutex(setuplock);
+    if (status == 0){
+        nascom_run(m);
+        // the last device messages before the screens
+        log_sync();
+        status = nascom_report(m);
+    }
+    // nothing left in the ring for the log before it is closed
+    log_sync();
+    machine_free(m);
+    free(job);
+    fclose(nothing);
+    fclose(log);
+    return status;
+}
+
+// a worker thread - runs jobs until there are none left
+static int worker(void *data){
+
+    char *line;
+    int number;
+    int linenumber;
+
+    while ((line = nextjob(&number, &linenumber)) != NULL){
+        time_t started = time(NULL);
+        int status = runjob(line, number);
+        free(line);
+
+        SDL_LockMutex(reportlock);
+        if (status != 0){
+            jobsfailed++;
+        }
+        fprintf(stdout, "job %d ( line %d ) %s in %lds", number, linenumber,
+                status == 0 ? "ok" : "FAILED", (long)(time(NULL) - started));
+        if (status == 3){
+            fprintf(stdout, " - timed out");
+        }
+        else if (status != 0){
+            fprintf(stdout, " - exit status %d", status);
+        }
+        fprintf(stdout, "\n");
+        fflush(stdout);
+        SDL_UnlockMutex(reportlock);
+    }
+    return 0;
+}
+
+static void usage(char *progname){
+    fprintf(stderr,
+ "Usage: %s [-j jobs] [-o logdir] jobfile\n"
+ "           -j jobs          jobs to run at once - default is the number of cores\n"
+ "           -o logdir        where the job<n>.log and job<n>.nas files go - default is .\n"
+            ,progname);
+    exit(255);
+}
+
+int main(int argc, char **argv){
+
+    int c;
+    int maxjobs = SDL_GetCPUCount();
+
+    while ((c = getopt(argc, argv, "j:o:")) != EOF){
+        switch (c) {
+        case 'j':
+            maxjobs = atoi(optarg);
+            break;
+        case 'o':
+            logdir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || maxjobs < 1){
+        usage(argv[0]);
+    }
+
+    jobfile = fopen(argv[optind], "r");
+    if (jobfile == NULL){
+        perror(argv[optind]);
+        return 255;
+    }
+    jobfilelock = SDL_CreateMutex();
+    setuplock = SDL_CreateMutex();
+    reportlock = SDL_CreateMutex();
+    SDL_Thread **workers = calloc(maxjobs, sizeof(SDL_Thread *));
+    if (jobfilelock == NULL || setuplock == NULL || reportlock == NULL || workers == NULL){
+        fprintf(stderr, "Could not set up the workers: %s\n", SDL_GetError());
+        return 255;
+    }
+
+    time_t batchstart = time(NULL);
+    // the machines' device messages go through the one log thread
+    if (log_start() != 0){
+        fprintf(stderr, "Log thread could not be started: %s\n", SDL_GetError());
+    }
+    int running = 0;
+    for (int i = 0; i < maxjobs; i++){
+        char name[32];
+        snprintf(name, sizeof(name), "nasbatch%d", i + 1);
+        workers[i] = SDL_CreateThread(worker, name, NULL);
+        if (workers[i] == NULL){
+            fprintf(stderr, "Worker %d could not be started: %s\n", i + 1, SDL_GetError());
+        }
+        else {
+            running++;
+        }
+    }
+    if (running == 0){
+        // do the jobs here instead
+        worker(NULL);
+    }
+    for (int i = 0; i < maxjobs; i++){
+        SDL_WaitThread(workers[i], NULL);
+    }
+    log_stop();
+
+    fclose(jobfile);
+    free(workers);
+    SDL_DestroyMutex(jobfilelock);
+    SDL_DestroyMutex(setuplock);
+    SDL_DestroyMutex(reportlock);
+
+    fprintf(stdout, "%d jobs, %d failed, in %lds with up to %d at once\n", jobsstarted, jobsfailed,
+            (long)(time(NULL) - batchstart), running > 0 ? running : 1);
+    return jobsfailed > 255 ? 255 : jobsfailed;
+}
+
+// end of file
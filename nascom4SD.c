@@ -6,243 +6,377 @@
 
 #include <stdlib.h>            // std libraries
 #include <stdio.h>
-#include <assert.h>
+#include <string.h>
 
 #include "options.h"           // defines the options to use
+#include "simz80.h"
 #include "nascom4SD.h"         // define the SDcard stuff
+#include "diskimage.h"         // mapped image file
+#include "snapshot.h"
+#include "log.h"
 
-// Logical block address written through SDLBA2/1/0
-static unsigned int lba;
+typedef struct SDCARD {
+    // Logical block address written through SDLBA2/1/0
+    unsigned int lba;
 
-// Track state
-// 0 no image file
-// 1 initialising
-// 2 idle
-// 3 read command
-// 4 write command
-static int state = 0;
+    // Track state
+    // 0 no image file
+    // 1 initialising
+    // 2 idle
+    // 3 read command
+    // 4 write command
+    int state;
 
-// How many times we've polled waiting
-static int poll;
+    // How many times we've polled waiting
+    int poll;
 
-// On write command, sector buffer is filled with 0 and SDindex is set to 0. Write data
-// goes to the buffer and writes increment SDindex. Finally, the buffer is flushed to the disk image.
-// On read command, sector buffer is loaded from disk image and SDindex is set to 0. Read data
-// comes from the buffer and reads increment SDindex.
-static unsigned char sector[512];
-static int index;
+    // fast SD - blocks the next command transfers, and blocks still to come in the current one
+    int blocks;
+    int blocksleft;
 
-static FILE * sd_file;
+    // On a read or write command sectordata is pointed at the block in the mapped disk image
+    // and index is set to 0. Data is read or written in place and increments index.
+    // sector[] stands in for a block outside the image: reads return 0xff and writes are dropped.
+    unsigned char sector[512];
+    unsigned char * sectordata;
+    int index;
+
+    DISKIMAGE sd_image;
+} SDCARD;
+
+// give the machine its controller, with no image file
+void SDCreate(struct machine *m)
+{
+    SDCARD *sd = calloc(1, sizeof(SDCARD));
+    if (sd == NULL) {
+        fprintf(m->err, "Out of memory for the SDcard controller\n");
+        exit(1);
+    }
+    sd->blocks = 1;
+    sd->sectordata = sd->sector;
+    m->sd = sd;
+}
+
+void SDFree(struct machine *m)
+{
+    free(m->sd);
+    m->sd = NULL;
+}
+
+// the block selected by lba in the image - sector[] if it is outside the image
+static unsigned char * lba_block(struct machine *m, int forwrite)
+{
+    SDCARD *sd = m->sd;
+    unsigned char * block = diskimage_sector(&sd->sd_image, (off_t)sd->lba << 9, sizeof(sd->sector));
+    if (block == NULL) {
+        LOG(m, LOG_SD, LOG_ERROR, "ERROR SD address 0x%llx is past the end of the image\n", (unsigned long long)sd->lba << 9);
+    }
+    else if (forwrite && sd->sd_image.readOnly) {
+        LOG(m, LOG_SD, LOG_ERROR, "ERROR SD write to address 0x%llx but the image is read only\n", (unsigned long long)sd->lba << 9);
+        block = NULL;
+    }
+    if (block == NULL) {
+        memset(sd->sector, 0xff, sizeof(sd->sector));
+        return sd->sector;
+    }
+    return block;
+}
 
 // print 512-byte buffer in hex and ASCII
-// Buffer is in sector[] and its start address
+// Buffer is at sectordata and its start address
 // is addr.
-void dump_buffer(int addr)
+void dump_buffer(struct machine *m, int addr)
 {
+    SDCARD *sd = m->sd;
     for (int i = 0; i<16; i++) {
-        fprintf(stdout,"%08x: ", addr+i*32);
+        fprintf(m->out, "%08x: ", addr+i*32);
         for (int j = 0; j<32; j++) {
             if (j%8 == 0) {
-                fprintf(stdout," ");
+                fprintf(m->out, " ");
             }
-            fprintf(stdout,"%02x ",sector[i*32+j]);
+            fprintf(m->out, "%02x ",sd->sectordata[i*32+j]);
         }
-        fprintf(stdout," ");
+        fprintf(m->out, " ");
         for (int j = 0; j<32; j++) {
             if (j%8 == 0) {
-                fprintf(stdout," ");
+                fprintf(m->out, " ");
             }
-            if ((sector[i*32+j] < 0x7f) && (sector[i*32+j] > 0x1f)) {
-                fprintf(stdout,"%c", sector[i*32+j]);
+            if ((sd->sectordata[i*32+j] < 0x7f) && (sd->sectordata[i*32+j] > 0x1f)) {
+                fprintf(m->out, "%c", sd->sectordata[i*32+j]);
             }
             else {
-                fprintf(stdout,".");
+                fprintf(m->out, ".");
             }
         }
-        fprintf(stdout,"\n");
+        fprintf(m->out, "\n");
     }
 }
 
 
-extern int SDMountDisk(char * filename)
+// filename is image[,overlay[,keep|discard|commit]]
+extern int SDMountDisk(struct machine *m, char * filename)
 {
-    sd_file = fopen(filename, "r+b");
-    if (sd_file == NULL) {
-        fprintf(stdout, "SDcard failed to load '%s', ignoring it.\n", filename);
-        perror(filename);
+    SDCARD *sd = m->sd;
+    char * overlayname = strchr(filename, ',');
+    int overlayexit = OVERLAY_KEEP;
+    int result;
+
+    if (overlayname != NULL) {
+        *overlayname++ = 0;
+        char * exitname = strchr(overlayname, ',');
+        if (exitname != NULL) {
+            *exitname++ = 0;
+            overlayexit = diskimage_overlay_exit(exitname);
+            if (overlayexit < 0) {
+                fprintf(m->out, "SDcard overlay - unrecognised '%s', keeping the overlay.\n", exitname);
+                overlayexit = OVERLAY_KEEP;
+            }
+        }
+        // the image is only read, blocks written go to the overlay
+        result = diskimage_open_overlay(&sd->sd_image, filename, overlayname, sizeof(sd->sector), overlayexit,
+                                        m->out, m->err);
+    }
+    else {
+        // mapped so a large image mounts at once and only the blocks used are read in
+        result = diskimage_open(&sd->sd_image, filename, m->out, m->err);
+    }
+    if (result != 0) {
+        fprintf(m->out, "SDcard failed to load '%s', ignoring it.\n", filename);
     }
     else {
-        fprintf(stdout, "Mount SDcard, image file '%s'\n", filename);
-        state = 1;
+        fprintf(m->out, "Mount SDcard, image file '%s'%s%s%s\n", filename, sd->sd_image.readOnly ? " read only" : "",
+                overlayname != NULL ? " overlay " : "", overlayname != NULL ? overlayname : "");
+        sd->state = 1;
     }
     return 0;
 }
 
 
+// the last byte of a block has gone - on to the next block of a multi block command or back to idle
+static void block_done(struct machine *m, int forwrite)
+{
+    SDCARD *sd = m->sd;
+    if (sd->blocksleft > 0) {
+        sd->blocksleft--;
+        sd->lba = (sd->lba + 1) & 0xffffff;
+        sd->sectordata = lba_block(m, forwrite);
+        sd->index = 0;
+    }
+    else {
+        sd->state = 2;
+    }
+}
+
+// the last byte of a block written has gone - the data is already in the image
+static void block_written(struct machine *m)
+{
+    SDCARD *sd = m->sd;
+    if (sd->sectordata != sd->sector) {
+        diskimage_written(&sd->sd_image, (off_t)sd->lba << 9, sizeof(sd->sector));
+        LOG(m, LOG_SD, LOG_DEBUG, "WROTE THE DATA for address 0x%llx\n", (unsigned long long)sd->lba << 9);
+    }
+    block_done(m, 1);
+}
+
+// fast SD
+// the data is always ready, so the bytes are taken as if the Z80 had polled for each one
+int SDFastRead(struct machine *m, unsigned char **data, int max)
+{
+    SDCARD *sd = m->sd;
+    if (!m->sdfastsd || sd->state != 3 || sd->index >= 512) {
+        return 0;
+    }
+    int count = 512 - sd->index < max ? 512 - sd->index : max;
+    *data = &sd->sectordata[sd->index];
+    sd->index += count;
+    sd->poll = 0;
+    if (sd->index == 512) {
+        // the bytes stay where they are in the image, even if this moves sectordata on
+        block_done(m, 0);
+    }
+    return count;
+}
+
+// fast SD
+// the caller copies count bytes to the returned pointer straight away
+unsigned char * SDFastWrite(struct machine *m, int *count, int max)
+{
+    SDCARD *sd = m->sd;
+    if (!m->sdfastsd || sd->state != 4 || sd->index >= 512) {
+        return NULL;
+    }
+    unsigned char *data = &sd->sectordata[sd->index];
+    *count = 512 - sd->index < max ? 512 - sd->index : max;
+    sd->index += *count;
+    sd->poll = 0;
+    return data;
+}
+
+// fast SD - the write has gone into the block, finish it if it is full
+void SDFastWritten(struct machine *m)
+{
+    SDCARD *sd = m->sd;
+    if (sd->state == 4 && sd->index == 512) {
+        block_written(m);
+    }
+}
+
 // [NAC HACK 2021Jul31] implement busy bit based on index so that code does not need a counter?
 // .. need to test on real hardware.
 // for read: when polling for data status goes A0->E0 when byte available, and to 80 at end of block
 // for write: when polling for space status goes 20->A0 when it can accept a byte and to 80 at end of block
 
-void outPortSD (unsigned int port, unsigned int wdata)
+void outPortSD (struct machine *m, unsigned int port, unsigned int wdata)
 {
-    int retvar;
-    //fprintf(stdout,"INFO outPortSD with port=0x%02x wdata=0x%02x poll=%d state=%d index=%d lba=0x%06x\n", port, wdata, poll, state, index, lba);
+    SDCARD *sd = m->sd;
+    LOG(m, LOG_SD, LOG_DEBUG, "INFO outPortSD with port=0x%02x wdata=0x%02x poll=%d state=%d index=%d lba=0x%06x\n", port, wdata, sd->poll, sd->state, sd->index, sd->lba);
     switch (port) {
     case SDDATA:
-        switch (state) {
+        switch (sd->state) {
         case 0: case 1: case 2: case 3:
-            fprintf(stdout,"ERROR attempt to write to SD data during SD block read\n");
+            LOG(m, LOG_SD, LOG_ERROR, "ERROR attempt to write to SD data during SD block read\n");
             break;
         case 4: // in write
-            if (poll == 3) {
-                poll = 0;
-                if (index < 512) {
-                    sector[index++] = wdata;
-                    if (index == 512) {
-                        state = 2; // back to idle.
-                        // commit the data
-                        if (fseek(sd_file, lba<<9, SEEK_SET)) {
-                            fprintf(stdout,"ERROR seek to SD address 0x%x for write failed\n", lba<<9);
-                        }
-                        else {
-                            retvar = fwrite(sector, sizeof(sector), 1, sd_file);
-                            assert(retvar != -1);
-                            fprintf(stdout,"WROTE THE DATA for address 0x%x and got retvar %d\n", lba<<9, retvar);
-                            //                            dump_buffer(lba<<9);
-                        }
+            if (sd->poll == 3) {
+                sd->poll = 0;
+                if (sd->index < 512) {
+                    sd->sectordata[sd->index++] = wdata;
+                    if (sd->index == 512) {
+                        //                            dump_buffer(lba<<9);
+                        block_written(m);
                     }
                 }
                 else {
-                    fprintf(stdout,"ERROR attempt to write too much data to SD data\n");
+                    LOG(m, LOG_SD, LOG_ERROR, "ERROR attempt to write too much data to SD data\n");
                 }
             }
             else {
-                fprintf(stdout,"ERROR attempt to write to SD data while busy\n");
+                LOG(m, LOG_SD, LOG_ERROR, "ERROR attempt to write to SD data while busy\n");
             }
             break;
         }
         break;
     case SDCONTROL:
-        switch (state) {
+        switch (sd->state) {
         case 0:
-            fprintf(stdout,"ERROR attempt to write to SD control but no SD image file\n");
+            LOG(m, LOG_SD, LOG_ERROR, "ERROR attempt to write to SD control but no SD image file\n");
             break;
         case 1:
-            fprintf(stdout,"ERROR attempt to write to SD control but still initialising\n");
+            LOG(m, LOG_SD, LOG_ERROR, "ERROR attempt to write to SD control but still initialising\n");
             break;
         case 2:
-            poll = 0;
+            sd->poll = 0;
             switch (wdata) {
             case 0: // read command
-                //fprintf(stdout,"INFO SD READ: port=0x%02x wdata=0x%02x poll=%d state=%d index=%d lba=0x%06x (0x%08x)\n", port, wdata, poll, state, index, lba, lba<<9);
-                if (fseek(sd_file, lba<<9, SEEK_SET)) {
-                    fprintf(stdout,"ERROR seek to SD offset address 0x%x for read failed\n", lba<<9);
-                    for (index = 0; index < 512; index++) {
-                        sector[index] = 0xff;
-                    }
-                }
-                else {
-                    retvar = fread(sector, sizeof(sector), 1, sd_file);
-                    assert(retvar != -1);
-                }
+                LOG(m, LOG_SD, LOG_INFO, "INFO SD READ: port=0x%02x wdata=0x%02x poll=%d state=%d index=%d lba=0x%06x (0x%08x)\n", port, wdata, sd->poll, sd->state, sd->index, sd->lba, sd->lba<<9);
+                sd->blocksleft = sd->blocks - 1;
+                sd->blocks = 1;
+                sd->sectordata = lba_block(m, 0);
                 //                dump_buffer(lba<<9);
-                state = 3;
-                index = 0;
+                sd->state = 3;
+                sd->index = 0;
                 break;
             case 1: // write command
-                //fprintf(stdout,"INFO SD WRITE: port=0x%02x wdata=0x%02x poll=%d state=%d index=%d lba=0x%06x (0x%08x)\n", port, wdata, poll, state, index, lba, lba<<9);
-                state = 4;
-                index = 0;
+                LOG(m, LOG_SD, LOG_INFO, "INFO SD WRITE: port=0x%02x wdata=0x%02x poll=%d state=%d index=%d lba=0x%06x (0x%08x)\n", port, wdata, sd->poll, sd->state, sd->index, sd->lba, sd->lba<<9);
+                sd->blocksleft = sd->blocks - 1;
+                sd->blocks = 1;
+                sd->sectordata = lba_block(m, 1);
+                sd->state = 4;
+                sd->index = 0;
                 break;
             default:
-                fprintf(stdout,"ERROR unknown SD command 0x%02x\n", wdata);
+                LOG(m, LOG_SD, LOG_ERROR, "ERROR unknown SD command 0x%02x\n", wdata);
                 break;
             }
             break;
         case 3:
-            fprintf(stdout,"ERROR attempt to write to SD control during SD block read\n");
+            LOG(m, LOG_SD, LOG_ERROR, "ERROR attempt to write to SD control during SD block read\n");
             break;
         case 4:
-            fprintf(stdout,"ERROR attempt to write to SD control during SD block write\n");
+            LOG(m, LOG_SD, LOG_ERROR, "ERROR attempt to write to SD control during SD block write\n");
             break;
         default:
-            fprintf(stdout,"ERROR write to SD control when state is %d\n",state);
+            LOG(m, LOG_SD, LOG_ERROR, "ERROR write to SD control when state is %d\n",sd->state);
             break;
         }
         break;
     case SDLBA0: // SDLBA0
-        lba = (lba & 0xffff00) | (0xff & wdata);
-        //fprintf(stdout,"INFO outPortSD port=0x%02x wdata=0x%02x now lba=0x%06x\n", port, wdata, lba);
+        sd->lba = (sd->lba & 0xffff00) | (0xff & wdata);
+        LOG(m, LOG_SD, LOG_DEBUG, "INFO outPortSD port=0x%02x wdata=0x%02x now lba=0x%06x\n", port, wdata, sd->lba);
         break;
     case SDLBA1: // SDLBA1
-        lba = (lba & 0xff00ff) | ((0xff & wdata) << 8);
-        //fprintf(stdout,"INFO outPortSD port=0x%02x wdata=0x%02x now lba=0x%06x\n", port, wdata, lba);
+        sd->lba = (sd->lba & 0xff00ff) | ((0xff & wdata) << 8);
+        LOG(m, LOG_SD, LOG_DEBUG, "INFO outPortSD port=0x%02x wdata=0x%02x now lba=0x%06x\n", port, wdata, sd->lba);
         break;
     case SDLBA2: // SDLBA2
-        lba = (lba & 0x00ffff) | ((0xff & wdata) << 16);
-        //fprintf(stdout,"INFO outPortSD port=0x%02x wdata=0x%02x now lba=0x%06x\n", port, wdata, lba);
+        sd->lba = (sd->lba & 0x00ffff) | ((0xff & wdata) << 16);
+        LOG(m, LOG_SD, LOG_DEBUG, "INFO outPortSD port=0x%02x wdata=0x%02x now lba=0x%06x\n", port, wdata, sd->lba);
+        break;
+    case SDBLOCKS: // fast SD only
+        sd->blocks = wdata == 0 ? 1 : wdata;
         break;
     }
 }
 
 
-int inPortSD(unsigned int port)
+int inPortSD(struct machine *m, unsigned int port)
 {
-    //fprintf(stdout,"INFO inPortSD with port=0x%02x poll=%d state=%d index=%d lba=0x%06x\n", port, poll, state, index, lba);
+    SDCARD *sd = m->sd;
+    LOG(m, LOG_SD, LOG_DEBUG, "INFO inPortSD with port=0x%02x poll=%d state=%d index=%d lba=0x%06x\n", port, sd->poll, sd->state, sd->index, sd->lba);
     switch (port) {
     case SDDATA:
-        switch (state) {
+        switch (sd->state) {
         case 0: case 1: case 2:
             return 0xff;
         case 3: // in read
-            if (poll == 3) {
-                poll = 0;
-                if (index == 511) {
-                    state = 2; // final read then back to idle
-                }
-                if (index < 512) {
-                    return sector[index++];
+            if (sd->poll == 3) {
+                sd->poll = 0;
+                if (sd->index < 512) {
+                    int rdata = sd->sectordata[sd->index++];
+                    if (sd->index == 512) {
+                        block_done(m, 0); // final read then back to idle
+                    }
+                    return rdata;
                 }
                 else {
-                    fprintf(stdout,"ERROR attempt to read too much data from SD block\n");
+                    LOG(m, LOG_SD, LOG_ERROR, "ERROR attempt to read too much data from SD block\n");
                     return 0xff;
                 }
             }
             else {
-                fprintf(stdout,"ERROR attempt to read SD block when data not yet available\n");
+                LOG(m, LOG_SD, LOG_ERROR, "ERROR attempt to read SD block when data not yet available\n");
                 return 0xff;
             }
         case 4: // in write
-            fprintf(stdout,"ERROR attempt to read SD data during write\n");
+            LOG(m, LOG_SD, LOG_ERROR, "ERROR attempt to read SD data during write\n");
             return 0xff;
         }
         break; // unreachable
     case SDCONTROL:
-        switch (state)
+        switch (sd->state)
             {
             case 0: // busy and always will remain so
                 return 0x90;
             case 1: // count polls and initialise
-                poll++;
-                if (poll == 16)
-                    state = 2;
+                sd->poll++;
+                if (sd->poll == 16)
+                    sd->state = 2;
                 return 0x90;
             case 2: // idle.
                 return 0x80;
             case 3: // in read
-                if (poll < 3)
-                    poll++;
-                if (poll == 3) {
+                if (sd->poll < 3)
+                    sd->poll++;
+                if (sd->poll == 3) {
                     return 0xe0; // data available
                 }
                 else {
                     return 0xa0; // still waiting
                 }
             case 4: // in write
-                if (poll < 3)
-                    poll++;
-                if (poll == 3) {
+                if (sd->poll < 3)
+                    sd->poll++;
+                if (sd->poll == 3) {
                     return 0xa0; // space available
                 }
                 else {
@@ -254,4 +388,36 @@ int inPortSD(unsigned int port)
     return 0x00; // return default rdata
 }
 
+// flush and unmap the image - called when the emulator stops
+void SDUnmountDisk(struct machine *m)
+{
+    SDCARD *sd = m->sd;
+    diskimage_close(&sd->sd_image);
+    sd->state = 0;
+}
+
+// save or restore the controller registers
+// a block part way through a read or write is given up, the controller goes back to idle
+void SDSnapshot(struct machine *m, SNAPSHOT *s){
+
+    SDCARD *sd = m->sd;
+    int registers[4] = { (int)sd->lba, sd->state, sd->poll, sd->blocks };
+
+    snapshot_data(s, "sdcard", registers, sizeof(registers));
+    if (s->restoring && !s->error){
+        sd->lba = registers[0];
+        sd->poll = registers[2];
+        sd->blocks = registers[3];
+        sd->blocksleft = 0;
+        if (sd->sd_image.base == NULL){
+            sd->state = 0;
+        }
+        else {
+            sd->state = registers[1] > 2 ? 2 : registers[1];
+        }
+        sd->sectordata = sd->sector;
+        sd->index = 0;
+    }
+}
+
 // end of code
@@ -71,6 +71,14 @@
 -- At HW level each data transfer is 515 bytes: a start byte, 512 data bytes,
 -- 2 CRC bytes. CRC need not be valid in SPI mode, *except* for CMD0.
 --
+-- Fast SD ( the --fastsd option ) - not on the real controller
+-- The data is always ready, so INIR and OTIR on SDDATA move up to 256 bytes
+-- without polling SDSTATUS, and there is one more register:
+-- 0x15    SDBLOCKS      write-only
+-- The number of consecutive blocks, from SDLBA, the next read or write
+-- command transfers - as one stream of 512 * SDBLOCKS bytes through SDDATA.
+-- 0 is taken as 1, and it goes back to 1 after the command.
+--
 -- SDCARD specification can be downloaded from
 -- https://www.sdcard.org/downloads/pls/
 -- All you need is the "Part 1 Physical Layer Simplified Specification"
@@ -89,15 +97,28 @@
 #define SDLBA0    (0x12)
 #define SDLBA1    (0x13)
 #define SDLBA2    (0x14)
+#define SDBLOCKS  (0x15)        // fast SD only
+
+struct machine;
+
+// give the machine its controller, and free it again - the state is only seen in nascom4SD.c
+extern void SDCreate(struct machine *m);
+extern void SDFree(struct machine *m);
 
-extern int SDMountDisk(char * filename); // call to mount SDcard image
+extern int SDMountDisk(struct machine *m, char * filename); // call to mount SDcard image
+extern void SDUnmountDisk(struct machine *m);        // flush and release the SDcard image
 
-// global variables to allow for debug etc.,
-//extern int vfcfloppydebug;
-//extern int vfcfloppydisplaysectors;
+void outPortSD(struct machine *m, unsigned int port, unsigned int wdata);
+int inPortSD(struct machine *m, unsigned int port);
 
-void outPortSD(unsigned int port, unsigned int wdata);
-int inPortSD(unsigned int port);
+// fast SD - called by simz80 for INIR or OTIR on SDDATA, or a recognised read loop, when sdfastsd is set in the machine
+// the bytes of a read, up to max, still to come in the block - returns how many and
+// points *data at them, 0 if none
+extern int SDFastRead(struct machine *m, unsigned char **data, int max);
+// where the bytes of a write, up to max, go in the block - *count of them, NULL if none
+// copy them there and then call SDFastWritten
+extern unsigned char * SDFastWrite(struct machine *m, int *count, int max);
+extern void SDFastWritten(struct machine *m);
 
 
 #endif
@@ -4,12 +4,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <getopt.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <SDL2/SDL.h>
 #include "nasutils.h"
 #include "simz80.h"
 #include "map80nascom.h"
+#include "map80ram.h"
 #include "utilities.h"
 
 // Expect a line of text from a NAS file. It should start with 1, 4-digit hex address and either
@@ -18,7 +22,7 @@
 // return 0 if address and at least 1 data byte and no checksum error OR if valid end
 // otherwise return 1.
 // bytes[] holds 8 elements; count is the number of valid bytes
-int parseNASline(int line, const char *buf, int *address, int *count, unsigned int *bytes)
+int parseNASline(struct machine *m, int line, const char *buf, int *address, int *count, unsigned int *bytes)
 {
     unsigned int checksum;
     *count = sscanf(buf, "%4x %2x %2x %2x %2x %2x %2x %2x %2x %2x", address,
@@ -50,7 +54,7 @@ int parseNASline(int line, const char *buf, int *address, int *count, unsigned i
             return 0;
         }
         else {
-            if (verbose) printf("\tError on line %d - calculated checksum 0x%2X does not match 0x%2X\n",line, calcsum & 0xff, checksum);
+            if (m->verbose) fprintf(m->out, "\tError on line %d - calculated checksum 0x%2X does not match 0x%2X\n",line, calcsum & 0xff, checksum);
             return 1;
         }
     }
@@ -61,6 +65,41 @@ int parseNASline(int line, const char *buf, int *address, int *count, unsigned i
 }
 
 
+// the roms loaded so far - each is held once, however many machines load it
+typedef struct SHAREDROM {
+    struct SHAREDROM *next;
+    size_t size;
+    BYTE image[];
+} SHAREDROM;
+
+static SHAREDROM *sharedroms;
+static SDL_SpinLock sharedromslock;    // machines can be set up at the same time by nasbatch
+
+// a read only copy of the rom image, shared with any other machine that loaded the same one
+// returns NULL if there is no memory for it
+BYTE * sharedrom(const BYTE *image, size_t size)
+{
+    SHAREDROM *rom;
+
+    SDL_AtomicLock(&sharedromslock);
+    for (rom = sharedroms; rom != NULL; rom = rom->next){
+        if (rom->size == size && memcmp(rom->image, image, size) == 0){
+            break;
+        }
+    }
+    if (rom == NULL){
+        rom = malloc(sizeof(SHAREDROM) + size);
+        if (rom != NULL){
+            rom->size = size;
+            memcpy(rom->image, image, size);
+            rom->next = sharedroms;
+            sharedroms = rom;
+        }
+    }
+    SDL_AtomicUnlock(&sharedromslock);
+    return rom == NULL ? NULL : rom->image;
+}
+
 // load a Nascom NAS format file into memory.
 // It can be any filename.
 // The extention is normally .nas, but can be .nal
@@ -73,7 +112,7 @@ int parseNASline(int line, const char *buf, int *address, int *count, unsigned i
 // returns 0 if all okay anything else is a failure
 // will load into ram space but if .nal file it will create a rom space 
 // and copy it from ram space to there.
-int loadNASformat(const char *filetoload)
+int loadNASformat(struct machine *m, const char *filetoload)
 {
     int retval=0;
     int firstaddress=-1;
@@ -84,7 +123,7 @@ int loadNASformat(const char *filetoload)
     int namelen=0;
 
     namelen=strlen(filetoload);
-    if (verbose) printf("Loading %s\n", filetoload);
+    if (m->verbose) fprintf(m->out, "Loading %s\n", filetoload);
 
     // find the . in the file name
     for (count1=namelen;count1>0;count1--){
@@ -96,12 +135,12 @@ int loadNASformat(const char *filetoload)
     count1++; // allow for the .
     // check if we have any extension 
     if (count1<1){
-        if (verbose) printf("\tWarning - No extention on file %s\n", filetoload);
+        if (m->verbose) fprintf(m->out, "\tWarning - No extention on file %s\n", filetoload);
         count1=namelen;
     }
     // check extention name not too long
     if ((namelen-count1)>10){
-        if (verbose) printf("\tWarning - extention on file %s too long, max 10\n", filetoload);
+        if (m->verbose) fprintf(m->out, "\tWarning - extention on file %s too long, max 10\n", filetoload);
         count1=namelen;
     }
     
@@ -112,30 +151,30 @@ int loadNASformat(const char *filetoload)
     fileext[count2]=0; // mark end
 
     // split it out to make it easier to read the code :)
-    retval=loadNASformatinternal(filetoload,&firstaddress,&lastaddress );
+    retval=loadNASformatinternal(m, filetoload,&firstaddress,&lastaddress );
     
     // printf("loaded %s from %4.4X to %4.4X \n",filetoload,firstaddress,lastaddress);
     // allocate ROM type ( .nal file ) their own space when loading.
     // Cannot just lock the area in the first 64k - as we can move that into 32k lower or uppers :)
     // and it would appear in none locked areas.
     if (retval==0){
-        if (verbose) printf("\tLoaded %s into memory at address 0x%4.4X\n",filetoload,firstaddress);
+        if (m->verbose) fprintf(m->out, "\tLoaded %s into memory at address 0x%4.4X\n",filetoload,firstaddress);
         // check if it was a .nal type file
         if ( strcmp( fileext,"rom") == 0 ){
             // allocate some extra memory for it 
             int memoryused = lastaddress-firstaddress + 1;
-            if (verbose) printf("\tmemory used 0x%4.4X\n",memoryused);
+            if (m->verbose) fprintf(m->out, "\tmemory used 0x%4.4X\n",memoryused);
             // check that fist address is on a 2k boundary to calculate rampages to set
             // also if > 0x1000
             // if not could upset the nascom stuff if it tries to be rom
             if (firstaddress < 0x1000){
-                if (verbose) printf("\tcannot activate as ROM as below address 0x1000\n");
+                if (m->verbose) fprintf(m->out, "\tcannot activate as ROM as below address 0x1000\n");
             }
             else if ((firstaddress % 2048) > 0 ) {
-                if (verbose) printf("\tcannot activate as ROM as not starting on a 2k boundary\n");
+                if (m->verbose) fprintf(m->out, "\tcannot activate as ROM as not starting on a 2k boundary\n");
             }
             else if (memoryused > (8*1024)  ) {
-                if (verbose) printf("\tcannot activate as ROM as larger than 8k\n");
+                if (m->verbose) fprintf(m->out, "\tcannot activate as ROM as larger than 8k\n");
             }
             else {
                 // the memory must be in 2k chunks
@@ -143,24 +182,24 @@ int loadNASformat(const char *filetoload)
                 if (remainder > 0 ) {
                     memoryused=((memoryused/2048)+1)*2048;   // add extra 2k 
                 }
-                if (verbose) printf("\tmemory used now 0x%4.4X actual 0x%4.4X\n",memoryused,(unsigned int)(memoryused  * sizeof(BYTE)));
-                // allocate memory for the rom
-                BYTE * newmemory = malloc(memoryused  * sizeof(BYTE)); 
+                if (m->verbose) fprintf(m->out, "\tmemory used now 0x%4.4X actual 0x%4.4X\n",memoryused,(unsigned int)(memoryused  * sizeof(BYTE)));
+                // copy the info from the virtual memory to the rom space
+                // used the slow method as the ram may not be contiguous ?
+                BYTE image[8*1024];
+                int copycount=0;
+                for (copycount=0;copycount<memoryused;copycount++){
+                    image[copycount]=RAM(firstaddress+copycount);
+                }
+                // the rom space - shared with any other machine that loads it
+                BYTE * newmemory = sharedrom(image, memoryused);
                 if (newmemory==NULL){
                     // whoops that failed 
-                    printf("\tWarning - Unable to allocate 0x%4.4X ROM space for %s\n",(unsigned int)(memoryused  * sizeof(BYTE)),filetoload);
+                    fprintf(m->out, "\tWarning - Unable to allocate 0x%4.4X ROM space for %s\n",(unsigned int)(memoryused  * sizeof(BYTE)),filetoload);
                 }
                 else{
-                    // memory allocated 
-                    // copy the info from the virtual memory to the rom space
-                    // used the slow method as the ram may not be contiguous ?
-                    int copycount=0;
                     for (copycount=0;copycount<memoryused;copycount++){
-                        newmemory[copycount]=RAM(firstaddress+copycount);
                         RAM(firstaddress+copycount)=0x76;   // reset it to HALT 
                     }
-                    copycount--;    // backup 1
-                    // printf("Last mem copied add %4.4X count %4.4X value %2.2X \n",firstaddress+copycount,copycount,newmemory[copycount]);
                     // now point at it from rampagetable
                     // which entry do we need to use
                     int rampageentry = ((firstaddress)>>RAMPAGESHIFTBITS) & RAMPAGETABLESIZEMASK;
@@ -168,31 +207,31 @@ int loadNASformat(const char *filetoload)
 
                     for (int memoryusedcopy=memoryused ;memoryusedcopy>0 ;memoryusedcopy-=(RAMPAGESIZE*1024), rampageentry++ )  {
                         if (rampageentry<RAMPAGETABLESIZE){
-                            rampagetable[rampageentry]=newmemory;
-                            ramromtable[rampageentry]=1;    // say it is rom
-                            ramlocktable[rampageentry]=1;   // and active nas ram disable 
+                            m->rampagetable[rampageentry].host=newmemory;
+                            // say it is rom and active nas ram disable
+                            m->rampagetable[rampageentry].flags |= RAMPAGE_ROM | RAMPAGE_LOCKED;
                             //printf("rampage table %2.2x set to point to %p\n",rampageentry,newmemory);
                         }
                         else{
                             // should not happen but - - - -
-                            printf("\tError - rampageentry %d past top of RAMPAGETABLESIZE %d\n",rampageentry,RAMPAGETABLESIZE);
+                            fprintf(m->out, "\tError - rampageentry %d past top of RAMPAGETABLESIZE %d\n",rampageentry,RAMPAGETABLESIZE);
                             break;
                         }
                         newmemory+=(RAMPAGESIZE*1024);
                     }
-                    if (verbose) printf("\tLoaded into ROM at address 0x%4.4X for 0x%2.2X bytes\n",firstaddress,memoryused);
+                    if (m->verbose) fprintf(m->out, "\tLoaded into ROM at address 0x%4.4X for 0x%2.2X bytes\n",firstaddress,memoryused);
                 }
             }
         }
     }
     else {
-        if (verbose) printf("\tWarning - problem loading %s\n",filetoload);
+        if (m->verbose) fprintf(m->out, "\tWarning - problem loading %s\n",filetoload);
     }
     return retval;
 }
 
 // process the file and returns first (lowest) and last (highest) address used
-int loadNASformatinternal(const char *filetoload, int *firstaddressused, int *lastaddressused )
+int loadNASformatinternal(struct machine *m, const char *filetoload, int *firstaddressused, int *lastaddressused )
 {
     int address;
     int validbytes;
@@ -210,21 +249,24 @@ int loadNASformatinternal(const char *filetoload, int *firstaddressused, int *la
     FILE *f = fopen(filetoload, "r");
 
     if (!f) {
-        perror(filetoload);
+        fprintf(m->err, "%s: %s\n", filetoload, strerror(errno));
         return 1;
     }
 
     // process file line by line
     while (fgets(line, sizeof line, f) != NULL) {
         lineNumber++;
-        retval |= parseNASline(lineNumber, line, &address, &validbytes, bytes);
+        retval |= parseNASline(m, lineNumber, line, &address, &validbytes, bytes);
 
         if (firstaddress > address) {
             firstaddress=address;
         }
 
         for (int i=0; i<validbytes; i++) {
+            // a file can be loaded over a rom, but not the one the machines share
+            map80RamUnshareRom(m, address);
             RAM(address)=bytes[i];
+            RAMPAGEWRITE(address, 1);
             if (lastaddress<address){
                 lastaddress=address;
             }
@@ -235,14 +277,14 @@ int loadNASformatinternal(const char *filetoload, int *firstaddressused, int *la
 
     fclose(f);
     if (firstaddress>0xFFFF){
-        if (verbose) printf("\tWarning: No data loaded\n");
+        if (m->verbose) fprintf(m->out, "\tWarning: No data loaded\n");
         retval=1;
     }
-    if (verbose){
+    if (m->verbose){
         if (retval){
-            printf("\tError(s) during load. Loaded %d bytes into memory (0x%04X - 0x%04X)\n", totalbytes, firstaddress, lastaddress);
+            fprintf(m->out, "\tError(s) during load. Loaded %d bytes into memory (0x%04X - 0x%04X)\n", totalbytes, firstaddress, lastaddress);
         } else {
-            printf("\tSuccessfully loaded %d bytes into memory (0x%04X - 0x%04X)\n", totalbytes, firstaddress, lastaddress);
+            fprintf(m->out, "\tSuccessfully loaded %d bytes into memory (0x%04X - 0x%04X)\n", totalbytes, firstaddress, lastaddress);
         }
     }
 
@@ -253,7 +295,7 @@ int loadNASformatinternal(const char *filetoload, int *firstaddressused, int *la
 }
 
 // load a nas file into a specific part of memory -- used to load the nassys3 and map80vfc rom file
-int loadNASformatspecial(const char *filetoload, unsigned char *memory, int memorySize)
+int loadNASformatspecial(struct machine *m, const char *filetoload, unsigned char *memory, int memorySize)
 {
     int address;
     int validbytes;
@@ -263,21 +305,21 @@ int loadNASformatspecial(const char *filetoload, unsigned char *memory, int memo
     int retval = 0;   // defaults to all okay
     int totalbytes = 0;
 
-    if (verbose) printf("Loading %s\n", filetoload);
+    if (m->verbose) fprintf(m->out, "Loading %s\n", filetoload);
 
     char line[80]; // one line from the .nas file
 
     FILE *f = fopen(filetoload, "r");
 
     if (!f) {
-        perror(filetoload);
+        fprintf(m->err, "%s: %s\n", filetoload, strerror(errno));
         return 1;
     }
 
     // process file line by line
     while (fgets(line, sizeof line, f) != NULL) {
         lineNumber++;
-        retval |= parseNASline(lineNumber, line, &address, &validbytes, bytes);
+        retval |= parseNASline(m, lineNumber, line, &address, &validbytes, bytes);
 
         for (int i=0; i<validbytes; i++){
             if (address < memorySize){
@@ -286,7 +328,7 @@ int loadNASformatspecial(const char *filetoload, unsigned char *memory, int memo
                 totalbytes++;
             }
             else {
-                if (verbose) printf("\t%s Address 0x%1X on line %d passed end of memory size 0x%1X \n",
+                if (m->verbose) fprintf(m->out, "\t%s Address 0x%1X on line %d passed end of memory size 0x%1X \n",
                                     filetoload,address,lineNumber,memorySize);
                 retval=1; // signify error - but process rest of file
                 break;
@@ -295,15 +337,15 @@ int loadNASformatspecial(const char *filetoload, unsigned char *memory, int memo
     }
 
     fclose(f);
-    if (verbose){
+    if (m->verbose){
         if (totalbytes<1){
-            printf("\tWarning: No data loaded\n");
+            fprintf(m->out, "\tWarning: No data loaded\n");
         }
         else {
             if (retval){
-                printf("\tError(s) during load. Loaded %d bytes into its own memory\n", totalbytes);
+                fprintf(m->out, "\tError(s) during load. Loaded %d bytes into its own memory\n", totalbytes);
             } else {
-                printf("\tSuccessfully loaded %d bytes into its own memory\n", totalbytes);
+                fprintf(m->out, "\tSuccessfully loaded %d bytes into its own memory\n", totalbytes);
             }
         }
     }
@@ -10,8 +10,15 @@
 #ifndef NASUTILS_H
 #define NASUTILS_H 1
 
-int loadNASformat(const char *file);
-int loadNASformatspecial(const char *file,  unsigned char *memory,  int memorySize);
-int loadNASformatinternal(const char *file,  int *firstaddressused, int *lastaddressused );
+#include <stddef.h>
+
+struct machine;
+
+int loadNASformat(struct machine *m, const char *file);
+int loadNASformatspecial(struct machine *m, const char *file,  unsigned char *memory,  int memorySize);
+int loadNASformatinternal(struct machine *m, const char *file,  int *firstaddressused, int *lastaddressused );
+
+// a read only copy of a rom image, shared by the machines that load the same one
+unsigned char * sharedrom(const unsigned char *image, size_t size);
 
 #endif
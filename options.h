@@ -12,6 +12,10 @@
 #ifndef options_h
 #define options_h
 
+// set to 1 for ports 00 to 0F of the Nascom 2 board to repeat at 10 to 1F etc., till 70 to 7F
+// as on the real board - the SDcard still has ports 10 to 14
+#define NASCOMPORTMIRRORS 1
+
 // keyboard - 
 // 0 = us keyboard
 // 1 = uk keyboard
@@ -20,10 +24,29 @@
 // set to 1 to show debug details for the vfc display
 #define VFCDISPLAYDEBUG 0   
 
-// set to 1 to display floppy debug details
+// set to 1 to display floppy debug details - the starting level of the floppy log category,
+// see log.h, can also be changed with the --log option
 #define VFCFLOPPYDEBUG 0
 // set to 1 to display floppy sectors read and written
 #define VFCFLOPPYDISPLAYSECTORS 0
+// when sectors written to a floppy image reach the host disk - sector, timer or exit
+// can be changed for each drive with the flush keyword in the drive config file
+#define FLOPPYFLUSHDEFAULT FLOPPYFLUSH_TIMER
+// seconds to hold written sectors before flushing for the timer flush policy
+#define FLOPPYFLUSHSECONDS 2
+// set to 1 to have the sector loops of the VFC boot rom and the CP/M bios done
+// as one host copy instead of a byte at a time - also the --fastdisk option
+#define FLOPPYFASTDISK 0
+// set to 1 to have INIR / OTIR and the polled read loops on the SDcard data port
+// move the block in one go, and add the SDBLOCKS multi block register - also the --fastsd option
+#define SDFASTSD 0
+// blocks of a compressed ( .zimg ) floppy or SDcard image kept unpacked, ZIMAGEBLOCKSIZE bytes each
+#define DISKIMAGECACHEBLOCKS 256
+
+// size of the serial tape read ahead and write behind buffers
+#define SERIALBUFFERSIZE 16384
+// seconds to hold serial output before writing it to the output file
+#define SERIALFLUSHSECONDS 1
 
 // set to 1 to show the nascom keyboard matrix each time nassys does a keyboard scan.
 // displayed when it does an index reset.
@@ -32,9 +55,43 @@
 // shows the sdl key values during processing
 #define DISPLAYKEYVALUES 0
 
-// display clock card processing
+// display clock card processing - or --log clock
 #define CHSCLOCKCARDDEBUG 0
 
+// display the MAP80 ram paging - or --log rampage
+#define MAP80RAMDEBUG 0
+
+// device log messages waiting to be written - must be a power of 2
+#define LOGRINGSIZE 4096
+// longest log message kept, the rest is cut off
+#define LOGTEXTSIZE 160
+// milliseconds between the log thread writing out the messages
+#define LOGDRAINMS 20
+
+// set to 1 to build the Z80 emulator with gcc computed goto dispatch
+// it also keeps the registers in local variables for the CB, DD and FD prefixes
+// normally set from the Makefile - make clean then make SIMZ80_THREADED=1
+#ifndef SIMZ80_THREADED
+#define SIMZ80_THREADED 0
+#endif
+
+// the host sleeps while the Z80 is idle - halted waiting for an interrupt, or reading
+// the same values from its ports this many times in a row from the same bit of code
+#define IDLEREADS 256
+// reads further apart than this many T-states are not a polling loop
+#define IDLEREADGAP 2000
+// the reads are all within this many bytes of the first
+#define IDLEPCRANGE 1024
+// longest the host sleeps for each time in milliseconds - less if an SDL event comes in
+#define IDLESLEEPMS 10
+
+// set to 0 to stop the Z80 emulator caching straight line code ( for debugging )
+#define Z80BLOCKCACHE 1
+// number of blocks cached - must be a power of 2
+#define BLOCKCACHESIZE 4096
+// most opcodes in a block
+#define BLOCKMAXOPS 16
+
 // define to use Memory Management unit
 // #define MMU 1
 // removed as always doing MMU
@@ -0,0 +1,91 @@
+/*  the Z80 I/O ports
+
+    see ports.h
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "options.h"
+#include "simz80.h"
+#include "ports.h"
+
+static int port_unknown_read(struct machine *m, void *context, unsigned int port){
+
+    if (m->verbose){
+        fprintf(m->out, "unknown input request from port %2.2X returning %2.2X\n", port, 0xFF);
+    }
+    return 0xFF;
+}
+
+static void port_unknown_write(struct machine *m, void *context, unsigned int port, unsigned char value){
+
+    if (m->verbose){
+        fprintf(m->out, "Unknown output to port %02x value %02x\n", port, value);
+    }
+}
+
+void port_clear(struct machine *m){
+
+    static const PORTHANDLER unknown = { port_unknown_read, port_unknown_write, NULL, NULL, NULL, NULL };
+
+    for (int port = 0; port < 256; port++){
+        m->porttable[port] = unknown;
+        m->portreads[port] = 0;
+        m->portwrites[port] = 0;
+    }
+}
+
+void port_register(struct machine *m, unsigned int first, unsigned int count,
+                   PORTREAD read, PORTWRITE write, void *context, const char *name){
+
+    PORTHANDLER *porttable = m->porttable;
+
+    for (unsigned int port = first; port < first + count && port < 256; port++){
+        if (read != NULL){
+            porttable[port].read = read;
+            porttable[port].readcontext = context;
+            porttable[port].readname = name;
+        }
+        if (write != NULL){
+            porttable[port].write = write;
+            porttable[port].writecontext = context;
+            porttable[port].writename = name;
+        }
+    }
+}
+
+void port_mirror(struct machine *m, unsigned int first, unsigned int count, unsigned int step, unsigned int last){
+
+    PORTHANDLER *porttable = m->porttable;
+
+    for (unsigned int base = first + step; base + count - 1 <= last && base < 256; base += step){
+        for (unsigned int i = 0; i < count; i++){
+            porttable[base + i] = porttable[first + i];
+        }
+    }
+}
+
+void port_counts(struct machine *m, FILE *out){
+
+    PORTHANDLER *porttable = m->porttable;
+
+    fprintf(out, "Port    reads   writes  device\n");
+    for (int port = 0; port < 256; port++){
+        if (m->portreads[port] == 0 && m->portwrites[port] == 0){
+            continue;
+        }
+        const char *readname = porttable[port].readname ? porttable[port].readname : "-";
+        const char *writename = porttable[port].writename ? porttable[port].writename : "-";
+        fprintf(out, " %2.2X %8llu %8llu  %s", port,
+                (unsigned long long)m->portreads[port], (unsigned long long)m->portwrites[port], readname);
+        if (porttable[port].writename != porttable[port].readname){
+            fprintf(out, " / %s", writename);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+// end of file
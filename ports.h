@@ -0,0 +1,55 @@
+/*  the Z80 I/O ports
+
+    Each of the 256 ports has a read and a write handler and a context
+    pointer for the device, so in() and out() are one table look up.
+    The cards in the machine register their ports at start up, see
+    portsInitialise in map80nascom.c, and an extra card only needs its
+    own handlers and a port_register call.
+    A port nothing has registered reads as FF and ignores writes, with a
+    message when verbose.
+
+    The reads and writes of each port are counted, and shown at the end
+    of the run when verbose, to see where a program spends its I/O.
+
+*/
+
+#ifndef PORTS_DEFINED_H
+#define PORTS_DEFINED_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct machine;
+
+typedef int (*PORTREAD)(struct machine *m, void *context, unsigned int port);
+typedef void (*PORTWRITE)(struct machine *m, void *context, unsigned int port, unsigned char value);
+
+typedef struct {
+    PORTREAD read;
+    PORTWRITE write;
+    void * readcontext;         // passed to the handlers
+    void * writecontext;
+    const char * readname;      // the device, for the port counts
+    const char * writename;
+} PORTHANDLER;
+
+// the table and the counts are in struct machine - see simz80.h
+
+// set every port of the machine back to nothing registered
+extern void port_clear(struct machine *m);
+
+// give count ports from first to a device - either handler can be NULL to leave
+// that direction as it is, and a later registration takes a port over
+extern void port_register(struct machine *m, unsigned int first, unsigned int count,
+                          PORTREAD read, PORTWRITE write, void *context, const char *name);
+
+// repeat ports first to first+count-1 every step ports up to port last
+// as when a card does not decode all of the address lines
+extern void port_mirror(struct machine *m, unsigned int first, unsigned int count, unsigned int step, unsigned int last);
+
+// show the ports that have been used and how often
+extern void port_counts(struct machine *m, FILE *out);
+
+#endif
+
+// end of file
@@ -9,6 +9,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <ctype.h>
 #include <stdbool.h>
@@ -20,16 +21,17 @@
 #include "map80ram.h"
 #include "sdlevents.h"
 #include "serial.h"
+#include "snapshot.h"
 
 int showkeymatrix=SHOWKEYMATRIX;
 int displaykeyvalues=DISPLAYKEYVALUES;
 
 // define which key processing routine is used.
-static void handle_key_event_dwim(SDL_Keysym keysym, bool keydown);
-static void handle_key_event_raw(SDL_Keysym keysym, bool keydown);
+static void handle_key_event_dwim(struct machine *m, SDL_Keysym keysym, bool keydown);
+static void handle_key_event_raw(struct machine *m, SDL_Keysym keysym, bool keydown);
 
 // fix DA changed start keyboard type
-static void (*handle_key_event)(SDL_Keysym, bool) = handle_key_event_dwim;
+static void (*handle_key_event)(struct machine *, SDL_Keysym, bool) = handle_key_event_dwim;
 static int rawkeyboard=0; // set to 1 if using raw keyboard
 
 // SDL initialize everything
@@ -52,7 +54,7 @@ int sdl_initialise(void){
 // service the SDL event processing
 // all screens generate events in the SDL_Event queue
 //
-void ui_serve_input(void)
+void ui_serve_input(struct machine *m)
 {
     SDL_Event event;
 
@@ -77,16 +79,16 @@ void ui_serve_input(void)
         case SDL_KEYUP:
             // key up or key down event
             // send the keycode, true if keydown event else false
-            handle_key_event(event.key.keysym, event.type == SDL_KEYDOWN);
+            handle_key_event(m, event.key.keysym, event.type == SDL_KEYDOWN);
             break;
         case SDL_QUIT:
-            printf("Quit\n");
-            action = DONE;
+            fprintf(m->out, "Quit\n");
+            m->action = DONE;
             return;
         case SDL_WINDOWEVENT:
             // handle a window close on a multiple window setup
             if (event.window.event == SDL_WINDOWEVENT_CLOSE){
-                action=DONE;
+                m->action=DONE;
                 return;
             }
             break;
@@ -109,33 +111,52 @@ void ui_serve_input(void)
  * 
    */
 
-static struct keymap {
-    unsigned char mask[8];
+struct keymap {
+    unsigned char mask[8];      /* Ch @  Sh Ct -  Nl Bs
+                                   Up T  X  F  5  B  H
+                                   Lt Y  Z  D  6  N  J
+                                   Dn U  S  E  7  M  K
+                                   Rt I  A  W  8  ,  L
+                                   Gr O  Q  3  9  .  ;
+                                   [  P  1  2  0  /  :
+                                   ]  R  Sp C  4  V  G  */
     unsigned char index;
-} keyboard  = {
-    {   0,   /* Ch @  Sh Ct -  Nl Bs */
-        0,  /* Up T  X  F  5  B  H  */
-        0,  /* Lt Y  Z  D  6  N  J  */
-        0,  /* Dn U  S  E  7  M  K  */
-        0,  /* Rt I  A  W  8  ,  L  */
-        0,  /* Gr O  Q  3  9  .  ;  */
-        0,  /* [  P  1  2  0  /  :  */
-        0  /* ]  R  Sp C  4  V  G  */
-    },
-    0};
-
-struct keymap keyboardcopy =  {
-    {
-        0,   /* Ch @  Sh Ct -  Nl Bs */
-        0,  /* Up T  X  F  5  B  H  */
-        0,  /* Lt Y  Z  D  6  N  J  */
-        0,  /* Dn U  S  E  7  M  K  */
-        0,  /* Rt I  A  W  8  ,  L  */
-        0,  /* Gr O  Q  3  9  .  ;  */
-        0,  /* [  P  1  2  0  /  :  */
-        0  /* ]  R  Sp C  4  V  G  */
-    },
-    0};
+};
+
+// the keyboard of one machine
+typedef struct KEYBOARD {
+    struct keymap keyboard;     // the matrix the Z80 scans
+    struct keymap keyboardcopy; // and the one the key events set
+
+    FILE *keyboardfile;         // headless - keys typed from this file, NULL once it is done
+    int scans;                  //   scans left in the current state
+    bool keydown;               //   a key is being held down
+    int row, bit;               //   where it is in the matrix
+    bool shift;                 //   and if it is typed with shift
+
+    unsigned char port0;        // value written to port 0 on the previous call
+} KEYBOARD;
+
+// give the machine its keyboard, with no keys down
+void keyboardCreate(struct machine *m){
+
+    KEYBOARD *kbd = calloc(1, sizeof(KEYBOARD));
+    if (kbd == NULL){
+        fprintf(m->err, "Out of memory for the keyboard\n");
+        exit(1);
+    }
+    m->keyboard = kbd;
+}
+
+void keyboardFree(struct machine *m){
+
+    // a run stopped before all the keys were typed
+    if (m->keyboard->keyboardfile != NULL && m->keyboard->keyboardfile != m->in){
+        fclose(m->keyboard->keyboardfile);
+    }
+    free(m->keyboard);
+    m->keyboard = NULL;
+}
 
 /*
 static char * kbd_translation[] = {
@@ -225,16 +246,13 @@ kbd_spec_w_ctrl   [] = "{" ___ ___    ___ ___ ___ ___ ___    ___ ___ ___  ___ __
 static const char
 kbd_spec_w_shctrl [] = ___ ___ ___    ___ "}" "|" "~" "\177" ___ ___ ___  ___ ___ ___ ___ ___ ___ ___ ___;
 
-// typedef enum { CONT = 0, RESET = 1, DONE = -1 } sim_action_t;
-sim_action_t action = CONT;
-
 // Ctr-Shift-Meta 0 -> the REAL # (instead of the pound symbol)
 // Ctrl-Space -> `
 
 /*
    handle the Function keys
 */
-static void handle_app_control(SDL_Keysym keysym, bool keydown)
+static void handle_app_control(struct machine *m, SDL_Keysym keysym, bool keydown)
 {
     if (keydown)
         switch (keysym.sym) {
@@ -242,54 +260,57 @@ static void handle_app_control(SDL_Keysym keysym, bool keydown)
             FILE *f;
             // TODO sort out screen dump
             f = fopen("screendump", "a+");
-            printf("byte at 0x800 %2.2X \n",RAM(0x800));
-            printf("byte at 0x900 %2.2X \n",RAM(0x900));
-            printf("pointer %p \n",&RAM(0x800));
+            fprintf(m->out, "byte at 0x800 %2.2X \n",RAM(0x800));
+            fprintf(m->out, "byte at 0x900 %2.2X \n",RAM(0x900));
+            fprintf(m->out, "pointer %p \n",&RAM(0x800));
             //fwrite((const void *) RAM(0x800), 1, 1024, f);
             // need the address of the RAM
             fwrite((const BYTE *) &RAM(0x800), 1, 1024, f);
             fclose(f);
-            if (verbose) printf("Screen dumped\n");
+            if (m->verbose) fprintf(m->out, "Screen dumped\n");
             break;
         }
         // DA Fix added F1 as NMI switch
         case SDLK_F1:
-            NMI_flag=1;
+            m->NMI_flag=1;
+            m->simevents |= SIMEVENT_NMI;
             break;
 
         case SDLK_F2:
-            if (traceon==1){
-                traceon=0;
+            if (m->traceon==1){
+                m->traceon=0;
+                m->simevents &= ~SIMEVENT_TRACE;
             }
             else {
-                traceon=1;
+                m->traceon=1;
+                m->simevents |= SIMEVENT_TRACE;
             }
             break;
         case SDLK_F3:
             // reset serial in
-            resetserialinput();
+            resetserialinput(m);
             break;
 
         case SDLK_F4:
-            action = DONE;
+            m->action = DONE;
             break;
 
         case SDLK_F5:
-            go_fast = !go_fast;
-            printf("Switch to %s\n", go_fast ? "fast" : "slow");
+            m->go_fast = !m->go_fast;
+            fprintf(m->out, "Switch to %s\n", m->go_fast ? "fast" : "slow");
             // has no impact as t_sim_delay only used on call to simz80 ????
-            t_sim_delay = go_fast ? FAST_DELAY : SLOW_DELAY;
+            m->t_sim_delay = m->go_fast ? FAST_DELAY : SLOW_DELAY;
             break;
 
         case SDLK_F6:
-            tape_led = tape_led_force ^= 1;
+            m->serial->tape_led = m->serial->tape_led_force ^= 1;
             break;
 
         case SDLK_F9:
-            action = RESET;
+            m->action = RESET;
             // this will reset PC to 0 need to reset hardware
-            out(0xFE,0); // reset paging on MAP80RAM card
-            out(0xEC,0); // reset paging on MAP80VFC
+            out(m, 0xFE,0); // reset paging on MAP80RAM card
+            out(m, 0xEC,0); // reset paging on MAP80VFC
             break;
 
         case SDLK_F10:
@@ -301,7 +322,7 @@ static void handle_app_control(SDL_Keysym keysym, bool keydown)
                 handle_key_event = handle_key_event_raw;
                 rawkeyboard=1;
             }
-            printf("Switch to %s keyboard\n",
+            fprintf(m->out, "Switch to %s keyboard\n",
                    handle_key_event == handle_key_event_raw ? "raw" : "dwim");
             break;
 
@@ -335,8 +356,9 @@ static void handle_app_control(SDL_Keysym keysym, bool keydown)
 * 
 */
 
-static void handle_key_event_dwim(SDL_Keysym keysym, bool keydown)
+static void handle_key_event_dwim(struct machine *m, SDL_Keysym keysym, bool keydown)
 {
+    KEYBOARD *kbd = m->keyboard;
     int i = -1, bit = 0;
     static bool ui_shift = false;
     static bool ui_ctrl  = false;
@@ -349,7 +371,7 @@ static void handle_key_event_dwim(SDL_Keysym keysym, bool keydown)
     if (displaykeyvalues!=0){
     //printf("key event\n");
         if ( (keysym.sym  > 31) && (keysym.sym  < 128 )){
-            fprintf(stdout,"dwim keyvalue [%02X] as char [%c] name [%s]  keystate [%s] - uppercase [%02X] \n",
+            fprintf(m->out, "dwim keyvalue [%02X] as char [%c] name [%s]  keystate [%s] - uppercase [%02X] \n",
                      keysym.sym,
                      (uint8_t)keysym.sym,
                      SDL_GetKeyName(keysym.sym),
@@ -357,7 +379,7 @@ static void handle_key_event_dwim(SDL_Keysym keysym, bool keydown)
                      ch);
         }
         else {
-            fprintf(stdout,"dwim keyvalue [%02X] name [%s] keystate [%s] - uppercase [%02X] \n",
+            fprintf(m->out, "dwim keyvalue [%02X] name [%s] keystate [%s] - uppercase [%02X] \n",
                     keysym.sym,
                     SDL_GetKeyName(keysym.sym),
                     keydown ? "down" : "up",
@@ -506,7 +528,7 @@ static void handle_key_event_dwim(SDL_Keysym keysym, bool keydown)
 
                 switch (keysym.sym) {
                     default:
-                        handle_app_control(keysym, keydown);
+                        handle_app_control(m, keysym, keydown);
                         break;
                 }
             }
@@ -524,31 +546,31 @@ translate:
 //    }
 
     if (emu_shift){
-        keyboardcopy.mask[0] |= 1 << 4;
+        kbd->keyboardcopy.mask[0] |= 1 << 4;
 //        printf("shift key down\n");
     }
     else{
-        keyboardcopy.mask[0] &= ~(1 << 4);
+        kbd->keyboardcopy.mask[0] &= ~(1 << 4);
 //        printf("shift key up\n");
     }
     if (emu_ctrl)
-        keyboardcopy.mask[0] |= 1 << 3;
+        kbd->keyboardcopy.mask[0] |= 1 << 3;
     else
-        keyboardcopy.mask[0] &= ~(1 << 3);
+        kbd->keyboardcopy.mask[0] &= ~(1 << 3);
 
     if (emu_graph){
-        keyboardcopy.mask[5] |= 1 << 6;
+        kbd->keyboardcopy.mask[5] |= 1 << 6;
     }
     else
-        keyboardcopy.mask[5] &= ~(1 << 6);
+        kbd->keyboardcopy.mask[5] &= ~(1 << 6);
 
     if (i != -1) {
         if (keydown){
-            keyboardcopy.mask[i] |= 1 << bit;
+            kbd->keyboardcopy.mask[i] |= 1 << bit;
 //            printf("mark %d bit %d set\n",i,bit);
         }
         else{
-            keyboardcopy.mask[i] &= ~(1 << bit);
+            kbd->keyboardcopy.mask[i] &= ~(1 << bit);
 //            printf("mark %d bit %d cleared\n",i,bit);
         }
     }
@@ -583,22 +605,23 @@ on US keyboards
 
 */
 
-static void handle_key_event_raw(SDL_Keysym keysym, bool keydown)
+static void handle_key_event_raw(struct machine *m, SDL_Keysym keysym, bool keydown)
 {
+    KEYBOARD *kbd = m->keyboard;
     int i = -1, bit = 0;
     
     // debug don't print control code
     if (displaykeyvalues!=0){
     //printf("key event\n");
         if ( (keysym.sym  > 31) && (keysym.sym  < 128 )){
-            fprintf(stdout,"dwim keyvalue [%02X] as char [%c] name [%s]  keystate [%s] \n",
+            fprintf(m->out, "dwim keyvalue [%02X] as char [%c] name [%s]  keystate [%s] \n",
                      keysym.sym,
                      (uint8_t)keysym.sym,
                      SDL_GetKeyName(keysym.sym),
                      keydown ? "down" : "up");
         }
         else {
-            fprintf(stdout,"dwim keyvalue [%02X] name [%s] keystate [%s] \n",
+            fprintf(m->out, "dwim keyvalue [%02X] name [%s] keystate [%s] \n",
                     keysym.sym,
                     SDL_GetKeyName(keysym.sym),
                     keydown ? "down" : "up");
@@ -665,7 +688,7 @@ static void handle_key_event_raw(SDL_Keysym keysym, bool keydown)
                         i = 0, bit = 1; break; // return/enter key  main keyboard
         default:
             // not one for Nascom so check if emulator control key
-            handle_app_control(keysym, keydown);
+            handle_app_control(m, keysym, keydown);
         }
     }
     // having identified the bit required
@@ -674,15 +697,121 @@ static void handle_key_event_raw(SDL_Keysym keysym, bool keydown)
 
     if (i != -1) {
         if (keydown)
-            keyboardcopy.mask[i] |= 1 << bit;
+            kbd->keyboardcopy.mask[i] |= 1 << bit;
         else
-            keyboardcopy.mask[i] &= ~(1 << bit);
+            kbd->keyboardcopy.mask[i] &= ~(1 << bit);
+    }
+}
+
+/*
+ * headless keyboard
+ * with no SDL events the keys are typed in from a file or pipe.
+ * Each character is held down for a few keyboard scans and then released
+ * for a few more so the monitor sees it as a separate key press.
+ * Lower case letters are typed with shift as on the Nascom keyboard.
+ */
+
+#define HEADLESSKEYDOWNSCANS 3  // keyboard scans a key is held down for
+#define HEADLESSKEYUPSCANS   3  // and then released for
+
+int setkeyboardinputfile(struct machine *m, char *filename){
+    KEYBOARD *kbd = m->keyboard;
+
+    if (strcmp(filename,"-")==0){
+        kbd->keyboardfile=m->in;
+    }
+    else {
+        kbd->keyboardfile=fopen(filename,"r");
+    }
+    if (kbd->keyboardfile==NULL){
+        fprintf(m->err, "Unable to open keyboard input file %s\n",filename);
+        return 1;
+    }
+    return 0;
+}
+
+int keyboardinputwaiting(struct machine *m){
+    KEYBOARD *kbd = m->keyboard;
+
+    // the file is closed once the last key has been let go
+    return kbd->keyboardfile != NULL;
+}
+
+// find the row and bit in the keyboard matrix for a character
+// returns 0 if the Nascom keyboard cannot type it
+static int translatecharacter(int ch, int *row, int *bit, bool *shift){
+
+    *shift = false;
+
+    if (ch == '\n' || ch == '\r'){
+        *row = 0, *bit = 1;
+        return 1;
+    }
+    if (islower(ch)){
+        *shift = true;
+        ch = toupper(ch);
+    }
+    else {
+        for (int i = 0; kbd_spec_w_shift[i]; ++i){
+            if (kbd_spec_w_shift[i] == ch && ch != ' ' && ch != '@') {
+                *shift = true;
+                ch = kbd_spec[i];
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < 8; ++i){
+        for (int b = 0; b < 7; ++b){
+            if (kbd_translation[i][7-b] == ch && ch != '_') {
+                *row = i, *bit = b;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// called at each keyboard reset instead of ui_serve_input
+static void headless_serve_input(struct machine *m){
+    KEYBOARD *kbd = m->keyboard;
+
+    if (kbd->scans > 0){
+        kbd->scans--;
+    }
+    else if (kbd->keydown){
+        // let go of the key
+        kbd->keydown=false;
+        kbd->scans=HEADLESSKEYUPSCANS - 1;
+    }
+    else if (kbd->keyboardfile != NULL){
+        // type the next character
+        int ch;
+        while ((ch = fgetc(kbd->keyboardfile)) != EOF){
+            if (translatecharacter(ch, &kbd->row, &kbd->bit, &kbd->shift)){
+                kbd->keydown=true;
+                kbd->scans=HEADLESSKEYDOWNSCANS - 1;
+                break;
+            }
+        }
+        if (ch == EOF){
+            if (kbd->keyboardfile != m->in){
+                fclose(kbd->keyboardfile);
+            }
+            kbd->keyboardfile=NULL;
+        }
+    }
+
+    if (kbd->keydown){
+        kbd->keyboardcopy.mask[kbd->row] |= 1 << kbd->bit;
+        if (kbd->shift){
+            kbd->keyboardcopy.mask[0] |= 1 << 4;
+        }
     }
 }
 
-void outPort0Keyboard(int value){
+void outPort0Keyboard(struct machine *m, int value){
+    KEYBOARD *kbd = m->keyboard;
 
-    static unsigned char port0; // value on previous call
     unsigned int down_trans;
 
     /* KBD */
@@ -691,9 +820,9 @@ void outPort0Keyboard(int value){
     // ~ Binary One's Complement Operator is unary and has the effect of 'flipping' bits.
     // sets any bit where is was 1 last time but is now 0
     // so down_trans has bit set to 1 if that bit has moved from 1 to 0
-    down_trans = port0 & ~value;
+    down_trans = kbd->port0 & ~value;
     // save current value for next time.
-    port0 = value;
+    kbd->port0 = value;
 
     // debug display message
     // fprintf(stdout, "Port 0: Value [%02x] down_trans %02x\n", port0, down_trans);
@@ -703,11 +832,11 @@ void outPort0Keyboard(int value){
     // fix DA removed test for counter value
     //  and ensured counter recyles from 7 to 0
     if (down_trans & P0_OUT_KEYBOARD_CLOCK) {
-        keyboard.index++;
+        kbd->keyboard.index++;
         // fix DA there should only be 8 entries in the table 0 to 7
         // Nassys 3 does 9 scans and Polydos 10 scans ?
         // ensure it cycles round
-        keyboard.index &= 7;
+        kbd->keyboard.index &= 7;
         // fprintf(stdout, "keyboard.index stepped to  [%02x] \n" , keyboard.index);
     }
     // reset keyboard row counter - check for key inputs
@@ -717,21 +846,26 @@ void outPort0Keyboard(int value){
         // problem - does not allow for control if emulator not asking for input
         // solved by just checking control keys during z80sim call to sim_delay
         // TODO but may cause issues if the keystable is updated during processing?
-        ui_serve_input();
+        if (m->headless){
+            headless_serve_input(m);
+        }
+        else {
+            ui_serve_input(m);
+        }
         // copy the copy keymap to this one 
         int notzero=0;
         for (int entry=0;entry<8;entry++){
             // test for display if changed 
-            if (keyboard.mask[entry]!=keyboardcopy.mask[entry]){
+            if (kbd->keyboard.mask[entry]!=kbd->keyboardcopy.mask[entry]){
                 notzero=1;
             }
-            keyboard.mask[entry]=keyboardcopy.mask[entry];
+            kbd->keyboard.mask[entry]=kbd->keyboardcopy.mask[entry];
             // bug fix ---- there was  a problem with : and ; keys repeating 
             // the release of the key was not being recognised during the keyboard processing
             // so cleared keyboard matrix each time allows it to work
             // gives a problem when raw keyboard mode selected 
             if (! rawkeyboard ){
-                keyboardcopy.mask[entry]=0; // clear keyboard matrix after each key search
+                kbd->keyboardcopy.mask[entry]=0; // clear keyboard matrix after each key search
             }
         }
         
@@ -740,34 +874,49 @@ void outPort0Keyboard(int value){
             // if matrix changed then print it 
             if (notzero!=0){
                 for (int entry=0;entry<8;entry++){
-                    printf("%d ",entry);
+                    fprintf(m->out, "%d ",entry);
                     for (int bit=7;bit>=0;bit--){
-                        if (((keyboard.mask[entry]>>bit)&01)==0){
-                            printf("0");
+                        if (((kbd->keyboard.mask[entry]>>bit)&01)==0){
+                            fprintf(m->out, "0");
                         }
                         else{
-                            printf("1");
+                            fprintf(m->out, "1");
                         }
                     }
-                    printf("\n");
+                    fprintf(m->out, "\n");
                 }
-                printf("\n");
+                fprintf(m->out, "\n");
             }
         }
         // reset the index counter for the keyboard process
-        keyboard.index = 0;
+        kbd->keyboard.index = 0;
     }
 }
 
-int inPort0Keyboard(){
+int inPort0Keyboard(struct machine *m){
+    KEYBOARD *kbd = m->keyboard;
 
     /* KBD */
     // debug
 
     if (0) { // (keyboard.mask[keyboard.index] != 0 ){
-        printf("Port 0: returning [%02X] from [%d] \n",(~keyboard.mask[keyboard.index])&0xFF,keyboard.index);
+        fprintf(m->out, "Port 0: returning [%02X] from [%d] \n",(~kbd->keyboard.mask[kbd->keyboard.index])&0xFF,kbd->keyboard.index);
     }
-    return (~keyboard.mask[keyboard.index])&0xFF;
+    return (~kbd->keyboard.mask[kbd->keyboard.index])&0xFF;
+
+}
+
+// save or restore the keyboard row counter - no keys are down after a restore
+void keyboardSnapshot(struct machine *m, SNAPSHOT *s){
+    KEYBOARD *kbd = m->keyboard;
 
+    int state[1] = { kbd->keyboard.index };
+
+    snapshot_data(s, "keyboard", state, sizeof(state));
+    if (s->restoring && !s->error){
+        memset(&kbd->keyboard, 0, sizeof(kbd->keyboard));
+        memset(&kbd->keyboardcopy, 0, sizeof(kbd->keyboardcopy));
+        kbd->keyboard.index = state[0] & 7;
+    }
 }
 
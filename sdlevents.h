@@ -4,14 +4,23 @@
  */
 
 typedef enum { CONT = 0, RESET = 1, DONE = -1 } sim_action_t;
-extern sim_action_t action;
 
-void ui_serve_input(void);
+struct machine;
+
+// give the machine its keyboard, and take it away again
+void keyboardCreate(struct machine *m);
+void keyboardFree(struct machine *m);
+
+void ui_serve_input(struct machine *m);
 int sdl_initialise(void);
 
 // handle the keyboard stuff
-void outPort0Keyboard(int value);
-int inPort0Keyboard();
+void outPort0Keyboard(struct machine *m, int value);
+int inPort0Keyboard(struct machine *m);
+// type the keyboard input from a file when headless
+int setkeyboardinputfile(struct machine *m, char *filename);
+// 1 while there are keys still to type from the file
+int keyboardinputwaiting(struct machine *m);
 
 // end of file
 
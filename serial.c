@@ -2,72 +2,181 @@
 
 */
 
+#define _XOPEN_SOURCE 700      // fileno
+
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "options.h"
 #include "map80nascom.h"
+#include "simz80.h"
 #include "serial.h"
 
-// global variables 
-int tape_led = 0;       // set if tape led is on
-int tape_led_force = 0; // set if tape led forced on
+// give the machine its serial port, with no files
+void serialCreate(struct machine *m){
+
+    SERIALPORT *serial = calloc(1, sizeof(SERIALPORT));
+    if (serial == NULL){
+        fprintf(m->err, "Out of memory for the serial port\n");
+        exit(1);
+    }
+    serial->serial_in_notify = -1;
+    serial->serial_in_watch = -1;
+    m->serial = serial;
+}
+
+void serialFree(struct machine *m){
+
+    if (m->serial == NULL){
+        return;
+    }
+    // a machine that never got to run has not had its files closed
+    closeserialfiles(m);
+    free(m->serial->serial_input_filename);
+    free(m->serial->serial_output_filename);
+    free(m->serial);
+    m->serial = NULL;
+}
 
-char * serial_input_filename=NULL;
-int serial_input_available = 0;  // set to 1 if there is a file and not at end of file
-                                       // used when checking the UART for input 
-long int tape_in_pos = 0;       // set to tape position as we read characters 
-char serial_input_error[100];   // somewhere to store the serial input error message
-int  serial_input_errornumber=0;
 
-char * serial_output_filename=NULL;
-long int tape_out_pos = 0;      // set to tape length of output
-char serial_output_error[100];   // somewhere to store the serial input error message
+// find out how big the input file is now
+static void getserialinputsize(struct machine *m){
+    SERIALPORT *serial = m->serial;
+    struct stat filestatus;
+    if (serial->serial_in && fstat(fileno(serial->serial_in), &filestatus) == 0){
+        if (filestatus.st_size < serial->tape_in_buffer_start + serial->tape_in_buffer_length){
+            // it has been cut short - drop the read ahead
+            serial->tape_in_buffer_length = 0;
+        }
+        serial->tape_in_size = filestatus.st_size;
+    }
+}
 
-int serial_only1file=0;      // set to 1 if the input file and output file are the same file.
+static void openserialinput(struct machine *m);
+static void closeserialinput(struct machine *m);
 
-// local 
-static FILE *serial_out;
-static FILE *serial_in;
+// check if the input file has been replaced by a new one, or changed size
+static void checkserialinputfile(struct machine *m){
+    SERIALPORT *serial = m->serial;
+    struct stat namestatus;
+    struct stat filestatus;
+    if (stat(serial->serial_input_filename, &namestatus) != 0 || fstat(fileno(serial->serial_in), &filestatus) != 0
+        || namestatus.st_ino != filestatus.st_ino || namestatus.st_dev != filestatus.st_dev){
+        closeserialinput(m);
+        openserialinput(m);
+    }
+    else{
+        getserialinputsize(m);
+    }
+}
 
+// open the input file and keep it open
+static void openserialinput(struct machine *m){
+    SERIALPORT *serial = m->serial;
+    serial->serial_in = fopen(serial->serial_input_filename, "rb");
+    if (!serial->serial_in){
+        serial->serial_input_errornumber=errno;
+        serial->serial_input_error[0]=0;
+        serial->tape_in_size = 0;
+        return;
+    }
+    serial->tape_in_buffer_length = 0;
+    getserialinputsize(m);
+#ifdef __linux__
+    if (serial->serial_in_notify < 0){
+        serial->serial_in_notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    if (serial->serial_in_notify >= 0){
+        serial->serial_in_watch = inotify_add_watch(serial->serial_in_notify, serial->serial_input_filename,
+                                  IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+    }
+#endif
+}
+
+static void closeserialinput(struct machine *m){
+    SERIALPORT *serial = m->serial;
+#ifdef __linux__
+    if (serial->serial_in_watch >= 0){
+        inotify_rm_watch(serial->serial_in_notify, serial->serial_in_watch);
+        serial->serial_in_watch = -1;
+    }
+#endif
+    if (serial->serial_in){
+        fclose(serial->serial_in);
+        serial->serial_in = NULL;
+    }
+    serial->tape_in_buffer_length = 0;
+    serial->tape_in_size = 0;
+}
+
+// write the buffered output characters to the output file
+static void flushserialoutput(struct machine *m){
+    SERIALPORT *serial = m->serial;
+    if (serial->tape_out_buffered == 0){
+        return;
+    }
+    if (!serial->serial_out){
+        serial->serial_out = fopen(serial->serial_output_filename, "ab");
+    }
+    if (serial->serial_out){
+        if (fwrite(serial->tape_out_buffer, 1, serial->tape_out_buffered, serial->serial_out) != (size_t)serial->tape_out_buffered || fflush(serial->serial_out) != 0){
+            fprintf(m->err, "%s: %s\n", serial->serial_output_filename, strerror(errno));
+        }
+    }
+    else{
+        fprintf(m->err, "%s: %s\n", serial->serial_output_filename, strerror(errno));
+    }
+    serial->tape_out_buffered = 0;
+    serial->tape_out_unflushedsince = 0;
+}
 
 
-// open and read the next character from the serial file
-int readserialin(void){
+// read the next character from the serial file
+int readserialin(struct machine *m){
+    SERIALPORT *serial = m->serial;
     
     char ch=0;
-    int result=0;
     
-    if (tape_led){
-        if (serial_input_filename!=NULL){
-            serial_in = fopen(serial_input_filename, "rb");
-            if (serial_in){
-                // printf("Serial file %s open\n",serial_input_filename);
-                // position at current point 
-                result=fseek(serial_in, tape_in_pos, SEEK_SET );
-                if (result ==0 ) {
-                    ch = fgetc(serial_in);
-                    serial_input_available = !feof(serial_in);
-                    tape_in_pos = ftell(serial_in);
+    if (serial->tape_led){
+        if (serial->serial_in){
+            if (serial->tape_in_pos < serial->tape_in_size){
+                // refill the read ahead if the position is outside it
+                if (serial->tape_in_pos < serial->tape_in_buffer_start || serial->tape_in_pos >= serial->tape_in_buffer_start + serial->tape_in_buffer_length){
+                    serial->tape_in_buffer_length = 0;
+                    if (fseek(serial->serial_in, serial->tape_in_pos, SEEK_SET ) == 0){
+                        serial->tape_in_buffer_start = serial->tape_in_pos;
+                        serial->tape_in_buffer_length = fread(serial->tape_in_buffer, 1, SERIALBUFFERSIZE, serial->serial_in);
+                    }
+                    else{
+                        fprintf(m->err, "%s: %s\n", serial->serial_input_filename, strerror(errno));
+                        fprintf(m->out, "seek failed\n");
+                    }
                 }
-                else{
-                    perror(serial_input_filename);
-                    printf("seek failed\n");
-                }
-
-                fclose(serial_in);
+            }
+            if (serial->tape_in_pos >= serial->tape_in_buffer_start && serial->tape_in_pos < serial->tape_in_buffer_start + serial->tape_in_buffer_length){
+                ch = serial->tape_in_buffer[serial->tape_in_pos - serial->tape_in_buffer_start];
+                serial->tape_in_pos++;
+                serial->serial_input_available = 1;
             }
             else{
-                serial_input_error[0]=0;
-                //perror(serial_input_filename);
+                // read past the end of the file
+                ch = EOF;
+                serial->serial_input_available = 0;
             }
         }
     }
     // check if we only have 1 file 
-    if (serial_only1file){
-        tape_out_pos=tape_in_pos;
+    if (serial->serial_only1file){
+        serial->tape_out_pos=serial->tape_in_pos;
     }
 
 
@@ -76,146 +185,173 @@ int readserialin(void){
 }
 
 // check if there is any serial data to process
-int checkifanyserialinputdata(void){
+// the file size is kept up to date by checkserialfiles so no file access is needed here
+int checkifanyserialinputdata(struct machine *m){
+    SERIALPORT *serial = m->serial;
     
-    int returnval=0;
-    if (serial_input_filename!=NULL){  // check if we have a file name set
-        serial_in = fopen(serial_input_filename, "rb");
-        if (serial_in){
-            // position at end of file
-            int result=fseek(serial_in, 0, SEEK_END );
-            if (result ==0 ) {
-                // is there any data there
-                if (tape_in_pos < ftell(serial_in)){
-                    returnval=1;
-                }
-                else{
-                    returnval=0;
-                }
-                //printf("Uart checkserial eof  %2.2X\n",returnval);
+    // set the global variable
+    serial->serial_input_available = (serial->serial_in != NULL) && (serial->tape_in_pos < serial->tape_in_size);
+    //printf("Uart checkserial serial ready %2.2X, \n",serial_input_available);
+    
+    return serial->serial_input_available;
+}
+
+// called from sim_delay
+// pick up changes to the input file and write out output held back for SERIALFLUSHSECONDS
+void checkserialfiles(struct machine *m){
+    SERIALPORT *serial = m->serial;
+
+    if (serial->serial_input_filename!=NULL){
+        if (!serial->serial_in){
+            // see if it has turned up
+            openserialinput(m);
+        }
+#ifdef __linux__
+        else if (serial->serial_in_watch >= 0){
+            char events[4096];
+            int changed = 0;
+            while (read(serial->serial_in_notify, events, sizeof(events)) > 0){
+                // only need to know something happened
+                changed = 1;
             }
-            else{
+            if (changed){
+                // the contents may have changed as well as the size
+                serial->tape_in_buffer_length = 0;
+                checkserialinputfile(m);
             }
-            fclose(serial_in);
         }
+#endif
         else{
-            serial_input_error[0]=0;
-            //perror(serial_input_filename);
+            checkserialinputfile(m);
         }
     }
-    // set the global variable
-    serial_input_available=returnval;
-    //printf("Uart checkserial serial ready %2.2X, ret %2.2X, \n",serial_input_available,returnval);
-    
-    return returnval;
+
+    if (serial->tape_out_buffered > 0 && time(NULL) - serial->tape_out_unflushedsince >= SERIALFLUSHSECONDS){
+        flushserialoutput(m);
+    }
+}
+
+// write out any buffered output and close the files - called when the emulator stops
+void closeserialfiles(struct machine *m){
+    SERIALPORT *serial = m->serial;
+
+    flushserialoutput(m);
+    if (serial->serial_out){
+        fclose(serial->serial_out);
+        serial->serial_out = NULL;
+    }
+    closeserialinput(m);
+#ifdef __linux__
+    // each one counts against the user's inotify instances - nasbatch runs many machines
+    if (serial->serial_in_notify >= 0){
+        close(serial->serial_in_notify);
+        serial->serial_in_notify = -1;
+    }
+#endif
 }
 
-void setserialinputfile(char * filename){
+void setserialinputfile(struct machine *m, char * filename){
+    SERIALPORT *serial = m->serial;
     
-    tape_in_pos=0;
-    // changed to store filename and open when asked
-    if (serial_input_filename!=NULL){
+    serial->tape_in_pos=0;
+    closeserialinput(m);
+    // changed to store filename and keep the file open
+    if (serial->serial_input_filename!=NULL){
         // free memory already allocated
-        free(serial_input_filename);
+        free(serial->serial_input_filename);
     }
     // copy in the file name to local storage
     int len = strlen( filename );
-    serial_input_filename = malloc( len + 1 );
-    strcpy( serial_input_filename, filename );
-    // check that file exists 
-    serial_in = fopen(serial_input_filename, "r");
-    if (!serial_in){
-        serial_input_errornumber=errno;
-        serial_input_error[0]=0;
-        //perror(serial_input_filename), exit(1);
-    }
-    else {
-        serial_input_available = !feof(serial_in);
-        fclose(serial_in); // will open it when needed
-    }
-    //printf("serial input %s -> %p\n", serial_input_filename, serial_in);
+    serial->serial_input_filename = malloc( len + 1 );
+    strcpy( serial->serial_input_filename, filename );
+    // open it now - if it is not there yet checkserialfiles will keep trying
+    openserialinput(m);
     // if any characters in the file say serial available
+    serial->serial_input_available = serial->tape_in_size > 0;
+    //printf("serial input %s -> %p\n", serial_input_filename, serial_in);
 }
 
 // reset the serial input file 
-void resetserialinput(void){
+void resetserialinput(struct machine *m){
+    SERIALPORT *serial = m->serial;
 
-    if (verbose){
-        printf("Serial input reset to start\n");
+    if (m->verbose){
+        fprintf(m->out, "Serial input reset to start\n");
     }
     
-    tape_in_pos=0;
+    serial->tape_in_pos=0;
     // check if we only have 1 file 
-    if (serial_only1file){
-        tape_out_pos=tape_in_pos;
+    if (serial->serial_only1file){
+        serial->tape_out_pos=serial->tape_in_pos;
     }
     
 }
 
 // set the filename to be used for the serial output
-void setserialoutfilename(char * filename){
+void setserialoutfilename(struct machine *m, char * filename){
+    SERIALPORT *serial = m->serial;
 
-    if (serial_output_filename!=NULL){
+    flushserialoutput(m);
+    if (serial->serial_out){
+        fclose(serial->serial_out);
+        serial->serial_out = NULL;
+    }
+    if (serial->serial_output_filename!=NULL){
         // free memory already allocated
-        free(serial_output_filename);
+        free(serial->serial_output_filename);
     }
     // copy in the file name to local storage
     int len = strlen( filename );
-    serial_output_filename = malloc( len + 1 );
-    strcpy( serial_output_filename, filename );
+    serial->serial_output_filename = malloc( len + 1 );
+    strcpy( serial->serial_output_filename, filename );
     // check that file exists 
     
-    serial_out = fopen(serial_output_filename, "rb");
-    if (!serial_out){
+    serial->serial_out = fopen(serial->serial_output_filename, "rb");
+    if (!serial->serial_out){
         // no file - it will be created when output to it
         //perror(serial_output_filename), exit(1);
-        serial_output_error[0]=0;
+        serial->serial_output_error[0]=0;
     }
     else{
         // find out how big the file is
-        int result=fseek(serial_out, 0, SEEK_END );
+        int result=fseek(serial->serial_out, 0, SEEK_END );
         if (result ==0 ) {
-            tape_out_pos = ftell(serial_out);
+            serial->tape_out_pos = ftell(serial->serial_out);
         }
-        fclose(serial_out); // will open it when needed
+        fclose(serial->serial_out); // will open it for appending when needed
+        serial->serial_out = NULL;
     }
     // printf("serial output %s -> %p\n", serial_output_filename, serial_out);
-
-    // not working to give position - until something is written to it ?
-    //tape_out_pos = ftell(serial_out);
 }
 
 // put a character into the serial out file
-void writeserialout(unsigned charvalue){
+// it is held in tape_out_buffer until the buffer is full, SERIALFLUSHSECONDS have passed or the emulator stops
+void writeserialout(struct machine *m, unsigned charvalue){
+    SERIALPORT *serial = m->serial;
     
-//        fputc(value, serial_out);
-//        tape_out_pos = ftell(serial_out);
-//        fputc(value, serial_out);
-//        tape_out_pos = ftell(serial_out);
-
 //    printf("output to serial file %2.2X\n",charvalue);
-    if (serial_output_filename!=NULL){
-        serial_out = fopen(serial_output_filename, "a");
-        if (serial_out){
-            fputc(charvalue, serial_out);
-            tape_out_pos = ftell(serial_out);
-//            printf("output to serial file position %ld\n",tape_out_pos);
-            fclose(serial_out);
+    if (serial->serial_output_filename!=NULL){
+        if (serial->tape_out_buffered == 0){
+            serial->tape_out_unflushedsince = time(NULL);
         }
-        else{
-            perror(serial_input_filename);
+        serial->tape_out_buffer[serial->tape_out_buffered++] = charvalue;
+        serial->tape_out_pos++;
+        if (serial->tape_out_buffered == SERIALBUFFERSIZE){
+            flushserialoutput(m);
         }
     }
     // check if we only have 1 file 
-    if (serial_only1file){
-        tape_in_pos=tape_out_pos;
+    if (serial->serial_only1file){
+        flushserialoutput(m);
+        serial->tape_in_pos=serial->tape_out_pos;
     }
 
 }
 
 
-int getuartstatus(void){            
-    int uart_status= UART_TBR_EMPTY | (checkifanyserialinputdata() & tape_led ? UART_DATA_READY : 0);
+int getuartstatus(struct machine *m){            
+    SERIALPORT *serial = m->serial;
+    int uart_status= UART_TBR_EMPTY | (checkifanyserialinputdata(m) & serial->tape_led ? UART_DATA_READY : 0);
     // printf("Uart status check %2.2X, serial ready %2.2X, tape led %2.2X, \n",uart_status,serial_input_available,tape_led);
     return uart_status;
 }
\ No newline at end of file
@@ -3,29 +3,67 @@
 */
 
 
-extern int tape_led;    // set if tape led is on
+#ifndef SERIAL_DEFINED_H
+#define SERIAL_DEFINED_H
 
-extern int tape_led_force; // set if tape led forced on
+#include <stdio.h>
+#include <time.h>
 
-extern char * serial_input_filename;
+struct machine;
 
-extern long int tape_in_pos; // current tape position - serial input
-extern long int tape_out_pos; // current output tape   - serial output
-extern int serial_input_available;
+// the tape drive and UART of one machine - the status display shows the files and positions
+typedef struct SERIALPORT {
+    int tape_led;                   // set if tape led is on
+    int tape_led_force;             // set if tape led forced on
 
-extern char * serial_output_filename;
-extern long int tape_out_pos;      // set to tape length of output
-//extern char serial_output_error;   // somewhere to store the serial input error message
+    char * serial_input_filename;
+    int serial_input_available;     // set to 1 if there is a file and not at end of file
+                                    // used when checking the UART for input
+    long int tape_in_pos;           // current tape position - serial input
+    char serial_input_error[100];   // somewhere to store the serial input error message
+    int  serial_input_errornumber;
 
+    char * serial_output_filename;
+    long int tape_out_pos;          // set to tape length of output
+    char serial_output_error[100];  // somewhere to store the serial output error message
 
+    int serial_only1file;           // set to 1 if the input file and output file are the same file.
 
-extern int readserialin(void);
-extern void setserialinputfile(char * filename);
-extern void resetserialinput(void);
-extern int checkifanyserialinputdata(void);
-extern void setserialoutfilename(char * filename);
-extern void writeserialout(unsigned charvalue);
+    FILE *serial_out;
+    FILE *serial_in;
 
-extern int getuartstatus(void);
+    // read ahead - tape_in_buffer holds the input file from tape_in_buffer_start
+    unsigned char tape_in_buffer[SERIALBUFFERSIZE];
+    long int tape_in_buffer_start;
+    long int tape_in_buffer_length;
+    long int tape_in_size;          // how much of the input file there is to read
+
+    // write behind - characters waiting to be appended to the output file
+    unsigned char tape_out_buffer[SERIALBUFFERSIZE];
+    int tape_out_buffered;
+    time_t tape_out_unflushedsince; // when the first character was buffered
+
+    // inotify tells us when the input file has been written to
+    // so it does not have to be checked on every UART status poll - linux only, -1 if not used
+    int serial_in_notify;
+    int serial_in_watch;
+} SERIALPORT;
+
+// give the machine its serial port, with no files, and take it away again
+extern void serialCreate(struct machine *m);
+extern void serialFree(struct machine *m);
+
+extern int readserialin(struct machine *m);
+extern void setserialinputfile(struct machine *m, char * filename);
+extern void resetserialinput(struct machine *m);
+extern int checkifanyserialinputdata(struct machine *m);
+extern void setserialoutfilename(struct machine *m, char * filename);
+extern void writeserialout(struct machine *m, unsigned charvalue);
+extern void checkserialfiles(struct machine *m);     // called from sim_delay - input file changes and timed output flush
+extern void closeserialfiles(struct machine *m);     // flush the output and close the files
+
+extern int getuartstatus(struct machine *m);
+
+#endif
 
 //end of file
@@ -60,6 +60,9 @@ Line 2234 - the OUTD command -same issue as with OUTI
 #include "simz80.h"
 #include "disassemble.h"
 #include "cpmswitch.h"
+#include "map80VFCfloppy.h"
+#include "nascom4SD.h"
+#include "interrupts.h"
 
 // this is used to set the parity bit in the flags.
 static const unsigned char partab[256] = {
@@ -83,6 +86,256 @@ static const unsigned char partab[256] = {
 
 #define parity(x)	partab[(x)&0xff]
 
+// T-states for the unprefixed opcodes
+// conditional jumps, calls and returns hold the not taken time
+// the extra for a taken branch is added by the JRC, CALLC and RETC macros
+// the prefixes are 0 here as their own tables hold the full time
+static const unsigned char cycles_main[256] = {
+	 4,10, 7, 6, 4, 4, 7, 4, 4,11, 7, 6, 4, 4, 7, 4,	/* 00 */
+	 8,10, 7, 6, 4, 4, 7, 4, 7,11, 7, 6, 4, 4, 7, 4,	/* 10 */
+	 7,10,16, 6, 4, 4, 7, 4, 7,11,16, 6, 4, 4, 7, 4,	/* 20 */
+	 7,10,13, 6,11,11,10, 4, 7,11,13, 6, 4, 4, 7, 4,	/* 30 */
+	 4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,	/* 40 */
+	 4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,	/* 50 */
+	 4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,	/* 60 */
+	 7, 7, 7, 7, 7, 7, 4, 7, 4, 4, 4, 4, 4, 4, 7, 4,	/* 70 */
+	 4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,	/* 80 */
+	 4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,	/* 90 */
+	 4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,	/* A0 */
+	 4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,	/* B0 */
+	 5,10,10,10,10,11, 7,11, 5,10,10, 0,10,10, 7,11,	/* C0 */
+	 5,10,10,11,10,11, 7,11, 5, 4,10,11,10, 0, 7,11,	/* D0 */
+	 5,10,10,19,10,11, 7,11, 5, 4,10, 4,10, 0, 7,11,	/* E0 */
+	 5,10,10, 4,10,11, 7,11, 5, 6,10, 4,10, 0, 7,11,	/* F0 */
+};
+
+// T-states for the CB prefixed opcodes, including the prefix
+static const unsigned char cycles_cb[256] = {
+	 8, 8, 8, 8, 8, 8,15, 8, 8, 8, 8, 8, 8, 8,15, 8,	/* 00 */
+	 8, 8, 8, 8, 8, 8,15, 8, 8, 8, 8, 8, 8, 8,15, 8,	/* 10 */
+	 8, 8, 8, 8, 8, 8,15, 8, 8, 8, 8, 8, 8, 8,15, 8,	/* 20 */
+	 8, 8, 8, 8, 8, 8,15, 8, 8, 8, 8, 8, 8, 8,15, 8,	/* 30 */
+	 8, 8, 8, 8, 8, 8,12, 8, 8, 8, 8, 8, 8, 8,12, 8,	/* 40 */
+	 8, 8, 8, 8, 8, 8,12, 8, 8, 8, 8, 8, 8, 8,12, 8,	/* 50 */
+	 8, 8, 8, 8, 8, 8,12, 8, 8, 8, 8, 8, 8, 8,12, 8,	/* 60 */
+	 8, 8, 8, 8, 8, 8,12, 8, 8, 8, 8, 8, 8, 8,12, 8,	/* 70 */
+	 8, 8, 8, 8, 8, 8,15, 8, 8, 8, 8, 8, 8, 8,15, 8,	/* 80 */
+	 8, 8, 8, 8, 8, 8,15, 8, 8, 8, 8, 8, 8, 8,15, 8,	/* 90 */
+	 8, 8, 8, 8, 8, 8,15, 8, 8, 8, 8, 8, 8, 8,15, 8,	/* A0 */
+	 8, 8, 8, 8, 8, 8,15, 8, 8, 8, 8, 8, 8, 8,15, 8,	/* B0 */
+	 8, 8, 8, 8, 8, 8,15, 8, 8, 8, 8, 8, 8, 8,15, 8,	/* C0 */
+	 8, 8, 8, 8, 8, 8,15, 8, 8, 8, 8, 8, 8, 8,15, 8,	/* D0 */
+	 8, 8, 8, 8, 8, 8,15, 8, 8, 8, 8, 8, 8, 8,15, 8,	/* E0 */
+	 8, 8, 8, 8, 8, 8,15, 8, 8, 8, 8, 8, 8, 8,15, 8,	/* F0 */
+};
+
+// T-states for the DD and FD prefixed opcodes, including the prefix
+// opcodes that do not use IX/IY run as the plain opcode plus 4
+static const unsigned char cycles_dd[256] = {
+	 8,14,11,10, 8, 8,11, 8, 8,15,11,10, 8, 8,11, 8,	/* 00 */
+	12,14,11,10, 8, 8,11, 8,11,15,11,10, 8, 8,11, 8,	/* 10 */
+	11,14,20,10, 8, 8,11, 8,11,15,20,10, 8, 8,11, 8,	/* 20 */
+	11,14,17,10,23,23,19, 8,11,15,17,10, 8, 8,11, 8,	/* 30 */
+	 8, 8, 8, 8, 8, 8,19, 8, 8, 8, 8, 8, 8, 8,19, 8,	/* 40 */
+	 8, 8, 8, 8, 8, 8,19, 8, 8, 8, 8, 8, 8, 8,19, 8,	/* 50 */
+	 8, 8, 8, 8, 8, 8,19, 8, 8, 8, 8, 8, 8, 8,19, 8,	/* 60 */
+	19,19,19,19,19,19, 8,19, 8, 8, 8, 8, 8, 8,19, 8,	/* 70 */
+	 8, 8, 8, 8, 8, 8,19, 8, 8, 8, 8, 8, 8, 8,19, 8,	/* 80 */
+	 8, 8, 8, 8, 8, 8,19, 8, 8, 8, 8, 8, 8, 8,19, 8,	/* 90 */
+	 8, 8, 8, 8, 8, 8,19, 8, 8, 8, 8, 8, 8, 8,19, 8,	/* A0 */
+	 8, 8, 8, 8, 8, 8,19, 8, 8, 8, 8, 8, 8, 8,19, 8,	/* B0 */
+	 9,14,14,14,14,15,11,15, 9,14,14, 0,14,14,11,15,	/* C0 */
+	 9,14,14,15,14,15,11,15, 9, 8,14,15,14, 4,11,15,	/* D0 */
+	 9,14,14,23,14,15,11,15, 9, 8,14, 8,14, 4,11,15,	/* E0 */
+	 9,14,14, 8,14,15,11,15, 9,10,14, 8,14, 4,11,15,	/* F0 */
+};
+
+// T-states for the DD CB and FD CB prefixed opcodes, including both prefixes
+static const unsigned char cycles_ddcb[256] = {
+	23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,	/* 00 */
+	23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,	/* 10 */
+	23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,	/* 20 */
+	23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,	/* 30 */
+	20,20,20,20,20,20,20,20,20,20,20,20,20,20,20,20,	/* 40 */
+	20,20,20,20,20,20,20,20,20,20,20,20,20,20,20,20,	/* 50 */
+	20,20,20,20,20,20,20,20,20,20,20,20,20,20,20,20,	/* 60 */
+	20,20,20,20,20,20,20,20,20,20,20,20,20,20,20,20,	/* 70 */
+	23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,	/* 80 */
+	23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,	/* 90 */
+	23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,	/* A0 */
+	23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,	/* B0 */
+	23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,	/* C0 */
+	23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,	/* D0 */
+	23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,	/* E0 */
+	23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,23,	/* F0 */
+};
+
+// T-states for the ED prefixed opcodes, including the prefix
+// block repeats hold the time of the last pass, the extra 21 per repeat
+// is added by the instruction
+// undefined opcodes act as two NOPs
+static const unsigned char cycles_ed[256] = {
+	 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,	/* 00 */
+	 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,	/* 10 */
+	 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,	/* 20 */
+	 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,	/* 30 */
+	12,12,15,20, 8,14, 8, 9,12,12,15,20, 8,14, 8, 9,	/* 40 */
+	12,12,15,20, 8,14, 8, 9,12,12,15,20, 8,14, 8, 9,	/* 50 */
+	12,12,15,20, 8,14, 8,18,12,12,15,20, 8,14, 8,18,	/* 60 */
+	12,12,15,20, 8,14, 8, 8,12,12,15,20, 8,14, 8, 8,	/* 70 */
+	 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,	/* 80 */
+	 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,	/* 90 */
+	16,16,16,16, 8, 8, 8, 8,16,16,16,16, 8, 8, 8, 8,	/* A0 */
+	16,16,16,16, 8, 8, 8, 8,16,16,16,16, 8, 8, 8, 8,	/* B0 */
+	 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,	/* C0 */
+	 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,	/* D0 */
+	 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,	/* E0 */
+	 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,	/* F0 */
+};
+
+/* straight line code cache
+   A block is a run of opcodes that stays in one 2k page and ends with a
+   jump, call, return, HALT or ED opcode.  The opcodes of the block are
+   kept here so simz80 does not go through rampagetable for each one, and
+   the T-states and callback count are charged once for the whole block.
+   Operands are still read from memory as each opcode runs.
+   The entries are keyed on the host address from rampagetable, and are
+   thrown away when their page is mapped to something else, or a byte one
+   of them took as an opcode is written to through any page that maps it -
+   writes to the operands, data and self modifying addresses next to the
+   code, as in the BASIC interpreters, leave the blocks alone. */
+
+// blockinfo bits
+#define BLOCK_LENGTH	3	// length of the opcode without a prefix
+#define BLOCK_END	4	// opcode can change PC so ends the block
+#define BLOCK_INDEXED	8	// opcode takes a displacement after a DD or FD prefix
+
+static const unsigned char blockinfo[256] = {
+	 1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1,	/* 00 */
+	 6, 3, 1, 1, 1, 1, 2, 1, 6, 1, 1, 1, 1, 1, 2, 1,	/* 10 */
+	 6, 3, 3, 1, 1, 1, 2, 1, 6, 1, 3, 1, 1, 1, 2, 1,	/* 20 */
+	 6, 3, 3, 1, 9, 9,10, 1, 6, 1, 3, 1, 1, 1, 2, 1,	/* 30 */
+	 1, 1, 1, 1, 1, 1, 9, 1, 1, 1, 1, 1, 1, 1, 9, 1,	/* 40 */
+	 1, 1, 1, 1, 1, 1, 9, 1, 1, 1, 1, 1, 1, 1, 9, 1,	/* 50 */
+	 1, 1, 1, 1, 1, 1, 9, 1, 1, 1, 1, 1, 1, 1, 9, 1,	/* 60 */
+	 9, 9, 9, 9, 9, 9, 5, 9, 1, 1, 1, 1, 1, 1, 9, 1,	/* 70 */
+	 1, 1, 1, 1, 1, 1, 9, 1, 1, 1, 1, 1, 1, 1, 9, 1,	/* 80 */
+	 1, 1, 1, 1, 1, 1, 9, 1, 1, 1, 1, 1, 1, 1, 9, 1,	/* 90 */
+	 1, 1, 1, 1, 1, 1, 9, 1, 1, 1, 1, 1, 1, 1, 9, 1,	/* A0 */
+	 1, 1, 1, 1, 1, 1, 9, 1, 1, 1, 1, 1, 1, 1, 9, 1,	/* B0 */
+	 5, 1, 7, 7, 7, 1, 2, 5, 5, 5, 7, 2, 7, 7, 2, 5,	/* C0 */
+	 5, 1, 7, 2, 7, 1, 2, 5, 5, 1, 7, 2, 7, 1, 2, 5,	/* D0 */
+	 5, 1, 7, 1, 7, 1, 2, 5, 5, 5, 7, 1, 7, 5, 2, 5,	/* E0 */
+	 5, 1, 7, 1, 7, 1, 2, 5, 5, 1, 7, 1, 7, 1, 2, 5,	/* F0 */
+};
+
+// the page has been mapped to different memory
+void
+blockcachepagechanged(struct machine *m, int page)
+{
+    m->blockcachepagestamp[page] = ++m->blockcachestamp;
+    // the memory may hold code cached through another page that maps it,
+    // so the first write through this one to any byte has to look
+    m->rampagetable[page].flags |= RAMPAGE_CODE;
+    memset(m->blockcacheopcodes[page], 0xff, sizeof(m->blockcacheopcodes[page]));
+    // stop simz80 running on from a block it has already started
+    m->simevents |= SIMEVENT_BLOCKFLUSH;
+}
+
+// bytes have been written to - if any was taken as an opcode, the blocks cached through
+// every page mapping the same host memory are stale, e.g. the MAP80 32k mode with both
+// halves the same ram
+void
+blockcachewritten(struct machine *m, unsigned int a, int length)
+{
+    int page = RAMPAGEINDEX(a);
+    const unsigned char *opcodes = m->blockcacheopcodes[page];
+    unsigned int offset = a & RAMPAGEMASK;
+    int i;
+
+    for (i = 0; i < length; i++, offset++)
+	if (opcodes[offset >> 3] & (1 << (offset & 7)))
+	    break;
+    if (i == length)
+	return;
+
+    BYTE *host = m->rampagetable[page].host;
+    for (int alias = 0; alias < RAMPAGETABLESIZE; alias++)
+	if (m->rampagetable[alias].host == host) {
+	    m->rampagetable[alias].flags &= ~RAMPAGE_CODE;
+	    m->blockcachepagestamp[alias] = ++m->blockcachestamp;
+	    memset(m->blockcacheopcodes[alias], 0, sizeof(m->blockcacheopcodes[alias]));
+	}
+    m->simevents |= SIMEVENT_BLOCKFLUSH;
+}
+
+// throw away all the blocks
+void
+blockcacheflush(struct machine *m)
+{
+    for (int page = 0; page < RAMPAGETABLESIZE; page++)
+	blockcachepagechanged(m, page);
+}
+
+// find the block starting at PC - decoding it if not already cached
+static struct blockentry *
+blockcachefind(struct machine *m, FASTREG PC)
+{
+    int page = RAMPAGEINDEX(PC);
+    BYTE *host = m->rampagetable[page].host + (PC & RAMPAGEMASK);
+    struct blockentry *entry = &m->blockcache[PC & (BLOCKCACHESIZE - 1)];
+    FASTREG adr = PC;
+
+    if (entry->host == host && entry->stamp == m->blockcachepagestamp[page])
+	return entry;
+
+    entry->host = host;
+    entry->stamp = m->blockcachepagestamp[page];
+    entry->count = 0;
+    entry->cycles = 0;
+    // where the bytes that decide the opcodes and their lengths are
+    unsigned int opcodes[2 * BLOCKMAXOPS];
+    int opcodecount = 0;
+    do {
+	FASTREG op = RAM(adr);
+	int info = blockinfo[op];
+	int length = info & BLOCK_LENGTH;
+
+	opcodes[opcodecount++] = adr & RAMPAGEMASK;
+	if (op == 0xDD || op == 0xFD) {
+	    if (RAMPAGEINDEX(adr+1) != page) {
+		// the opcode after the prefix is in the next page - end the block on it
+		entry->ops[entry->count++] = op;
+		entry->cycles += cycles_main[op];
+		break;
+	    }
+	    FASTREG op2 = RAM(adr+1);
+	    opcodes[opcodecount++] = (adr+1) & RAMPAGEMASK;
+	    if (op2 == 0xCB)
+		length = 4;
+	    else {
+		info = blockinfo[op2];
+		length = 1 + (info & BLOCK_LENGTH) + ((info & BLOCK_INDEXED) != 0);
+	    }
+	}
+	entry->ops[entry->count++] = op;
+	entry->cycles += cycles_main[op];
+	adr += length;
+	if (info & BLOCK_END)
+	    break;
+    } while (entry->count < BLOCKMAXOPS &&
+	     RAMPAGEINDEX(adr) == page);
+
+    // a write to one of them through any page mapping this memory has to throw the block away
+    for (int alias = 0; alias < RAMPAGETABLESIZE; alias++)
+	if (m->rampagetable[alias].host == m->rampagetable[page].host) {
+	    m->rampagetable[alias].flags |= RAMPAGE_CODE;
+	    for (int i = 0; i < opcodecount; i++)
+		m->blockcacheopcodes[alias][opcodes[i] >> 3] |= 1 << (opcodes[i] & 7);
+	}
+    return entry;
+}
+
 #ifdef DEBUG
 volatile int stopsim;
 #endif
@@ -92,18 +345,39 @@ volatile int stopsim;
 	x = y + (RAM(SP) << 8); SP++;					\
 } while (0)
 
+/* through PutBYTE, as a stack run down into a rom must not change it -
+   the roms are shared by all the machines nasbatch runs */
 #define PUSH(x) do {							\
-	--SP; RAM(SP) = (x) >> 8;						\
-	--SP; RAM(SP) = x;							\
+	--SP; PutBYTE(SP, (x) >> 8);					\
+	--SP; PutBYTE(SP, x);						\
 } while (0)
 
 #define JPC(cond) PC = cond ? GetWORD(PC) : PC+2
 
+// relative jump - a taken jump is 5 T-states longer
+#define JRC(cond) do {							\
+    if (cond) {								\
+	PC += (signed char) GetBYTE(PC) + 1;				\
+	m->tstates += 5;						\
+    }									\
+    else								\
+	++PC;								\
+} while (0)
+
+// conditional return - a taken return is 6 T-states longer
+#define RETC(cond) do {							\
+    if (cond) {								\
+	POP(PC);							\
+	m->tstates += 6;						\
+    }									\
+} while (0)
+
 #define CALLC(cond) {							\
     if (cond) {								\
 	FASTREG adrr = GetWORD(PC);					\
 	PUSH(PC+2);							\
 	PC = adrr;							\
+	m->tstates += 7;						\
     }									\
     else								\
 	PC += 2;							\
@@ -111,35 +385,95 @@ volatile int stopsim;
 
 /* load Z80 registers into (we hope) host registers */
 #define LOAD_STATE()							\
-    PC = pc;								\
-    AF = af[af_sel];							\
-    BC = regs[regs_sel].bc;						\
-    DE = regs[regs_sel].de;						\
-    HL = regs[regs_sel].hl;						\
-    SP = sp
+    PC = m->pc;								\
+    AF = m->af[m->af_sel];						\
+    BC = m->regs[m->regs_sel].bc;					\
+    DE = m->regs[m->regs_sel].de;					\
+    HL = m->regs[m->regs_sel].hl;					\
+    SP = m->sp
 
 /* load Z80 registers into (we hope) host registers */
 #define DECLARE_STATE()							\
-    FASTREG PC = pc;							\
-    FASTREG AF = af[af_sel];						\
-    FASTREG BC = regs[regs_sel].bc;					\
-    FASTREG DE = regs[regs_sel].de;					\
-    FASTREG HL = regs[regs_sel].hl;					\
-    FASTREG SP = sp
+    FASTREG PC = m->pc;							\
+    FASTREG AF = m->af[m->af_sel];					\
+    FASTREG BC = m->regs[m->regs_sel].bc;				\
+    FASTREG DE = m->regs[m->regs_sel].de;				\
+    FASTREG HL = m->regs[m->regs_sel].hl;				\
+    FASTREG SP = m->sp
 
 /* save Z80 registers back into memory */
 #define SAVE_STATE()							\
-    pc = PC;								\
-    af[af_sel] = AF;							\
-    regs[regs_sel].bc = BC;						\
-    regs[regs_sel].de = DE;						\
-    regs[regs_sel].hl = HL;						\
-    sp = SP
+    m->pc = PC;								\
+    m->af[m->af_sel] = AF;						\
+    m->regs[m->regs_sel].bc = BC;					\
+    m->regs[m->regs_sel].de = DE;					\
+    m->regs[m->regs_sel].hl = HL;					\
+    m->sp = SP
 
-static void
-cb_prefix(FASTREG adr)
+#if SIMZ80_THREADED
+#ifndef __GNUC__
+#error SIMZ80_THREADED needs the gcc computed goto extension
+#endif
+/* the prefix pages work on simz80's locals through pointers and are
+   always inlined, so the registers stay in host registers instead of
+   going out to the machine and back on every prefixed instruction */
+#define PREFIX_FUNC	static inline __attribute__((always_inline))
+#define PREFIX_PARAMS	, struct machine *m, FASTREG *pPC, FASTREG *pAF,	\
+			FASTREG *pBC, FASTREG *pDE, FASTREG *pHL, FASTREG *pSP
+#define PREFIX_ARGS	, m, &PC, &AF, &BC, &DE, &HL, &SP
+
+#define PREFIX_DECLARE_STATE()						\
+    FASTREG PC = *pPC;							\
+    FASTREG AF = *pAF;							\
+    FASTREG BC = *pBC;							\
+    FASTREG DE = *pDE;							\
+    FASTREG HL = *pHL;							\
+    FASTREG SP = *pSP
+
+#define PREFIX_SAVE_STATE()						\
+    *pPC = PC;								\
+    *pAF = AF;								\
+    *pBC = BC;								\
+    *pDE = DE;								\
+    *pHL = HL;								\
+    *pSP = SP
+
+/* nothing to move around the call as the registers are passed in */
+#define PREFIX_ENTER()
+#define PREFIX_LEAVE()
+
+/* the opcode table entries are labels as well as cases */
+#define OPCASE(n)	case 0x##n: op_##n
+
+/* go straight on to the next opcode of the block unless the top of the
+   loop has work to do - this keeps a separate indirect jump for every opcode */
+#define NEXT do {							\
+    if (blockleft != 0 && m->simevents == 0) {				\
+	--blockleft;							\
+	op = *blockop++; ++PC;						\
+	goto *optable[op];						\
+    }									\
+    goto housekeeping;							\
+} while (0)
+
+#else
+/* the prefix pages go through the machine */
+#define PREFIX_FUNC	static
+#define PREFIX_PARAMS	, struct machine *m
+#define PREFIX_ARGS	, m
+#define PREFIX_DECLARE_STATE()	DECLARE_STATE()
+#define PREFIX_SAVE_STATE()	SAVE_STATE()
+#define PREFIX_ENTER()		SAVE_STATE()
+#define PREFIX_LEAVE()		LOAD_STATE()
+
+#define OPCASE(n)	case 0x##n
+#define NEXT		break
+#endif
+
+PREFIX_FUNC void
+cb_prefix(FASTREG adr PREFIX_PARAMS)
 {
-    DECLARE_STATE();
+    PREFIX_DECLARE_STATE();
     FASTWORK temp = 0, acu = 0, op, cbits;
     int saveresult=1;
 
@@ -224,16 +558,16 @@ cb_prefix(FASTREG adr)
 			case 7: Sethreg(AF, temp); break;
 			}
                 }
-    SAVE_STATE();
+    PREFIX_SAVE_STATE();
 }
 
-static FASTREG
-dfd_prefix(FASTREG IXY)
+PREFIX_FUNC FASTREG
+dfd_prefix(FASTREG IXY PREFIX_PARAMS)
 {
-    DECLARE_STATE();
+    PREFIX_DECLARE_STATE();
     FASTWORK temp, adr, acu, op, sum, cbits;
 
-		switch (++PC, op = GetBYTE(PC-1)) {
+		switch (++PC, op = GetBYTE(PC-1), m->tstates += cycles_dd[op], op) {
 		case 0x09:			/* ADD IXY,BC */
 			IXY &= 0xffff;
 			BC &= 0xffff;
@@ -679,9 +1013,10 @@ dfd_prefix(FASTREG IXY)
 			break;
 		case 0xCB:			/* CB prefix */
 			adr = IXY + (signed char) GetBYTE(PC); ++PC;
-			SAVE_STATE();
-			cb_prefix(adr);
-			LOAD_STATE();
+			m->tstates += cycles_ddcb[GetBYTE(PC)];
+			PREFIX_ENTER();
+			cb_prefix(adr PREFIX_ARGS);
+			PREFIX_LEAVE();
 			break;
 		case 0xE1:			/* POP IXY */
 			POP(IXY);
@@ -699,37 +1034,383 @@ dfd_prefix(FASTREG IXY)
 			SP = IXY;
 			break;
 		default: PC--;		/* ignore DD */
-            printf("unknown ix iy command %2.2X\n",op);
+            fprintf(m->out, "unknown ix iy command %2.2X\n",op);
             exit (1);
 		}
-    SAVE_STATE();
+    PREFIX_SAVE_STATE();
     return(IXY);
 }
 
+/* The block move and search opcodes work a page at a time on the host
+   memory behind rampagetable, rather than a byte at a time through
+   GetBYTE and PutBYTE.  A span never crosses a 2k page on either side. */
+
+#define PAGELEFTUP(a)	(RAMPAGEMASK + 1 - ((a) & RAMPAGEMASK))	// bytes from a to the end of its page
+#define PAGELEFTDOWN(a)	(((a) & RAMPAGEMASK) + 1)		// bytes from a back to the start of its page
+
+// LDIR - copy count bytes up from 'from' to 'to'
+// returns the last byte copied, which the flags need
+static FASTWORK
+ldirpages(struct machine *m, FASTREG from, FASTREG to, FASTWORK count)
+{
+    FASTWORK last = 0;
+
+    while (count != 0) {
+	FASTWORK span = PAGELEFTUP(from);
+	if (span > PAGELEFTUP(to))
+	    span = PAGELEFTUP(to);
+	if (span > count)
+	    span = count;
+	BYTE *src = &RAM(from);
+	BYTE *dst = &RAM(to);
+	// writes to ROM are ignored
+	if ((m->rampagetable[RAMPAGEINDEX(to)].flags & RAMPAGE_READONLY) == 0) {
+	    if ((uintptr_t)dst > (uintptr_t)src && (uintptr_t)dst < (uintptr_t)(src + span)) {
+		// destination just above the source - the Z80 copies bytes it has
+		// already copied, so a gap of 1 fills with the first byte
+		if (dst == src + 1)
+		    memset(dst, *src, span);
+		else
+		    for (FASTWORK i = 0; i < span; i++)
+			dst[i] = src[i];
+	    }
+	    else
+		memmove(dst, src, span);
+	    RAMPAGEWRITE(to, span);
+	}
+	last = src[span - 1];
+	from += span;
+	to += span;
+	count -= span;
+    }
+    return last;
+}
+
+// LDDR - copy count bytes down from 'from' to 'to'
+// returns the last byte copied, which the flags need
+static FASTWORK
+lddrpages(struct machine *m, FASTREG from, FASTREG to, FASTWORK count)
+{
+    FASTWORK last = 0;
+
+    while (count != 0) {
+	FASTWORK span = PAGELEFTDOWN(from);
+	if (span > PAGELEFTDOWN(to))
+	    span = PAGELEFTDOWN(to);
+	if (span > count)
+	    span = count;
+	// lowest address of the span on each side
+	BYTE *src = &RAM(from) - (span - 1);
+	BYTE *dst = &RAM(to) - (span - 1);
+	if ((m->rampagetable[RAMPAGEINDEX(to)].flags & RAMPAGE_READONLY) == 0) {
+	    if ((uintptr_t)dst < (uintptr_t)src && (uintptr_t)(dst + span) > (uintptr_t)src) {
+		// destination just below the source - copying down repeats bytes
+		if (dst + 1 == src)
+		    memset(dst, src[span - 1], span);
+		else
+		    for (FASTWORK i = span; i-- > 0; )
+			dst[i] = src[i];
+	    }
+	    else
+		memmove(dst, src, span);
+	    RAMPAGEWRITE(to - (span - 1), span);
+	}
+	last = src[0];
+	from -= span;
+	to -= span;
+	count -= span;
+    }
+    return last;
+}
+
+// CPIR - look up from 'from' for value in up to count bytes
+// returns the number of bytes looked at, including the match
+static FASTWORK
+cpirpages(struct machine *m, FASTREG from, FASTWORK count, int value)
+{
+    FASTWORK looked = 0;
+
+    while (count != 0) {
+	FASTWORK span = PAGELEFTUP(from);
+	if (span > count)
+	    span = count;
+	BYTE *src = &RAM(from);
+	BYTE *found = memchr(src, value, span);
+	if (found != NULL)
+	    return looked + (found - src) + 1;
+	looked += span;
+	from += span;
+	count -= span;
+    }
+    return looked;
+}
+
+// CPDR - look down from 'from' for value in up to count bytes
+// returns the number of bytes looked at, including the match
+static FASTWORK
+cpdrpages(struct machine *m, FASTREG from, FASTWORK count, int value)
+{
+    FASTWORK looked = 0;
+
+    while (count != 0) {
+	FASTWORK span = PAGELEFTDOWN(from);
+	if (span > count)
+	    span = count;
+	BYTE *src = &RAM(from);
+	for (FASTWORK i = 0; i < span; i++)
+	    if (*(src - i) == value)
+		return looked + i + 1;
+	looked += span;
+	from -= span;
+	count -= span;
+    }
+    return looked;
+}
+
+// copy count bytes from the host to the Z80 memory at 'to'
+static void
+putpages(struct machine *m, FASTREG to, const BYTE *from, FASTWORK count)
+{
+    while (count != 0) {
+	FASTWORK span = PAGELEFTUP(to);
+	if (span > count)
+	    span = count;
+	// writes to ROM are ignored
+	if ((m->rampagetable[RAMPAGEINDEX(to)].flags & RAMPAGE_READONLY) == 0) {
+	    memcpy(&RAM(to), from, span);
+	    RAMPAGEWRITE(to, span);
+	}
+	from += span;
+	to += span;
+	count -= span;
+    }
+}
+
+// copy count bytes from the Z80 memory at 'from' to the host
+static void
+getpages(struct machine *m, FASTREG from, BYTE *to, FASTWORK count)
+{
+    while (count != 0) {
+	FASTWORK span = PAGELEFTUP(from);
+	if (span > count)
+	    span = count;
+	memcpy(to, &RAM(from), span);
+	from += span;
+	to += span;
+	count -= span;
+    }
+}
+
+/* Fast disk - the sector loops of the VFC boot rom and the CP/M bios
+   poll the drive port with IN r,(C) and move one byte through the
+   data port each time round.  When the data port IN or OUT is part of
+   one of these loops the rest of the sector is copied in one go.  */
+
+#define FLOPPYDATAPORT	0xE3
+
+// IN r,(C) that leaves HL and C alone - B, D, E or A
+static int
+fastdiskpoll(struct machine *m, FASTREG a)
+{
+    int op = GetBYTE(a + 1);
+    return GetBYTE(a) == 0xED &&
+	(op == 0x40 || op == 0x50 || op == 0x58 || op == 0x78);
+}
+
+// the IN A,(E3h) at 'at' is the data read of
+//   at:   IN A,(E3h)  LD (HL),A  INC HL  IN r,(C)  JR Z,$-2  JP M,at
+// or
+//   loop: LD (HL),A  INC HL  IN r,(C)  JR Z,$-2  at: IN A,(E3h)  JP M,loop
+static int
+fastdiskreadloop(struct machine *m, FASTREG at)
+{
+    at &= 0xffff;
+    if (GetBYTE(at + 2) == 0x77 && GetBYTE(at + 3) == 0x23 &&
+	fastdiskpoll(m, at + 4) && GetBYTE(at + 6) == 0x28 &&
+	GetBYTE(at + 7) == 0xfc && GetBYTE(at + 8) == 0xfa &&
+	GetWORD(at + 9) == at)
+	return 1;
+    FASTREG loop = (at - 6) & 0xffff;
+    return GetBYTE(loop) == 0x77 && GetBYTE(loop + 1) == 0x23 &&
+	fastdiskpoll(m, loop + 2) && GetBYTE(loop + 4) == 0x28 &&
+	GetBYTE(loop + 5) == 0xfc && GetBYTE(at + 2) == 0xfa &&
+	GetWORD(at + 3) == loop;
+}
+
+// the OUT (E3h),A at 'at' is the data write of
+//   loop: LD A,(HL)  INC HL  IN r,(C)  JR Z,$-2  at: OUT (E3h),A  JP M,loop
+static int
+fastdiskwriteloop(struct machine *m, FASTREG at)
+{
+    FASTREG loop = (at - 6) & 0xffff;
+    return GetBYTE(loop) == 0x7e && GetBYTE(loop + 1) == 0x23 &&
+	fastdiskpoll(m, loop + 2) && GetBYTE(loop + 4) == 0x28 &&
+	GetBYTE(loop + 5) == 0xfc && GetBYTE(at + 2) == 0xfa &&
+	GetWORD(at + 3) == loop;
+}
+
+/* Fast SD - the Nascom 4 SDcard is read with a loop that polls the
+   status port until a byte is there, then takes it from the data port,
+   counting with DJNZ.  When the data port IN is part of this loop, or
+   an INIR / OTIR is on the data port, as much of the block as the count
+   allows is moved in one go.  */
+
+//   loop: IN A,(11h)  CP E0h or AND 40h  JR NZ or JR Z,loop
+//   at:   IN A,(10h)  LD (HL),A  INC HL  DJNZ loop
+static int
+fastsdreadloop(struct machine *m, FASTREG at)
+{
+    at &= 0xffff;
+    FASTREG loop = (at - 6) & 0xffff;
+    int test = GetBYTE(loop + 2);
+    int jump = GetBYTE(loop + 4);
+    return GetBYTE(loop) == 0xdb && GetBYTE(loop + 1) == SDSTATUS &&
+	((test == 0xfe && GetBYTE(loop + 3) == 0xe0 && jump == 0x20) ||
+	 (test == 0xe6 && GetBYTE(loop + 3) == 0x40 && jump == 0x28)) &&
+	GetBYTE(loop + 5) == 0xfa &&
+	GetBYTE(at + 2) == 0x77 && GetBYTE(at + 3) == 0x23 &&
+	GetBYTE(at + 4) == 0x10 && GetBYTE(at + 5) == 0xf4;
+}
+
+/* Idle loop detector - a Z80 waiting for a key or the serial input reads
+   the same values from its ports again and again from the same bit of
+   code.  After IDLEREADS such reads SIMEVENT_IDLE calls the callback
+   straight away with z80idle set, so the host can sleep.  Any change in
+   a value read, a read from somewhere else or long after the last, or an
+   OUT unlike the last few ( e.g. the characters of a message rather than
+   the keyboard scan ), starts the count again.  */
+
+static inline int
+idleinput(struct machine *m, unsigned int port, FASTREG pc)
+{
+	int value = in(m, port);
+
+	port &= 0xff;
+	if (value != m->idlelastvalue[port] || m->tstates - m->idletstates > IDLEREADGAP ||
+	    ((pc - m->idlepc + IDLEPCRANGE) & 0xffff) >= 2 * IDLEPCRANGE) {
+		m->idlelastvalue[port] = value;
+		m->idlepc = pc;
+		m->idlereads = 0;
+	}
+	else if (++m->idlereads == IDLEREADS) {
+		m->idlereads = 0;
+		m->simevents |= SIMEVENT_IDLE;
+	}
+	m->idletstates = m->tstates;
+	return value;
+}
+
+static inline void
+idleoutput(struct machine *m, unsigned int port, unsigned char value)
+{
+	unsigned int portvalue = ((port & 0xff) << 8) | value;
+
+	out(m, port, value);
+	if (m->idleouts[0] != portvalue && m->idleouts[1] != portvalue &&
+	    m->idleouts[2] != portvalue && m->idleouts[3] != portvalue) {
+		m->idleouts[m->idleoutnext] = portvalue;
+		m->idleoutnext = (m->idleoutnext + 1) & 3;
+		m->idlereads = 0;
+	}
+}
+
 FASTWORK
-simz80(FASTREG PC, int count, int (*fnc)())
+simz80(struct machine *m, FASTREG PC, int count, int (*fnc)(struct machine *))
 {
 
-    FASTREG AF = af[af_sel];
-    FASTREG BC = regs[regs_sel].bc;
-    FASTREG DE = regs[regs_sel].de;
-    FASTREG HL = regs[regs_sel].hl;
-    FASTREG SP = sp;
+    FASTREG AF = m->af[m->af_sel];
+    FASTREG BC = m->regs[m->regs_sel].bc;
+    FASTREG DE = m->regs[m->regs_sel].de;
+    FASTREG HL = m->regs[m->regs_sel].hl;
+    FASTREG SP = m->sp;
     FASTWORK temp, acu, sum, cbits;
-    FASTWORK op;
+    FASTWORK op = 0;
     int n = count;
+    int halted = 0;		// PC is on a HALT waiting for an interrupt
+    const BYTE *blockop = NULL;	// next opcode of the current block
+    int blockleft = 0;		// opcodes left to run in the current block
+#if SIMZ80_THREADED
+    static const void *const optable[256] = {
+	&&op_00, &&op_01, &&op_02, &&op_03, &&op_04, &&op_05, &&op_06, &&op_07,
+	&&op_08, &&op_09, &&op_0A, &&op_0B, &&op_0C, &&op_0D, &&op_0E, &&op_0F,
+	&&op_10, &&op_11, &&op_12, &&op_13, &&op_14, &&op_15, &&op_16, &&op_17,
+	&&op_18, &&op_19, &&op_1A, &&op_1B, &&op_1C, &&op_1D, &&op_1E, &&op_1F,
+	&&op_20, &&op_21, &&op_22, &&op_23, &&op_24, &&op_25, &&op_26, &&op_27,
+	&&op_28, &&op_29, &&op_2A, &&op_2B, &&op_2C, &&op_2D, &&op_2E, &&op_2F,
+	&&op_30, &&op_31, &&op_32, &&op_33, &&op_34, &&op_35, &&op_36, &&op_37,
+	&&op_38, &&op_39, &&op_3A, &&op_3B, &&op_3C, &&op_3D, &&op_3E, &&op_3F,
+	&&op_40, &&op_41, &&op_42, &&op_43, &&op_44, &&op_45, &&op_46, &&op_47,
+	&&op_48, &&op_49, &&op_4A, &&op_4B, &&op_4C, &&op_4D, &&op_4E, &&op_4F,
+	&&op_50, &&op_51, &&op_52, &&op_53, &&op_54, &&op_55, &&op_56, &&op_57,
+	&&op_58, &&op_59, &&op_5A, &&op_5B, &&op_5C, &&op_5D, &&op_5E, &&op_5F,
+	&&op_60, &&op_61, &&op_62, &&op_63, &&op_64, &&op_65, &&op_66, &&op_67,
+	&&op_68, &&op_69, &&op_6A, &&op_6B, &&op_6C, &&op_6D, &&op_6E, &&op_6F,
+	&&op_70, &&op_71, &&op_72, &&op_73, &&op_74, &&op_75, &&op_76, &&op_77,
+	&&op_78, &&op_79, &&op_7A, &&op_7B, &&op_7C, &&op_7D, &&op_7E, &&op_7F,
+	&&op_80, &&op_81, &&op_82, &&op_83, &&op_84, &&op_85, &&op_86, &&op_87,
+	&&op_88, &&op_89, &&op_8A, &&op_8B, &&op_8C, &&op_8D, &&op_8E, &&op_8F,
+	&&op_90, &&op_91, &&op_92, &&op_93, &&op_94, &&op_95, &&op_96, &&op_97,
+	&&op_98, &&op_99, &&op_9A, &&op_9B, &&op_9C, &&op_9D, &&op_9E, &&op_9F,
+	&&op_A0, &&op_A1, &&op_A2, &&op_A3, &&op_A4, &&op_A5, &&op_A6, &&op_A7,
+	&&op_A8, &&op_A9, &&op_AA, &&op_AB, &&op_AC, &&op_AD, &&op_AE, &&op_AF,
+	&&op_B0, &&op_B1, &&op_B2, &&op_B3, &&op_B4, &&op_B5, &&op_B6, &&op_B7,
+	&&op_B8, &&op_B9, &&op_BA, &&op_BB, &&op_BC, &&op_BD, &&op_BE, &&op_BF,
+	&&op_C0, &&op_C1, &&op_C2, &&op_C3, &&op_C4, &&op_C5, &&op_C6, &&op_C7,
+	&&op_C8, &&op_C9, &&op_CA, &&op_CB, &&op_CC, &&op_CD, &&op_CE, &&op_CF,
+	&&op_D0, &&op_D1, &&op_D2, &&op_D3, &&op_D4, &&op_D5, &&op_D6, &&op_D7,
+	&&op_D8, &&op_D9, &&op_DA, &&op_DB, &&op_DC, &&op_DD, &&op_DE, &&op_DF,
+	&&op_E0, &&op_E1, &&op_E2, &&op_E3, &&op_E4, &&op_E5, &&op_E6, &&op_E7,
+	&&op_E8, &&op_E9, &&op_EA, &&op_EB, &&op_EC, &&op_ED, &&op_EE, &&op_EF,
+	&&op_F0, &&op_F1, &&op_F2, &&op_F3, &&op_F4, &&op_F5, &&op_F6, &&op_F7,
+	&&op_F8, &&op_F9, &&op_FA, &&op_FB, &&op_FC, &&op_FD, &&op_FE, &&op_FF,
+    };
+#endif
+    // memory may have been changed by the monitor or loading files
+    blockcacheflush(m);
+
 #ifdef DEBUG
     while (!stopsim) {
 #else
     while (1) {
 #endif
 
+    if (blockleft != 0 && m->simevents == 0){
+        // carry on with the current block
+        --blockleft;
+        op = *blockop++; ++PC;
+    }
+    else {
+#if SIMZ80_THREADED
+    housekeeping:
+#endif
+    if (blockleft != 0){
+        // block cut short - take off the T-states of the opcodes not run,
+        // and give them back to the callback count they were charged to
+        do {
+            --blockleft;
+            ++n;
+            m->tstates -= cycles_main[*blockop++];
+        } while (blockleft != 0);
+    }
+
+    // devices waiting for the T-state count to reach a value
+    if (m->tstates >= m->eventnext){
+        event_run(m);
+    }
+
+    // trace, single step, NMI and INT each raise a bit in simevents
+    // so there is just the one test while none of them are active
+    if (m->simevents != 0){
+
+      // any block that has been started has now been given up
+      m->simevents &= ~SIMEVENT_BLOCKFLUSH;
+
       // debug - displays current instruction and registers 
-    if (traceon==1){
+      if (m->simevents & SIMEVENT_TRACE){
         // show registers
         //fprintf(stdout,"doing trace\n");
-        disassembleprogram(PC,stdout,1,tracestartaddress,traceendaddress,AF,BC,DE,HL,SP);
-    }
+        disassembleprogram(m,PC,m->out,1,m->tracestartaddress,m->traceendaddress,AF,BC,DE,HL,SP);
+      }
 
     /*
     The single step function works by setting singleStep to 2
@@ -739,79 +1420,146 @@ simz80(FASTREG PC, int count, int (*fnc)())
             RETN	; return using address previously added to stack
       */
       // checks if single step set
-      if (singleStep != 0 ){
+      if (m->simevents & SIMEVENT_SINGLESTEP){
           // see if time to set NMI
-          singleStep -= 1;
-          if (singleStep == 0){
-              NMI_flag=1;
+          m->singleStep -= 1;
+          if (m->singleStep <= 0){
+              m->singleStep = 0;
+              m->NMI_flag=1;
+              m->simevents = (m->simevents & ~SIMEVENT_SINGLESTEP) | SIMEVENT_NMI;
           }
       }
-      // not doing other INTs
 
       // test if NMI set
-      if ( NMI_flag == 1 ){
+      if (m->simevents & SIMEVENT_NMI){
+          // carry on after a HALT when the NMI returns
+          PC += halted;
+          halted = 0;
           // save current address
           PUSH (PC);
           // set interupt address
           PC = 0x66;
-          IFF = 0;
-          NMI_flag = 0; // reset NMI
+          m->IFF = 0;
+          m->NMI_flag = 0; // reset NMI
+          m->simevents &= ~SIMEVENT_NMI;
+          m->tstates += 11;
+      }
+
+      // maskable interrupt - not straight after EI, the instruction after it runs first
+      if ((m->simevents & SIMEVENT_INT) && op != 0xFB){
+          // EI, RETN and RETI raise the bit again if the line is still high
+          m->simevents &= ~SIMEVENT_INT;
+          if (m->IFF & 1){
+              int vector = interrupt_acknowledge(m);
+              if (vector >= 0){
+                  PC += halted;
+                  halted = 0;
+                  PUSH (PC);
+                  m->IFF = 0;
+                  switch (m->im){
+                  case 0:     // the vector is an RST instruction
+                      PC = vector & 0x38;
+                      m->tstates += 13;
+                      break;
+                  case 1:
+                      PC = 0x38;
+                      m->tstates += 13;
+                      break;
+                  default:    // the vector is the low byte of the table entry
+                      PC = GetWORD((m->ir & 0xff00) | (vector & 0xfe));
+                      m->tstates += 19;
+                      break;
+                  }
+              }
+          }
+      }
+
+      // waiting on a port - call back now so the host can sleep
+      if (m->simevents & SIMEVENT_IDLE){
+          m->simevents &= ~SIMEVENT_IDLE;
+          m->z80idle = 1;
+          n = 1;
       }
+    }
 
-      if (--n == 0) {	// if n has reached 0 then call callback function
+      if (--n <= 0) {	// if n has reached 0 then call callback function
+            m->z80instructions += count - n;
             n = count;	// reset count
 //            printf("count %d\n",count);
-            int r = (*fnc)();	// call callback function -
+            int r = (*fnc)(m);	// call callback function -
     				// handles screens and F type keyboard entries
 
             if (r == -1)		// if it returned -1
-                break;		// stop the emulator
-            else if (r != 0)	// if not 0
+                goto stopped;		// stop the emulator
+            else if (r != 0){	// if not 0
                 PC = 0;		// reset the emulator
+                halted = 0;
+                m->IFF = 0;
+                m->im = 0;
+                interrupt_reset(m);
+            }
       }
 
-    switch(++PC,RAM(PC-1)) {
-	case 0x00:			/* NOP */
-		break;
-	case 0x01:			/* LD BC,nnnn */
+    if (Z80BLOCKCACHE && m->simevents == 0){
+        // start the next block - charging for all of it now
+        struct blockentry *block = blockcachefind(m, PC);
+        blockop = block->ops;
+        blockleft = block->count - 1;
+        n -= blockleft;
+        m->tstates += block->cycles;
+        op = *blockop++; ++PC;
+    }
+    else {
+        // one opcode at a time while there are events to deal with
+        op = RAM(PC); ++PC;
+        m->tstates += cycles_main[op];
+    }
+    }
+#if SIMZ80_THREADED
+    goto *optable[op];
+#endif
+    switch(op) {
+	OPCASE(00):			/* NOP */
+		NEXT;
+	OPCASE(01):			/* LD BC,nnnn */
 		BC = GetWORD(PC);
 		PC += 2;
-		break;
-	case 0x02:			/* LD (BC),A */
+		NEXT;
+	OPCASE(02):			/* LD (BC),A */
 		PutBYTE(BC, hreg(AF));
-		break;
-	case 0x03:			/* INC BC */
+		NEXT;
+	OPCASE(03):			/* INC BC */
 		++BC;
-		break;
-	case 0x04:			/* INC B */
+		NEXT;
+	OPCASE(04):			/* INC B */
 		BC += 0x100;
 		temp = hreg(BC);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0) << 4) |
 			((temp == 0x80) << 2);
-		break;
-	case 0x05:			/* DEC B */
+		NEXT;
+	OPCASE(05):			/* DEC B */
 		BC -= 0x100;
 		temp = hreg(BC);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0xf) << 4) |
 			((temp == 0x7f) << 2) | 2;
-		break;
-	case 0x06:			/* LD B,nn */
+		NEXT;
+	OPCASE(06):			/* LD B,nn */
 		Sethreg(BC, GetBYTE(PC)); ++PC;
-		break;
-	case 0x07:			/* RLCA */
+		NEXT;
+	OPCASE(07):			/* RLCA */
 		AF = ((AF >> 7) & 0x0128) | ((AF << 1) & ~0x1ff) |
 			(AF & 0xc4) | ((AF >> 15) & 1);
-		break;
-	case 0x08:			/* EX AF,AF' */
-		af[af_sel] = AF;
-		af_sel = 1 - af_sel;
-		AF = af[af_sel];
-		break;
-	case 0x09:			/* ADD HL,BC */
+		NEXT;
+	OPCASE(08):			/* EX AF,AF' */
+		m->af[m->af_sel] = AF;
+		m->af_sel = 1 - m->af_sel;
+		AF = m->af[m->af_sel];
+		NEXT;
+	OPCASE(09):			/* ADD HL,BC */
 		HL &= 0xffff;
 		BC &= 0xffff;
 		sum = HL + BC;
@@ -819,78 +1567,78 @@ simz80(FASTREG PC, int count, int (*fnc)())
 		HL = sum;
 		AF = (AF & ~0x3b) | ((sum >> 8) & 0x28) |
 			(cbits & 0x10) | ((cbits >> 8) & 1);
-		break;
-	case 0x0A:			/* LD A,(BC) */
+		NEXT;
+	OPCASE(0A):			/* LD A,(BC) */
 		Sethreg(AF, GetBYTE(BC));
-		break;
-	case 0x0B:			/* DEC BC */
+		NEXT;
+	OPCASE(0B):			/* DEC BC */
 		--BC;
-		break;
-	case 0x0C:			/* INC C */
+		NEXT;
+	OPCASE(0C):			/* INC C */
 		temp = lreg(BC)+1;
 		Setlreg(BC, temp);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0) << 4) |
 			((temp == 0x80) << 2);
-		break;
-	case 0x0D:			/* DEC C */
+		NEXT;
+	OPCASE(0D):			/* DEC C */
 		temp = lreg(BC)-1;
 		Setlreg(BC, temp);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0xf) << 4) |
 			((temp == 0x7f) << 2) | 2;
-		break;
-	case 0x0E:			/* LD C,nn */
+		NEXT;
+	OPCASE(0E):			/* LD C,nn */
 		Setlreg(BC, GetBYTE(PC)); ++PC;
-		break;
-	case 0x0F:			/* RRCA */
+		NEXT;
+	OPCASE(0F):			/* RRCA */
 		temp = hreg(AF);
 		sum = temp >> 1;
 		AF = ((temp & 1) << 15) | (sum << 8) |
 			(sum & 0x28) | (AF & 0xc4) | (temp & 1);
-		break;
-	case 0x10:			/* DJNZ dd */
-		PC += ((BC -= 0x100) & 0xff00) ? (signed char) GetBYTE(PC) + 1 : 1;
-		break;
-	case 0x11:			/* LD DE,nnnn */
+		NEXT;
+	OPCASE(10):			/* DJNZ dd */
+		JRC((BC -= 0x100) & 0xff00);
+		NEXT;
+	OPCASE(11):			/* LD DE,nnnn */
 		DE = GetWORD(PC);
 		PC += 2;
-		break;
-	case 0x12:			/* LD (DE),A */
+		NEXT;
+	OPCASE(12):			/* LD (DE),A */
 		PutBYTE(DE, hreg(AF));
-		break;
-	case 0x13:			/* INC DE */
+		NEXT;
+	OPCASE(13):			/* INC DE */
 		++DE;
-		break;
-	case 0x14:			/* INC D */
+		NEXT;
+	OPCASE(14):			/* INC D */
 		DE += 0x100;
 		temp = hreg(DE);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0) << 4) |
 			((temp == 0x80) << 2);
-		break;
-	case 0x15:			/* DEC D */
+		NEXT;
+	OPCASE(15):			/* DEC D */
 		DE -= 0x100;
 		temp = hreg(DE);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0xf) << 4) |
 			((temp == 0x7f) << 2) | 2;
-		break;
-	case 0x16:			/* LD D,nn */
+		NEXT;
+	OPCASE(16):			/* LD D,nn */
 		Sethreg(DE, GetBYTE(PC)); ++PC;
-		break;
-	case 0x17:			/* RLA */
+		NEXT;
+	OPCASE(17):			/* RLA */
 		AF = ((AF << 8) & 0x0100) | ((AF >> 7) & 0x28) | ((AF << 1) & ~0x01ff) |
 			(AF & 0xc4) | ((AF >> 15) & 1);
-		break;
-	case 0x18:			/* JR dd */
-		PC += (1) ? (signed char) GetBYTE(PC) + 1 : 1;
-		break;
-	case 0x19:			/* ADD HL,DE */
+		NEXT;
+	OPCASE(18):			/* JR dd */
+		JRC(1);
+		NEXT;
+	OPCASE(19):			/* ADD HL,DE */
 		HL &= 0xffff;
 		DE &= 0xffff;
 		sum = HL + DE;
@@ -898,73 +1646,73 @@ simz80(FASTREG PC, int count, int (*fnc)())
 		HL = sum;
 		AF = (AF & ~0x3b) | ((sum >> 8) & 0x28) |
 			(cbits & 0x10) | ((cbits >> 8) & 1);
-		break;
-	case 0x1A:			/* LD A,(DE) */
+		NEXT;
+	OPCASE(1A):			/* LD A,(DE) */
 		Sethreg(AF, GetBYTE(DE));
-		break;
-	case 0x1B:			/* DEC DE */
+		NEXT;
+	OPCASE(1B):			/* DEC DE */
 		--DE;
-		break;
-	case 0x1C:			/* INC E */
+		NEXT;
+	OPCASE(1C):			/* INC E */
 		temp = lreg(DE)+1;
 		Setlreg(DE, temp);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0) << 4) |
 			((temp == 0x80) << 2);
-		break;
-	case 0x1D:			/* DEC E */
+		NEXT;
+	OPCASE(1D):			/* DEC E */
 		temp = lreg(DE)-1;
 		Setlreg(DE, temp);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0xf) << 4) |
 			((temp == 0x7f) << 2) | 2;
-		break;
-	case 0x1E:			/* LD E,nn */
+		NEXT;
+	OPCASE(1E):			/* LD E,nn */
 		Setlreg(DE, GetBYTE(PC)); ++PC;
-		break;
-	case 0x1F:			/* RRA */
+		NEXT;
+	OPCASE(1F):			/* RRA */
 		temp = hreg(AF);
 		sum = temp >> 1;
 		AF = ((AF & 1) << 15) | (sum << 8) |
 			(sum & 0x28) | (AF & 0xc4) | (temp & 1);
-		break;
-	case 0x20:			/* JR NZ,dd */
-		PC += (!TSTFLAG(Z)) ? (signed char) GetBYTE(PC) + 1 : 1;
-		break;
-	case 0x21:			/* LD HL,nnnn */
+		NEXT;
+	OPCASE(20):			/* JR NZ,dd */
+		JRC(!TSTFLAG(Z));
+		NEXT;
+	OPCASE(21):			/* LD HL,nnnn */
 		HL = GetWORD(PC);
 		PC += 2;
-		break;
-	case 0x22:			/* LD (nnnn),HL */
+		NEXT;
+	OPCASE(22):			/* LD (nnnn),HL */
 		temp = GetWORD(PC);
 		PutWORD(temp, HL);
 		PC += 2;
-		break;
-	case 0x23:			/* INC HL */
+		NEXT;
+	OPCASE(23):			/* INC HL */
 		++HL;
-		break;
-	case 0x24:			/* INC H */
+		NEXT;
+	OPCASE(24):			/* INC H */
 		HL += 0x100;
 		temp = hreg(HL);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0) << 4) |
 			((temp == 0x80) << 2);
-		break;
-	case 0x25:			/* DEC H */
+		NEXT;
+	OPCASE(25):			/* DEC H */
 		HL -= 0x100;
 		temp = hreg(HL);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0xf) << 4) |
 			((temp == 0x7f) << 2) | 2;
-		break;
-	case 0x26:			/* LD H,nn */
+		NEXT;
+	OPCASE(26):			/* LD H,nn */
 		Sethreg(HL, GetBYTE(PC)); ++PC;
-		break;
-	case 0x27:			/* DAA */
+		NEXT;
+	OPCASE(27):			/* DAA */
 		acu = hreg(AF);
 		temp = ldig(acu);
 		cbits = TSTFLAG(C);
@@ -991,89 +1739,89 @@ simz80(FASTREG PC, int count, int (*fnc)())
 		acu &= 0xff;
 		AF = (acu << 8) | (acu & 0xa8) | ((acu == 0) << 6) |
 			(AF & 0x12) | partab[acu] | cbits;
-		break;
-	case 0x28:			/* JR Z,dd */
-		PC += (TSTFLAG(Z)) ? (signed char) GetBYTE(PC) + 1 : 1;
-		break;
-	case 0x29:			/* ADD HL,HL */
+		NEXT;
+	OPCASE(28):			/* JR Z,dd */
+		JRC(TSTFLAG(Z));
+		NEXT;
+	OPCASE(29):			/* ADD HL,HL */
 		HL &= 0xffff;
 		sum = HL + HL;
 		cbits = (HL ^ HL ^ sum) >> 8;
 		HL = sum;
 		AF = (AF & ~0x3b) | ((sum >> 8) & 0x28) |
 			(cbits & 0x10) | ((cbits >> 8) & 1);
-		break;
-	case 0x2A:			/* LD HL,(nnnn) */
+		NEXT;
+	OPCASE(2A):			/* LD HL,(nnnn) */
 		temp = GetWORD(PC);
 		HL = GetWORD(temp);
 		PC += 2;
-		break;
-	case 0x2B:			/* DEC HL */
+		NEXT;
+	OPCASE(2B):			/* DEC HL */
 		--HL;
-		break;
-	case 0x2C:			/* INC L */
+		NEXT;
+	OPCASE(2C):			/* INC L */
 		temp = lreg(HL)+1;
 		Setlreg(HL, temp);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0) << 4) |
 			((temp == 0x80) << 2);
-		break;
-	case 0x2D:			/* DEC L */
+		NEXT;
+	OPCASE(2D):			/* DEC L */
 		temp = lreg(HL)-1;
 		Setlreg(HL, temp);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0xf) << 4) |
 			((temp == 0x7f) << 2) | 2;
-		break;
-	case 0x2E:			/* LD L,nn */
+		NEXT;
+	OPCASE(2E):			/* LD L,nn */
 		Setlreg(HL, GetBYTE(PC)); ++PC;
-		break;
-	case 0x2F:			/* CPL */
+		NEXT;
+	OPCASE(2F):			/* CPL */
 		AF = (~AF & ~0xff) | (AF & 0xc5) | ((~AF >> 8) & 0x28) | 0x12;
-		break;
-	case 0x30:			/* JR NC,dd */
-		PC += (!TSTFLAG(C)) ? (signed char) GetBYTE(PC) + 1 : 1;
-		break;
-	case 0x31:			/* LD SP,nnnn */
+		NEXT;
+	OPCASE(30):			/* JR NC,dd */
+		JRC(!TSTFLAG(C));
+		NEXT;
+	OPCASE(31):			/* LD SP,nnnn */
 		SP = GetWORD(PC);
 		PC += 2;
-		break;
-	case 0x32:			/* LD (nnnn),A */
+		NEXT;
+	OPCASE(32):			/* LD (nnnn),A */
 		temp = GetWORD(PC);
 		PutBYTE(temp, hreg(AF));
 		PC += 2;
-		break;
-	case 0x33:			/* INC SP */
+		NEXT;
+	OPCASE(33):			/* INC SP */
 		++SP;
-		break;
-	case 0x34:			/* INC (HL) */
+		NEXT;
+	OPCASE(34):			/* INC (HL) */
 		temp = GetBYTE(HL)+1;
 		PutBYTE(HL, temp);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0) << 4) |
 			((temp == 0x80) << 2);
-		break;
-	case 0x35:			/* DEC (HL) */
+		NEXT;
+	OPCASE(35):			/* DEC (HL) */
 		temp = GetBYTE(HL)-1;
 		PutBYTE(HL, temp);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0xf) << 4) |
 			((temp == 0x7f) << 2) | 2;
-		break;
-	case 0x36:			/* LD (HL),nn */
+		NEXT;
+	OPCASE(36):			/* LD (HL),nn */
 		PutBYTE(HL, GetBYTE(PC)); ++PC;
-		break;
-	case 0x37:			/* SCF */
+		NEXT;
+	OPCASE(37):			/* SCF */
 		AF = (AF&~0x3b)|((AF>>8)&0x28)|1;
-		break;
-	case 0x38:			/* JR C,dd */
-		PC += (TSTFLAG(C)) ? (signed char) GetBYTE(PC) + 1 : 1;
-		break;
-	case 0x39:			/* ADD HL,SP */
+		NEXT;
+	OPCASE(38):			/* JR C,dd */
+		JRC(TSTFLAG(C));
+		NEXT;
+	OPCASE(39):			/* ADD HL,SP */
 		HL &= 0xffff;
 		SP &= 0xffff;
 		sum = HL + SP;
@@ -1081,231 +1829,249 @@ simz80(FASTREG PC, int count, int (*fnc)())
 		HL = sum;
 		AF = (AF & ~0x3b) | ((sum >> 8) & 0x28) |
 			(cbits & 0x10) | ((cbits >> 8) & 1);
-		break;
-	case 0x3A:			/* LD A,(nnnn) */
+		NEXT;
+	OPCASE(3A):			/* LD A,(nnnn) */
 		temp = GetWORD(PC);
 		Sethreg(AF, GetBYTE(temp));
 		PC += 2;
-		break;
-	case 0x3B:			/* DEC SP */
+		NEXT;
+	OPCASE(3B):			/* DEC SP */
 		--SP;
-		break;
-	case 0x3C:			/* INC A */
+		NEXT;
+	OPCASE(3C):			/* INC A */
 		AF += 0x100;
 		temp = hreg(AF);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0) << 4) |
 			((temp == 0x80) << 2);
-		break;
-	case 0x3D:			/* DEC A */
+		NEXT;
+	OPCASE(3D):			/* DEC A */
 		AF -= 0x100;
 		temp = hreg(AF);
 		AF = (AF & ~0xfe) | (temp & 0xa8) |
 			(((temp & 0xff) == 0) << 6) |
 			(((temp & 0xf) == 0xf) << 4) |
 			((temp == 0x7f) << 2) | 2;
-		break;
-	case 0x3E:			/* LD A,nn */
+		NEXT;
+	OPCASE(3E):			/* LD A,nn */
 		Sethreg(AF, GetBYTE(PC)); ++PC;
-		break;
-	case 0x3F:			/* CCF */
+		NEXT;
+	OPCASE(3F):			/* CCF */
 		AF = (AF&~0x3b)|((AF>>8)&0x28)|((AF&1)<<4)|(~AF&1);
-		break;
-	case 0x40:			/* LD B,B */
+		NEXT;
+	OPCASE(40):			/* LD B,B */
 		/* nop */
-		break;
-	case 0x41:			/* LD B,C */
+		NEXT;
+	OPCASE(41):			/* LD B,C */
 		BC = (BC & 255) | ((BC & 255) << 8);
-		break;
-	case 0x42:			/* LD B,D */
+		NEXT;
+	OPCASE(42):			/* LD B,D */
 		BC = (BC & 255) | (DE & ~255);
-		break;
-	case 0x43:			/* LD B,E */
+		NEXT;
+	OPCASE(43):			/* LD B,E */
 		BC = (BC & 255) | ((DE & 255) << 8);
-		break;
-	case 0x44:			/* LD B,H */
+		NEXT;
+	OPCASE(44):			/* LD B,H */
 		BC = (BC & 255) | (HL & ~255);
-		break;
-	case 0x45:			/* LD B,L */
+		NEXT;
+	OPCASE(45):			/* LD B,L */
 		BC = (BC & 255) | ((HL & 255) << 8);
-		break;
-	case 0x46:			/* LD B,(HL) */
+		NEXT;
+	OPCASE(46):			/* LD B,(HL) */
 		Sethreg(BC, GetBYTE(HL));
-		break;
-	case 0x47:			/* LD B,A */
+		NEXT;
+	OPCASE(47):			/* LD B,A */
 		BC = (BC & 255) | (AF & ~255);
-		break;
-	case 0x48:			/* LD C,B */
+		NEXT;
+	OPCASE(48):			/* LD C,B */
 		BC = (BC & ~255) | ((BC >> 8) & 255);
-		break;
-	case 0x49:			/* LD C,C */
+		NEXT;
+	OPCASE(49):			/* LD C,C */
 		/* nop */
-		break;
-	case 0x4A:			/* LD C,D */
+		NEXT;
+	OPCASE(4A):			/* LD C,D */
 		BC = (BC & ~255) | ((DE >> 8) & 255);
-		break;
-	case 0x4B:			/* LD C,E */
+		NEXT;
+	OPCASE(4B):			/* LD C,E */
 		BC = (BC & ~255) | (DE & 255);
-		break;
-	case 0x4C:			/* LD C,H */
+		NEXT;
+	OPCASE(4C):			/* LD C,H */
 		BC = (BC & ~255) | ((HL >> 8) & 255);
-		break;
-	case 0x4D:			/* LD C,L */
+		NEXT;
+	OPCASE(4D):			/* LD C,L */
 		BC = (BC & ~255) | (HL & 255);
-		break;
-	case 0x4E:			/* LD C,(HL) */
+		NEXT;
+	OPCASE(4E):			/* LD C,(HL) */
 		Setlreg(BC, GetBYTE(HL));
-		break;
-	case 0x4F:			/* LD C,A */
+		NEXT;
+	OPCASE(4F):			/* LD C,A */
 		BC = (BC & ~255) | ((AF >> 8) & 255);
-		break;
-	case 0x50:			/* LD D,B */
+		NEXT;
+	OPCASE(50):			/* LD D,B */
 		DE = (DE & 255) | (BC & ~255);
-		break;
-	case 0x51:			/* LD D,C */
+		NEXT;
+	OPCASE(51):			/* LD D,C */
 		DE = (DE & 255) | ((BC & 255) << 8);
-		break;
-	case 0x52:			/* LD D,D */
+		NEXT;
+	OPCASE(52):			/* LD D,D */
 		/* nop */
-		break;
-	case 0x53:			/* LD D,E */
+		NEXT;
+	OPCASE(53):			/* LD D,E */
 		DE = (DE & 255) | ((DE & 255) << 8);
-		break;
-	case 0x54:			/* LD D,H */
+		NEXT;
+	OPCASE(54):			/* LD D,H */
 		DE = (DE & 255) | (HL & ~255);
-		break;
-	case 0x55:			/* LD D,L */
+		NEXT;
+	OPCASE(55):			/* LD D,L */
 		DE = (DE & 255) | ((HL & 255) << 8);
-		break;
-	case 0x56:			/* LD D,(HL) */
+		NEXT;
+	OPCASE(56):			/* LD D,(HL) */
 		Sethreg(DE, GetBYTE(HL));
-		break;
-	case 0x57:			/* LD D,A */
+		NEXT;
+	OPCASE(57):			/* LD D,A */
 		DE = (DE & 255) | (AF & ~255);
-		break;
-	case 0x58:			/* LD E,B */
+		NEXT;
+	OPCASE(58):			/* LD E,B */
 		DE = (DE & ~255) | ((BC >> 8) & 255);
-		break;
-	case 0x59:			/* LD E,C */
+		NEXT;
+	OPCASE(59):			/* LD E,C */
 		DE = (DE & ~255) | (BC & 255);
-		break;
-	case 0x5A:			/* LD E,D */
+		NEXT;
+	OPCASE(5A):			/* LD E,D */
 		DE = (DE & ~255) | ((DE >> 8) & 255);
-		break;
-	case 0x5B:			/* LD E,E */
+		NEXT;
+	OPCASE(5B):			/* LD E,E */
 		/* nop */
-		break;
-	case 0x5C:			/* LD E,H */
+		NEXT;
+	OPCASE(5C):			/* LD E,H */
 		DE = (DE & ~255) | ((HL >> 8) & 255);
-		break;
-	case 0x5D:			/* LD E,L */
+		NEXT;
+	OPCASE(5D):			/* LD E,L */
 		DE = (DE & ~255) | (HL & 255);
-		break;
-	case 0x5E:			/* LD E,(HL) */
+		NEXT;
+	OPCASE(5E):			/* LD E,(HL) */
 		Setlreg(DE, GetBYTE(HL));
-		break;
-	case 0x5F:			/* LD E,A */
+		NEXT;
+	OPCASE(5F):			/* LD E,A */
 		DE = (DE & ~255) | ((AF >> 8) & 255);
-		break;
-	case 0x60:			/* LD H,B */
+		NEXT;
+	OPCASE(60):			/* LD H,B */
 		HL = (HL & 255) | (BC & ~255);
-		break;
-	case 0x61:			/* LD H,C */
+		NEXT;
+	OPCASE(61):			/* LD H,C */
 		HL = (HL & 255) | ((BC & 255) << 8);
-		break;
-	case 0x62:			/* LD H,D */
+		NEXT;
+	OPCASE(62):			/* LD H,D */
 		HL = (HL & 255) | (DE & ~255);
-		break;
-	case 0x63:			/* LD H,E */
+		NEXT;
+	OPCASE(63):			/* LD H,E */
 		HL = (HL & 255) | ((DE & 255) << 8);
-		break;
-	case 0x64:			/* LD H,H */
+		NEXT;
+	OPCASE(64):			/* LD H,H */
 		/* nop */
-		break;
-	case 0x65:			/* LD H,L */
+		NEXT;
+	OPCASE(65):			/* LD H,L */
 		HL = (HL & 255) | ((HL & 255) << 8);
-		break;
-	case 0x66:			/* LD H,(HL) */
+		NEXT;
+	OPCASE(66):			/* LD H,(HL) */
 		Sethreg(HL, GetBYTE(HL));
-		break;
-	case 0x67:			/* LD H,A */
+		NEXT;
+	OPCASE(67):			/* LD H,A */
 		HL = (HL & 255) | (AF & ~255);
-		break;
-	case 0x68:			/* LD L,B */
+		NEXT;
+	OPCASE(68):			/* LD L,B */
 		HL = (HL & ~255) | ((BC >> 8) & 255);
-		break;
-	case 0x69:			/* LD L,C */
+		NEXT;
+	OPCASE(69):			/* LD L,C */
 		HL = (HL & ~255) | (BC & 255);
-		break;
-	case 0x6A:			/* LD L,D */
+		NEXT;
+	OPCASE(6A):			/* LD L,D */
 		HL = (HL & ~255) | ((DE >> 8) & 255);
-		break;
-	case 0x6B:			/* LD L,E */
+		NEXT;
+	OPCASE(6B):			/* LD L,E */
 		HL = (HL & ~255) | (DE & 255);
-		break;
-	case 0x6C:			/* LD L,H */
+		NEXT;
+	OPCASE(6C):			/* LD L,H */
 		HL = (HL & ~255) | ((HL >> 8) & 255);
-		break;
-	case 0x6D:			/* LD L,L */
+		NEXT;
+	OPCASE(6D):			/* LD L,L */
 		/* nop */
-		break;
-	case 0x6E:			/* LD L,(HL) */
+		NEXT;
+	OPCASE(6E):			/* LD L,(HL) */
 		Setlreg(HL, GetBYTE(HL));
-		break;
-	case 0x6F:			/* LD L,A */
+		NEXT;
+	OPCASE(6F):			/* LD L,A */
 		HL = (HL & ~255) | ((AF >> 8) & 255);
-		break;
-	case 0x70:			/* LD (HL),B */
+		NEXT;
+	OPCASE(70):			/* LD (HL),B */
 		PutBYTE(HL, hreg(BC));
-		break;
-	case 0x71:			/* LD (HL),C */
+		NEXT;
+	OPCASE(71):			/* LD (HL),C */
 		PutBYTE(HL, lreg(BC));
-		break;
-	case 0x72:			/* LD (HL),D */
+		NEXT;
+	OPCASE(72):			/* LD (HL),D */
 		PutBYTE(HL, hreg(DE));
-		break;
-	case 0x73:			/* LD (HL),E */
+		NEXT;
+	OPCASE(73):			/* LD (HL),E */
 		PutBYTE(HL, lreg(DE));
-		break;
-	case 0x74:			/* LD (HL),H */
+		NEXT;
+	OPCASE(74):			/* LD (HL),H */
 		PutBYTE(HL, hreg(HL));
-		break;
-	case 0x75:			/* LD (HL),L */
+		NEXT;
+	OPCASE(75):			/* LD (HL),L */
 		PutBYTE(HL, lreg(HL));
-		break;
-	case 0x76:			/* HALT */
+		NEXT;
+	OPCASE(76):			/* HALT */
+		if (m->IFF & 1) {
+			/* wait for an interrupt - the NOPs up to the next event
+			   are run in one go, or up to the next callback if there
+			   is nothing due, which lets the host sleep */
+			int nops = n - 1;
+			if (m->eventnext == UINT64_MAX)
+				m->z80idle = 1;
+			else if (m->eventnext <= m->tstates)
+				nops = 0;
+			else if ((m->eventnext - m->tstates + 3) / 4 < (uint64_t)nops)
+				nops = (m->eventnext - m->tstates + 3) / 4;
+			m->tstates += 4 * (uint64_t)nops;
+			n -= nops;
+			--PC;
+			halted = 1;
+			NEXT;
+		}
 		SAVE_STATE();
-	    fprintf(stderr,"Halt instructions at address %04X \n",PC);
+		m->z80instructions += count - n;
+	    fprintf(m->err, "Halt instructions at address %04X \n",PC);
 		return PC&0xffff;
-	case 0x77:			/* LD (HL),A */
+	OPCASE(77):			/* LD (HL),A */
 		PutBYTE(HL, hreg(AF));
-		break;
-	case 0x78:			/* LD A,B */
+		NEXT;
+	OPCASE(78):			/* LD A,B */
 		AF = (AF & 255) | (BC & ~255);
-		break;
-	case 0x79:			/* LD A,C */
+		NEXT;
+	OPCASE(79):			/* LD A,C */
 		AF = (AF & 255) | ((BC & 255) << 8);
-		break;
-	case 0x7A:			/* LD A,D */
+		NEXT;
+	OPCASE(7A):			/* LD A,D */
 		AF = (AF & 255) | (DE & ~255);
-		break;
-	case 0x7B:			/* LD A,E */
+		NEXT;
+	OPCASE(7B):			/* LD A,E */
 		AF = (AF & 255) | ((DE & 255) << 8);
-		break;
-	case 0x7C:			/* LD A,H */
+		NEXT;
+	OPCASE(7C):			/* LD A,H */
 		AF = (AF & 255) | (HL & ~255);
-		break;
-	case 0x7D:			/* LD A,L */
+		NEXT;
+	OPCASE(7D):			/* LD A,L */
 		AF = (AF & 255) | ((HL & 255) << 8);
-		break;
-	case 0x7E:			/* LD A,(HL) */
+		NEXT;
+	OPCASE(7E):			/* LD A,(HL) */
 		Sethreg(AF, GetBYTE(HL));
-		break;
-	case 0x7F:			/* LD A,A */
+		NEXT;
+	OPCASE(7F):			/* LD A,A */
 		/* nop */
-		break;
-	case 0x80:			/* ADD A,B */
+		NEXT;
+	OPCASE(80):			/* ADD A,B */
 		temp = hreg(BC);
 		acu = hreg(AF);
 		sum = acu + temp;
@@ -1314,8 +2080,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x81:			/* ADD A,C */
+		NEXT;
+	OPCASE(81):			/* ADD A,C */
 		temp = lreg(BC);
 		acu = hreg(AF);
 		sum = acu + temp;
@@ -1324,8 +2090,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x82:			/* ADD A,D */
+		NEXT;
+	OPCASE(82):			/* ADD A,D */
 		temp = hreg(DE);
 		acu = hreg(AF);
 		sum = acu + temp;
@@ -1334,8 +2100,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x83:			/* ADD A,E */
+		NEXT;
+	OPCASE(83):			/* ADD A,E */
 		temp = lreg(DE);
 		acu = hreg(AF);
 		sum = acu + temp;
@@ -1344,8 +2110,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x84:			/* ADD A,H */
+		NEXT;
+	OPCASE(84):			/* ADD A,H */
 		temp = hreg(HL);
 		acu = hreg(AF);
 		sum = acu + temp;
@@ -1354,8 +2120,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x85:			/* ADD A,L */
+		NEXT;
+	OPCASE(85):			/* ADD A,L */
 		temp = lreg(HL);
 		acu = hreg(AF);
 		sum = acu + temp;
@@ -1364,8 +2130,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x86:			/* ADD A,(HL) */
+		NEXT;
+	OPCASE(86):			/* ADD A,(HL) */
 		temp = GetBYTE(HL);
 		acu = hreg(AF);
 		sum = acu + temp;
@@ -1374,8 +2140,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x87:			/* ADD A,A */
+		NEXT;
+	OPCASE(87):			/* ADD A,A */
 		temp = hreg(AF);
 		acu = hreg(AF);
 		sum = acu + temp;
@@ -1384,8 +2150,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x88:			/* ADC A,B */
+		NEXT;
+	OPCASE(88):			/* ADC A,B */
 		temp = hreg(BC);
 		acu = hreg(AF);
 		sum = acu + temp + TSTFLAG(C);
@@ -1394,8 +2160,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x89:			/* ADC A,C */
+		NEXT;
+	OPCASE(89):			/* ADC A,C */
 		temp = lreg(BC);
 		acu = hreg(AF);
 		sum = acu + temp + TSTFLAG(C);
@@ -1404,8 +2170,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x8A:			/* ADC A,D */
+		NEXT;
+	OPCASE(8A):			/* ADC A,D */
 		temp = hreg(DE);
 		acu = hreg(AF);
 		sum = acu + temp + TSTFLAG(C);
@@ -1414,8 +2180,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x8B:			/* ADC A,E */
+		NEXT;
+	OPCASE(8B):			/* ADC A,E */
 		temp = lreg(DE);
 		acu = hreg(AF);
 		sum = acu + temp + TSTFLAG(C);
@@ -1424,8 +2190,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x8C:			/* ADC A,H */
+		NEXT;
+	OPCASE(8C):			/* ADC A,H */
 		temp = hreg(HL);
 		acu = hreg(AF);
 		sum = acu + temp + TSTFLAG(C);
@@ -1434,8 +2200,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x8D:			/* ADC A,L */
+		NEXT;
+	OPCASE(8D):			/* ADC A,L */
 		temp = lreg(HL);
 		acu = hreg(AF);
 		sum = acu + temp + TSTFLAG(C);
@@ -1444,8 +2210,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x8E:			/* ADC A,(HL) */
+		NEXT;
+	OPCASE(8E):			/* ADC A,(HL) */
 		temp = GetBYTE(HL);
 		acu = hreg(AF);
 		sum = acu + temp + TSTFLAG(C);
@@ -1454,8 +2220,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x8F:			/* ADC A,A */
+		NEXT;
+	OPCASE(8F):			/* ADC A,A */
 		temp = hreg(AF);
 		acu = hreg(AF);
 		sum = acu + temp + TSTFLAG(C);
@@ -1464,8 +2230,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
-		break;
-	case 0x90:			/* SUB B */
+		NEXT;
+	OPCASE(90):			/* SUB B */
 		temp = hreg(BC);
 		acu = hreg(AF);
 		sum = acu - temp;
@@ -1474,8 +2240,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x91:			/* SUB C */
+		NEXT;
+	OPCASE(91):			/* SUB C */
 		temp = lreg(BC);
 		acu = hreg(AF);
 		sum = acu - temp;
@@ -1484,8 +2250,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x92:			/* SUB D */
+		NEXT;
+	OPCASE(92):			/* SUB D */
 		temp = hreg(DE);
 		acu = hreg(AF);
 		sum = acu - temp;
@@ -1494,8 +2260,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x93:			/* SUB E */
+		NEXT;
+	OPCASE(93):			/* SUB E */
 		temp = lreg(DE);
 		acu = hreg(AF);
 		sum = acu - temp;
@@ -1504,8 +2270,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x94:			/* SUB H */
+		NEXT;
+	OPCASE(94):			/* SUB H */
 		temp = hreg(HL);
 		acu = hreg(AF);
 		sum = acu - temp;
@@ -1514,8 +2280,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x95:			/* SUB L */
+		NEXT;
+	OPCASE(95):			/* SUB L */
 		temp = lreg(HL);
 		acu = hreg(AF);
 		sum = acu - temp;
@@ -1524,8 +2290,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x96:			/* SUB (HL) */
+		NEXT;
+	OPCASE(96):			/* SUB (HL) */
 		temp = GetBYTE(HL);
 		acu = hreg(AF);
 		sum = acu - temp;
@@ -1534,8 +2300,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x97:			/* SUB A */
+		NEXT;
+	OPCASE(97):			/* SUB A */
 		temp = hreg(AF);
 		acu = hreg(AF);
 		sum = acu - temp;
@@ -1544,8 +2310,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x98:			/* SBC A,B */
+		NEXT;
+	OPCASE(98):			/* SBC A,B */
 		temp = hreg(BC);
 		acu = hreg(AF);
 		sum = acu - temp - TSTFLAG(C);
@@ -1554,8 +2320,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x99:			/* SBC A,C */
+		NEXT;
+	OPCASE(99):			/* SBC A,C */
 		temp = lreg(BC);
 		acu = hreg(AF);
 		sum = acu - temp - TSTFLAG(C);
@@ -1564,8 +2330,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x9A:			/* SBC A,D */
+		NEXT;
+	OPCASE(9A):			/* SBC A,D */
 		temp = hreg(DE);
 		acu = hreg(AF);
 		sum = acu - temp - TSTFLAG(C);
@@ -1574,8 +2340,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x9B:			/* SBC A,E */
+		NEXT;
+	OPCASE(9B):			/* SBC A,E */
 		temp = lreg(DE);
 		acu = hreg(AF);
 		sum = acu - temp - TSTFLAG(C);
@@ -1584,8 +2350,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x9C:			/* SBC A,H */
+		NEXT;
+	OPCASE(9C):			/* SBC A,H */
 		temp = hreg(HL);
 		acu = hreg(AF);
 		sum = acu - temp - TSTFLAG(C);
@@ -1594,8 +2360,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x9D:			/* SBC A,L */
+		NEXT;
+	OPCASE(9D):			/* SBC A,L */
 		temp = lreg(HL);
 		acu = hreg(AF);
 		sum = acu - temp - TSTFLAG(C);
@@ -1604,8 +2370,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x9E:			/* SBC A,(HL) */
+		NEXT;
+	OPCASE(9E):			/* SBC A,(HL) */
 		temp = GetBYTE(HL);
 		acu = hreg(AF);
 		sum = acu - temp - TSTFLAG(C);
@@ -1614,8 +2380,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0x9F:			/* SBC A,A */
+		NEXT;
+	OPCASE(9F):			/* SBC A,A */
 		temp = hreg(AF);
 		acu = hreg(AF);
 		sum = acu - temp - TSTFLAG(C);
@@ -1624,112 +2390,112 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (cbits & 0x10) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
-		break;
-	case 0xA0:			/* AND B */
+		NEXT;
+	OPCASE(A0):			/* AND B */
 		sum = ((AF & (BC)) >> 8) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) |
 			((sum == 0) << 6) | 0x10 | partab[sum];
-		break;
-	case 0xA1:			/* AND C */
+		NEXT;
+	OPCASE(A1):			/* AND C */
 		sum = ((AF >> 8) & BC) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | 0x10 |
 			((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xA2:			/* AND D */
+		NEXT;
+	OPCASE(A2):			/* AND D */
 		sum = ((AF & (DE)) >> 8) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) |
 			((sum == 0) << 6) | 0x10 | partab[sum];
-		break;
-	case 0xA3:			/* AND E */
+		NEXT;
+	OPCASE(A3):			/* AND E */
 		sum = ((AF >> 8) & DE) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | 0x10 |
 			((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xA4:			/* AND H */
+		NEXT;
+	OPCASE(A4):			/* AND H */
 		sum = ((AF & (HL)) >> 8) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) |
 			((sum == 0) << 6) | 0x10 | partab[sum];
-		break;
-	case 0xA5:			/* AND L */
+		NEXT;
+	OPCASE(A5):			/* AND L */
 		sum = ((AF >> 8) & HL) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | 0x10 |
 			((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xA6:			/* AND (HL) */
+		NEXT;
+	OPCASE(A6):			/* AND (HL) */
 		sum = ((AF >> 8) & GetBYTE(HL)) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | 0x10 |
 			((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xA7:			/* AND A */
+		NEXT;
+	OPCASE(A7):			/* AND A */
 		sum = ((AF & (AF)) >> 8) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) |
 			((sum == 0) << 6) | 0x10 | partab[sum];
-		break;
-	case 0xA8:			/* XOR B */
+		NEXT;
+	OPCASE(A8):			/* XOR B */
 		sum = ((AF ^ (BC)) >> 8) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xA9:			/* XOR C */
+		NEXT;
+	OPCASE(A9):			/* XOR C */
 		sum = ((AF >> 8) ^ BC) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xAA:			/* XOR D */
+		NEXT;
+	OPCASE(AA):			/* XOR D */
 		sum = ((AF ^ (DE)) >> 8) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xAB:			/* XOR E */
+		NEXT;
+	OPCASE(AB):			/* XOR E */
 		sum = ((AF >> 8) ^ DE) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xAC:			/* XOR H */
+		NEXT;
+	OPCASE(AC):			/* XOR H */
 		sum = ((AF ^ (HL)) >> 8) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xAD:			/* XOR L */
+		NEXT;
+	OPCASE(AD):			/* XOR L */
 		sum = ((AF >> 8) ^ HL) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xAE:			/* XOR (HL) */
+		NEXT;
+	OPCASE(AE):			/* XOR (HL) */
 		sum = ((AF >> 8) ^ GetBYTE(HL)) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xAF:			/* XOR A */
+		NEXT;
+	OPCASE(AF):			/* XOR A */
 		sum = ((AF ^ (AF)) >> 8) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xB0:			/* OR B */
+		NEXT;
+	OPCASE(B0):			/* OR B */
 		sum = ((AF | (BC)) >> 8) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xB1:			/* OR C */
+		NEXT;
+	OPCASE(B1):			/* OR C */
 		sum = ((AF >> 8) | BC) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xB2:			/* OR D */
+		NEXT;
+	OPCASE(B2):			/* OR D */
 		sum = ((AF | (DE)) >> 8) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xB3:			/* OR E */
+		NEXT;
+	OPCASE(B3):			/* OR E */
 		sum = ((AF >> 8) | DE) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xB4:			/* OR H */
+		NEXT;
+	OPCASE(B4):			/* OR H */
 		sum = ((AF | (HL)) >> 8) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xB5:			/* OR L */
+		NEXT;
+	OPCASE(B5):			/* OR L */
 		sum = ((AF >> 8) | HL) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xB6:			/* OR (HL) */
+		NEXT;
+	OPCASE(B6):			/* OR (HL) */
 		sum = ((AF >> 8) | GetBYTE(HL)) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xB7:			/* OR A */
+		NEXT;
+	OPCASE(B7):			/* OR A */
 		sum = ((AF | (AF)) >> 8) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
-		break;
-	case 0xB8:			/* CP B */
+		NEXT;
+	OPCASE(B8):			/* CP B */
 		temp = hreg(BC);
 		AF = (AF & ~0x28) | (temp & 0x28);
 		acu = hreg(AF);
@@ -1739,8 +2505,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (temp & 0x28) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			(cbits & 0x10) | ((cbits >> 8) & 1);
-		break;
-	case 0xB9:			/* CP C */
+		NEXT;
+	OPCASE(B9):			/* CP C */
 		temp = lreg(BC);
 		AF = (AF & ~0x28) | (temp & 0x28);
 		acu = hreg(AF);
@@ -1750,8 +2516,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (temp & 0x28) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			(cbits & 0x10) | ((cbits >> 8) & 1);
-		break;
-	case 0xBA:			/* CP D */
+		NEXT;
+	OPCASE(BA):			/* CP D */
 		temp = hreg(DE);
 		AF = (AF & ~0x28) | (temp & 0x28);
 		acu = hreg(AF);
@@ -1761,8 +2527,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (temp & 0x28) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			(cbits & 0x10) | ((cbits >> 8) & 1);
-		break;
-	case 0xBB:			/* CP E */
+		NEXT;
+	OPCASE(BB):			/* CP E */
 		temp = lreg(DE);
 		AF = (AF & ~0x28) | (temp & 0x28);
 		acu = hreg(AF);
@@ -1772,8 +2538,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (temp & 0x28) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			(cbits & 0x10) | ((cbits >> 8) & 1);
-		break;
-	case 0xBC:			/* CP H */
+		NEXT;
+	OPCASE(BC):			/* CP H */
 		temp = hreg(HL);
 		AF = (AF & ~0x28) | (temp & 0x28);
 		acu = hreg(AF);
@@ -1783,8 +2549,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (temp & 0x28) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			(cbits & 0x10) | ((cbits >> 8) & 1);
-		break;
-	case 0xBD:			/* CP L */
+		NEXT;
+	OPCASE(BD):			/* CP L */
 		temp = lreg(HL);
 		AF = (AF & ~0x28) | (temp & 0x28);
 		acu = hreg(AF);
@@ -1794,8 +2560,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (temp & 0x28) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			(cbits & 0x10) | ((cbits >> 8) & 1);
-		break;
-	case 0xBE:			/* CP (HL) */
+		NEXT;
+	OPCASE(BE):			/* CP (HL) */
 		temp = GetBYTE(HL);
 		AF = (AF & ~0x28) | (temp & 0x28);
 		acu = hreg(AF);
@@ -1805,8 +2571,8 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (temp & 0x28) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			(cbits & 0x10) | ((cbits >> 8) & 1);
-		break;
-	case 0xBF:			/* CP A */
+		NEXT;
+	OPCASE(BF):			/* CP A */
 		temp = hreg(AF);
 		AF = (AF & ~0x28) | (temp & 0x28);
 		acu = hreg(AF);
@@ -1816,26 +2582,26 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((sum & 0xff) == 0) << 6) | (temp & 0x28) |
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			(cbits & 0x10) | ((cbits >> 8) & 1);
-		break;
-	case 0xC0:			/* RET NZ */
-		if (!TSTFLAG(Z)) POP(PC);
-		break;
-	case 0xC1:			/* POP BC */
+		NEXT;
+	OPCASE(C0):			/* RET NZ */
+		RETC(!TSTFLAG(Z));
+		NEXT;
+	OPCASE(C1):			/* POP BC */
 		POP(BC);
-		break;
-	case 0xC2:			/* JP NZ,nnnn */
+		NEXT;
+	OPCASE(C2):			/* JP NZ,nnnn */
 		JPC(!TSTFLAG(Z));
-		break;
-	case 0xC3:			/* JP nnnn */
+		NEXT;
+	OPCASE(C3):			/* JP nnnn */
 		JPC(1);
-		break;
-	case 0xC4:			/* CALL NZ,nnnn */
+		NEXT;
+	OPCASE(C4):			/* CALL NZ,nnnn */
 		CALLC(!TSTFLAG(Z));
-		break;
-	case 0xC5:			/* PUSH BC */
+		NEXT;
+	OPCASE(C5):			/* PUSH BC */
 		PUSH(BC);
-		break;
-	case 0xC6:			/* ADD A,nn */
+		NEXT;
+	OPCASE(C6):			/* ADD A,nn */
 		temp = GetBYTE(PC);
 		acu = hreg(AF);
 		sum = acu + temp;
@@ -1845,31 +2611,32 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
 		++PC;
-		break;
-	case 0xC7:			/* RST 0 */
+		NEXT;
+	OPCASE(C7):			/* RST 0 */
 		PUSH(PC); PC = 0;
-		break;
-	case 0xC8:			/* RET Z */
-		if (TSTFLAG(Z)) POP(PC);
-		break;
-	case 0xC9:			/* RET */
+		NEXT;
+	OPCASE(C8):			/* RET Z */
+		RETC(TSTFLAG(Z));
+		NEXT;
+	OPCASE(C9):			/* RET */
 		POP(PC);
-		break;
-	case 0xCA:			/* JP Z,nnnn */
+		NEXT;
+	OPCASE(CA):			/* JP Z,nnnn */
 		JPC(TSTFLAG(Z));
-		break;
-	case 0xCB:			/* CB prefix */
-		SAVE_STATE();
-		cb_prefix(HL);
-		LOAD_STATE();
-		break;
-	case 0xCC:			/* CALL Z,nnnn */
+		NEXT;
+	OPCASE(CB):			/* CB prefix */
+		m->tstates += cycles_cb[GetBYTE(PC)];
+		PREFIX_ENTER();
+		cb_prefix(HL PREFIX_ARGS);
+		PREFIX_LEAVE();
+		NEXT;
+	OPCASE(CC):			/* CALL Z,nnnn */
 		CALLC(TSTFLAG(Z));
-		break;
-	case 0xCD:			/* CALL nnnn */
+		NEXT;
+	OPCASE(CD):			/* CALL nnnn */
 		CALLC(1);
-		break;
-	case 0xCE:			/* ADC A,nn */
+		NEXT;
+	OPCASE(CE):			/* ADC A,nn */
 		temp = GetBYTE(PC);
 		acu = hreg(AF);
 		sum = acu + temp + TSTFLAG(C);
@@ -1879,29 +2646,39 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) |
 			((cbits >> 8) & 1);
 		++PC;
-		break;
-	case 0xCF:			/* RST 8 */
+		NEXT;
+	OPCASE(CF):			/* RST 8 */
 		PUSH(PC); PC = 8;
-		break;
-	case 0xD0:			/* RET NC */
-		if (!TSTFLAG(C)) POP(PC);
-		break;
-	case 0xD1:			/* POP DE */
+		NEXT;
+	OPCASE(D0):			/* RET NC */
+		RETC(!TSTFLAG(C));
+		NEXT;
+	OPCASE(D1):			/* POP DE */
 		POP(DE);
-		break;
-	case 0xD2:			/* JP NC,nnnn */
+		NEXT;
+	OPCASE(D2):			/* JP NC,nnnn */
 		JPC(!TSTFLAG(C));
-		break;
-	case 0xD3:			/* OUT (nn),A */
+		NEXT;
+	OPCASE(D3):			/* OUT (nn),A */
 		Output(GetBYTE(PC), hreg(AF)); ++PC;
-		break;
-	case 0xD4:			/* CALL NC,nnnn */
+		if (m->floppyfastdisk && GetBYTE(PC - 1) == FLOPPYDATAPORT &&
+		    fastdiskwriteloop(m, PC - 2)) {
+			// all but the last byte of the sector, the loop sends that
+			int left;
+			BYTE *data = floppyFastWrite(m, &left);
+			if (data != NULL) {
+				getpages(m, HL, data, left);
+				HL = (HL + left) & 0xffff;
+			}
+		}
+		NEXT;
+	OPCASE(D4):			/* CALL NC,nnnn */
 		CALLC(!TSTFLAG(C));
-		break;
-	case 0xD5:			/* PUSH DE */
+		NEXT;
+	OPCASE(D5):			/* PUSH DE */
 		PUSH(DE);
-		break;
-	case 0xD6:			/* SUB nn */
+		NEXT;
+	OPCASE(D6):			/* SUB nn */
 		temp = GetBYTE(PC);
 		acu = hreg(AF);
 		sum = acu - temp;
@@ -1911,37 +2688,64 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
 		++PC;
-		break;
-	case 0xD7:			/* RST 10H */
+		NEXT;
+	OPCASE(D7):			/* RST 10H */
 		PUSH(PC); PC = 0x10;
-		break;
-	case 0xD8:			/* RET C */
-		if (TSTFLAG(C)) POP(PC);
-		break;
-	case 0xD9:			/* EXX */
-		regs[regs_sel].bc = BC;
-		regs[regs_sel].de = DE;
-		regs[regs_sel].hl = HL;
-		regs_sel = 1 - regs_sel;
-		BC = regs[regs_sel].bc;
-		DE = regs[regs_sel].de;
-		HL = regs[regs_sel].hl;
-		break;
-	case 0xDA:			/* JP C,nnnn */
+		NEXT;
+	OPCASE(D8):			/* RET C */
+		RETC(TSTFLAG(C));
+		NEXT;
+	OPCASE(D9):			/* EXX */
+		m->regs[m->regs_sel].bc = BC;
+		m->regs[m->regs_sel].de = DE;
+		m->regs[m->regs_sel].hl = HL;
+		m->regs_sel = 1 - m->regs_sel;
+		BC = m->regs[m->regs_sel].bc;
+		DE = m->regs[m->regs_sel].de;
+		HL = m->regs[m->regs_sel].hl;
+		NEXT;
+	OPCASE(DA):			/* JP C,nnnn */
 		JPC(TSTFLAG(C));
-		break;
-	case 0xDB:			/* IN A,(nn) */
+		NEXT;
+	OPCASE(DB):			/* IN A,(nn) */
 		Sethreg(AF, Input(GetBYTE(PC))); ++PC;
-		break;
-	case 0xDC:			/* CALL C,nnnn */
+		if (m->floppyfastdisk && GetBYTE(PC - 1) == FLOPPYDATAPORT &&
+		    fastdiskreadloop(m, PC - 2)) {
+			// store this byte and the rest but the last, the loop stores that
+			BYTE *data;
+			int left = floppyFastRead(m, &data);
+			if (left > 0) {
+				PutBYTE(HL, hreg(AF));
+				putpages(m, HL + 1, data, left - 1);
+				HL = (HL + left) & 0xffff;
+				Sethreg(AF, data[left - 1]);
+			}
+		}
+		else if (m->sdfastsd && GetBYTE(PC - 1) == SDDATA &&
+		    fastsdreadloop(m, PC - 2)) {
+			// store this byte and the ones the DJNZ count still wants
+			// but the last, the loop stores that
+			BYTE *data;
+			int want = hreg(BC) == 0 ? 0xff : hreg(BC) - 1;
+			int got = want > 0 ? SDFastRead(m, &data, want) : 0;
+			if (got > 0) {
+				PutBYTE(HL, hreg(AF));
+				putpages(m, HL + 1, data, got - 1);
+				HL = (HL + got) & 0xffff;
+				Sethreg(AF, data[got - 1]);
+				Sethreg(BC, hreg(BC) - got);
+			}
+		}
+		NEXT;
+	OPCASE(DC):			/* CALL C,nnnn */
 		CALLC(TSTFLAG(C));
-		break;
-	case 0xDD:			/* DD prefix */
-		SAVE_STATE();
-		ix = dfd_prefix(ix);
-		LOAD_STATE();
-		break;
-	case 0xDE:			/* SBC A,nn */
+		NEXT;
+	OPCASE(DD):			/* DD prefix */
+		PREFIX_ENTER();
+		m->ix = dfd_prefix(m->ix PREFIX_ARGS);
+		PREFIX_LEAVE();
+		NEXT;
+	OPCASE(DE):			/* SBC A,nn */
 		temp = GetBYTE(PC);
 		acu = hreg(AF);
 		sum = acu - temp - TSTFLAG(C);
@@ -1951,54 +2755,54 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			((cbits >> 8) & 1);
 		++PC;
-		break;
-	case 0xDF:			/* RST 18H */
+		NEXT;
+	OPCASE(DF):			/* RST 18H */
 		PUSH(PC); PC = 0x18;
-		break;
-	case 0xE0:			/* RET PO */
-		if (!TSTFLAG(P)) POP(PC);
-		break;
-	case 0xE1:			/* POP HL */
+		NEXT;
+	OPCASE(E0):			/* RET PO */
+		RETC(!TSTFLAG(P));
+		NEXT;
+	OPCASE(E1):			/* POP HL */
 		POP(HL);
-		break;
-	case 0xE2:			/* JP PO,nnnn */
+		NEXT;
+	OPCASE(E2):			/* JP PO,nnnn */
 		JPC(!TSTFLAG(P));
-		break;
-	case 0xE3:			/* EX (SP),HL */
+		NEXT;
+	OPCASE(E3):			/* EX (SP),HL */
 		temp = HL; POP(HL); PUSH(temp);
-		break;
-	case 0xE4:			/* CALL PO,nnnn */
+		NEXT;
+	OPCASE(E4):			/* CALL PO,nnnn */
 		CALLC(!TSTFLAG(P));
-		break;
-	case 0xE5:			/* PUSH HL */
+		NEXT;
+	OPCASE(E5):			/* PUSH HL */
 		PUSH(HL);
-		break;
-	case 0xE6:			/* AND nn */
+		NEXT;
+	OPCASE(E6):			/* AND nn */
 		sum = ((AF >> 8) & GetBYTE(PC)) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | 0x10 |
 			((sum == 0) << 6) | partab[sum];
 		++PC;
-		break;
-	case 0xE7:			/* RST 20H */
+		NEXT;
+	OPCASE(E7):			/* RST 20H */
 		PUSH(PC); PC = 0x20;
-		break;
-	case 0xE8:			/* RET PE */
-		if (TSTFLAG(P)) POP(PC);
-		break;
-	case 0xE9:			/* JP (HL) */
+		NEXT;
+	OPCASE(E8):			/* RET PE */
+		RETC(TSTFLAG(P));
+		NEXT;
+	OPCASE(E9):			/* JP (HL) */
 		PC = HL;
-		break;
-	case 0xEA:			/* JP PE,nnnn */
+		NEXT;
+	OPCASE(EA):			/* JP PE,nnnn */
 		JPC(TSTFLAG(P));
-		break;
-	case 0xEB:			/* EX DE,HL */
+		NEXT;
+	OPCASE(EB):			/* EX DE,HL */
 		temp = HL; HL = DE; DE = temp;
-		break;
-	case 0xEC:			/* CALL PE,nnnn */
+		NEXT;
+	OPCASE(EC):			/* CALL PE,nnnn */
 		CALLC(TSTFLAG(P));
-		break;
-	case 0xED:			/* ED prefix */
-		switch (++PC, op = GetBYTE(PC-1)) {
+		NEXT;
+	OPCASE(ED):			/* ED prefix */
+		switch (++PC, op = GetBYTE(PC-1), m->tstates += cycles_ed[op], op) {
 		case 0x40:			/* IN B,(C) */
 			temp = Input(lreg(BC));
 			Sethreg(BC, temp);
@@ -2035,14 +2839,16 @@ simz80(FASTREG PC, int count, int (*fnc)())
 				2 | (temp != 0);
 			break;
 		case 0x45:			/* RETN */
-			IFF |= IFF >> 1;
+			m->IFF |= m->IFF >> 1;
+			if (m->interruptline)
+				m->simevents |= SIMEVENT_INT;
 			POP(PC);
 			break;
 		case 0x46:			/* IM 0 */
-			/* interrupt mode 0 */
+			m->im = 0;
 			break;
 		case 0x47:			/* LD I,A */
-			ir = (ir & 255) | (AF & ~255);
+			m->ir = (m->ir & 255) | (AF & ~255);
 			break;
 		case 0x48:			/* IN C,(C) */
 			temp = Input(lreg(BC));
@@ -2071,11 +2877,12 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			PC += 2;
 			break;
 		case 0x4D:			/* RETI */
-			IFF |= IFF >> 1;
+			m->IFF |= m->IFF >> 1;
+			interrupt_reti(m);
 			POP(PC);
 			break;
 		case 0x4F:			/* LD R,A */
-			ir = (ir & ~255) | ((AF >> 8) & 255);
+			m->ir = (m->ir & ~255) | ((AF >> 8) & 255);
 			break;
 		case 0x50:			/* IN D,(C) */
 			temp = Input(lreg(BC));
@@ -2104,10 +2911,10 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			PC += 2;
 			break;
 		case 0x56:			/* IM 1 */
-			/* interrupt mode 1 */
+			m->im = 1;
 			break;
 		case 0x57:			/* LD A,I */
-			AF = (AF & 0x29) | (ir & ~255) | ((ir >> 8) & 0x80) | (((ir & ~255) == 0) << 6) | ((IFF & 2) << 1);
+			AF = (AF & 0x29) | (m->ir & ~255) | ((m->ir >> 8) & 0x80) | (((m->ir & ~255) == 0) << 6) | ((m->IFF & 2) << 1);
 			break;
 		case 0x58:			/* IN E,(C) */
 			temp = Input(lreg(BC));
@@ -2136,10 +2943,10 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			PC += 2;
 			break;
 		case 0x5E:			/* IM 2 */
-			/* interrupt mode 2 */
+			m->im = 2;
 			break;
 		case 0x5F:			/* LD A,R */
-			AF = (AF & 0x29) | ((ir & 255) << 8) | (ir & 0x80) | (((ir & 255) == 0) << 6) | ((IFF & 2) << 1);
+			AF = (AF & 0x29) | ((m->ir & 255) << 8) | (m->ir & 0x80) | (((m->ir & 255) == 0) << 6) | ((m->IFF & 2) << 1);
 			break;
 		case 0x60:			/* IN H,(C) */
 			temp = Input(lreg(BC));
@@ -2330,10 +3137,14 @@ simz80(FASTREG PC, int count, int (*fnc)())
 		case 0xB0:			/* LDIR */
 			acu = hreg(AF);
 			BC &= 0xffff;
-			do {
-				acu = GetBYTE(HL); ++HL;
-				PutBYTE(DE, acu); ++DE;
-			} while (--BC);
+			// fix DA - if BC is 0 then should do loads of cycles
+			if (BC == 0)
+			    BC = 0x10000;
+			m->tstates += 21 * (BC - 1);
+			acu = ldirpages(m, HL, DE, BC);
+			HL += BC;
+			DE += BC;
+			BC = 0;
 			acu += hreg(AF);
 			AF = (AF & ~0x3e) | (acu & 8) | ((acu & 2) << 4);
 			break;
@@ -2343,11 +3154,16 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			// fix DA - if B is 0 then should do loads cycles
 			if (BC == 0)
 			    BC = 0x10000;
-			do {
-				temp = GetBYTE(HL); ++HL;
-				op = --BC != 0;
-				sum = acu - temp;
-			} while (op && sum != 0);
+			m->tstates += 21 * (BC - 1);
+			temp = cpirpages(m, HL, BC, acu);
+			HL += temp;
+			BC -= temp;
+			// the last byte compared
+			temp = GetBYTE(HL - 1);
+			op = BC != 0;
+			sum = acu - temp;
+			// take off the repeats not done as a match was found
+			m->tstates -= 21 * BC;
 			cbits = acu ^ temp ^ sum;
 			AF = (AF & ~0xfe) | (sum & 0x80) | (!(sum & 0xff) << 6) |
 				(((sum - ((cbits&16)>>4))&2) << 4) |
@@ -2361,9 +3177,21 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			// fix DA - if B is 0 then should do 256 cycles
 			if (temp == 0)
 			    temp = 0x100;
-			do {
+			m->tstates += 21 * (temp - 1);
+			if (m->sdfastsd && lreg(BC) == SDDATA) {
+				// the SDcard block straight into memory
+				BYTE *data;
+				int got;
+				while (temp != 0 && (got = SDFastRead(m, &data, temp)) > 0) {
+					putpages(m, HL, data, got);
+					HL = (HL + got) & 0xffff;
+					temp -= got;
+				}
+			}
+			while (temp != 0) {
 				PutBYTE(HL, Input(lreg(BC))); ++HL;
-			} while (--temp);
+				--temp;
+			}
 			Sethreg(BC, 0);
 			SETFLAG(N, 1);
 			SETFLAG(Z, 1);
@@ -2373,9 +3201,22 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			// fix DA - if B is 0 then should do 256 cycles
 			if (temp == 0)
 			    temp = 0x100;
-			do {
+			m->tstates += 21 * (temp - 1);
+			if (m->sdfastsd && lreg(BC) == SDDATA) {
+				// memory straight into the SDcard block
+				BYTE *data;
+				int got;
+				while (temp != 0 && (data = SDFastWrite(m, &got, temp)) != NULL) {
+					getpages(m, HL, data, got);
+					SDFastWritten(m);
+					HL = (HL + got) & 0xffff;
+					temp -= got;
+				}
+			}
+			while (temp != 0) {
 				Output(lreg(BC), GetBYTE(HL)); ++HL;
-			} while (--temp);
+				--temp;
+			}
 			Sethreg(BC, 0);
 			SETFLAG(N, 1);
 			SETFLAG(Z, 1);
@@ -2385,10 +3226,11 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			// fix DA - if BC is 0 then should do loads of cycles
 			if (BC == 0)
 			    BC = 0x10000;
-			do {
-				acu = GetBYTE(HL); --HL;
-				PutBYTE(DE, acu); --DE;
-			} while (--BC);
+			m->tstates += 21 * (BC - 1);
+			acu = lddrpages(m, HL, DE, BC);
+			HL -= BC;
+			DE -= BC;
+			BC = 0;
 			acu += hreg(AF);
 			AF = (AF & ~0x3e) | (acu & 8) | ((acu & 2) << 4);
 			break;
@@ -2398,11 +3240,16 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			// fix DA - if BC is 0 then should do loads of cycles
 			if (BC == 0)
 			    BC = 0x10000;
-			do {
-				temp = GetBYTE(HL); --HL;
-				op = --BC != 0;
-				sum = acu - temp;
-			} while (op && sum != 0);
+			m->tstates += 21 * (BC - 1);
+			temp = cpdrpages(m, HL, BC, acu);
+			HL -= temp;
+			BC -= temp;
+			// the last byte compared
+			temp = GetBYTE(HL + 1);
+			op = BC != 0;
+			sum = acu - temp;
+			// take off the repeats not done as a match was found
+			m->tstates -= 21 * BC;
 			cbits = acu ^ temp ^ sum;
 			AF = (AF & ~0xfe) | (sum & 0x80) | (!(sum & 0xff) << 6) |
 				(((sum - ((cbits&16)>>4))&2) << 4) |
@@ -2416,6 +3263,7 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			// fix DA - if B is 0 then should do 256 cycles
 			if (temp == 0)
 			    temp = 0x100;
+			m->tstates += 21 * (temp - 1);
 			do {
 				PutBYTE(HL, Input(lreg(BC))); --HL;
 			} while (--temp);
@@ -2428,6 +3276,7 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			// fix DA - if B is 0 then should do 256 cycles
 			if (temp == 0)
 			    temp = 0x100;
+			m->tstates += 21 * (temp - 1);
 			do {
 				Output(lreg(BC), GetBYTE(HL)); --HL;
 			} while (--temp);
@@ -2437,62 +3286,64 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			break;
 		default: if (0x40 <= op && op <= 0x7f) PC--;		/* ignore ED */
 		}
-		break;
-	case 0xEE:			/* XOR nn */
+		NEXT;
+	OPCASE(EE):			/* XOR nn */
 		sum = ((AF >> 8) ^ GetBYTE(PC)) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
 		++PC;
-		break;
-	case 0xEF:			/* RST 28H */
+		NEXT;
+	OPCASE(EF):			/* RST 28H */
 		PUSH(PC); PC = 0x28;
-		break;
-	case 0xF0:			/* RET P */
-		if (!TSTFLAG(S)) POP(PC);
-		break;
-	case 0xF1:			/* POP AF */
+		NEXT;
+	OPCASE(F0):			/* RET P */
+		RETC(!TSTFLAG(S));
+		NEXT;
+	OPCASE(F1):			/* POP AF */
 		POP(AF);
-		break;
-	case 0xF2:			/* JP P,nnnn */
+		NEXT;
+	OPCASE(F2):			/* JP P,nnnn */
 		JPC(!TSTFLAG(S));
-		break;
-	case 0xF3:			/* DI */
-		IFF = 0;
-		break;
-	case 0xF4:			/* CALL P,nnnn */
+		NEXT;
+	OPCASE(F3):			/* DI */
+		m->IFF = 0;
+		NEXT;
+	OPCASE(F4):			/* CALL P,nnnn */
 		CALLC(!TSTFLAG(S));
-		break;
-	case 0xF5:			/* PUSH AF */
+		NEXT;
+	OPCASE(F5):			/* PUSH AF */
 		PUSH(AF);
-		break;
-	case 0xF6:			/* OR nn */
+		NEXT;
+	OPCASE(F6):			/* OR nn */
 		sum = ((AF >> 8) | GetBYTE(PC)) & 0xff;
 		AF = (sum << 8) | (sum & 0xa8) | ((sum == 0) << 6) | partab[sum];
 		++PC;
-		break;
-	case 0xF7:			/* RST 30H */
+		NEXT;
+	OPCASE(F7):			/* RST 30H */
 		PUSH(PC); PC = 0x30;
-		break;
-	case 0xF8:			/* RET M */
-		if (TSTFLAG(S)) POP(PC);
-		break;
-	case 0xF9:			/* LD SP,HL */
+		NEXT;
+	OPCASE(F8):			/* RET M */
+		RETC(TSTFLAG(S));
+		NEXT;
+	OPCASE(F9):			/* LD SP,HL */
 		SP = HL;
-		break;
-	case 0xFA:			/* JP M,nnnn */
+		NEXT;
+	OPCASE(FA):			/* JP M,nnnn */
 		JPC(TSTFLAG(S));
-		break;
-	case 0xFB:			/* EI */
-		IFF = 3;
-		break;
-	case 0xFC:			/* CALL M,nnnn */
+		NEXT;
+	OPCASE(FB):			/* EI */
+		m->IFF = 3;
+		if (m->interruptline)
+			m->simevents |= SIMEVENT_INT;
+		NEXT;
+	OPCASE(FC):			/* CALL M,nnnn */
 		CALLC(TSTFLAG(S));
-		break;
-	case 0xFD:			/* FD prefix */
-		SAVE_STATE();
-		iy = dfd_prefix(iy);
-		LOAD_STATE();
-		break;
-	case 0xFE:			/* CP nn */
+		NEXT;
+	OPCASE(FD):			/* FD prefix */
+		PREFIX_ENTER();
+		m->iy = dfd_prefix(m->iy PREFIX_ARGS);
+		PREFIX_LEAVE();
+		NEXT;
+	OPCASE(FE):			/* CP nn */
 		temp = GetBYTE(PC);
 		AF = (AF & ~0x28) | (temp & 0x28);
 		acu = hreg(AF);
@@ -2503,11 +3354,14 @@ simz80(FASTREG PC, int count, int (*fnc)())
 			(((cbits >> 6) ^ (cbits >> 5)) & 4) | 2 |
 			(cbits & 0x10) | ((cbits >> 8) & 1);
 		++PC;
-		break;
-	case 0xFF:			/* RST 38H */
+		NEXT;
+	OPCASE(FF):			/* RST 38H */
 		PUSH(PC); PC = 0x38;
+		NEXT;
     }
     }
+stopped:
+    m->z80instructions += count - n;
 /* make registers visible for debugging if interrupted */
     SAVE_STATE();
     return (PC&0xffff)|0x10000;	/* flag non-bios stop */
@@ -17,17 +17,20 @@ You should have received a copy of the GNU General Public License
 along with this program; if not, write to the Free Software
 Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA. */
 
+#ifndef SIMZ80_DEFINED_H
+#define SIMZ80_DEFINED_H
+
 #include <stdio.h>
 
 #include <limits.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <time.h>
 #include "options.h"  //defines the options to use
-
-// these are in map80nascom.h but . . . . .
-extern int traceon; // set to 1 to trace z80
-extern int tracestartaddress;    // trace will only show results when the PC is within this range
-extern int traceendaddress;      //  end address of the trace range ( 0 to 0xFFFF )
+#include "ports.h"
+#include "interrupts.h"
+#include "log.h"
 
 #if UCHAR_MAX == 255
 typedef uint8_t BYTE;
@@ -57,28 +60,22 @@ typedef unsigned int	FASTWORK;
 typedef unsigned long	FASTWORK;
 #endif
 
-/* NMI controls */
-extern int singleStep; // set to 4 to execute some instructions before triggering NMI
-extern int NMI_flag;   // set to 1 to trigger NMI
-
-/* two sets of accumulator / flags */
-extern WORD af[2];
-extern int af_sel;
+/* events pending - simz80 only looks at the trace, single step, NMI
+   and interrupt controls when one of these bits is set, so set the bit
+   as well when changing them - see simevents in struct machine */
+#define SIMEVENT_TRACE      1   // traceon is set
+#define SIMEVENT_SINGLESTEP 2   // singleStep is counting down
+#define SIMEVENT_NMI        4   // NMI_flag is set
+#define SIMEVENT_BLOCKFLUSH 8   // cached code has been thrown away
+#define SIMEVENT_INT        16  // interruptline has gone high - see interrupts.h
+#define SIMEVENT_IDLE       32  // the idle loop detector has gone off
 
 /* two sets of 16-bit registers */
-extern struct ddregs {
+struct ddregs {
 	WORD bc;
 	WORD de;
 	WORD hl;
-} regs[2];
-extern int regs_sel;
-
-extern WORD ir;
-extern WORD ix;
-extern WORD iy;
-extern WORD sp;
-extern WORD pc;
-extern WORD IFF;
+};
 
 // fix DA see options.h for these definitions
 // this defines how much memory the Z80 can see in K
@@ -92,8 +89,170 @@ extern WORD IFF;
 // if using MMU then we have a set of pointers to point to ram
 // each entry points to the start of that page
 // will be 2k if RAMPAGESIZE is 2
-extern BYTE *rampagetable[RAMPAGETABLESIZE];
-// see map80ram.h
+// the flags for the page are kept next to the pointer
+// so a memory access only has to look at one entry
+struct rampage {
+    BYTE *host;			// start of the page in host memory
+    unsigned int flags;		// RAMPAGE_ bits below
+};
+// the table is in struct machine - see map80ram.h
+
+// rampagetable flags
+#define RAMPAGE_ROM	1	// writes are ignored - i.e. monitor
+#define RAMPAGE_NORAM	2	// mapped past the end of virtual ram - writes are ignored
+#define RAMPAGE_LOCKED	4	// the MAP80 card cannot change host - acts like the N2 ram disable line
+#define RAMPAGE_IOTRAP	8	// writes are passed on to rampagewritetrap
+#define RAMPAGE_CODE	16	// simz80 may have cached code from the page's host memory
+#define RAMPAGE_DIRTY	32	// written to since the flag was last cleared
+
+// writes to the page are ignored
+#define RAMPAGE_READONLY	(RAMPAGE_ROM | RAMPAGE_NORAM)
+// a write to the page needs rampagewritten unless only RAMPAGE_DIRTY is set
+#define RAMPAGE_WRITECHECK	(RAMPAGE_IOTRAP | RAMPAGE_CODE | RAMPAGE_DIRTY)
+
+#define RAMPAGEINDEX(a)	(((a) >> RAMPAGESHIFTBITS) & RAMPAGETABLESIZEMASK)
+
+/* an entry in simz80's straight line code cache - see simz80.c */
+struct blockentry {
+    BYTE *host;			// where the block starts in host memory
+    unsigned int stamp;		// page stamp when it was decoded
+    int count;			// number of opcodes
+    unsigned int cycles;	// T-states of the opcodes - prefixes and taken branches add their own
+    BYTE ops[BLOCKMAXOPS];	// the first byte of each opcode
+};
+
+/* the state of an emulated machine - simz80 runs the machine it is given,
+   keeping the main registers in host registers while it runs and
+   putting them back here when it calls out or stops.
+   Everything a run changes is in here, or in the cards it points to, so
+   more than one machine can run in the one process. */
+struct machine {
+	/* the Z80 registers - the "z80" snapshot section, see MACHINEREGISTERS */
+	WORD af[2];		/* two sets of accumulator / flags */
+	int af_sel;		/* bank select for af */
+	struct ddregs regs[2];	/* bc,de,hl */
+	int regs_sel;		/* bank select for ddregs */
+	WORD ir;		/* other Z80 registers */
+	WORD ix;
+	WORD iy;
+	WORD sp;
+	WORD pc;
+	WORD IFF;
+	int im;			/* interrupt mode 0, 1 or 2 */
+
+	uint64_t tstates;	// T-states executed since the emulator started - used to pace the emulation
+	uint64_t z80instructions;	// instructions executed - updated when simz80 calls back or stops
+	int simevents;		// SIMEVENT_ bits for simz80 to act on
+	int z80idle;		// set by simz80 before calling back when the Z80 is halted or polling
+				// ports with nothing changing - the callback can let the host sleep
+
+	/* NMI controls */
+	int singleStep;		// set to 4 to execute some instructions before triggering NMI
+	int NMI_flag;		// set to 1 to trigger NMI
+
+	int traceon;		// set to 1 to trace z80
+	int tracestartaddress;	// trace will only show results when the PC is within this range
+	int traceendaddress;	//  end address of the trace range ( 0 to 0xFFFF )
+
+	/* memory as the Z80 sees it - see map80ram.h */
+	struct rampage rampagetable[RAMPAGETABLESIZE];
+	// called after length bytes from a have been written to a RAMPAGE_IOTRAP page
+	void (*rampagewritetrap)(struct machine *m, unsigned int a, int length);
+
+	/* simz80's straight line code cache */
+	struct blockentry blockcache[BLOCKCACHESIZE];
+	unsigned int blockcachestamp;			// last stamp given out
+	unsigned int blockcachepagestamp[RAMPAGETABLESIZE];	// entries from a page with a different stamp are stale
+	unsigned char blockcacheopcodes[RAMPAGETABLESIZE][(RAMPAGEMASK + 1) / 8];	// bit per byte - set if a block may have decoded it as an opcode
+
+	/* simz80's idle loop detector */
+	int idlelastvalue[256];		// last value read from each port
+	FASTREG idlepc;			// PC of the first read of the run
+	uint64_t idletstates;		// when the last read was
+	int idlereads;			// unchanged reads in the run
+	unsigned int idleouts[4];	// port and value of the last OUTs
+	int idleoutnext;
+
+	/* the I/O ports - see ports.h */
+	PORTHANDLER porttable[256];
+	uint64_t portreads[256];
+	uint64_t portwrites[256];
+
+	/* interrupts and the event queue - see interrupts.h */
+	int interruptline;	// 1 while a source can interrupt
+	uint64_t eventnext;	// tstates count of the first event in the queue, UINT64_MAX if there are none
+	INTSOURCE *daisychain[INTERRUPTMAXSOURCES];	// highest priority first
+	int daisychainlength;
+	EVENT *eventqueue;	// in when order
+
+	int loglevel[LOGCATEGORIES];	// the level each category logs down to - see log.h
+
+	/* where the machine's messages go, and the bios monitor and -k - read from,
+	   stdout, stderr and stdin unless nasbatch gives it a job log */
+	FILE *out;
+	FILE *err;
+	FILE *in;
+
+	/* the run - set from the command line, see map80nascom.c */
+	int verbose;		// set to true to display messages
+	int headless;		// set to 1 to run without SDL - no windows and keyboard from a file
+	int go_fast;
+	int t_sim_delay;
+	int clockrate;		// emulated Z80 clock in MHz when not going fast
+	int timelimit;		// stop the emulator after this many seconds - 0 for no limit
+	int timelimitreached;	// set to 1 when the run was stopped by the time limit
+	time_t runstarttime;	// when the emulator started running
+	int usebiosmonitor;	// set to 1 to make use of the bios monitor
+	int vfcboot;		// set to 1 to start in cpm mode
+	int cpmswitchstate;	// set to 1 if cpm mode set - see cpmswitch.h
+	int action;		// sim_action_t for sim_delay to return - see sdlevents.h
+	int floppyfastdisk;	// fast disk - see map80VFCfloppy.h
+	int vfcfloppydisplaysectors;	// show the sectors read and written
+	int sdfastsd;		// fast SD - see nascom4SD.h
+	char firstcommand[3];	// the bios monitor command the run starts with
+	const char *snapshotfile;	// save the machine here when it stops
+	const char *memorydumpfile;	// where the nascom mode memory is dumped at the end
+
+	// used by pace_to_clockrate
+	int pacingstarted;		// set to 1 once the start points are recorded
+	uint64_t pacingstarthost;	// host performance counter at start of pacing
+	uint64_t pacingstarttstates;	// T-states at start of pacing
+
+	// port 0 single step - see nascomport0_write
+	int singlestepstate;
+	int sscount;
+
+	FASTREG previousPC;	// last PC the trace showed - see disassemble.c
+
+	/* the cards - each module keeps its own state in its card, which only it
+	   looks inside unless the header says otherwise */
+	struct MAP80RAM *ram;
+	struct VFCDISPLAY *vfc;
+	struct VFCFLOPPY *floppy;
+	struct SDCARD *sd;
+	struct CLOCKCARD *clock;
+	struct KEYBOARD *keyboard;
+	struct SERIALPORT *serial;
+};
+
+// the registers at the start of struct machine, which are the "z80" snapshot section
+#define MACHINEREGISTERS	offsetof(struct machine, tstates)
+
+// set up a machine with nothing loaded and its cards as at power on, and free it again
+// see map80nascom.c
+extern struct machine *machine_new(void);
+extern void machine_free(struct machine *m);
+
+// sets RAMPAGE_DIRTY, drops cached code and calls the trap - see map80ram.c
+extern void rampagewritten(struct machine *m, unsigned int a, int length);
+
+// call after writing length bytes from a - they must all be in the one page
+// the memory macros work on the machine m of the function they are used in
+#define RAMPAGEWRITE(a, length) do {					\
+	struct rampage *writepage = &m->rampagetable[RAMPAGEINDEX(a)];	\
+	if ((writepage->flags & RAMPAGE_WRITECHECK) != RAMPAGE_DIRTY)	\
+		rampagewritten(m, (a), (length));			\
+} while (0)
 
 // DA Fix ram as the old memory space
 // virutalram replaced it
@@ -102,23 +261,11 @@ extern BYTE *rampagetable[RAMPAGETABLESIZE];
 //extern BYTE virutalram[VIRTUALRAMSIZE*1024];
 //extern BYTE ram[RAMSIZE*1024];
 
-// fix DA
-// ramromtable is set to 0 if you can write to it
-// otherwise a write attempt is just ignored
-// i.e. that area is a ROM
-extern int ramromtable[RAMPAGETABLESIZE];
-
-// ram lock table is set to 0 if you can change it's pointer in rampagetable
-// otherwise the rampagetable will not be changed
-// acts like the N2 ram disable line.
-// normally this would be linked to a seperate 2k block and not the nrmal ram area.
-extern int ramlocktable[RAMPAGETABLESIZE];
-
 #ifdef DEBUG
 extern volatile int stopsim;
 #endif
 
-extern FASTWORK simz80(FASTREG PC, int, int (*)());
+extern FASTWORK simz80(struct machine *, FASTREG PC, int, int (*)(struct machine *));
 
 #define FLAG_C	1
 #define FLAG_N	2
@@ -141,10 +288,28 @@ extern FASTWORK simz80(FASTREG PC, int, int (*)());
 // fix DA - original was for 4k pages
 //#define RAM(a)		*(pagetable[((a)&0xffff)>>12]+((a)&0x0fff))
 // need to define based on 2k pages and for a bigger virtual space
-#define RAM(a)		*(rampagetable[((a)>>RAMPAGESHIFTBITS) & RAMPAGETABLESIZEMASK] + ((a) & RAMPAGEMASK) )
+// the memory of the machine m of the function it is used in
+#define RAM(a)		*(m->rampagetable[RAMPAGEINDEX(a)].host + ((a) & RAMPAGEMASK) )
+
+// simz80's straight line code cache
+// RAMPAGE_CODE is set for a page once code has been cached from its host memory,
+// on every page mapping the same host memory, as a write through any of them changes the code
+// call when length bytes from a, all in the one page, have been written to
+extern void blockcachewritten(struct machine *m, unsigned int a, int length);
+// nonzero if a block may have taken the byte at a as an opcode
+#define BLOCKCACHEOPCODE(a)	(m->blockcacheopcodes[RAMPAGEINDEX(a)][((a) & RAMPAGEMASK) >> 3] & (1 << ((a) & 7)))
+// call when rampagetable is changed for a page
+extern void blockcachepagechanged(struct machine *m, int page);
+// call to throw away all the cached code
+extern void blockcacheflush(struct machine *m);
+
+// GetBYTE, PutBYTE and PutWORD work on the machine m, as RAM does
+#define GetBYTE(a)	getbyte(m, (a))
+#define PutBYTE(a, v)	putbyte(m, (a), (v))
+#define PutWORD(a, v)	putword(m, (a), (v))
 
 static inline unsigned char
-GetBYTE(uint16_t a)
+getbyte(struct machine *m, uint16_t a)
 {
 // fix DA - change to use the RAM macro
 //    return ram[a];
@@ -161,7 +326,7 @@ GetBYTE(uint16_t a)
 // void slow_write(unsigned int a, unsigned char v);
 
 static inline void
-PutBYTE(uint16_t a, uint16_t v)
+putbyte(struct machine *m, uint16_t a, uint16_t v)
 {
 // fix DA removed the basic rom for now
 // need to look to a more subtle way of setting it
@@ -178,13 +343,18 @@ PutBYTE(uint16_t a, uint16_t v)
 /*
       fprintf(stdout, "address [%04x] [%04x] = [%02x] value [%02x] \n",
            a,
-           (a >> RAMPAGESHIFTBITS) & RAMPAGETABLESIZEMASK,
-           ramromtable[ (a >> RAMPAGESHIFTBITS) & RAMPAGETABLESIZEMASK],
+           RAMPAGEINDEX(a),
+           m->rampagetable[RAMPAGEINDEX(a)].flags,
             v );
 */
 
-      if ( ramromtable[ (a >> RAMPAGESHIFTBITS) & RAMPAGETABLESIZEMASK] == 0 ) {
-        RAM(a) = v;
+      struct rampage *page = &m->rampagetable[RAMPAGEINDEX(a)];
+      if ( (page->flags & RAMPAGE_READONLY) == 0 ) {
+        page->host[a & RAMPAGEMASK] = v;
+        // a write beside cached code, not to one of its opcodes, needs nothing more
+        if ( (page->flags & RAMPAGE_WRITECHECK) != RAMPAGE_DIRTY &&
+             ( (page->flags & RAMPAGE_WRITECHECK) != (RAMPAGE_DIRTY | RAMPAGE_CODE) || BLOCKCACHEOPCODE(a) ) )
+            rampagewritten(m, a, 1);
       }
 }
 // this was in original zaye code
@@ -209,7 +379,7 @@ static inline uint16_t GetWORD(uint16_t a)
 */
 
 
-static inline void PutWORD(unsigned a, uint16_t v)
+static inline void putword(struct machine *m, unsigned a, uint16_t v)
 {
 // fix DA change to use PutBYTE - slower but . . . .
 // need to look to a more subtle way of setting it
@@ -223,13 +393,15 @@ static inline void PutWORD(unsigned a, uint16_t v)
 }
 
 #ifndef BIOS
-extern int in(unsigned int);
-extern void out(unsigned int, unsigned char);
-#define Input(port) in(port)
-#define Output(port, value) out(port,value)
+extern int in(struct machine *m, unsigned int);
+extern void out(struct machine *m, unsigned int, unsigned char);
+/* through the idle loop detector in simz80.c */
+#define Input(port) idleinput(m, port, PC)
+#define Output(port, value) idleoutput(m, port, value)
 #else
 /* Define these as macros or functions if you really want to simulate I/O */
 #define Input(port)	0
 #define Output(port, value)
 #endif
 
+#endif
@@ -0,0 +1,220 @@
+/*  snapshots of the whole emulated machine
+
+    Saving writes each section with stdio and renames the file into place,
+    so a snapshot is never left half written.
+    Restoring maps the snapshot file, so the runs restoring the same
+    snapshot share its pages in the page cache, checks every section is
+    there with the length the machine expects, then copies each section
+    straight into the machine.
+
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "options.h"
+#include "simz80.h"
+#include "cpmswitch.h"
+#include "interrupts.h"
+#include "snapshot.h"
+
+typedef struct {
+    char magic[8];              // SNAPSHOTMAGIC
+    uint32_t version;           // SNAPSHOTVERSION
+    uint32_t sections;
+} SNAPSHOTHEADER;
+
+typedef struct {
+    char tag[8];
+    uint64_t length;            // bytes of data - it is followed by padding to a multiple of 8
+} SNAPSHOTSECTION;
+
+#define SNAPSHOTPADDED(length) (((length) + 7) & ~(uint64_t)7)
+
+// the state held outside the devices
+static void machineSnapshot(struct machine *m, SNAPSHOT *s){
+
+    snapshot_data(s, "z80", m, MACHINEREGISTERS);
+    snapshot_data(s, "tstates", &m->tstates, sizeof(m->tstates));
+    snapshot_data(s, "z80instr", &m->z80instructions, sizeof(m->z80instructions));
+    snapshot_data(s, "cpmswtch", &m->cpmswitchstate, sizeof(m->cpmswitchstate));
+}
+
+// every part of the machine in the same order for saving and restoring
+static void snapshot_all(struct machine *m, SNAPSHOT *s){
+
+    machineSnapshot(m, s);
+    map80RamSnapshot(m, s);
+    map80VFCDisplaySnapshot(m, s);
+    floppySnapshot(m, s);
+    SDSnapshot(m, s);
+    chsclockcardSnapshot(m, s);
+    keyboardSnapshot(m, s);
+}
+
+// the data of section tag in the snapshot file, which must be length bytes
+// returns NULL, having said why, if it is missing or the wrong length
+static unsigned char * snapshotsection(SNAPSHOT *s, const char *tag, size_t length){
+
+    SNAPSHOTSECTION section;
+
+    // look for the section - there are only a few of them
+    size_t position = sizeof(SNAPSHOTHEADER);
+    while (position + sizeof(section) <= s->size){
+        memcpy(&section, s->mapping + position, sizeof(section));
+        position += sizeof(section);
+        if (section.length > s->size - position){
+            break;
+        }
+        if (strncmp(section.tag, tag, sizeof(section.tag)) == 0){
+            if (section.length != length){
+                fprintf(s->out, "Snapshot section '%s' is %llu bytes, expected %zu.\n", tag,
+                        (unsigned long long)section.length, length);
+                return NULL;
+            }
+            return s->mapping + position;
+        }
+        position += SNAPSHOTPADDED(section.length);
+    }
+    fprintf(s->out, "Snapshot section '%s' is missing.\n", tag);
+    return NULL;
+}
+
+void snapshot_data(SNAPSHOT *s, const char *tag, void *data, size_t length){
+
+    SNAPSHOTSECTION section;
+    static const unsigned char padding[8];
+
+    if (s->error){
+        return;
+    }
+    if (s->checking){
+        if (snapshotsection(s, tag, length) == NULL){
+            s->error = 1;
+        }
+        return;
+    }
+    if (!s->restoring){
+        memset(&section, 0, sizeof(section));
+        memcpy(section.tag, tag, strnlen(tag, sizeof(section.tag)));
+        section.length = length;
+        if (fwrite(&section, sizeof(section), 1, s->file) != 1 ||
+            fwrite(data, 1, length, s->file) != length ||
+            fwrite(padding, 1, SNAPSHOTPADDED(length) - length, s->file) != SNAPSHOTPADDED(length) - length){
+            s->error = 1;
+        }
+        s->sections++;
+        return;
+    }
+
+    unsigned char *saved = snapshotsection(s, tag, length);
+    if (saved == NULL){
+        s->error = 1;
+        return;
+    }
+    memcpy(data, saved, length);
+}
+
+int snapshot_save(struct machine *m, const char *filename){
+
+    SNAPSHOT s;
+    SNAPSHOTHEADER header;
+    char tempname[FILENAME_MAX];
+
+    memset(&s, 0, sizeof(s));
+    s.out = m->out;
+    snprintf(tempname, sizeof(tempname), "%s.tmp", filename);
+    s.file = fopen(tempname, "wb");
+    if (s.file == NULL){
+        fprintf(m->err, "%s: %s\n", tempname, strerror(errno));
+        return -1;
+    }
+    // the header is written again at the end with the number of sections
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOTMAGIC, sizeof(header.magic));
+    header.version = SNAPSHOTVERSION;
+    if (fwrite(&header, sizeof(header), 1, s.file) != 1){
+        s.error = 1;
+    }
+    snapshot_all(m, &s);
+    header.sections = s.sections;
+    if (fseek(s.file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, s.file) != 1){
+        s.error = 1;
+    }
+    if (fclose(s.file) != 0){
+        s.error = 1;
+    }
+    if (s.error || rename(tempname, filename) != 0){
+        fprintf(m->err, "%s: %s\n", filename, strerror(errno));
+        unlink(tempname);
+        return -1;
+    }
+    fprintf(m->out, "Snapshot saved to '%s', PC %4.4X\n", filename, m->pc);
+    return 0;
+}
+
+int snapshot_restore(struct machine *m, const char *filename){
+
+    SNAPSHOT s;
+    SNAPSHOTHEADER header;
+    struct stat filestatus;
+
+    memset(&s, 0, sizeof(s));
+    s.out = m->out;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &filestatus) != 0){
+        fprintf(m->err, "%s: %s\n", filename, strerror(errno));
+        if (fd >= 0){
+            close(fd);
+        }
+        return -1;
+    }
+    s.size = filestatus.st_size;
+    if (s.size < sizeof(header)){
+        fprintf(m->out, "Snapshot '%s' is not a snapshot.\n", filename);
+        close(fd);
+        return -1;
+    }
+    void * mapping = mmap(NULL, s.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED){
+        fprintf(m->err, "%s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    s.mapping = mapping;
+    memcpy(&header, s.mapping, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOTMAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOTVERSION){
+        fprintf(m->out, "Snapshot '%s' is not a version %d snapshot.\n", filename, SNAPSHOTVERSION);
+        munmap(s.mapping, s.size);
+        return -1;
+    }
+    // every section is checked before any is copied, so a bad snapshot
+    // leaves the machine as it was - the parts go through their saving side
+    // for this, which only reads the machine
+    s.checking = 1;
+    snapshot_all(m, &s);
+    if (s.error){
+        fprintf(m->out, "Snapshot '%s' could not be restored.\n", filename);
+        munmap(s.mapping, s.size);
+        return -1;
+    }
+    s.checking = 0;
+    s.restoring = 1;
+    snapshot_all(m, &s);
+    munmap(s.mapping, s.size);
+    // the interrupt sources are back as they were, so is the INT line
+    interrupt_update(m);
+    fprintf(m->out, "Snapshot restored from '%s', PC %4.4X\n", filename, m->pc);
+    return 0;
+}
+
+// end of file
@@ -0,0 +1,60 @@
+/*  snapshots of the whole emulated machine
+
+    A snapshot file holds the Z80 registers, all of the MAP80 ram, the
+    memory mapping, and the state of the VFC display, floppy controller,
+    SDcard, clock card and keyboard, as tagged binary sections:
+
+        header      SNAPSHOTMAGIC, version and the number of sections
+        sections    an 8 character tag and a length, then the data
+                    padded to a multiple of 8 bytes
+
+    Each part of the machine has a snapshot function that both saves and
+    restores, by passing its state to snapshot_data with a tag.
+    The disc images are not in the snapshot - they are mounted as given on
+    the command line, so keep them the same, e.g. with a copy of an overlay.
+
+*/
+
+#ifndef SNAPSHOT_DEFINED_H
+#define SNAPSHOT_DEFINED_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define SNAPSHOTMAGIC "MAP80SNP"
+#define SNAPSHOTVERSION 3
+
+struct machine;
+
+typedef struct {
+    int restoring;              // 1 when restoring, 0 when saving
+    int checking;               // 1 when checking the sections before restoring - nothing is saved or copied
+    int error;                  // set if anything went wrong
+    FILE * out;                 // where problems are reported - the machine's out
+    FILE * file;                // when saving
+    unsigned int sections;      //   sections written
+    unsigned char * mapping;    // when restoring - the snapshot file
+    size_t size;
+} SNAPSHOT;
+
+// save the machine to the file - returns 0 if okay
+extern int snapshot_save(struct machine *m, const char *filename);
+
+// put the machine back as it was saved - call once everything is set up
+// returns 0 if okay
+extern int snapshot_restore(struct machine *m, const char *filename);
+
+// save length bytes at data as section tag, or restore them from it
+extern void snapshot_data(SNAPSHOT *s, const char *tag, void *data, size_t length);
+
+// the snapshot functions of each part of the machine
+extern void map80RamSnapshot(struct machine *m, SNAPSHOT *s);
+extern void map80VFCDisplaySnapshot(struct machine *m, SNAPSHOT *s);
+extern void floppySnapshot(struct machine *m, SNAPSHOT *s);
+extern void SDSnapshot(struct machine *m, SNAPSHOT *s);
+extern void chsclockcardSnapshot(struct machine *m, SNAPSHOT *s);
+extern void keyboardSnapshot(struct machine *m, SNAPSHOT *s);
+
+#endif
+
+// end of file
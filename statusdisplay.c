@@ -36,7 +36,8 @@ int statusdisplayxpos=STATUS_DISPLAY_XPOS;
 int statusdisplayypos=STATUS_DISPLAY_YPOS;
 
 
-void displaytapestatus(void){
+void displaytapestatus(struct machine *m){
+    SERIALPORT *serial = m->serial;
 
     char nofile[]="no file";
     // use this to display if data avialable or not 
@@ -48,28 +49,28 @@ void displaytapestatus(void){
     // build filename string into 
     char strserialname[100];
 
-    if (serial_input_filename==NULL){
+    if (serial->serial_input_filename==NULL){
         copystringtobuffer(strserialname,nofile,20);
         //strserialname[0]=0;
     }
     else{
-        copystringtobuffer(strserialname,serial_input_filename,20);
+        copystringtobuffer(strserialname,serial->serial_input_filename,20);
         // sprintf(strBuffer,"Serial in: %s %c position:%06ld ",strserialname, " *"[tape_led & 0x1] , tape_in_pos ); 
     }
-    sprintf(strBuffer,"Serial in  %06ld file: %s", tape_in_pos, strserialname ); 
+    sprintf(strBuffer,"Serial in  %06ld file: %s", serial->tape_in_pos, strserialname ); 
 
     status_display_show_chars_full(strBuffer,0,STATUS_DISPLAYLINES-2,STATUS_DISPLAYSCALEX,STATUS_DISPLAYSCALEY,STATUS_LIGHTBLUE,STATUS_BLACK);
 
-    if (serial_output_filename==NULL){
+    if (serial->serial_output_filename==NULL){
         copystringtobuffer(strserialname,nofile,20);
         //strserialname[0]=0;
     }
     else{
-        copystringtobuffer(strserialname,serial_output_filename,20);
+        copystringtobuffer(strserialname,serial->serial_output_filename,20);
         // sprintf(strBuffer,"Serial in: %s %c position:%06ld ",strserialname, " *"[tape_led & 0x1] , tape_in_pos ); 
     }
 
-    sprintf(strBuffer,"Serial out %06ld file: %s", tape_out_pos, strserialname ); 
+    sprintf(strBuffer,"Serial out %06ld file: %s", serial->tape_out_pos, strserialname ); 
 
     status_display_show_chars_full(strBuffer,0,STATUS_DISPLAYLINES-1,STATUS_DISPLAYSCALEX,STATUS_DISPLAYSCALEY,STATUS_LIGHTBLUE,STATUS_BLACK);
     
@@ -78,11 +79,11 @@ void displaytapestatus(void){
         
     status_display_show_chars_full(strBuffer,0,STATUS_DISPLAYLINES-3,STATUS_DISPLAYSCALEX,STATUS_DISPLAYSCALEY,STATUS_LIGHTBLUE,STATUS_BLACK);
 
-    sprintf(strBuffer,"%c","\xB8\xB9"[tape_led & 0x1]); 
+    sprintf(strBuffer,"%c","\xB8\xB9"[serial->tape_led & 0x1]); 
         
     status_display_show_chars_full(strBuffer,10,STATUS_DISPLAYLINES-3,STATUS_DISPLAYSCALEX,STATUS_DISPLAYSCALEY,STATUS_RED,STATUS_BLACK);
     
-    if (serial_input_available){
+    if (serial->serial_input_available){
         displaynodata+=3;
     }
     
@@ -201,7 +202,7 @@ void status_GetWindowSize(int* w, int* h){
 
 // this is called when the simz80 code calls the sim_delay function
 
-void status_display_refresh(void)
+void status_display_refresh(struct machine *m)
 {
 
     bool dirty = needsrefresh;
@@ -219,7 +220,7 @@ void status_display_refresh(void)
     // char strBuffer[100];
     // display serial input details
 
-    displaytapestatus();
+    displaytapestatus(m);
 
     //sprintf(strBuffer,"Serial in: %d %c input:%06ld  output:%06ld ",serial_input_available, " *"[tape_led] , tape_in_pos, tape_out_pos ); 
 
@@ -50,6 +50,8 @@
 
 #define STATUS_DISPLAYFORCEREFRESH 10
 
+struct machine;
+
 int status_create_screen(BYTE *ScreenMemory);
 void status_display_change_size(int sizefactor);
 void status_display_position(int x, int y);
@@ -57,8 +59,7 @@ void status_display_position(int x, int y);
 // updates the integers pointed to by w and h
 void status_GetWindowSize(int* w, int* h);
 
-
-void status_display_refresh(void);
+void status_display_refresh(struct machine *m);
 void status_display_show_string(char * stringdata, unsigned int xpos, unsigned int ypos);
 void status_display_show_string_full(char * stringdata, unsigned int xpixelpos, unsigned int ypixelpos, 
         unsigned fontxscale, unsigned fontyscale,  uint32_t charcolour, uint32_t backgroundcolour);
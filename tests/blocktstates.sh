@@ -0,0 +1,81 @@
+#!/bin/sh
+# CPIR, CPDR and LDIR take the T-states of the repeats they really make - a
+# search that finds its byte is charged up to the match and no further, and
+# each repeat is 21 T-states
+#
+#   sh tests/blocktstates.sh emulator - run in a scratch directory by runtests.sh
+#
+# A program of one block opcode then HALT is run with different counts in BC,
+# and the T-states to the HALT are read from a snapshot of the machine.  The
+# runs only differ in BC, so anything else the machine did is the same in each.
+
+emulator=$1
+failed=0
+
+# 1000H: LD HL,hl  LD DE,3000H  LD BC,bc  LD A,a  opcode  DI  HALT - as a .nas file
+program(){
+    set -- 0x21 $(($1 & 255)) $(($1 >> 8)) 0x11 0x00 0x30 0x01 $(($2 & 255)) \
+           $(($2 >> 8)) 0x3E $3 0xED $4 0xF3 0x76 0x00
+    line 0x1000 $1 $2 $3 $4 $5 $6 $7 $8
+    shift 8
+    line 0x1008 $1 $2 $3 $4 $5 $6 $7 $8
+}
+
+# a .nas line - the address, 8 bytes and their sum
+line(){
+    sum=$((($1 & 255) + ($1 >> 8)))
+    printf '%04X' $1
+    shift
+    for byte in "$@"; do
+        printf ' %02X' $byte
+        sum=$((sum + byte))
+    done
+    printf ' %02X\n' $((sum & 255))
+}
+
+# T-states the machine had run when it HALTed
+tstates(){
+    program "$@" > block.nas
+    "$emulator" --headless -e 10 -k keys --snapshot block.snp block.nas > /dev/null 2>&1
+    # the sections follow the 16 byte header as tag, length and data padded to 8 bytes
+    offset=16
+    while [ "$(dd if=block.snp bs=1 skip=$offset count=7 2> /dev/null | tr -d '\000')" != tstates ]; do
+        length=$(od -An -t u8 -j $((offset + 8)) -N 8 block.snp | tr -d ' ')
+        if [ -z "$length" ]; then
+            echo "no tstates in the snapshot"
+            exit 1
+        fi
+        offset=$((offset + 16 + (length + 7) / 8 * 8))
+    done
+    od -An -t u8 -j $((offset + 16)) -N 8 block.snp | tr -d ' '
+    rm -f block.nas block.snp
+}
+
+# the two must differ by difference T-states
+differ(){
+    if [ $(($2 - $3)) -ne $4 ]; then
+        echo "$1: $2 - $3 T-states is $(($2 - $3)), not $4"
+        failed=1
+    fi
+}
+
+printf 'E1000\n' > keys
+
+# 0ADH is first in the monitor rom at 07B8H, 0BFH is last at 00B1H
+cpirfound=$(tstates 0x0000 0x07B9 0xAD 0xB1)
+cpirlong=$(tstates 0x0000 0x0800 0xAD 0xB1)
+cpirshort=$(tstates 0x0000 0x07B8 0xAD 0xB1)
+differ "CPIR found with more to go and in the last byte" $cpirlong $cpirfound 0
+differ "CPIR found in the last byte and not found one short" $cpirfound $cpirshort 21
+
+cpdrfound=$(tstates 0x07FF 0x074F 0xBF 0xB9)
+cpdrlong=$(tstates 0x07FF 0x0800 0xBF 0xB9)
+cpdrshort=$(tstates 0x07FF 0x074E 0xBF 0xB9)
+differ "CPDR found with more to go and in the last byte" $cpdrlong $cpdrfound 0
+differ "CPDR found in the last byte and not found one short" $cpdrfound $cpdrshort 21
+
+ldirlong=$(tstates 0x2000 0x0101 0x00 0xB0)
+ldirshort=$(tstates 0x2000 0x0100 0x00 0xB0)
+differ "LDIR one more byte" $ldirlong $ldirshort 21
+
+exit $failed
@@ -0,0 +1,111 @@
+#!/bin/sh
+# a file saved by CP/M on a floppy with an overlay lands in the overlay, the
+# image is not changed, and the file is there when the disc is mounted again;
+# the overlay is then discarded or committed, by the floppy config and by
+# the -c image,overlay,exit of an SDcard
+#
+#   sh tests/overlay.sh emulator - run in a scratch directory by runtests.sh
+
+emulator=$1
+disks=$(cd "$(dirname "$0")/../disks" && pwd)
+failed=0
+
+cp "$disks/cpm001system22.img" base.img
+basesum=$(md5sum < base.img)
+
+# the CP/M 2.2 floppy config on base.img - with overlay cpm.cow and overlay-exit $1 if given
+config(){
+    sed 's#^imagefilename=.*#imagefilename=base.img#' "$disks/cpm001system22.config" > cpm.config
+    if [ -n "$1" ]; then
+        printf 'overlay=cpm.cow\noverlay-exit=%s\n' "$1" >> cpm.config
+    fi
+}
+
+# boot CP/M and type the command - what is on the screen is left in run.out
+cpm(){
+    printf '%s\r' "$1" > cpm.keys
+    "$emulator" --headless -e 5 -b -f cpm.config -k cpm.keys > run.out 2>&1
+}
+
+fail(){
+    echo "$1"
+    sed 's/^/    /' run.out
+    failed=1
+}
+
+unchanged(){
+    if [ "$(md5sum < base.img)" != "$basesum" ]; then
+        echo "$1 - base.img has been changed"
+        failed=1
+    fi
+}
+
+config keep
+cpm 'SAVE 1 NEWFILE.COM'
+if [ ! -f cpm.cow ] || ! grep -a -q "NEWFILE COM" cpm.cow; then
+    fail "SAVE with the overlay kept - NEWFILE.COM is not in the overlay"
+fi
+unchanged "SAVE with the overlay kept"
+
+cpm DIR
+if ! grep -q "NEWFILE .COM" run.out; then
+    fail "mounted again with the overlay - NEWFILE.COM is not in the directory"
+fi
+unchanged "mounted again with the overlay"
+
+cp cpm.cow saved.cow
+config discard
+cpm DIR
+if ! grep -q "NEWFILE .COM" run.out; then
+    fail "overlay-exit=discard - NEWFILE.COM is not in the directory"
+fi
+if [ -f cpm.cow ]; then
+    fail "overlay-exit=discard - the overlay is still there"
+fi
+unchanged "overlay-exit=discard"
+
+config
+cpm DIR
+if grep -q "NEWFILE .COM" run.out; then
+    fail "mounted without the discarded overlay - NEWFILE.COM is in the directory"
+fi
+unchanged "mounted without the overlay"
+
+# the same overlay through -c - the image is a floppy image, but the overlay
+# only knows blocks of the file, so the SDcard commits the floppy's sectors
+cp saved.cow cpm.cow
+"$emulator" --headless -e 1 -k /dev/null -c base.img,cpm.cow > run.out 2>&1
+if ! grep -q "Mount SDcard, image file 'base.img' overlay cpm.cow" run.out || [ ! -f cpm.cow ]; then
+    fail "-c base.img,cpm.cow - the overlay is not kept"
+fi
+unchanged "-c base.img,cpm.cow"
+
+"$emulator" --headless -e 1 -k /dev/null -c base.img,cpm.cow,never > run.out 2>&1
+if ! grep -q "SDcard overlay - unrecognised 'never', keeping the overlay." run.out || [ ! -f cpm.cow ]; then
+    fail "-c base.img,cpm.cow,never - the overlay is not kept"
+fi
+unchanged "-c base.img,cpm.cow,never"
+
+"$emulator" --headless -e 1 -k /dev/null -c base.img,other.cow,discard > run.out 2>&1
+if ! grep -q "overlay other.cow" run.out || [ -f other.cow ]; then
+    fail "-c base.img,other.cow,discard - the overlay is still there"
+fi
+unchanged "-c base.img,other.cow,discard"
+
+"$emulator" --headless -e 1 -k /dev/null -c base.img,cpm.cow,commit > run.out 2>&1
+if [ -f cpm.cow ] || ! grep -a -q "NEWFILE COM" base.img; then
+    fail "-c base.img,cpm.cow,commit - the overlay is not in base.img"
+fi
+
+config commit
+cpm 'SAVE 1 OTHER.COM'
+if [ -f cpm.cow ]; then
+    fail "overlay-exit=commit - the overlay is still there"
+fi
+config
+cpm DIR
+if ! grep -q "NEWFILE .COM" run.out || ! grep -q "OTHER   .COM" run.out; then
+    fail "mounted after the commits - NEWFILE.COM and OTHER.COM are not both in the directory"
+fi
+
+exit $failed
@@ -0,0 +1,77 @@
+#!/bin/sh
+# run the test programs headless and check what they leave on the screen
+#
+#   tests/runtests.sh [emulator]
+#
+# Each tests/<name>.nas is loaded, tests/<name>.keys is typed in to start it,
+# and it passes if it puts PASS on the top line of the Nascom screen before
+# it HALTs.  The runs are made in a scratch directory, with the roms linked
+# in, so the memory dump the emulator writes when it stops is not left behind.
+# If nasbatch is next to the emulator the programs are run again, each a few
+# times over, as machines side by side in the one nasbatch.
+# Then each tests/<name>.sh is run in a scratch directory of its own, given
+# the emulator, and passes if it exits 0 - what it says is shown if it fails.
+# The exit status is the number of tests that failed.
+
+emulator=$(cd "$(dirname "${1:-./map80nascom}")" && pwd)/$(basename "${1:-./map80nascom}")
+nasbatch=$(dirname "$emulator")/nasbatch
+tests=$(cd "$(dirname "$0")" && pwd)
+scratch=$(mktemp -d) || exit 255
+ln -s "$tests/../roms" "$scratch/roms"
+failed=0
+
+for program in "$tests"/*.nas; do
+    name=$(basename "$program" .nas)
+    if (cd "$scratch" && "$emulator" --headless -e 10 -k "$tests/$name.keys" "$program" 2>&1) | grep -q "^PASS"; then
+        echo "$name ok"
+    else
+        echo "$name FAILED"
+        failed=$((failed + 1))
+    fi
+done
+
+if [ -x "$nasbatch" ]; then
+    # job n is program (n - 1) / 4 - the machines share the roms, so one
+    # changing a rom shows up in the others
+    for program in "$tests"/*.nas; do
+        for copy in 1 2 3 4; do
+            echo "-e 10 -k $tests/$(basename "$program" .nas).keys $program"
+        done
+    done > "$scratch/tests.jobs"
+    (cd "$scratch" && "$nasbatch" -j 4 -o "$scratch" tests.jobs > /dev/null)
+    job=0
+    for program in "$tests"/*.nas; do
+        name=$(basename "$program" .nas)
+        passed=0
+        for copy in 1 2 3 4; do
+            job=$((job + 1))
+            if grep -q "^PASS" "$scratch/job$job.log"; then
+                passed=$((passed + 1))
+            fi
+        done
+        if [ $passed -eq 4 ]; then
+            echo "$name in nasbatch ok"
+        else
+            echo "$name in nasbatch FAILED"
+            failed=$((failed + 1))
+        fi
+    done
+fi
+
+for script in "$tests"/*.sh; do
+    name=$(basename "$script" .sh)
+    if [ "$name" = runtests ]; then
+        continue
+    fi
+    mkdir "$scratch/$name"
+    ln -s "$tests/../roms" "$scratch/$name/roms"
+    if (cd "$scratch/$name" && sh "$script" "$emulator" > "$scratch/$name.out" 2>&1); then
+        echo "$name ok"
+    else
+        echo "$name FAILED"
+        sed 's/^/    /' "$scratch/$name.out"
+        failed=$((failed + 1))
+    fi
+done
+rm -rf "$scratch"
+exit $failed
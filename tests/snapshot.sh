@@ -0,0 +1,63 @@
+#!/bin/sh
+# a CP/M 2.2 booted and saved with --snapshot carries on from where it was
+# with --restore, and a damaged snapshot is refused
+#
+#   sh tests/snapshot.sh emulator - run in a scratch directory by runtests.sh
+
+emulator=$1
+disks=$(cd "$(dirname "$0")/../disks" && pwd)
+failed=0
+
+# a copy of the disc, as the snapshot does not hold it
+cp "$disks/cpm001system22.img" .
+sed 's#^imagefilename=.*#imagefilename=cpm001system22.img#' "$disks/cpm001system22.config" > cpm.config
+
+# boot, and leave a mark on the screen to look for after restoring
+printf 'MARK1\r' > mark.keys
+"$emulator" --headless -e 5 -b -f cpm.config -k mark.keys --snapshot cpm.snp > save.out 2>&1
+if ! grep -q "Snapshot saved to 'cpm.snp'" save.out || ! grep -q "^MARK1?" save.out; then
+    echo "CP/M did not boot and save the snapshot"
+    sed 's/^/    /' save.out
+    exit 1
+fi
+
+printf 'DIR\r' > dir.keys
+"$emulator" --headless -e 5 -b -f cpm.config -k dir.keys --restore cpm.snp > restore.out 2>&1
+if ! grep -q "Snapshot restored from 'cpm.snp'" restore.out; then
+    echo "the snapshot was not restored"
+    failed=1
+fi
+# the screen of the saved machine, then the directory from the restored one
+if ! grep -q "^MARK1?" restore.out || ! grep -q "^A>dir" restore.out ||
+   ! grep -q "^-SYSTEM .010  :  PIP     .COM" restore.out; then
+    echo "the restored CP/M did not carry on"
+    sed 's/^/    /' restore.out
+    failed=1
+fi
+
+# damaged snapshots - each must be refused, with the exit status 1
+refused(){
+    "$emulator" --headless -e 5 -f cpm.config -k /dev/null --restore bad.snp > bad.out 2>&1
+    status=$?
+    if [ $status -ne 1 ] || ! grep -q "$2" bad.out; then
+        echo "$1 - exit status $status"
+        sed 's/^/    /' bad.out
+        failed=1
+    fi
+    rm -f bad.snp bad.out
+}
+
+printf 'NOTASNAPSHOT' > bad.snp
+refused "not a snapshot" "is not a snapshot"
+
+# the last section, the keyboard, cut off
+head -c $(($(wc -c < cpm.snp) - 16)) cpm.snp > bad.snp
+refused "cut short" "Snapshot section 'keyboard' is missing"
+
+# the length of the first section, the registers, one byte more
+cp cpm.snp bad.snp
+length=$(od -An -t u8 -j 24 -N 8 cpm.snp | tr -d ' ')
+printf "$(printf '\\%03o' $(((length + 1) & 255)))" | dd of=bad.snp bs=1 seek=24 conv=notrunc 2> /dev/null
+refused "wrong length" "Snapshot section 'z80' is"
+
+exit $failed
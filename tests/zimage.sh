@@ -0,0 +1,104 @@
+#!/bin/sh
+# imgzip packs and unpacks the images in disks, incompressible and odd sized
+# data back to what they were, and a damaged .zimg is refused rather than
+# unpacked wrong - by imgzip and by the emulator mounting it
+#
+#   sh tests/zimage.sh emulator - run in a scratch directory by runtests.sh,
+#   imgzip is next to the emulator
+
+emulator=$1
+imgzip=$(dirname "$emulator")/imgzip
+disks=$(cd "$(dirname "$0")/../disks" && pwd)
+failed=0
+
+# image packs and unpacks to itself
+roundtrip(){
+    if ! "$imgzip" "$1" packed.zimg > /dev/null || ! "$imgzip" -d packed.zimg unpacked.img > /dev/null ||
+       ! cmp -s "$1" unpacked.img; then
+        echo "$1 is not the same packed and unpacked"
+        failed=1
+    fi
+    rm -f packed.zimg unpacked.img
+}
+
+# zimage_open or the unpacking of a block refuses zimg - imgzip -d exits 1, not crashing
+refused(){
+    "$imgzip" -d "$2" unpacked.img > /dev/null 2>&1
+    status=$?
+    if [ $status -ne 1 ]; then
+        echo "$1 - imgzip -d exited with $status, not 1"
+        failed=1
+    fi
+    rm -f unpacked.img
+}
+
+# write the bytes in printf format at offset into file
+patch(){
+    printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc 2> /dev/null
+}
+
+# unsigned 64 bit number at offset in file
+number(){
+    od -An -t u8 -j "$2" -N 8 "$1" | tr -d ' '
+}
+
+for image in "$disks"/*.img "$disks"/*.BIN; do
+    roundtrip "$image"
+done
+
+# nothing to find, so every block is stored as it is
+head -c 1000000 /dev/urandom > random.img
+roundtrip random.img
+# a short last block
+head -c 12345 /dev/urandom > short.img
+roundtrip short.img
+# smaller than the 12 bytes a match can start in, and just over
+for length in 1 5 11 12 13 17; do
+    head -c $length /dev/urandom > tiny.img
+    roundtrip tiny.img
+done
+# runs, repeats and random mixed, so matches and literals end all over the blocks
+( head -c 5000 /dev/zero; head -c 3001 /dev/urandom; yes MAP80 | head -c 9000
+  head -c 70000 /dev/urandom; head -c 300 /dev/zero; yes 0123456789abcdef | head -c 20000 ) > mixed.img
+roundtrip mixed.img
+
+"$imgzip" "$disks/cpm3.img" good.zimg > /dev/null
+# the header is 32 bytes, the index of file offsets follows it
+first=$(number good.zimg 32)
+second=$(number good.zimg 40)
+if [ $((second - first)) -ge 4096 ]; then
+    echo "block 0 of cpm3.img is not packed - the damaged block checks need it to be"
+    failed=1
+fi
+
+cp good.zimg bad.zimg
+patch bad.zimg 0 'X'
+refused "bad magic" bad.zimg
+
+cp good.zimg bad.zimg
+patch bad.zimg 16 '\001'
+refused "block count not for the image size" bad.zimg
+
+cp good.zimg bad.zimg
+patch bad.zimg 40 '\377\377\377\377'
+refused "block 0 longer than a block in the index" bad.zimg
+
+head -c $(($(wc -c < good.zimg) - 100)) good.zimg > bad.zimg
+refused "cut short" bad.zimg
+
+cp good.zimg bad.zimg
+patch bad.zimg "$first" '\360\377\377\377\377\377\377\377\377\377\377\377\377\377\377\377\377\377\377\377\377'
+refused "literals longer than the block" bad.zimg
+
+cp good.zimg bad.zimg
+patch bad.zimg "$first" '\000\020\000'
+refused "match from before the start of the block" bad.zimg
+
+cp good.zimg bad.zimg
+patch bad.zimg 40 '\377\377\377\377'
+if ! "$emulator" --headless -e 1 -k /dev/null -c bad.zimg,bad.cow 2>&1 | grep -q "SDcard failed to load 'bad.zimg'"; then
+    echo "the emulator did not refuse a bad index"
+    failed=1
+fi
+
+exit $failed
@@ -0,0 +1,355 @@
+/*  compressed disc images
+
+    The blocks of a .zimg are unpacked on first use into the memory
+    diskimage maps for the whole image, so the controllers still get a
+    pointer to the sector. A ring of the blocks unpacked, oldest first,
+    lets the oldest go once it is full - the pages are given back with
+    madvise and the block is unpacked again if it is used again.
+    Blocks written to are pinned and never let go.
+
+*/
+
+#define _XOPEN_SOURCE 700      // pread
+#define _DEFAULT_SOURCE        // madvise
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "zimage.h"
+
+#define ZIMAGEBIT(map, n) ((map)[(n) >> 3] & (1 << ((n) & 7)))
+#define ZIMAGESETBIT(map, n) ((map)[(n) >> 3] |= (1 << ((n) & 7)))
+#define ZIMAGECLEARBIT(map, n) ((map)[(n) >> 3] &= ~(1 << ((n) & 7)))
+
+// an empty slot in the ring
+#define ZIMAGENOBLOCK ((size_t)-1)
+
+int zimage_is_compressed(const char *filename){
+
+    char magic[8];
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0){
+        return 0;
+    }
+    ssize_t got = pread(fd, magic, sizeof(magic), 0);
+    close(fd);
+    return got == sizeof(magic) && memcmp(magic, ZIMAGEMAGIC, sizeof(magic)) == 0;
+}
+
+int zimage_open(ZIMAGE *zimage, const char *filename, size_t cacheblocks, FILE *out, FILE *err){
+
+    ZIMAGEHEADER header;
+
+    memset(zimage, 0, sizeof(ZIMAGE));
+    zimage->out = out;
+    zimage->err = err;
+    zimage->file = open(filename, O_RDONLY);
+    if (zimage->file < 0){
+        fprintf(zimage->err, "%s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (pread(zimage->file, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, ZIMAGEMAGIC, sizeof(header.magic)) != 0 ||
+        header.blockSize == 0 || header.imageSize == 0 ||
+        header.blocks != (header.imageSize + header.blockSize - 1) / header.blockSize){
+        fprintf(zimage->out, "Disc image '%s' is not a compressed image.\n", filename);
+        zimage_close(zimage);
+        return -1;
+    }
+    zimage->blockSize = header.blockSize;
+    zimage->blocks = header.blocks;
+    zimage->imageSize = header.imageSize;
+
+    size_t indexbytes = (zimage->blocks + 1) * sizeof(uint64_t);
+    zimage->index = malloc(indexbytes);
+    zimage->packed = malloc(zimage->blockSize);
+    zimage->loaded = calloc((zimage->blocks + 7) / 8, 1);
+    zimage->pinned = calloc((zimage->blocks + 7) / 8, 1);
+    zimage->ringSize = cacheblocks;
+    zimage->ring = cacheblocks > 0 ? malloc(cacheblocks * sizeof(size_t)) : NULL;
+    if (zimage->index == NULL || zimage->packed == NULL || zimage->loaded == NULL ||
+        zimage->pinned == NULL || (zimage->ring == NULL && cacheblocks > 0)){
+        fprintf(zimage->out, "Disc image '%s' - out of memory.\n", filename);
+        zimage_close(zimage);
+        return -1;
+    }
+    for (size_t n = 0; n < zimage->ringSize; n++){
+        zimage->ring[n] = ZIMAGENOBLOCK;
+    }
+
+    if (pread(zimage->file, zimage->index, indexbytes, sizeof(header)) != (ssize_t)indexbytes){
+        fprintf(zimage->err, "%s: %s\n", filename, strerror(errno));
+        zimage_close(zimage);
+        return -1;
+    }
+    // a bad index would have blocks overlapping or bigger than they unpack to
+    for (size_t n = 0; n < zimage->blocks; n++){
+        if (zimage->index[n + 1] < zimage->index[n] || zimage->index[n + 1] - zimage->index[n] > zimage->blockSize){
+            fprintf(zimage->out, "Disc image '%s' - block %zu is bad in the index.\n", filename, n);
+            zimage_close(zimage);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// bytes block n unpacks to - the last block of the image can be short
+static size_t zimage_blocklength(ZIMAGE *zimage, size_t n){
+    size_t offset = n * zimage->blockSize;
+    return (zimage->imageSize - offset < zimage->blockSize) ? zimage->imageSize - offset : zimage->blockSize;
+}
+
+// let go of the oldest block in the ring to make room for block n
+static void zimage_ring_add(ZIMAGE *zimage, unsigned char *image, size_t n){
+
+    size_t oldest = zimage->ring[zimage->ringNext];
+    if (oldest != ZIMAGENOBLOCK && ZIMAGEBIT(zimage->loaded, oldest) && !ZIMAGEBIT(zimage->pinned, oldest)){
+        ZIMAGECLEARBIT(zimage->loaded, oldest);
+        // the pages go back to the system and read as 0 until unpacked again
+        if (zimage->blockSize % sysconf(_SC_PAGESIZE) == 0){
+            madvise(image + oldest * zimage->blockSize, zimage->blockSize, MADV_DONTNEED);
+        }
+    }
+    zimage->ring[zimage->ringNext] = n;
+    zimage->ringNext = (zimage->ringNext + 1) % zimage->ringSize;
+}
+
+int zimage_load(ZIMAGE *zimage, unsigned char *image, size_t offset, size_t length){
+
+    if (length == 0){
+        return 0;
+    }
+    for (size_t n = offset / zimage->blockSize; n <= (offset + length - 1) / zimage->blockSize; n++){
+        if (ZIMAGEBIT(zimage->loaded, n)){
+            continue;
+        }
+        size_t packedlength = zimage->index[n + 1] - zimage->index[n];
+        size_t blocklength = zimage_blocklength(zimage, n);
+        unsigned char *block = image + n * zimage->blockSize;
+        if (packedlength == blocklength){
+            // stored as it is
+            if (pread(zimage->file, block, blocklength, zimage->index[n]) != (ssize_t)blocklength){
+                fprintf(zimage->err, "compressed disc image: %s\n", strerror(errno));
+                return -1;
+            }
+        }
+        else if (pread(zimage->file, zimage->packed, packedlength, zimage->index[n]) != (ssize_t)packedlength ||
+                 lz4_uncompress(zimage->packed, packedlength, block, blocklength) != 0){
+            fprintf(zimage->out, "Compressed disc image - block %zu will not unpack.\n", n);
+            return -1;
+        }
+        ZIMAGESETBIT(zimage->loaded, n);
+        zimage->unpacked++;
+        if (zimage->ringSize > 0){
+            zimage_ring_add(zimage, image, n);
+        }
+    }
+    return 0;
+}
+
+void zimage_pin(ZIMAGE *zimage, size_t offset, size_t length){
+
+    if (length == 0){
+        return;
+    }
+    for (size_t n = offset / zimage->blockSize; n <= (offset + length - 1) / zimage->blockSize; n++){
+        ZIMAGESETBIT(zimage->pinned, n);
+    }
+}
+
+void zimage_close(ZIMAGE *zimage){
+
+    if (zimage->file >= 0){
+        close(zimage->file);
+    }
+    free(zimage->index);
+    free(zimage->packed);
+    free(zimage->loaded);
+    free(zimage->pinned);
+    free(zimage->ring);
+    memset(zimage, 0, sizeof(ZIMAGE));
+    zimage->file = -1;
+}
+
+// LZ4 block format
+//   sequences of a token, literals then a match, the last sequence only has literals
+//   token       high 4 bits literal count, low 4 bits match length - 4, 15 means more bytes follow
+//   more        bytes added to the count until one is not 255
+//   offset      2 bytes, low first, back from where the match goes
+//   the last 5 bytes are always literals and no match starts in the last 12
+
+#define LZ4MINMATCH 4
+#define LZ4LASTLITERALS 5
+#define LZ4MFLIMIT 12
+#define LZ4HASHBITS 12
+#define LZ4MAXOFFSET 65535
+
+static uint32_t lz4_read32(const unsigned char *p){
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static unsigned int lz4_hash(uint32_t sequence){
+    return (sequence * 2654435761u) >> (32 - LZ4HASHBITS);
+}
+
+// the rest of a count of 15 or more
+static unsigned char * lz4_putlength(unsigned char *op, size_t length){
+    while (length >= 255){
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+// worst case bytes to put a sequence with literals literal bytes
+static size_t lz4_sequencebytes(size_t literals, size_t matchlength){
+    return 1 + literals / 255 + 1 + literals + 2 + matchlength / 255 + 1;
+}
+
+size_t lz4_compress(const unsigned char *src, size_t srclength, unsigned char *dst, size_t dstlength){
+
+    uint32_t table[1 << LZ4HASHBITS];   // where a 4 byte sequence was last seen
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;  // start of the literals not put yet
+    const unsigned char *end = src + srclength;
+    unsigned char *op = dst;
+    unsigned char *token;
+    size_t literals;
+
+    memset(table, 0, sizeof(table));
+    if (srclength >= LZ4MFLIMIT){
+        const unsigned char *mflimit = end - LZ4MFLIMIT;
+        const unsigned char *matchlimit = end - LZ4LASTLITERALS;
+        while (ip < mflimit){
+            uint32_t sequence = lz4_read32(ip);
+            unsigned int hash = lz4_hash(sequence);
+            const unsigned char *ref = src + table[hash];
+            table[hash] = ip - src;
+            if (ref >= ip || ip - ref > LZ4MAXOFFSET || lz4_read32(ref) != sequence){
+                ip++;
+                continue;
+            }
+            // the match may start before where it was found
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]){
+                ip--;
+                ref--;
+            }
+            const unsigned char *mp = ip + LZ4MINMATCH;
+            const unsigned char *rp = ref + LZ4MINMATCH;
+            while (mp < matchlimit && *mp == *rp){
+                mp++;
+                rp++;
+            }
+            literals = ip - anchor;
+            size_t matchlength = mp - ip - LZ4MINMATCH;
+            if (lz4_sequencebytes(literals, matchlength) > (size_t)(dst + dstlength - op)){
+                return 0;
+            }
+            token = op++;
+            *token = (literals >= 15 ? 15 : literals) << 4;
+            if (literals >= 15){
+                op = lz4_putlength(op, literals - 15);
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+            *token |= matchlength >= 15 ? 15 : matchlength;
+            if (matchlength >= 15){
+                op = lz4_putlength(op, matchlength - 15);
+            }
+            ip = anchor = mp;
+        }
+    }
+    // the rest are literals
+    literals = end - anchor;
+    if (lz4_sequencebytes(literals, 0) > (size_t)(dst + dstlength - op)){
+        return 0;
+    }
+    token = op++;
+    *token = (literals >= 15 ? 15 : literals) << 4;
+    if (literals >= 15){
+        op = lz4_putlength(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - dst;
+}
+
+int lz4_uncompress(const unsigned char *src, size_t srclength, unsigned char *dst, size_t dstlength){
+
+    const unsigned char *ip = src;
+    const unsigned char *iend = src + srclength;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + dstlength;
+    unsigned char more;
+
+    while (ip < iend){
+        unsigned int token = *ip++;
+        size_t length = token >> 4;
+        if (length == 15){
+            do {
+                if (ip >= iend){
+                    return -1;
+                }
+                more = *ip++;
+                length += more;
+            } while (more == 255);
+        }
+        if (length > (size_t)(iend - ip) || length > (size_t)(oend - op)){
+            return -1;
+        }
+        memcpy(op, ip, length);
+        op += length;
+        ip += length;
+        if (ip == iend){
+            // the last sequence has no match
+            break;
+        }
+
+        if (iend - ip < 2){
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)){
+            return -1;
+        }
+        length = (token & 15) + LZ4MINMATCH;
+        if ((token & 15) == 15){
+            do {
+                if (ip >= iend){
+                    return -1;
+                }
+                more = *ip++;
+                length += more;
+            } while (more == 255);
+        }
+        if (length > (size_t)(oend - op)){
+            return -1;
+        }
+        const unsigned char *match = op - offset;
+        if (offset >= length){
+            memcpy(op, match, length);
+            op += length;
+        }
+        else {
+            // the match overlaps what it makes - a run
+            while (length--){
+                *op++ = *match++;
+            }
+        }
+    }
+    return op == oend ? 0 : -1;
+}
+
+// end of file
@@ -0,0 +1,79 @@
+/*  compressed disc images
+
+    A .zimg file holds a floppy or SDcard image cut into blocks, each block
+    compressed on its own, so a sector can be read without unpacking the rest:
+
+        header      ZIMAGEMAGIC, block size, number of blocks and image size
+        index       blocks + 1 file offsets, block n is from index[n] to index[n+1]
+        blocks      LZ4 block format - a block that would not get smaller is stored as it is
+
+    Only the blocks used are unpacked, into the memory given by diskimage,
+    and the least recently unpacked are let go again once there are
+    DISKIMAGECACHEBLOCKS of them.
+    imgzip converts an image to a .zimg and back.
+
+*/
+
+#ifndef ZIMAGE_DEFINED_H
+#define ZIMAGE_DEFINED_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZIMAGEMAGIC "MAP80ZIM"
+// bytes in each block - a multiple of the host page size so an unpacked block can be let go
+#define ZIMAGEBLOCKSIZE 4096
+
+// start of a .zimg file - the index follows
+typedef struct {
+    char magic[8];              // ZIMAGEMAGIC
+    uint32_t blockSize;
+    uint32_t reserved;
+    uint64_t blocks;
+    uint64_t imageSize;
+} ZIMAGEHEADER;
+
+typedef struct {
+    int file;                  // the .zimg file
+    size_t blockSize;
+    size_t blocks;
+    size_t imageSize;           // bytes in the image once unpacked
+    uint64_t * index;           // where each block is in the file
+    unsigned char * packed;     // a block read from the file
+    // the unpacked blocks
+    unsigned char * loaded;     // bit per block - set if unpacked
+    unsigned char * pinned;     // bit per block - set if written to, so it is never let go
+    size_t * ring;              // blocks unpacked, oldest first from ringNext
+    size_t ringSize;
+    size_t ringNext;
+    unsigned long unpacked;     // blocks unpacked
+    FILE * out;                 // where problems are reported
+    FILE * err;                 //    and the errors from the system
+} ZIMAGE;
+
+// 1 if the file is a .zimg
+extern int zimage_is_compressed(const char *filename);
+
+// open a .zimg and read its index, keeping up to cacheblocks unpacked, 0 for all of them - returns 0 if okay
+// problems with it are reported to out, and the errors from the system to err, from now until it is closed
+extern int zimage_open(ZIMAGE *zimage, const char *filename, size_t cacheblocks, FILE *out, FILE *err);
+
+// unpack the blocks from offset to offset + length into image, the unpacked copy of the whole image,
+// letting go of the oldest unpacked block when the cache is full - returns 0 if okay
+extern int zimage_load(ZIMAGE *zimage, unsigned char *image, size_t offset, size_t length);
+
+// keep the blocks from offset to offset + length - they have been written to
+extern void zimage_pin(ZIMAGE *zimage, size_t offset, size_t length);
+
+extern void zimage_close(ZIMAGE *zimage);
+
+// LZ4 block format
+// compress srclength bytes - returns the compressed length, 0 if it will not fit in dstlength
+extern size_t lz4_compress(const unsigned char *src, size_t srclength, unsigned char *dst, size_t dstlength);
+// uncompress to exactly dstlength bytes - returns -1 if the data is bad
+extern int lz4_uncompress(const unsigned char *src, size_t srclength, unsigned char *dst, size_t dstlength);
+
+#endif
+
+// end of file